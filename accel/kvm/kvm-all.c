@@ -74,6 +74,9 @@
 /* Default max allowed memslots if kernel reported nothing */
 #define  KVM_MEMSLOTS_NR_MAX_DEFAULT                        32
 
+/* Upper bound of the dirty-ring-harvesters accelerator property */
+#define KVM_DIRTY_RING_MAX_HARVESTERS 64
+
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
@@ -777,7 +780,12 @@ static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
         return;
     }
 
-    set_bit(offset, mem->dirty_bmap);
+    /* Harvesters of different vCPUs can dirty pages in the same word */
+    if (s->kvm_dirty_ring_harvesters > 1) {
+        set_bit_atomic(offset, mem->dirty_bmap);
+    } else {
+        set_bit(offset, mem->dirty_bmap);
+    }
 }
 
 static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
@@ -850,6 +858,89 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
     return count;
 }
 
+/* Reap the dirty rings of the vCPUs in shard @index */
+static uint64_t kvm_dirty_ring_reap_shard(KVMState *s, unsigned int index)
+{
+    unsigned int n = s->kvm_dirty_ring_harvesters;
+    uint64_t total = 0;
+    CPUState *cpu;
+
+    RCU_READ_LOCK_GUARD();
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index % n == index) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+    return total;
+}
+
+/*
+ * The helpers run while the thread that woke them up waits with the BQL and
+ * slots_lock held, so the vCPU list and the memory slots cannot change
+ * under their feet.
+ */
+static void *kvm_dirty_ring_harvester_thread(void *data)
+{
+    struct KVMDirtyRingHarvester *h = data;
+    KVMState *s = h->s;
+
+    rcu_register_thread();
+
+    while (true) {
+        qemu_sem_wait(&h->sem);
+        h->count = kvm_dirty_ring_reap_shard(s, h->index);
+        qemu_sem_post(&s->harvest_done);
+    }
+
+    g_assert_not_reached();
+}
+
+static void kvm_dirty_ring_harvesters_init(KVMState *s)
+{
+    unsigned int n = s->kvm_dirty_ring_harvesters - 1;
+
+    if (!n) {
+        return;
+    }
+
+    s->harvesters = g_new0(struct KVMDirtyRingHarvester, n);
+    qemu_sem_init(&s->harvest_done, 0);
+
+    for (unsigned int i = 0; i < n; i++) {
+        struct KVMDirtyRingHarvester *h = &s->harvesters[i];
+        g_autofree char *name = g_strdup_printf("kvm-harvest-%u", i + 1);
+
+        h->s = s;
+        h->index = i + 1;
+        qemu_sem_init(&h->sem, 0);
+        qemu_thread_create(&h->thread, name,
+                           kvm_dirty_ring_harvester_thread,
+                           h, QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Reap all vCPUs, spreading them over the harvester threads */
+static uint64_t kvm_dirty_ring_reap_all(KVMState *s)
+{
+    unsigned int n = s->kvm_dirty_ring_harvesters - 1;
+    uint64_t total;
+
+    for (unsigned int i = 0; i < n; i++) {
+        qemu_sem_post(&s->harvesters[i].sem);
+    }
+
+    total = kvm_dirty_ring_reap_shard(s, 0);
+
+    for (unsigned int i = 0; i < n; i++) {
+        qemu_sem_wait(&s->harvest_done);
+    }
+    for (unsigned int i = 0; i < n; i++) {
+        total += s->harvesters[i].count;
+    }
+
+    return total;
+}
+
 /* Must be with slots_lock held */
 static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
 {
@@ -862,9 +953,7 @@ static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
     if (cpu) {
         total = kvm_dirty_ring_reap_one(s, cpu);
     } else {
-        CPU_FOREACH(cpu) {
-            total += kvm_dirty_ring_reap_one(s, cpu);
-        }
+        total = kvm_dirty_ring_reap_all(s);
     }
 
     if (total) {
@@ -875,7 +964,10 @@ static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
     stamp = get_clock() - stamp;
 
     if (total) {
-        trace_kvm_dirty_ring_reap(total, stamp / 1000);
+        stat64_add(&s->dirty_ring_harvested, total);
+        stat64_add(&s->dirty_ring_harvest_ns, stamp);
+        trace_kvm_dirty_ring_reap(total, stamp / 1000,
+                                  s->kvm_dirty_ring_harvesters);
     }
 
     return total;
@@ -1601,6 +1693,8 @@ static void kvm_dirty_ring_reaper_init(KVMState *s)
     qemu_thread_create(&r->reaper_thr, "kvm-reaper",
                        kvm_dirty_ring_reaper_thread,
                        s, QEMU_THREAD_JOINABLE);
+
+    kvm_dirty_ring_harvesters_init(s);
 }
 
 static int kvm_dirty_ring_init(KVMState *s)
@@ -2440,6 +2534,16 @@ uint32_t kvm_dirty_ring_size(void)
     return kvm_state->kvm_dirty_ring_size;
 }
 
+void kvm_dirty_ring_stats(uint64_t *pages, uint64_t *time_ns,
+                          uint64_t *full_exits)
+{
+    KVMState *s = kvm_state;
+
+    *pages = stat64_get(&s->dirty_ring_harvested);
+    *time_ns = stat64_get(&s->dirty_ring_harvest_ns);
+    *full_exits = stat64_get(&s->dirty_ring_full_exits);
+}
+
 static int do_kvm_create_vm(MachineState *ms, int type)
 {
     KVMState *s;
@@ -3209,6 +3313,7 @@ int kvm_cpu_exec(CPUState *cpu)
              * still full.  Got kicked by KVM_RESET_DIRTY_RINGS.
              */
             trace_kvm_dirty_ring_full(cpu->cpu_index);
+            stat64_inc(&kvm_state->dirty_ring_full_exits);
             bql_lock();
             /*
              * We throttle vCPU by making it sleep once it exit from kernel
@@ -3880,6 +3985,41 @@ static void kvm_set_dirty_ring_size(Object *obj, Visitor *v,
     s->kvm_dirty_ring_size = value;
 }
 
+static void kvm_get_dirty_ring_harvesters(Object *obj, Visitor *v,
+                                          const char *name, void *opaque,
+                                          Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value = s->kvm_dirty_ring_harvesters;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void kvm_set_dirty_ring_harvesters(Object *obj, Visitor *v,
+                                          const char *name, void *opaque,
+                                          Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value;
+
+    if (s->fd != -1) {
+        error_setg(errp, "Cannot set properties after the accelerator has "
+                   "been initialized");
+        return;
+    }
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value < 1 || value > KVM_DIRTY_RING_MAX_HARVESTERS) {
+        error_setg(errp, "dirty-ring-harvesters must be between 1 and %d",
+                   KVM_DIRTY_RING_MAX_HARVESTERS);
+        return;
+    }
+
+    s->kvm_dirty_ring_harvesters = value;
+}
+
 static char *kvm_get_device(Object *obj,
                             Error **errp G_GNUC_UNUSED)
 {
@@ -3925,6 +4065,7 @@ static void kvm_accel_instance_init(Object *obj)
     /* KVM dirty ring is by default off */
     s->kvm_dirty_ring_size = 0;
     s->kvm_dirty_ring_with_bitmap = false;
+    s->kvm_dirty_ring_harvesters = 1;
     s->kvm_eager_split_size = 0;
     s->notify_vmexit = NOTIFY_VMEXIT_OPTION_RUN;
     s->notify_window = 0;
@@ -3973,6 +4114,12 @@ static void kvm_accel_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "dirty-ring-size",
         "Size of KVM dirty page ring buffer (default: 0, i.e. use bitmap)");
 
+    object_class_property_add(oc, "dirty-ring-harvesters", "uint32",
+        kvm_get_dirty_ring_harvesters, kvm_set_dirty_ring_harvesters,
+        NULL, NULL);
+    object_class_property_set_description(oc, "dirty-ring-harvesters",
+        "Number of threads that harvest the KVM dirty rings (default: 1)");
+
     object_class_property_add_str(oc, "device", kvm_get_device, kvm_set_device);
     object_class_property_set_description(oc, "device",
         "Path to the device node to use (default: /dev/kvm)");
@@ -125,6 +125,12 @@ uint32_t kvm_dirty_ring_size(void)
     return 0;
 }
 
+void kvm_dirty_ring_stats(uint64_t *pages, uint64_t *time_ns,
+                          uint64_t *full_exits)
+{
+    *pages = *time_ns = *full_exits = 0;
+}
+
 bool kvm_hwpoisoned_mem(void)
 {
     return false;
@@ -5160,6 +5160,8 @@ static void bdrv_close(BlockDriverState *bs)
     bs->full_open_options = NULL;
     g_free(bs->block_status_cache);
     bs->block_status_cache = NULL;
+    block_node_latency_histogram_free(bs->latency_histogram);
+    bs->latency_histogram = NULL;
 
     bdrv_release_named_dirty_bitmaps(bs);
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
@@ -5629,12 +5631,16 @@ fail:
 /*
  * Run consistency checks on an image
  *
+ * If @checkpoint is not NULL, drivers that support it record the progress of
+ * the check in that file, so that it can be resumed after an interruption.
+ *
  * Returns 0 if the check could be completed (it doesn't mean that the image is
  * free of errors) or -errno when an internal error occurred. The results of the
  * check are stored in res.
  */
 int coroutine_fn bdrv_co_check(BlockDriverState *bs,
-                               BdrvCheckResult *res, BdrvCheckMode fix)
+                               BdrvCheckResult *res, BdrvCheckMode fix,
+                               const char *checkpoint)
 {
     IO_CODE();
     assert_bdrv_graph_readable();
@@ -5646,7 +5652,7 @@ int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     }
 
     memset(res, 0, sizeof(*res));
-    return bs->drv->bdrv_co_check(bs, res, fix);
+    return bs->drv->bdrv_co_check(bs, res, fix, checkpoint);
 }
 
 /*
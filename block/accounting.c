@@ -26,6 +26,8 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/coroutine-tls.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "sysemu/qtest.h"
 
@@ -200,6 +202,82 @@ void block_latency_histograms_clear(BlockAcctStats *stats)
     }
 }
 
+BlockNodeLatencyHistogram *block_node_latency_histogram_new(void)
+{
+    BlockNodeLatencyHistogram *hist;
+    int i, j, k;
+
+    hist = qemu_memalign(__alignof__(BlockNodeLatencyShard), sizeof(*hist));
+    for (i = 0; i < BLOCK_NODE_LATENCY_SHARDS; i++) {
+        for (j = 0; j < 2; j++) {
+            for (k = 0; k < BLOCK_NODE_LATENCY_BINS; k++) {
+                stat64_init(&hist->shards[i].bins[j][k], 0);
+            }
+        }
+    }
+    return hist;
+}
+
+void block_node_latency_histogram_free(BlockNodeLatencyHistogram *hist)
+{
+    qemu_vfree(hist);
+}
+
+/* Shard index plus one of the current thread, 0 if not chosen yet */
+QEMU_DEFINE_STATIC_CO_TLS(int, node_latency_shard);
+
+static BlockNodeLatencyShard *
+block_node_latency_shard(BlockNodeLatencyHistogram *hist)
+{
+    int shard = get_node_latency_shard();
+
+    if (!shard) {
+        shard = qemu_get_thread_id() % BLOCK_NODE_LATENCY_SHARDS + 1;
+        set_node_latency_shard(shard);
+    }
+    return &hist->shards[shard - 1];
+}
+
+int64_t block_node_latency_start(void)
+{
+    return qemu_clock_get_ns(clock_type);
+}
+
+void block_node_latency_done(BlockNodeLatencyHistogram *hist,
+                             enum BlockAcctType type, int64_t start_ns)
+{
+    int64_t latency_ns = qemu_clock_get_ns(clock_type) - start_ns;
+    int bin;
+
+    assert(type == BLOCK_ACCT_READ || type == BLOCK_ACCT_WRITE);
+
+    if (qtest_enabled()) {
+        latency_ns = qtest_latency_ns;
+    }
+
+    bin = latency_ns > 0 ? 63 - clz64(latency_ns) : 0;
+    bin = MIN(bin, BLOCK_NODE_LATENCY_BINS - 1);
+    stat64_add(&block_node_latency_shard(hist)->bins[type == BLOCK_ACCT_WRITE]
+                                                    [bin], 1);
+}
+
+void block_node_latency_histogram_get(BlockNodeLatencyHistogram *hist,
+                                      enum BlockAcctType type,
+                                      uint64_t bins[BLOCK_NODE_LATENCY_BINS])
+{
+    int i, k;
+
+    assert(type == BLOCK_ACCT_READ || type == BLOCK_ACCT_WRITE);
+
+    memset(bins, 0, BLOCK_NODE_LATENCY_BINS * sizeof(bins[0]));
+    for (i = 0; i < BLOCK_NODE_LATENCY_SHARDS; i++) {
+        for (k = 0; k < BLOCK_NODE_LATENCY_BINS; k++) {
+            bins[k] += stat64_get(&hist->shards[i].bins[type ==
+                                                        BLOCK_ACCT_WRITE][k]);
+        }
+    }
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
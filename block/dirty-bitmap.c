@@ -95,11 +95,19 @@ BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs, const char *name)
     return NULL;
 }
 
+static HBitmap *dirty_bitmap_alloc_hbitmap(uint64_t size, int granularity,
+                                           bool sparse)
+{
+    return sparse ? hbitmap_alloc_sparse(size, granularity) :
+                    hbitmap_alloc(size, granularity);
+}
+
 /* Called with BQL taken.  */
-BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
-                                          uint32_t granularity,
-                                          const char *name,
-                                          Error **errp)
+static BdrvDirtyBitmap *bdrv_do_create_dirty_bitmap(BlockDriverState *bs,
+                                                    uint32_t granularity,
+                                                    const char *name,
+                                                    bool sparse,
+                                                    Error **errp)
 {
     int64_t bitmap_size;
     BdrvDirtyBitmap *bitmap;
@@ -124,7 +132,8 @@ BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
     }
     bitmap = g_new0(BdrvDirtyBitmap, 1);
     bitmap->bs = bs;
-    bitmap->bitmap = hbitmap_alloc(bitmap_size, ctz32(granularity));
+    bitmap->bitmap = dirty_bitmap_alloc_hbitmap(bitmap_size, ctz32(granularity),
+                                                sparse);
     bitmap->size = bitmap_size;
     bitmap->name = g_strdup(name);
     bitmap->disabled = false;
@@ -134,6 +143,34 @@ BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
     return bitmap;
 }
 
+/* Called with BQL taken.  */
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          uint32_t granularity,
+                                          const char *name,
+                                          Error **errp)
+{
+    return bdrv_do_create_dirty_bitmap(bs, granularity, name, false, errp);
+}
+
+/*
+ * Like bdrv_create_dirty_bitmap(), but the bitmap stores runs of dirty
+ * clusters rather than one bit per cluster, which takes much less memory
+ * for large and mostly clean bitmaps.
+ * Called with BQL taken.
+ */
+BdrvDirtyBitmap *bdrv_create_sparse_dirty_bitmap(BlockDriverState *bs,
+                                                 uint32_t granularity,
+                                                 const char *name,
+                                                 Error **errp)
+{
+    return bdrv_do_create_dirty_bitmap(bs, granularity, name, true, errp);
+}
+
+bool bdrv_dirty_bitmap_sparse(const BdrvDirtyBitmap *bitmap)
+{
+    return hbitmap_is_sparse(bitmap->bitmap);
+}
+
 int64_t bdrv_dirty_bitmap_size(const BdrvDirtyBitmap *bitmap)
 {
     return bitmap->size;
@@ -224,7 +261,8 @@ int bdrv_dirty_bitmap_create_successor(BdrvDirtyBitmap *bitmap, Error **errp)
 
     /* Create an anonymous successor */
     granularity = bdrv_dirty_bitmap_granularity(bitmap);
-    child = bdrv_create_dirty_bitmap(bitmap->bs, granularity, NULL, errp);
+    child = bdrv_do_create_dirty_bitmap(bitmap->bs, granularity, NULL,
+                                        bdrv_dirty_bitmap_sparse(bitmap), errp);
     if (!child) {
         return -1;
     }
@@ -467,6 +505,8 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         info->persistent = bm->persistent;
         info->has_inconsistent = bm->inconsistent;
         info->inconsistent = bm->inconsistent;
+        info->has_sparse = bdrv_dirty_bitmap_sparse(bm);
+        info->sparse = info->has_sparse;
         QAPI_LIST_APPEND(tail, info);
     }
     bdrv_dirty_bitmaps_unlock(bs);
@@ -580,8 +620,9 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
         hbitmap_reset_all(bitmap->bitmap);
     } else {
         HBitmap *backup = bitmap->bitmap;
-        bitmap->bitmap = hbitmap_alloc(bitmap->size,
-                                       hbitmap_granularity(backup));
+        bitmap->bitmap = dirty_bitmap_alloc_hbitmap(bitmap->size,
+                                                    hbitmap_granularity(backup),
+                                                    hbitmap_is_sparse(backup));
         *out = backup;
     }
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
@@ -875,7 +916,9 @@ void bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
 
     if (backup) {
         *backup = dest->bitmap;
-        dest->bitmap = hbitmap_alloc(dest->size, hbitmap_granularity(*backup));
+        dest->bitmap = dirty_bitmap_alloc_hbitmap(dest->size,
+                                                  hbitmap_granularity(*backup),
+                                                  hbitmap_is_sparse(*backup));
         hbitmap_merge(*backup, src->bitmap, dest->bitmap);
     } else {
         hbitmap_merge(dest->bitmap, src->bitmap, dest->bitmap);
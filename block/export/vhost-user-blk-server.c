@@ -10,6 +10,7 @@
  * later.  See the COPYING file in the top-level directory.
  */
 #include "qemu/osdep.h"
+#include "qemu/bitmap.h"
 #include "qemu/error-report.h"
 #include "block/block.h"
 #include "subprojects/libvhost-user/libvhost-user.h" /* only for the type definitions */
@@ -18,6 +19,7 @@
 #include "vhost-user-blk-server.h"
 #include "qapi/error.h"
 #include "qom/object_interfaces.h"
+#include "sysemu/iothread.h"
 #include "util/block-helpers.h"
 #include "virtio-blk-handler.h"
 
@@ -38,6 +40,11 @@ typedef struct {
     VirtioBlkHandler handler;
     QIOChannelSocket *sioc;
     struct virtio_blk_config blkcfg;
+
+    /* AioContext of each virtqueue with iothread-vq-mapping, else NULL */
+    AioContext **vq_ctx;
+    IOThread **iothreads;
+    size_t num_iothreads;
 } VuBlkExport;
 
 static void vu_blk_req_complete(VuBlkReq *req, size_t in_len)
@@ -314,6 +321,128 @@ static const BlockDevOps vu_blk_dev_ops = {
     .resize_cb = vu_blk_exp_resize,
 };
 
+static bool
+vu_blk_validate_iothread_vq_mapping(VhostUserBlkIOThreadVqMappingList *list,
+                                    uint16_t num_queues, Error **errp)
+{
+    g_autofree unsigned long *vqs = bitmap_new(num_queues);
+    g_autoptr(GHashTable) iothreads =
+        g_hash_table_new(g_str_hash, g_str_equal);
+
+    for (VhostUserBlkIOThreadVqMappingList *node = list; node;
+         node = node->next) {
+        const char *name = node->value->iothread;
+        uint16List *vq;
+
+        if (!iothread_by_id(name)) {
+            error_setg(errp, "IOThread \"%s\" object does not exist", name);
+            return false;
+        }
+
+        if (!g_hash_table_add(iothreads, (gpointer)name)) {
+            error_setg(errp,
+                    "duplicate IOThread name \"%s\" in iothread-vq-mapping",
+                    name);
+            return false;
+        }
+
+        if (!!node->value->vqs != !!list->value->vqs) {
+            error_setg(errp, "either all items in iothread-vq-mapping "
+                             "must have vqs or none of them must have it");
+            return false;
+        }
+
+        for (vq = node->value->vqs; vq; vq = vq->next) {
+            if (vq->value >= num_queues) {
+                error_setg(errp, "vq index %u for IOThread \"%s\" must be "
+                        "less than num-queues %u in iothread-vq-mapping",
+                        vq->value, name, num_queues);
+                return false;
+            }
+
+            if (test_and_set_bit(vq->value, vqs)) {
+                error_setg(errp, "cannot assign vq %u to IOThread \"%s\" "
+                        "because it is already assigned", vq->value, name);
+                return false;
+            }
+        }
+    }
+
+    if (list->value->vqs) {
+        for (uint16_t i = 0; i < num_queues; i++) {
+            if (!test_bit(i, vqs)) {
+                error_setg(errp,
+                        "missing vq %u IOThread assignment in iothread-vq-mapping",
+                        i);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Fill in vexp->vq_ctx from the iothread-vq-mapping option. The IOThreads are
+ * referenced until vu_blk_vq_ctx_cleanup().
+ */
+static bool vu_blk_vq_ctx_init(VuBlkExport *vexp,
+                               VhostUserBlkIOThreadVqMappingList *list,
+                               uint16_t num_queues, Error **errp)
+{
+    VhostUserBlkIOThreadVqMappingList *node;
+    size_t num_iothreads = 0;
+    size_t cur_iothread = 0;
+
+    if (!vu_blk_validate_iothread_vq_mapping(list, num_queues, errp)) {
+        return false;
+    }
+
+    for (node = list; node; node = node->next) {
+        num_iothreads++;
+    }
+
+    vexp->vq_ctx = g_new0(AioContext *, num_queues);
+    vexp->iothreads = g_new0(IOThread *, num_iothreads);
+    vexp->num_iothreads = num_iothreads;
+
+    for (node = list; node; node = node->next) {
+        IOThread *iothread = iothread_by_id(node->value->iothread);
+        AioContext *ctx = iothread_get_aio_context(iothread);
+
+        object_ref(OBJECT(iothread));
+        vexp->iothreads[cur_iothread] = iothread;
+
+        if (node->value->vqs) {
+            for (uint16List *vq = node->value->vqs; vq; vq = vq->next) {
+                vexp->vq_ctx[vq->value] = ctx;
+            }
+        } else {
+            for (unsigned i = cur_iothread; i < num_queues;
+                 i += num_iothreads) {
+                vexp->vq_ctx[i] = ctx;
+            }
+        }
+
+        cur_iothread++;
+    }
+
+    return true;
+}
+
+static void vu_blk_vq_ctx_cleanup(VuBlkExport *vexp)
+{
+    for (size_t i = 0; i < vexp->num_iothreads; i++) {
+        object_unref(OBJECT(vexp->iothreads[i]));
+    }
+    g_free(vexp->iothreads);
+    vexp->iothreads = NULL;
+    vexp->num_iothreads = 0;
+
+    g_free(vexp->vq_ctx);
+    vexp->vq_ctx = NULL;
+}
+
 static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                              Error **errp)
 {
@@ -340,6 +469,11 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
         error_setg(errp, "num-queues must be greater than 0");
         return -EINVAL;
     }
+    if (vu_opts->iothread_vq_mapping &&
+        !vu_blk_vq_ctx_init(vexp, vu_opts->iothread_vq_mapping, num_queues,
+                            errp)) {
+        return -EINVAL;
+    }
     vexp->handler.blk = exp->blk;
     vexp->handler.serial = g_strdup("vhost_user_blk");
     vexp->handler.logical_block_size = logical_block_size;
@@ -354,10 +488,12 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
     blk_set_dev_ops(exp->blk, &vu_blk_dev_ops, vexp);
 
     if (!vhost_user_server_start(&vexp->vu_server, vu_opts->addr, exp->ctx,
-                                 num_queues, &vu_blk_iface, errp)) {
+                                 vexp->vq_ctx, num_queues, &vu_blk_iface,
+                                 errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
         g_free(vexp->handler.serial);
+        vu_blk_vq_ctx_cleanup(vexp);
         return -EADDRNOTAVAIL;
     }
 
@@ -371,6 +507,7 @@ static void vu_blk_exp_delete(BlockExport *exp)
     blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                     vexp);
     g_free(vexp->handler.serial);
+    vu_blk_vq_ctx_cleanup(vexp);
 }
 
 const BlockExportDriver blk_exp_vhost_user_blk = {
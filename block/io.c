@@ -1774,8 +1774,10 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     BdrvRequestFlags flags)
 {
     BlockDriverState *bs = child->bs;
+    BlockNodeLatencyHistogram *hist;
     BdrvTrackedRequest req;
     BdrvRequestPadding pad;
+    int64_t start_ns = 0;
     int ret;
     IO_CODE();
 
@@ -1804,6 +1806,11 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
 
     bdrv_inc_in_flight(bs);
 
+    hist = qatomic_read(&bs->latency_histogram);
+    if (hist) {
+        start_ns = block_node_latency_start();
+    }
+
     /* Don't do copy-on-read if we read data before write operation */
     if (qatomic_read(&bs->copy_on_read)) {
         flags |= BDRV_REQ_COPY_ON_READ;
@@ -1823,6 +1830,9 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     bdrv_padding_finalize(&pad);
 
 fail:
+    if (hist) {
+        block_node_latency_done(hist, BLOCK_ACCT_READ, start_ns);
+    }
     bdrv_dec_in_flight(bs);
 
     return ret;
@@ -2226,9 +2236,11 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     BdrvRequestFlags flags)
 {
     BlockDriverState *bs = child->bs;
+    BlockNodeLatencyHistogram *hist;
     BdrvTrackedRequest req;
     uint64_t align = bs->bl.request_alignment;
     BdrvRequestPadding pad;
+    int64_t start_ns = 0;
     int ret;
     bool padded = false;
     IO_CODE();
@@ -2283,6 +2295,11 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     bdrv_inc_in_flight(bs);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
 
+    hist = qatomic_read(&bs->latency_histogram);
+    if (hist) {
+        start_ns = block_node_latency_start();
+    }
+
     if (flags & BDRV_REQ_ZERO_WRITE) {
         assert(!padded);
         ret = bdrv_co_do_zero_pwritev(child, offset, bytes, flags, &req);
@@ -2308,6 +2325,9 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
 
 out:
     tracked_request_end(&req);
+    if (hist) {
+        block_node_latency_done(hist, BLOCK_ACCT_WRITE, start_ns);
+    }
     bdrv_dec_in_flight(bs);
 
     return ret;
@@ -3397,9 +3417,7 @@ static int coroutine_fn GRAPH_RDLOCK bdrv_co_copy_range_internal(
     int ret;
     assert_bdrv_graph_readable();
 
-    /* TODO We can support BDRV_REQ_NO_FALLBACK here */
     assert(!(read_flags & BDRV_REQ_NO_FALLBACK));
-    assert(!(write_flags & BDRV_REQ_NO_FALLBACK));
     assert(!(read_flags & BDRV_REQ_NO_WAIT));
     assert(!(write_flags & BDRV_REQ_NO_WAIT));
 
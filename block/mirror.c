@@ -29,6 +29,14 @@
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/* Upper bound for the in-flight limit chosen by the adaptive controller */
+#define MIRROR_ADAPTIVE_MAX_IN_FLIGHT 64
+/*
+ * The controller considers the target congested once the average latency of
+ * an epoch exceeds the base latency by this factor.
+ */
+#define MIRROR_ADAPTIVE_CONGESTION_FACTOR 2
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -94,6 +102,27 @@ typedef struct MirrorBlockJob {
     bool prepared;
     bool in_drain;
     bool base_ro;
+
+    /*
+     * Limits for background copy operations.  Constant unless @adaptive is
+     * set, in which case they are adjusted by mirror_adapt() and read by
+     * mirror_query(), so they have to be accessed with atomics.
+     */
+    unsigned max_in_flight;
+    int max_io_bytes;
+
+    /* Adaptive controller state, only updated from the job coroutine */
+    bool adaptive;
+    uint64_t epoch_latency_ns;
+    unsigned epoch_ops;
+    uint64_t base_latency_ns;
+    /* Incremented by the mirror-top filter for every guest request */
+    unsigned guest_requests;
+    unsigned last_guest_requests;
+    /* Published for mirror_query(), to be accessed with atomics */
+    uint32_t latency_us;
+    uint32_t base_latency_us;
+    bool guest_busy;
 } MirrorBlockJob;
 
 typedef struct MirrorBDSOpaque {
@@ -115,6 +144,8 @@ struct MirrorOp {
     bool is_pseudo_op;
     bool is_active_write;
     bool is_in_flight;
+    /* Time at which a copy operation was issued, 0 for other operations */
+    int64_t start_ns;
     CoQueue waiting_requests;
     Coroutine *co;
     MirrorOp *waiting_for_op;
@@ -194,6 +225,104 @@ static void coroutine_fn mirror_wait_on_conflicts(MirrorOp *self,
     }
 }
 
+/*
+ * Install new limits for the adaptive controller, clamped so that neither the
+ * number of requests in flight nor their size exceeds what the rate limit
+ * allows in one time slice.
+ */
+static void mirror_adaptive_set_limits(MirrorBlockJob *s,
+                                       unsigned max_in_flight,
+                                       int max_io_bytes)
+{
+    int64_t speed;
+
+    WITH_JOB_LOCK_GUARD() {
+        speed = s->common.speed;
+    }
+    if (speed) {
+        int64_t slice_bytes = speed /
+                              (NANOSECONDS_PER_SECOND / BLOCK_JOB_SLICE_TIME);
+
+        slice_bytes = QEMU_ALIGN_UP(MAX(slice_bytes, 1), s->granularity);
+        max_io_bytes = MIN(max_io_bytes, slice_bytes);
+        max_in_flight = MIN(max_in_flight,
+                            MAX(slice_bytes / max_io_bytes, 1));
+    }
+    max_io_bytes = MAX(QEMU_ALIGN_DOWN(max_io_bytes, s->granularity),
+                       s->granularity);
+
+    if (max_io_bytes != s->max_io_bytes) {
+        /* Assume that latency scales with the request size */
+        s->base_latency_ns = s->base_latency_ns * max_io_bytes /
+                             s->max_io_bytes;
+    }
+
+    qatomic_set(&s->max_in_flight, max_in_flight);
+    qatomic_set(&s->max_io_bytes, max_io_bytes);
+}
+
+/*
+ * Called once per epoch (i.e. after max_in_flight copy operations have
+ * completed) to adjust the in-flight limit and the chunk size, in the spirit
+ * of TCP congestion control: as long as the target keeps up, grow the number
+ * of requests in flight additively; once latency inflates, halve it.  While
+ * the guest is issuing I/O and the target is congested, also halve the chunk
+ * size so that guest requests don't queue up behind large mirror requests;
+ * grow it back when the guest is idle.
+ */
+static void mirror_adapt(MirrorBlockJob *s)
+{
+    unsigned max_in_flight = s->max_in_flight;
+    int max_io_bytes = s->max_io_bytes;
+    int64_t io_bytes_limit = MAX(s->buf_size / 4, MAX_IO_BYTES);
+    uint64_t latency_ns;
+    unsigned guest_requests;
+    bool guest_busy;
+    bool congested;
+
+    latency_ns = s->epoch_latency_ns / s->epoch_ops;
+    s->epoch_latency_ns = 0;
+    s->epoch_ops = 0;
+
+    guest_requests = qatomic_read(&s->guest_requests);
+    guest_busy = guest_requests != s->last_guest_requests;
+    s->last_guest_requests = guest_requests;
+
+    /*
+     * Track the minimum latency, but let it drift upwards slowly so that a
+     * permanent change in target performance is eventually picked up.
+     */
+    if (!s->base_latency_ns || latency_ns < s->base_latency_ns) {
+        s->base_latency_ns = latency_ns;
+    } else {
+        s->base_latency_ns += (latency_ns - s->base_latency_ns) / 16;
+    }
+    congested = latency_ns >
+                s->base_latency_ns * MIRROR_ADAPTIVE_CONGESTION_FACTOR;
+
+    if (congested) {
+        max_in_flight = MAX(max_in_flight / 2, 1);
+        if (guest_busy) {
+            max_io_bytes = MAX(max_io_bytes / 2, s->granularity);
+        }
+    } else {
+        max_in_flight = MIN(max_in_flight + 1, MIRROR_ADAPTIVE_MAX_IN_FLIGHT);
+        if (!guest_busy) {
+            max_io_bytes = MIN((int64_t)max_io_bytes * 2, io_bytes_limit);
+        }
+    }
+
+    mirror_adaptive_set_limits(s, max_in_flight, max_io_bytes);
+    trace_mirror_adapt(s, latency_ns, s->base_latency_ns, guest_busy,
+                       s->max_in_flight, s->max_io_bytes);
+
+    qatomic_set(&s->latency_us,
+                MIN(latency_ns / SCALE_US, UINT32_MAX));
+    qatomic_set(&s->base_latency_us,
+                MIN(s->base_latency_ns / SCALE_US, UINT32_MAX));
+    qatomic_set(&s->guest_busy, guest_busy);
+}
+
 static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -227,6 +356,14 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
     }
     qemu_iovec_destroy(&op->qiov);
 
+    if (s->adaptive && op->start_ns && ret >= 0) {
+        s->epoch_latency_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                               op->start_ns;
+        if (++s->epoch_ops >= s->max_in_flight) {
+            mirror_adapt(s);
+        }
+    }
+
     qemu_co_queue_restart_all(&op->waiting_requests);
     g_free(op);
 }
@@ -396,6 +533,9 @@ static void coroutine_fn mirror_co_read(void *opaque)
     s->in_flight++;
     s->bytes_in_flight += op->bytes;
     op->is_in_flight = true;
+    if (s->adaptive) {
+        op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
     WITH_GRAPH_RDLOCK_GUARD() {
@@ -488,7 +628,7 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int max_io_bytes = s->max_io_bytes;
 
     bdrv_graph_co_rdlock();
     source = s->mirror_top_bs->backing->bs;
@@ -600,7 +740,7 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -866,7 +1006,7 @@ static int coroutine_fn GRAPH_UNLOCKED mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -939,6 +1079,10 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
                                  checking for a NULL string */
     int ret = 0;
 
+    if (s->adaptive) {
+        mirror_adaptive_set_limits(s, s->max_in_flight, s->max_io_bytes);
+    }
+
     bdrv_graph_co_rdlock();
     bs = bdrv_filter_bs(s->mirror_top_bs);
     bdrv_graph_co_rdunlock();
@@ -1069,7 +1213,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         }
         if (delta < BLOCK_JOB_SLICE_TIME &&
             iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1298,6 +1442,19 @@ static void mirror_query(BlockJob *job, BlockJobInfo *info)
     info->u.mirror = (BlockJobInfoMirror) {
         .actively_synced = qatomic_read(&s->actively_synced),
     };
+
+    if (s->adaptive) {
+        MirrorAdaptiveInfo *adaptive = g_new(MirrorAdaptiveInfo, 1);
+
+        *adaptive = (MirrorAdaptiveInfo) {
+            .in_flight_limit = qatomic_read(&s->max_in_flight),
+            .chunk_size = qatomic_read(&s->max_io_bytes),
+            .latency_us = qatomic_read(&s->latency_us),
+            .base_latency_us = qatomic_read(&s->base_latency_us),
+            .guest_busy = qatomic_read(&s->guest_busy),
+        };
+        info->u.mirror.adaptive = adaptive;
+    }
 }
 
 static const BlockJobDriver mirror_job_driver = {
@@ -1513,10 +1670,21 @@ static void coroutine_fn GRAPH_RDLOCK active_write_settle(MirrorOp *op)
     g_free(op);
 }
 
+/* Let the adaptive controller know that the guest is issuing I/O */
+static void mirror_top_account_request(MirrorBDSOpaque *s)
+{
+    MirrorBlockJob *job = s->job;
+
+    if (job && job->adaptive) {
+        qatomic_inc(&job->guest_requests);
+    }
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 bdrv_mirror_top_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
                        QEMUIOVector *qiov, BdrvRequestFlags flags)
 {
+    mirror_top_account_request(bs->opaque);
     return bdrv_co_preadv(bs->backing, offset, bytes, qiov, flags);
 }
 
@@ -1536,6 +1704,8 @@ bdrv_mirror_top_do_write(BlockDriverState *bs, MirrorMethod method,
     MirrorBDSOpaque *s = bs->opaque;
     int ret = 0;
 
+    mirror_top_account_request(s);
+
     if (copy_to_target) {
         op = active_write_prepare(s->job, offset, bytes);
     }
@@ -1722,7 +1892,7 @@ static BlockJob *mirror_start_job(
                              bool is_none_mode, BlockDriverState *base,
                              bool auto_complete, const char *filter_node_name,
                              bool is_mirror, MirrorCopyMode copy_mode,
-                             bool base_ro,
+                             bool adaptive, bool base_ro,
                              Error **errp)
 {
     MirrorBlockJob *s;
@@ -1886,6 +2056,9 @@ static BlockJob *mirror_start_job(
     s->base_overlay = bdrv_find_overlay(bs, base);
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
+    s->max_in_flight = MAX_IN_FLIGHT;
+    s->max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    s->adaptive = adaptive;
     s->unmap = unmap;
     if (auto_complete) {
         s->should_complete = true;
@@ -2013,7 +2186,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp)
+                  MirrorCopyMode copy_mode, bool adaptive, Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -2036,7 +2209,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                      speed, granularity, buf_size, backing_mode, zero_target,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
-                     filter_node_name, true, copy_mode, false, errp);
+                     filter_node_name, true, copy_mode, adaptive, false,
+                     errp);
 }
 
 BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -2065,7 +2239,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
                      filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND,
-                     base_read_only, errp);
+                     false, base_read_only, errp);
     if (!job) {
         goto error_restore_flags;
     }
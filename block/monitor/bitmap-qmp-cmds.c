@@ -91,6 +91,7 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
                                 bool has_persistent, bool persistent,
                                 bool has_disabled, bool disabled,
+                                bool has_sparse, bool sparse,
                                 Error **errp)
 {
     BlockDriverState *bs;
@@ -131,7 +132,11 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         return;
     }
 
-    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (has_sparse && sparse) {
+        bitmap = bdrv_create_sparse_dirty_bitmap(bs, granularity, name, errp);
+    } else {
+        bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    }
     if (bitmap == NULL) {
         return;
     }
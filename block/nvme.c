@@ -23,6 +23,7 @@
 #include "qemu/cutils.h"
 #include "qemu/option.h"
 #include "qemu/memalign.h"
+#include "qemu/stats64.h"
 #include "qemu/vfio-helpers.h"
 #include "block/block-io.h"
 #include "block/block_int.h"
@@ -36,6 +37,7 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_DOORBELL_SIZE 4096
+#define NVME_MAX_IO_QUEUES 64
 
 /*
  * We have to leave one slot empty as that is the full queue case where
@@ -49,7 +51,10 @@ typedef struct BDRVNVMeState BDRVNVMeState;
 #define INDEX_ADMIN     0
 #define INDEX_IO(n)     (1 + n)
 
-/* This driver shares a single MSIX IRQ for the admin and I/O queues */
+/*
+ * The admin queue and the first I/O queue share an MSIX IRQ. Each further I/O
+ * queue has an IRQ of its own so it can be processed in its own AioContext.
+ */
 enum {
     MSIX_SHARED_IRQ_IDX = 0,
     MSIX_IRQ_COUNT = 1
@@ -78,6 +83,18 @@ typedef struct {
     /* Read from I/O code path, initialized under BQL */
     BDRVNVMeState   *s;
     int             index;
+    unsigned        irq_idx;
+
+    /*
+     * The AioContext that processes completions. Queues on the shared IRQ
+     * follow the BlockDriverState's AioContext, the others are bound to the
+     * first AioContext that submits requests to them, under
+     * BDRVNVMeState.bind_lock. NULL while unbound.
+     */
+    AioContext      *aio_context;
+
+    /* Only initialized if irq_idx != MSIX_SHARED_IRQ_IDX */
+    EventNotifier   irq_notifier;
 
     /* Fields protected by BQL */
     uint8_t     *prp_list_pages;
@@ -116,6 +133,9 @@ struct BDRVNVMeState {
     bool write_cache_supported;
     EventNotifier irq_notifier[MSIX_IRQ_COUNT];
 
+    /* Serializes binding of I/O queues to AioContexts */
+    QemuMutex bind_lock;
+
     uint64_t nsze; /* Namespace size reported by identify command */
     int nsid;      /* The namespace id to read/write data. */
     int blkshift;
@@ -135,14 +155,15 @@ struct BDRVNVMeState {
     char *device;
 
     struct {
-        uint64_t completion_errors;
-        uint64_t aligned_accesses;
-        uint64_t unaligned_accesses;
+        Stat64 completion_errors;
+        Stat64 aligned_accesses;
+        Stat64 unaligned_accesses;
     } stats;
 };
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_NUM_QUEUES "num-queues"
 
 static void nvme_process_completion_bh(void *opaque);
 
@@ -160,6 +181,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_NUM_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs (default: 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -198,6 +224,15 @@ static void nvme_free_queue_pair(NVMeQueuePair *q)
     if (q->completion_bh) {
         qemu_bh_delete(q->completion_bh);
     }
+    if (q->irq_idx != MSIX_SHARED_IRQ_IDX) {
+        if (q->aio_context) {
+            aio_set_event_notifier(q->aio_context, &q->irq_notifier,
+                                   NULL, NULL, NULL);
+            /* Taken by nvme_bind_queue_pair() */
+            aio_context_unref(q->aio_context);
+        }
+        event_notifier_cleanup(&q->irq_notifier);
+    }
     nvme_free_queue(&q->sq);
     nvme_free_queue(&q->cq);
     qemu_vfree(q->prp_list_pages);
@@ -217,24 +252,41 @@ static void nvme_free_req_queue_cb(void *opaque)
     qemu_mutex_unlock(&q->lock);
 }
 
+/*
+ * Queues on the shared IRQ are created in @aio_context. The others get an IRQ
+ * of their own and stay unbound until nvme_bind_queue_pair().
+ */
 static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
                                              AioContext *aio_context,
-                                             unsigned idx, size_t size,
-                                             Error **errp)
+                                             unsigned idx, unsigned irq_idx,
+                                             size_t size, Error **errp)
 {
     ERRP_GUARD();
     int i, r;
     NVMeQueuePair *q;
     uint64_t prp_list_iova;
     size_t bytes;
+    EventNotifier *irq_notifier;
 
     q = g_try_new0(NVMeQueuePair, 1);
     if (!q) {
         error_setg(errp, "Cannot allocate queue pair");
         return NULL;
     }
-    trace_nvme_create_queue_pair(idx, q, size, aio_context,
-                                 event_notifier_get_fd(s->irq_notifier));
+    q->irq_idx = irq_idx;
+    if (irq_idx != MSIX_SHARED_IRQ_IDX) {
+        if (event_notifier_init(&q->irq_notifier, 0)) {
+            error_setg(errp, "Failed to init event notifier");
+            g_free(q);
+            return NULL;
+        }
+        irq_notifier = &q->irq_notifier;
+    } else {
+        irq_notifier = &s->irq_notifier[MSIX_SHARED_IRQ_IDX];
+        q->aio_context = aio_context;
+    }
+    trace_nvme_create_queue_pair(idx, q, size, q->aio_context,
+                                 event_notifier_get_fd(irq_notifier));
     bytes = QEMU_ALIGN_UP(s->page_size * NVME_NUM_REQS,
                           qemu_real_host_page_size());
     q->prp_list_pages = qemu_try_memalign(qemu_real_host_page_size(), bytes);
@@ -247,7 +299,10 @@ static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
     q->s = s;
     q->index = idx;
     qemu_co_queue_init(&q->free_req_queue);
-    q->completion_bh = aio_bh_new(aio_context, nvme_process_completion_bh, q);
+    if (q->aio_context) {
+        q->completion_bh = aio_bh_new(q->aio_context,
+                                      nvme_process_completion_bh, q);
+    }
     r = qemu_vfio_dma_map(s->vfio, q->prp_list_pages, bytes,
                           false, &prp_list_iova, errp);
     if (r) {
@@ -344,7 +399,7 @@ static void nvme_put_free_req_locked(NVMeQueuePair *q, NVMeRequest *req)
 static void nvme_wake_free_req_locked(NVMeQueuePair *q)
 {
     if (!qemu_co_queue_empty(&q->free_req_queue)) {
-        replay_bh_schedule_oneshot_event(q->s->aio_context,
+        replay_bh_schedule_oneshot_event(q->aio_context,
                 nvme_free_req_queue_cb, q);
     }
 }
@@ -412,7 +467,7 @@ static bool nvme_process_completion(NVMeQueuePair *q)
         }
         ret = nvme_translate_error(c);
         if (ret) {
-            s->stats.completion_errors++;
+            stat64_add(&s->stats.completion_errors, 1);
         }
         q->cq.head = (q->cq.head + 1) % NVME_QUEUE_SIZE;
         if (!q->cq.head) {
@@ -454,6 +509,8 @@ static void nvme_process_completion_bh(void *opaque)
 {
     NVMeQueuePair *q = opaque;
 
+    QEMU_LOCK_GUARD(&q->lock);
+
     /*
      * We're being invoked because a nvme_process_completion() cb() function
      * called aio_poll(). The callback may be waiting for further completions
@@ -486,7 +543,14 @@ static void nvme_deferred_fn(void *opaque)
 
     QEMU_LOCK_GUARD(&q->lock);
     nvme_kick(q);
-    nvme_process_completion(q);
+
+    /*
+     * Completions are only processed in the queue's own AioContext, other
+     * AioContexts may share the queue when there are not enough of them.
+     */
+    if (qatomic_read(&q->aio_context) == qemu_get_current_aio_context()) {
+        nvme_process_completion(q);
+    }
 }
 
 static void nvme_submit_command(NVMeQueuePair *q, NVMeRequest *req,
@@ -625,18 +689,24 @@ out:
     return ret;
 }
 
-static void nvme_poll_queue(NVMeQueuePair *q)
+/*
+ * q->lock isn't needed because nvme_process_completion() only runs in the
+ * queue's event loop thread and cannot race with itself.
+ */
+static bool nvme_queue_has_completion(NVMeQueuePair *q)
 {
     const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
     NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
 
+    return (le16_to_cpu(cqe->status) & 0x1) != q->cq_phase;
+}
+
+static void nvme_poll_queue(NVMeQueuePair *q)
+{
     trace_nvme_poll_queue(q->s, q->index);
-    /*
-     * Do an early check for completions. q->lock isn't needed because
-     * nvme_process_completion() only runs in the event loop thread and
-     * cannot race with itself.
-     */
-    if ((le16_to_cpu(cqe->status) & 0x1) == q->cq_phase) {
+
+    /* Do an early check for completions */
+    if (!nvme_queue_has_completion(q)) {
         return;
     }
 
@@ -647,12 +717,15 @@ static void nvme_poll_queue(NVMeQueuePair *q)
     qemu_mutex_unlock(&q->lock);
 }
 
+/* Poll the queues on the shared IRQ */
 static void nvme_poll_queues(BDRVNVMeState *s)
 {
     int i;
 
     for (i = 0; i < s->queue_count; i++) {
-        nvme_poll_queue(s->queues[i]);
+        if (s->queues[i]->irq_idx == MSIX_SHARED_IRQ_IDX) {
+            nvme_poll_queue(s->queues[i]);
+        }
     }
 }
 
@@ -666,25 +739,100 @@ static void nvme_handle_event(EventNotifier *n)
     nvme_poll_queues(s);
 }
 
-static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+static void nvme_queue_handle_event(EventNotifier *n)
+{
+    NVMeQueuePair *q = container_of(n, NVMeQueuePair, irq_notifier);
+
+    trace_nvme_queue_handle_event(q->s, q->index);
+    event_notifier_test_and_clear(n);
+    nvme_poll_queue(q);
+}
+
+static bool nvme_queue_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NVMeQueuePair *q = container_of(e, NVMeQueuePair, irq_notifier);
+
+    return nvme_queue_has_completion(q);
+}
+
+static void nvme_queue_poll_ready(EventNotifier *e)
+{
+    NVMeQueuePair *q = container_of(e, NVMeQueuePair, irq_notifier);
+
+    nvme_poll_queue(q);
+}
+
+/* Called with s->bind_lock held */
+static void nvme_bind_queue_pair(NVMeQueuePair *q, AioContext *ctx)
+{
+    trace_nvme_bind_queue_pair(q->s, q->index, ctx);
+
+    /* Released in nvme_free_queue_pair() */
+    aio_context_ref(ctx);
+
+    q->completion_bh = aio_bh_new(ctx, nvme_process_completion_bh, q);
+    aio_set_event_notifier(ctx, &q->irq_notifier, nvme_queue_handle_event,
+                           nvme_queue_poll_cb, nvme_queue_poll_ready);
+    qatomic_store_release(&q->aio_context, ctx);
+}
+
+/*
+ * Return the I/O queue for requests submitted from the current AioContext.
+ *
+ * Each iothread AioContext gets an I/O queue of its own, with completions
+ * processed in that AioContext, as long as there are unbound queues left.
+ * The main loop and further AioContexts share the first I/O queue.
+ */
+static NVMeQueuePair *nvme_get_io_queue(BDRVNVMeState *s)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    unsigned i;
+
+    /* Requests from the main loop are rare, do not spend a queue on them */
+    if (ctx == qemu_get_aio_context()) {
+        return s->queues[INDEX_IO(0)];
+    }
+
+    for (i = INDEX_IO(0); i < s->queue_count; i++) {
+        if (qatomic_load_acquire(&s->queues[i]->aio_context) == ctx) {
+            return s->queues[i];
+        }
+    }
+
+    /* Queues are bound in order, so all are taken if the last one is */
+    if (qatomic_load_acquire(&s->queues[s->queue_count - 1]->aio_context)) {
+        return s->queues[INDEX_IO(0)];
+    }
+
+    QEMU_LOCK_GUARD(&s->bind_lock);
+    for (i = INDEX_IO(1); i < s->queue_count; i++) {
+        NVMeQueuePair *q = s->queues[i];
+
+        if (!q->aio_context) {
+            nvme_bind_queue_pair(q, ctx);
+            return q;
+        }
+    }
+    return s->queues[INDEX_IO(0)];
+}
+
+/* Takes ownership of @q */
+static bool nvme_add_io_queue(BlockDriverState *bs, NVMeQueuePair *q,
+                              Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     unsigned n = s->queue_count;
-    NVMeQueuePair *q;
     NvmeCmd cmd;
     unsigned queue_size = NVME_QUEUE_SIZE;
 
     assert(n <= UINT16_MAX);
-    q = nvme_create_queue_pair(s, bdrv_get_aio_context(bs),
-                               n, queue_size, errp);
-    if (!q) {
-        return false;
-    }
+    assert(q->index == n);
     cmd = (NvmeCmd) {
         .opcode = NVME_ADM_CMD_CREATE_CQ,
         .dptr.prp1 = cpu_to_le64(q->cq.iova),
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | n),
-        .cdw11 = cpu_to_le32(NVME_CQ_IEN | NVME_CQ_PC),
+        .cdw11 = cpu_to_le32((q->irq_idx << 16) | NVME_CQ_IEN | NVME_CQ_PC),
     };
     if (nvme_admin_cmd_sync(bs, &cmd)) {
         error_setg(errp, "Failed to create CQ io queue [%u]", n);
@@ -698,12 +846,19 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     };
     if (nvme_admin_cmd_sync(bs, &cmd)) {
         error_setg(errp, "Failed to create SQ io queue [%u]", n);
-        goto out_error;
+        goto out_delete_cq;
     }
     s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
     s->queues[n] = q;
     s->queue_count++;
     return true;
+out_delete_cq:
+    /* Opening goes on without this queue, do not leave its CQ behind */
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_DELETE_CQ,
+        .cdw10 = cpu_to_le32(n),
+    };
+    nvme_admin_cmd_sync(bs, &cmd);
 out_error:
     nvme_free_queue_pair(q);
     return false;
@@ -718,14 +873,9 @@ static bool nvme_poll_cb(void *opaque)
 
     for (i = 0; i < s->queue_count; i++) {
         NVMeQueuePair *q = s->queues[i];
-        const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
-        NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
-
-        /*
-         * q->lock isn't needed because nvme_process_completion() only runs in
-         * the event loop thread and cannot race with itself.
-         */
-        if ((le16_to_cpu(cqe->status) & 0x1) != q->cq_phase) {
+
+        if (q->irq_idx == MSIX_SHARED_IRQ_IDX &&
+            nvme_queue_has_completion(q)) {
             return true;
         }
     }
@@ -740,12 +890,32 @@ static void nvme_poll_ready(EventNotifier *e)
     nvme_poll_queues(s);
 }
 
+/* Ask the controller for @num_queues I/O submission and completion queues */
+static bool nvme_set_num_queues(BlockDriverState *bs, unsigned num_queues)
+{
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((num_queues - 1) << 16) | (num_queues - 1)),
+    };
+
+    if (nvme_admin_cmd_sync(bs, &cmd)) {
+        warn_report("NVMe: failed to set the number of queues, "
+                    "using a single I/O queue");
+        return false;
+    }
+    return true;
+}
+
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     unsigned num_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q;
     AioContext *aio_context = bdrv_get_aio_context(bs);
+    g_autofree NVMeQueuePair **io_queues = NULL;
+    g_autofree EventNotifier **irq_notifiers = NULL;
+    unsigned i, allocated_queues = 0;
     int ret;
     uint64_t cap;
     uint32_t ver;
@@ -755,6 +925,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
+    qemu_mutex_init(&s->bind_lock);
     s->device = g_strdup(device);
     s->nsid = namespace;
     s->aio_context = bdrv_get_aio_context(bs);
@@ -835,7 +1006,8 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     /* Set up admin queue. */
     s->queues = g_new(NVMeQueuePair *, 1);
-    q = nvme_create_queue_pair(s, aio_context, 0, NVME_QUEUE_SIZE, errp);
+    q = nvme_create_queue_pair(s, aio_context, 0, MSIX_SHARED_IRQ_IDX,
+                               NVME_QUEUE_SIZE, errp);
     if (!q) {
         ret = -EINVAL;
         goto out;
@@ -865,8 +1037,37 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         }
     }
 
-    ret = qemu_vfio_pci_init_irq(s->vfio, s->irq_notifier,
-                                 VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    /*
+     * The first I/O queue shares the admin queue's IRQ, every further one
+     * needs an IRQ and a doorbell pair of its own.
+     */
+    ret = qemu_vfio_pci_get_irq_count(s->vfio, VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    if (ret < 0) {
+        goto out;
+    }
+    num_queues = MIN(num_queues, ret);
+    num_queues = MIN(num_queues, NVME_DOORBELL_SIZE /
+                     (sizeof(*s->doorbells) * s->doorbell_scale) - 1);
+    num_queues = MAX(num_queues, 1);
+
+    io_queues = g_new0(NVMeQueuePair *, num_queues);
+    allocated_queues = num_queues;
+    irq_notifiers = g_new(EventNotifier *, num_queues);
+    irq_notifiers[MSIX_SHARED_IRQ_IDX] = &s->irq_notifier[MSIX_SHARED_IRQ_IDX];
+    for (i = 0; i < num_queues; i++) {
+        io_queues[i] = nvme_create_queue_pair(s, aio_context, INDEX_IO(i), i,
+                                              NVME_QUEUE_SIZE, errp);
+        if (!io_queues[i]) {
+            ret = -EINVAL;
+            goto out;
+        }
+        if (i != MSIX_SHARED_IRQ_IDX) {
+            irq_notifiers[i] = &io_queues[i]->irq_notifier;
+        }
+    }
+
+    ret = qemu_vfio_pci_init_irqs(s->vfio, irq_notifiers, num_queues,
+                                  VFIO_PCI_MSIX_IRQ_INDEX, errp);
     if (ret) {
         goto out;
     }
@@ -880,11 +1081,30 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         goto out;
     }
 
+    if (num_queues > 1 && !nvme_set_num_queues(bs, num_queues)) {
+        num_queues = 1;
+    }
+
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
-        ret = -EIO;
+    for (i = 0; i < num_queues; i++) {
+        q = io_queues[i];
+        io_queues[i] = NULL;
+        if (!nvme_add_io_queue(bs, q, i == 0 ? errp : NULL)) {
+            if (i == 0) {
+                ret = -EIO;
+                goto out;
+            }
+            /* Make do with the queues that the controller let us create */
+            warn_report("NVMe: using %u of %u I/O queues", i, num_queues);
+            break;
+        }
     }
 out:
+    for (i = 0; i < allocated_queues; i++) {
+        if (io_queues[i]) {
+            nvme_free_queue_pair(io_queues[i]);
+        }
+    }
     if (regs) {
         qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)regs, 0, sizeof(NvmeBar));
     }
@@ -963,6 +1183,7 @@ static void nvme_close(BlockDriverState *bs)
     qemu_vfio_pci_unmap_bar(s->vfio, 0, s->bar0_wo_map,
                             0, sizeof(NvmeBar) + NVME_DOORBELL_SIZE);
     qemu_vfio_close(s->vfio);
+    qemu_mutex_destroy(&s->bind_lock);
 
     g_free(s->device);
 }
@@ -973,6 +1194,7 @@ static int nvme_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    uint64_t num_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -988,7 +1210,14 @@ static int nvme_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    num_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NUM_QUEUES, 1);
+    if (num_queues < 1 || num_queues > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_NUM_QUEUES "' must be between 1 "
+                   "and %d", NVME_MAX_IO_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, num_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -1169,14 +1398,16 @@ static void nvme_rw_cb_bh(void *opaque)
     qemu_coroutine_enter(data->co);
 }
 
+/*
+ * The request coroutine always yields after submission and is entered from a
+ * BH in its own AioContext. Completions of a shared I/O queue are processed in
+ * another thread and may race with the submission, so there is no shortcut
+ * for requests that complete before the coroutine yields.
+ */
 static void nvme_rw_cb(void *opaque, int ret)
 {
     NVMeCoData *data = opaque;
     data->ret = ret;
-    if (!data->co) {
-        /* The rw coroutine hasn't yielded, don't try to enter. */
-        return;
-    }
     replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
 }
 
@@ -1188,7 +1419,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1201,7 +1432,8 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw12 = cpu_to_le32(cdw12),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .co = qemu_coroutine_self(),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1218,11 +1450,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         return r;
     }
     nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
-
-    data.co = qemu_coroutine_self();
-    while (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
+    qemu_coroutine_yield();
 
     qemu_co_mutex_lock(&s->dma_map_lock);
     r = nvme_cmd_unmap_qiov(bs, qiov);
@@ -1267,10 +1495,10 @@ static coroutine_fn int nvme_co_prw(BlockDriverState *bs,
     assert(QEMU_IS_ALIGNED(bytes, s->page_size));
     assert(bytes <= s->max_transfer);
     if (nvme_qiov_aligned(bs, qiov)) {
-        s->stats.aligned_accesses++;
+        stat64_add(&s->stats.aligned_accesses, 1);
         return nvme_co_prw_aligned(bs, offset, bytes, qiov, is_write, flags);
     }
-    s->stats.unaligned_accesses++;
+    stat64_add(&s->stats.unaligned_accesses, 1);
     trace_nvme_prw_buffered(s, offset, bytes, qiov->niov, is_write);
     buf = qemu_try_memalign(qemu_real_host_page_size(), len);
 
@@ -1309,14 +1537,15 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .co = qemu_coroutine_self(),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1324,11 +1553,7 @@ static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
     req = nvme_get_free_req(ioq);
     assert(req);
     nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
-
-    data.co = qemu_coroutine_self();
-    if (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
+    qemu_coroutine_yield();
 
     return data.ret;
 }
@@ -1340,7 +1565,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     uint32_t cdw12;
 
@@ -1367,7 +1592,8 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .co = qemu_coroutine_self(),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1387,11 +1613,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     assert(req);
 
     nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
-
-    data.co = qemu_coroutine_self();
-    while (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
+    qemu_coroutine_yield();
 
     trace_nvme_rw_done(s, true, offset, bytes, data.ret);
     return data.ret;
@@ -1403,7 +1625,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int64_t bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     QEMU_AUTO_VFREE NvmeDsmRange *buf = NULL;
     QEMUIOVector local_qiov;
@@ -1417,7 +1639,8 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .co = qemu_coroutine_self(),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1462,11 +1685,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     trace_nvme_dsm(s, offset, bytes);
 
     nvme_submit_command(ioq, req, &cmd, nvme_rw_cb, &data);
-
-    data.co = qemu_coroutine_self();
-    while (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
+    qemu_coroutine_yield();
 
     qemu_co_mutex_lock(&s->dma_map_lock);
     ret = nvme_cmd_unmap_qiov(bs, &local_qiov);
@@ -1550,8 +1769,13 @@ static void nvme_detach_aio_context(BlockDriverState *bs)
     for (unsigned i = 0; i < s->queue_count; i++) {
         NVMeQueuePair *q = s->queues[i];
 
+        /* Queues with their own IRQ stay in the AioContext they are bound to */
+        if (q->irq_idx != MSIX_SHARED_IRQ_IDX) {
+            continue;
+        }
         qemu_bh_delete(q->completion_bh);
         q->completion_bh = NULL;
+        q->aio_context = NULL;
     }
 
     aio_set_event_notifier(bdrv_get_aio_context(bs),
@@ -1572,8 +1796,12 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
     for (unsigned i = 0; i < s->queue_count; i++) {
         NVMeQueuePair *q = s->queues[i];
 
+        if (q->irq_idx != MSIX_SHARED_IRQ_IDX) {
+            continue;
+        }
         q->completion_bh =
             aio_bh_new(new_context, nvme_process_completion_bh, q);
+        q->aio_context = new_context;
     }
 }
 
@@ -1606,9 +1834,9 @@ static BlockStatsSpecific *nvme_get_specific_stats(BlockDriverState *bs)
 
     stats->driver = BLOCKDEV_DRIVER_NVME;
     stats->u.nvme = (BlockStatsSpecificNvme) {
-        .completion_errors = s->stats.completion_errors,
-        .aligned_accesses = s->stats.aligned_accesses,
-        .unaligned_accesses = s->stats.unaligned_accesses,
+        .completion_errors = stat64_get(&s->stats.completion_errors),
+        .aligned_accesses = stat64_get(&s->stats.aligned_accesses),
+        .unaligned_accesses = stat64_get(&s->stats.unaligned_accesses),
     };
 
     return stats;
@@ -491,6 +491,26 @@ bdrv_latency_histogram_stats(BlockLatencyHistogram *hist)
     return info;
 }
 
+static BlockLatencyHistogramInfo *
+bdrv_node_latency_histogram_stats(BlockNodeLatencyHistogram *hist,
+                                  enum BlockAcctType type)
+{
+    BlockLatencyHistogramInfo *info;
+    uint64_t boundaries[BLOCK_NODE_LATENCY_BINS - 1];
+    uint64_t bins[BLOCK_NODE_LATENCY_BINS];
+    int i;
+
+    for (i = 0; i < BLOCK_NODE_LATENCY_BINS - 1; i++) {
+        boundaries[i] = 2ULL << i;
+    }
+    block_node_latency_histogram_get(hist, type, bins);
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    info->boundaries = uint64_list(boundaries, BLOCK_NODE_LATENCY_BINS - 1);
+    info->bins = uint64_list(bins, BLOCK_NODE_LATENCY_BINS);
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -615,6 +635,16 @@ bdrv_query_bds_stats(BlockDriverState *bs, bool blk_level)
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
 
+    /* At the BlockBackend level, these are the device's histograms */
+    if (!blk_level && bs->latency_histogram) {
+        s->stats->rd_latency_histogram =
+            bdrv_node_latency_histogram_stats(bs->latency_histogram,
+                                              BLOCK_ACCT_READ);
+        s->stats->wr_latency_histogram =
+            bdrv_node_latency_histogram_stats(bs->latency_histogram,
+                                              BLOCK_ACCT_WRITE);
+    }
+
     s->driver_specific = bdrv_get_specific_stats(bs);
 
     parent_child = bdrv_primary_child(bs);
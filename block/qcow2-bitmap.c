@@ -338,24 +338,45 @@ finish:
     return ret;
 }
 
+/*
+ * Whether a bitmap should be loaded with the sparse representation if the
+ * sparse-bitmaps option is set: it must be large enough for the memory
+ * savings to matter, and at most 1/16 of its clusters may hold data.
+ * All-zeroes and all-ones clusters cost at most one run each.
+ */
+static bool bitmap_table_is_sparse(const uint64_t *bitmap_table,
+                                   uint32_t bitmap_table_size)
+{
+    uint32_t i, data_clusters = 0;
+
+    if (bitmap_table_size < 16) {
+        return false;
+    }
+
+    for (i = 0; i < bitmap_table_size; i++) {
+        if (bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK) {
+            data_clusters++;
+        }
+    }
+
+    return data_clusters <= bitmap_table_size / 16;
+}
+
 static coroutine_fn GRAPH_RDLOCK
 BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
                              Qcow2Bitmap *bm, Error **errp)
 {
+    BDRVQcow2State *s = bs->opaque;
     int ret;
     uint64_t *bitmap_table = NULL;
     uint32_t granularity;
     BdrvDirtyBitmap *bitmap = NULL;
 
     granularity = 1U << bm->granularity_bits;
-    bitmap = bdrv_create_dirty_bitmap(bs, granularity, bm->name, errp);
-    if (bitmap == NULL) {
-        goto fail;
-    }
 
     if (bm->flags & BME_FLAG_IN_USE) {
         /* Data is unusable, skip loading it */
-        return bitmap;
+        return bdrv_create_dirty_bitmap(bs, granularity, bm->name, errp);
     }
 
     ret = bitmap_table_load(bs, &bm->table, &bitmap_table);
@@ -366,6 +387,17 @@ BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
         goto fail;
     }
 
+    if (s->sparse_bitmaps &&
+        bitmap_table_is_sparse(bitmap_table, bm->table.size)) {
+        bitmap = bdrv_create_sparse_dirty_bitmap(bs, granularity, bm->name,
+                                                 errp);
+    } else {
+        bitmap = bdrv_create_dirty_bitmap(bs, granularity, bm->name, errp);
+    }
+    if (bitmap == NULL) {
+        goto fail;
+    }
+
     ret = load_bitmap_data(bs, bitmap_table, bm->table.size, bitmap);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Could not read bitmap '%s' from image",
@@ -43,6 +43,7 @@ int coroutine_fn qcow2_shrink_l1_table(BlockDriverState *bs,
     }
 
     new_l1_size = exact_size;
+    qcow2_extent_cache_clear(s->extent_cache);
 
 #ifdef DEBUG_ALLOC2
     fprintf(stderr, "shrink l1_table from %d to %d\n", s->l1_size, new_l1_size);
@@ -563,6 +564,31 @@ do_perform_cow_write(BlockDriverState *bs, uint64_t cluster_offset,
 }
 
 
+/*
+ * Like qcow2_get_host_offset(), but only consult the extent cache and never
+ * load any metadata. This does not need s->lock, so requests coming from
+ * several AioContexts can find their data without queuing up on the CoMutex.
+ *
+ * Returns true on a cache hit. Otherwise the caller has to fall back to
+ * qcow2_get_host_offset().
+ */
+bool qcow2_try_get_host_offset(BlockDriverState *bs, uint64_t offset,
+                               unsigned int *bytes, uint64_t *host_offset,
+                               QCow2SubclusterType *subcluster_type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cached_bytes = *bytes;
+
+    if (has_subclusters(s) ||
+        !qcow2_extent_cache_lookup(s->extent_cache, offset, &cached_bytes,
+                                   host_offset, subcluster_type)) {
+        return false;
+    }
+
+    *bytes = cached_bytes;
+    return true;
+}
+
 /*
  * get_host_offset
  *
@@ -599,6 +625,12 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
     offset_in_cluster = offset_into_cluster(s, offset);
     bytes_needed = (uint64_t) *bytes + offset_in_cluster;
 
+    /* A cached extent may cover the whole request, even across L2 slices */
+    if (qcow2_try_get_host_offset(bs, offset, bytes, host_offset,
+                                  subcluster_type)) {
+        return 0;
+    }
+
     /* compute how many bytes there are between the start of the cluster
      * containing offset and the end of the l2 slice that contains
      * the entry pointing to it */
@@ -722,6 +754,16 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
 
     bytes_available = ((int64_t)sc + sc_index) << s->subcluster_bits;
 
+    /*
+     * Without subclusters, the run found above consists of whole clusters;
+     * remember it so that the next lookups need not load the L2 slice again.
+     */
+    if (!has_subclusters(s) && type != QCOW2_SUBCLUSTER_COMPRESSED) {
+        qcow2_extent_cache_insert(s->extent_cache, offset - offset_in_cluster,
+                                  bytes_available,
+                                  l2_entry & L2E_OFFSET_MASK, type);
+    }
+
 out:
     if (bytes_available > bytes_needed) {
         bytes_available = bytes_needed;
@@ -879,6 +921,8 @@ qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs, uint64_t offset,
         set_l2_bitmap(s, l2_slice, l2_index, 0);
     }
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    qcow2_extent_cache_invalidate(s->extent_cache,
+                                  start_of_cluster(s, offset), s->cluster_size);
 
     *host_offset = cluster_offset & s->cluster_offset_mask;
     return 0;
@@ -1103,6 +1147,8 @@ int coroutine_fn qcow2_alloc_cluster_link_l2(BlockDriverState *bs,
 
 
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    qcow2_extent_cache_invalidate(s->extent_cache, m->offset,
+                                  (uint64_t)m->nb_clusters << s->cluster_bits);
 
     /*
      * If this was a COW, we need to decrease the refcount of the old cluster.
@@ -1988,6 +2034,8 @@ discard_in_l2_slice(BlockDriverState *bs, uint64_t offset, uint64_t nb_clusters,
     }
 
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    qcow2_extent_cache_invalidate(s->extent_cache, offset,
+                                  nb_clusters << s->cluster_bits);
 
     return nb_clusters;
 }
@@ -2103,6 +2151,8 @@ zero_in_l2_slice(BlockDriverState *bs, uint64_t offset,
     }
 
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    qcow2_extent_cache_invalidate(s->extent_cache, offset,
+                                  nb_clusters << s->cluster_bits);
 
     return nb_clusters;
 }
@@ -2237,6 +2287,125 @@ fail:
     return ret;
 }
 
+/*
+ * Make the guest cluster at @dst_offset point to the host cluster that backs
+ * the guest cluster at @src_offset instead of writing a copy of it, and
+ * account for the new reference in the refcount table. Whatever the
+ * destination referenced before is released.
+ *
+ * Both offsets must be cluster aligned and the source must be a normal data
+ * cluster.
+ *
+ * Returns 0 on success, -ENOTSUP if the clusters cannot be shared (the caller
+ * must then fall back to copying the data) and -errno on other errors.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_share_cluster(BlockDriverState *bs, uint64_t src_offset,
+                       uint64_t dst_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice;
+    uint64_t l2_entry, old_l2_entry, host_offset, refcount;
+    int l2_index;
+    int ret;
+
+    assert(offset_into_cluster(s, src_offset) == 0);
+    assert(offset_into_cluster(s, dst_offset) == 0);
+
+    /*
+     * Clusters in external data files are not refcounted, and with
+     * subclusters a partially allocated source cannot be shared as a whole.
+     */
+    if (has_data_file(bs) || has_subclusters(s) || src_offset == dst_offset) {
+        return -ENOTSUP;
+    }
+
+    ret = get_cluster_table(bs, src_offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    host_offset = l2_entry & L2E_OFFSET_MASK;
+    if (qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_NORMAL) {
+        ret = -ENOTSUP;
+        goto out;
+    }
+    if (offset_into_cluster(s, host_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Cluster allocation offset %#"
+                                PRIx64 " unaligned (guest offset: %#" PRIx64
+                                ")", host_offset, src_offset);
+        ret = -EIO;
+        goto out;
+    }
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        goto out;
+    }
+    if (refcount == 0 || refcount >= s->refcount_max) {
+        ret = -ENOTSUP;
+        goto out;
+    }
+
+    /*
+     * The source must stop being written in place before anything else
+     * refers to its host cluster, so make sure that the cleared
+     * QCOW_OFLAG_COPIED is on disk before the new reference can be.
+     */
+    if (l2_entry & QCOW_OFLAG_COPIED) {
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        set_l2_entry(s, l2_slice, l2_index, l2_entry & ~QCOW_OFLAG_COPIED);
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+        ret = qcow2_cache_flush(bs, s->l2_table_cache);
+        if (ret < 0) {
+            return ret;
+        }
+    } else {
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    }
+
+    ret = get_cluster_table(bs, dst_offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+    old_l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    if ((old_l2_entry & L2E_OFFSET_MASK) == host_offset &&
+        qcow2_get_cluster_type(bs, old_l2_entry) == QCOW2_CLUSTER_NORMAL) {
+        /* Already shared */
+        ret = 0;
+        goto out;
+    }
+
+    ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits, 1,
+                                        false, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* The new L2 entry may only be written after the refcount update */
+    if (s->use_lazy_refcounts) {
+        qcow2_mark_dirty(bs);
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    set_l2_entry(s, l2_slice, l2_index, host_offset);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    qcow2_extent_cache_invalidate(s->extent_cache, dst_offset, s->cluster_size);
+
+    /* Then drop the reference to what the destination pointed to before */
+    qcow2_free_any_cluster(bs, old_l2_entry, QCOW2_DISCARD_OTHER);
+
+    return 0;
+
+out:
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    return ret;
+}
+
 /*
  * Expands all zero clusters in a specific L1 table (or deallocates them, for
  * non-backed non-pre-allocated zero clusters).
@@ -2471,6 +2640,9 @@ int qcow2_expand_zero_clusters(BlockDriverState *bs,
     int ret;
     int i, j;
 
+    /* Zero clusters are about to become allocated ones */
+    qcow2_extent_cache_clear(s->extent_cache);
+
     if (status_cb) {
         l1_entries = s->l1_size;
         for (i = 0; i < s->nb_snapshots; i++) {
@@ -0,0 +1,271 @@
+/*
+ * Guest offset -> host offset extent cache for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The extent cache remembers runs of clusters that qcow2_get_host_offset()
+ * has found while walking L2 slices: ranges of guest offsets that have the
+ * same cluster type and, for allocated clusters, are contiguous in the image
+ * file. Adjacent runs are merged, so a single lookup can answer a query that
+ * spans several L2 slices (or L2 tables) without loading any of them.
+ *
+ * The cache is filled lazily and is only a view of the L2 tables: every
+ * change to a guest mapping must invalidate the affected range, and anything
+ * that replaces the L1 table must clear the whole cache. Insertions and
+ * invalidations happen under s->lock. Lookups may also be done without it
+ * (see qcow2_try_get_host_offset()), so the cache has a lock of its own that
+ * is never held across a yield.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+#include "qemu/lockable.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2Extent {
+    IntervalTreeNode node;      /* guest range, [start, last] */
+    uint64_t host_offset;       /* host offset of node.start, if allocated */
+    QCow2SubclusterType type;
+    QTAILQ_ENTRY(Qcow2Extent) lru;
+} Qcow2Extent;
+
+struct Qcow2ExtentCache {
+    QemuMutex lock;
+    IntervalTreeRoot root;
+    QTAILQ_HEAD(, Qcow2Extent) lru; /* most recently used first */
+    int nb_extents;
+    int max_extents;
+};
+
+static bool extent_type_has_host(QCow2SubclusterType type)
+{
+    return type == QCOW2_SUBCLUSTER_NORMAL ||
+           type == QCOW2_SUBCLUSTER_ZERO_ALLOC;
+}
+
+Qcow2ExtentCache *qcow2_extent_cache_create(int max_extents)
+{
+    Qcow2ExtentCache *c = g_new0(Qcow2ExtentCache, 1);
+
+    assert(max_extents > 0);
+    qemu_mutex_init(&c->lock);
+    QTAILQ_INIT(&c->lru);
+    c->max_extents = max_extents;
+    return c;
+}
+
+static void extent_free(Qcow2ExtentCache *c, Qcow2Extent *e)
+{
+    interval_tree_remove(&e->node, &c->root);
+    QTAILQ_REMOVE(&c->lru, e, lru);
+    c->nb_extents--;
+    g_free(e);
+}
+
+void qcow2_extent_cache_clear(Qcow2ExtentCache *c)
+{
+    Qcow2Extent *e, *next;
+
+    QEMU_LOCK_GUARD(&c->lock);
+    QTAILQ_FOREACH_SAFE(e, &c->lru, lru, next) {
+        extent_free(c, e);
+    }
+    assert(c->nb_extents == 0);
+}
+
+void qcow2_extent_cache_destroy(Qcow2ExtentCache *c)
+{
+    if (c) {
+        qcow2_extent_cache_clear(c);
+        qemu_mutex_destroy(&c->lock);
+        g_free(c);
+    }
+}
+
+/*
+ * Look up the extent containing @offset. On a hit, *bytes is reduced to the
+ * number of bytes from @offset to the end of the extent (if that is smaller),
+ * and *host_offset and *type describe @offset like qcow2_get_host_offset()
+ * does.
+ */
+bool qcow2_extent_cache_lookup(Qcow2ExtentCache *c, uint64_t offset,
+                               uint64_t *bytes, uint64_t *host_offset,
+                               QCow2SubclusterType *type)
+{
+    IntervalTreeNode *node;
+    Qcow2Extent *e;
+
+    QEMU_LOCK_GUARD(&c->lock);
+    node = interval_tree_iter_first(&c->root, offset, offset);
+    if (!node) {
+        return false;
+    }
+    e = container_of(node, Qcow2Extent, node);
+
+    *bytes = MIN(*bytes, e->node.last - offset + 1);
+    *type = e->type;
+    *host_offset = extent_type_has_host(e->type) ?
+                   e->host_offset + (offset - e->node.start) : 0;
+
+    if (QTAILQ_FIRST(&c->lru) != e) {
+        QTAILQ_REMOVE(&c->lru, e, lru);
+        QTAILQ_INSERT_HEAD(&c->lru, e, lru);
+    }
+
+    trace_qcow2_extent_cache_hit(c, offset, *bytes);
+    return true;
+}
+
+static void extent_cache_invalidate_locked(Qcow2ExtentCache *c,
+                                           uint64_t offset, uint64_t bytes)
+{
+    uint64_t last = offset + bytes - 1;
+    IntervalTreeNode *node;
+
+    if (!bytes) {
+        return;
+    }
+
+    while ((node = interval_tree_iter_first(&c->root, offset, last))) {
+        Qcow2Extent *e = container_of(node, Qcow2Extent, node);
+        uint64_t start = e->node.start, end = e->node.last;
+
+        interval_tree_remove(&e->node, &c->root);
+
+        if (end > last) {
+            /* Keep the tail */
+            Qcow2Extent *tail = g_new(Qcow2Extent, 1);
+
+            *tail = (Qcow2Extent) {
+                .node.start  = last + 1,
+                .node.last   = end,
+                .host_offset = e->host_offset + (last + 1 - start),
+                .type        = e->type,
+            };
+            interval_tree_insert(&tail->node, &c->root);
+            QTAILQ_INSERT_AFTER(&c->lru, e, tail, lru);
+            c->nb_extents++;
+        }
+
+        if (start < offset) {
+            /* Keep the head */
+            e->node.last = offset - 1;
+            interval_tree_insert(&e->node, &c->root);
+        } else {
+            QTAILQ_REMOVE(&c->lru, e, lru);
+            c->nb_extents--;
+            g_free(e);
+        }
+    }
+}
+
+/*
+ * Forget about [@offset, @offset + @bytes). Extents that only partially
+ * overlap the range are trimmed.
+ */
+void qcow2_extent_cache_invalidate(Qcow2ExtentCache *c, uint64_t offset,
+                                   uint64_t bytes)
+{
+    QEMU_LOCK_GUARD(&c->lock);
+    extent_cache_invalidate_locked(c, offset, bytes);
+}
+
+static bool extent_continues(Qcow2Extent *e, uint64_t offset,
+                             uint64_t host_offset, QCow2SubclusterType type)
+{
+    return e->type == type &&
+           (!extent_type_has_host(type) ||
+            e->host_offset + (offset - e->node.start) == host_offset);
+}
+
+/*
+ * Record that [@offset, @offset + @bytes) has cluster type @type and, for
+ * allocated types, is stored contiguously starting at @host_offset.
+ */
+void qcow2_extent_cache_insert(Qcow2ExtentCache *c, uint64_t offset,
+                               uint64_t bytes, uint64_t host_offset,
+                               QCow2SubclusterType type)
+{
+    uint64_t last = offset + bytes - 1;
+    IntervalTreeNode *node;
+    Qcow2Extent *e = NULL;
+
+    assert(bytes > 0);
+    assert(type == QCOW2_SUBCLUSTER_NORMAL ||
+           type == QCOW2_SUBCLUSTER_ZERO_ALLOC ||
+           type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
+           type == QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN);
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    /* What we know about the range now replaces what was cached before */
+    extent_cache_invalidate_locked(c, offset, bytes);
+
+    /* Merge with an extent that ends right before this one... */
+    if (offset > 0) {
+        node = interval_tree_iter_first(&c->root, offset - 1, offset - 1);
+        if (node) {
+            Qcow2Extent *prev = container_of(node, Qcow2Extent, node);
+            if (extent_continues(prev, offset, host_offset, type)) {
+                interval_tree_remove(&prev->node, &c->root);
+                QTAILQ_REMOVE(&c->lru, prev, lru);
+                offset = prev->node.start;
+                host_offset = prev->host_offset;
+                e = prev;
+            }
+        }
+    }
+
+    /* ...and with one that starts right after it */
+    if (last < UINT64_MAX) {
+        node = interval_tree_iter_first(&c->root, last + 1, last + 1);
+        if (node) {
+            Qcow2Extent *next = container_of(node, Qcow2Extent, node);
+            if (extent_continues(next, last + 1,
+                                 host_offset + (last + 1 - offset), type)) {
+                last = next->node.last;
+                extent_free(c, next);
+            }
+        }
+    }
+
+    if (!e) {
+        if (c->nb_extents >= c->max_extents) {
+            extent_free(c, QTAILQ_LAST(&c->lru));
+        }
+        e = g_new(Qcow2Extent, 1);
+        c->nb_extents++;
+    }
+
+    *e = (Qcow2Extent) {
+        .node.start  = offset,
+        .node.last   = last,
+        .host_offset = extent_type_has_host(type) ? host_offset : 0,
+        .type        = type,
+    };
+    interval_tree_insert(&e->node, &c->root);
+    QTAILQ_INSERT_HEAD(&c->lru, e, lru);
+
+    trace_qcow2_extent_cache_insert(c, offset, last - offset + 1, type);
+}
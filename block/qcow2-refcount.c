@@ -23,8 +23,10 @@
  */
 
 #include "qemu/osdep.h"
+#include "block/aio_task.h"
 #include "block/block-io.h"
 #include "qapi/error.h"
+#include "crypto/hash.h"
 #include "qcow2.h"
 #include "qemu/range.h"
 #include "qemu/bswap.h"
@@ -885,6 +887,10 @@ update_refcount(BlockDriverState *bs, int64_t offset, int64_t length,
         }
         s->set_refcount(refcount_block, block_index, refcount);
 
+        if (decrease && refcount == 1) {
+            s->copied_flags_stale = true;
+        }
+
         if (refcount == 0) {
             void *table;
 
@@ -1420,6 +1426,9 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     }
 
     ret = bdrv_flush(bs);
+    if (ret == 0 && addend == 0 && l1_table_offset == s->l1_table_offset) {
+        s->copied_flags_stale = false;
+    }
 fail:
     if (l2_slice) {
         qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
@@ -1590,6 +1599,241 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/* Number of L2 tables that check_refcounts_l1() reads ahead */
+#define CHECK_L2_READAHEAD 16
+
+#define CHECK_CHECKPOINT_MAGIC "QCOW2CHK"
+#define CHECK_CHECKPOINT_VERSION 2
+/* Minimum time between two checkpoints */
+#define CHECK_CHECKPOINT_INTERVAL (10 * G_USEC_PER_SEC)
+
+/*
+ * Header of a checkpoint file, followed by the in-memory refcount array.
+ * Checkpoints are only meant to be resumed on the same host, so all fields
+ * are in host byte order.
+ */
+typedef struct Qcow2CheckCheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint32_t refcount_order;
+    uint32_t l1_size;
+    uint64_t l1_table_offset;
+    uint64_t snapshots_offset;
+    uint32_t nb_snapshots;
+    /* Position from which to resume, see Qcow2CheckCheckpoint */
+    uint32_t table;
+    uint32_t l1_index;
+    int32_t corruptions;
+    int32_t check_errors;
+    uint32_t reserved;
+    uint64_t file_size;
+    uint64_t allocated_clusters;
+    uint64_t fragmented_clusters;
+    uint64_t compressed_clusters;
+    uint64_t nb_clusters;
+    /* See check_checkpoint_hash_tables() */
+    uint8_t tables_hash[QCRYPTO_HASH_DIGEST_LEN_SHA256];
+} Qcow2CheckCheckpointHeader;
+
+/*
+ * State of a checkpointed check.  Positions in the walk over the L1 tables are
+ * given as a table index, where 0 is the active L1 table and n is the L1
+ * table of the nth snapshot, and the index of the next L1 entry to check.
+ */
+typedef struct Qcow2CheckCheckpoint {
+    const char *filename;
+    int64_t file_size;
+    int64_t last_save;
+    bool failed;
+
+    /* Set while skipping the part of the walk covered by the checkpoint */
+    bool resume;
+    uint32_t table;
+    uint32_t l1_index;
+} Qcow2CheckCheckpoint;
+
+/* Whether the L1 table @table has been checked completely before resuming */
+static bool check_checkpoint_skip_table(Qcow2CheckCheckpoint *cp,
+                                        uint32_t table)
+{
+    return cp && cp->resume && table < cp->table;
+}
+
+/*
+ * Compute into @hash the SHA-256 of the active L1 table, of the refcount
+ * table and of the L1 table location of each snapshot, so that a checkpoint
+ * is not resumed after the metadata of the image changed in place.
+ */
+static bool check_checkpoint_hash_tables(BlockDriverState *bs, uint8_t *hash)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree uint64_t *snapshot_l1 = g_new(uint64_t, 2 * s->nb_snapshots);
+    g_autofree uint8_t *result = NULL;
+    Error *local_err = NULL;
+    size_t result_len = QCRYPTO_HASH_DIGEST_LEN_SHA256;
+    struct iovec iov[3];
+    int i;
+
+    for (i = 0; i < s->nb_snapshots; i++) {
+        snapshot_l1[2 * i] = s->snapshots[i].l1_table_offset;
+        snapshot_l1[2 * i + 1] = s->snapshots[i].l1_size;
+    }
+    iov[0] = (struct iovec) {
+        .iov_base = s->l1_table,
+        .iov_len = s->l1_size * L1E_SIZE,
+    };
+    iov[1] = (struct iovec) {
+        .iov_base = s->refcount_table,
+        .iov_len = s->refcount_table_size * REFTABLE_ENTRY_SIZE,
+    };
+    iov[2] = (struct iovec) {
+        .iov_base = snapshot_l1,
+        .iov_len = 2 * s->nb_snapshots * sizeof(uint64_t),
+    };
+
+    if (qcrypto_hash_bytesv(QCRYPTO_HASH_ALGO_SHA256, iov, ARRAY_SIZE(iov),
+                            &result, &result_len, &local_err) < 0) {
+        fprintf(stderr, "Warning: Cannot hash the image metadata for the "
+                "checkpoint: %s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        return false;
+    }
+    assert(result_len == QCRYPTO_HASH_DIGEST_LEN_SHA256);
+    memcpy(hash, result, result_len);
+    return true;
+}
+
+/*
+ * Load the checkpoint file, if it exists and belongs to the image, into
+ * @res and the refcount array.  Otherwise the check starts from scratch.
+ */
+static void check_checkpoint_load(BlockDriverState *bs, BdrvCheckResult *res,
+                                  Qcow2CheckCheckpoint *cp,
+                                  void **refcount_table, int64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autoptr(GError) err = NULL;
+    g_autofree char *buf = NULL;
+    Qcow2CheckCheckpointHeader *h;
+    uint8_t tables_hash[QCRYPTO_HASH_DIGEST_LEN_SHA256];
+    int64_t size = 0;
+    gsize len;
+
+    if (!g_file_get_contents(cp->filename, &buf, &len, &err)) {
+        if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            fprintf(stderr, "Warning: Ignoring checkpoint: %s\n",
+                    err->message);
+        }
+        return;
+    }
+
+    h = (Qcow2CheckCheckpointHeader *)buf;
+    if (len < sizeof(*h) ||
+        memcmp(h->magic, CHECK_CHECKPOINT_MAGIC, sizeof(h->magic)) ||
+        h->version != CHECK_CHECKPOINT_VERSION ||
+        h->cluster_bits != s->cluster_bits ||
+        h->refcount_order != s->refcount_order ||
+        h->l1_size != s->l1_size ||
+        h->l1_table_offset != s->l1_table_offset ||
+        h->snapshots_offset != s->snapshots_offset ||
+        h->nb_snapshots != s->nb_snapshots ||
+        h->table > s->nb_snapshots + 1 ||
+        h->file_size != cp->file_size ||
+        h->nb_clusters < *nb_clusters ||
+        h->nb_clusters > INT_MAX ||
+        len != sizeof(*h) + refcount_array_byte_size(s, h->nb_clusters))
+    {
+        fprintf(stderr, "Warning: Checkpoint file '%s' does not match the "
+                "image, starting over\n", cp->filename);
+        return;
+    }
+    if (!check_checkpoint_hash_tables(bs, tables_hash)) {
+        return;
+    }
+    if (memcmp(h->tables_hash, tables_hash, sizeof(tables_hash))) {
+        fprintf(stderr, "Warning: The L1 or refcount table of the image "
+                "changed since checkpoint '%s', starting over\n",
+                cp->filename);
+        return;
+    }
+
+    if (realloc_refcount_array(s, refcount_table, &size, h->nb_clusters) < 0) {
+        return;
+    }
+    memcpy(*refcount_table, buf + sizeof(*h), len - sizeof(*h));
+    *nb_clusters = h->nb_clusters;
+
+    res->corruptions = h->corruptions;
+    res->check_errors = h->check_errors;
+    res->bfi.allocated_clusters = h->allocated_clusters;
+    res->bfi.fragmented_clusters = h->fragmented_clusters;
+    res->bfi.compressed_clusters = h->compressed_clusters;
+
+    cp->resume = true;
+    cp->table = h->table;
+    cp->l1_index = h->l1_index;
+    fprintf(stderr, "Resuming check from checkpoint '%s'\n", cp->filename);
+}
+
+/*
+ * Record that the walk over the L1 tables has reached position (@table,
+ * @l1_index), unless the last checkpoint is more recent than
+ * CHECK_CHECKPOINT_INTERVAL.
+ */
+static void check_checkpoint_save(BlockDriverState *bs, BdrvCheckResult *res,
+                                  Qcow2CheckCheckpoint *cp,
+                                  uint32_t table, uint32_t l1_index,
+                                  void *refcount_table, int64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autoptr(GError) err = NULL;
+    g_autofree char *buf = NULL;
+    Qcow2CheckCheckpointHeader *h;
+    size_t array_size = refcount_array_byte_size(s, nb_clusters);
+    int64_t now = g_get_monotonic_time();
+
+    if (!cp || cp->failed || now - cp->last_save < CHECK_CHECKPOINT_INTERVAL) {
+        return;
+    }
+    cp->last_save = now;
+
+    buf = g_malloc0(sizeof(*h) + array_size);
+    h = (Qcow2CheckCheckpointHeader *)buf;
+    *h = (Qcow2CheckCheckpointHeader) {
+        .version                = CHECK_CHECKPOINT_VERSION,
+        .cluster_bits           = s->cluster_bits,
+        .refcount_order         = s->refcount_order,
+        .l1_size                = s->l1_size,
+        .l1_table_offset        = s->l1_table_offset,
+        .snapshots_offset       = s->snapshots_offset,
+        .nb_snapshots           = s->nb_snapshots,
+        .table                  = table,
+        .l1_index               = l1_index,
+        .corruptions            = res->corruptions,
+        .check_errors           = res->check_errors,
+        .file_size              = cp->file_size,
+        .allocated_clusters     = res->bfi.allocated_clusters,
+        .fragmented_clusters    = res->bfi.fragmented_clusters,
+        .compressed_clusters    = res->bfi.compressed_clusters,
+        .nb_clusters            = nb_clusters,
+    };
+    memcpy(h->magic, CHECK_CHECKPOINT_MAGIC, sizeof(h->magic));
+    if (!check_checkpoint_hash_tables(bs, h->tables_hash)) {
+        cp->failed = true;
+        return;
+    }
+    memcpy(buf + sizeof(*h), refcount_table, array_size);
+
+    /* g_file_set_contents() replaces the file atomically */
+    if (!g_file_set_contents(cp->filename, buf, sizeof(*h) + array_size,
+                             &err)) {
+        fprintf(stderr, "Warning: Failed to write checkpoint: %s\n",
+                err->message);
+        cp->failed = true;
+    }
+}
+
 /*
  * Fix L2 entry by making it QCOW2_CLUSTER_ZERO_PLAIN (or making all its present
  * subclusters QCOW2_SUBCLUSTER_ZERO_PLAIN).
@@ -1653,8 +1897,8 @@ fail:
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table at @l2_offset, whose content the caller has read
+ * into @l2_table. While doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1663,24 +1907,15 @@ static int coroutine_fn GRAPH_RDLOCK
 check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                    void **refcount_table,
                    int64_t *refcount_table_size, int64_t l2_offset,
-                   int flags, BdrvCheckMode fix, bool active)
+                   uint64_t *l2_table, int flags, BdrvCheckMode fix,
+                   bool active)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
     int i, ret;
-    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
-    g_autofree uint64_t *l2_table = g_malloc(l2_size_bytes);
     bool metadata_overlap;
 
-    /* Read L2 table from disk */
-    ret = bdrv_co_pread(bs->file, l2_offset, l2_size_bytes, l2_table, 0);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        return ret;
-    }
-
     /* Do the actual checks */
     for (i = 0; i < s->l2_size; i++) {
         uint64_t coffset;
@@ -1851,11 +2086,36 @@ check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     return 0;
 }
 
+typedef struct CheckL2ReadTask {
+    AioTask task;
+    BlockDriverState *bs;
+    int64_t offset;
+    size_t bytes;
+    void *buf;
+    int *ret;
+} CheckL2ReadTask;
+
+static int coroutine_fn GRAPH_RDLOCK check_l2_read_task_entry(AioTask *task)
+{
+    CheckL2ReadTask *t = container_of(task, CheckL2ReadTask, task);
+
+    /* Errors are reported by the caller when it gets to this table */
+    *t->ret = bdrv_co_pread(t->bs->file, t->offset, t->bytes, t->buf, 0);
+    return 0;
+}
+
 /*
  * Increases the refcount for the L1 table, its L2 tables and all referenced
  * clusters in the given refcount table. While doing so, performs some checks
  * on L1 and L2 entries.
  *
+ * L2 tables are read ahead concurrently, but checked in L1 order, so that the
+ * output is the same as for a sequential check.  When repairing errors, the
+ * tables are read one by one because checking one of them may modify
+ * another.
+ *
+ * @table identifies the L1 table for checkpointing (see Qcow2CheckCheckpoint).
+ *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
@@ -1863,23 +2123,35 @@ static int coroutine_fn GRAPH_RDLOCK
 check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
                    void **refcount_table, int64_t *refcount_table_size,
                    int64_t l1_table_offset, int l1_size,
-                   int flags, BdrvCheckMode fix, bool active)
+                   int flags, BdrvCheckMode fix, bool active,
+                   Qcow2CheckCheckpoint *cp, uint32_t table)
 {
     BDRVQcow2State *s = bs->opaque;
     size_t l1_size_bytes = l1_size * L1E_SIZE;
+    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
+    int readahead = fix & BDRV_FIX_ERRORS ? 1 : CHECK_L2_READAHEAD;
     g_autofree uint64_t *l1_table = NULL;
+    g_autofree uint8_t *l2_tables = NULL;
     uint64_t l2_offset;
-    int i, ret;
+    int i, j, n, batch_end, ret;
+    int start = 0;
 
     if (!l1_size) {
         return 0;
     }
 
-    /* Mark L1 table as used */
-    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, refcount_table_size,
-                                   l1_table_offset, l1_size_bytes);
-    if (ret < 0) {
-        return ret;
+    if (cp && cp->resume && cp->table == table) {
+        /* The L1 table has been marked as used before the checkpoint */
+        start = cp->l1_index;
+        cp->resume = false;
+    } else {
+        /* Mark L1 table as used */
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                       refcount_table_size,
+                                       l1_table_offset, l1_size_bytes);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     l1_table = g_try_malloc(l1_size_bytes);
@@ -1900,41 +2172,90 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
         be64_to_cpus(&l1_table[i]);
     }
 
-    /* Do the actual checks */
-    for (i = 0; i < l1_size; i++) {
-        if (!l1_table[i]) {
-            continue;
-        }
+    l2_tables = g_try_malloc(readahead * l2_size_bytes);
+    if (l2_tables == NULL) {
+        res->check_errors++;
+        return -ENOMEM;
+    }
 
-        if (l1_table[i] & L1E_RESERVED_MASK) {
-            fprintf(stderr, "ERROR found L1 entry with reserved bits set: "
-                    "%" PRIx64 "\n", l1_table[i]);
-            res->corruptions++;
-        }
+    for (i = start; i < l1_size; i = batch_end) {
+        AioTaskPool *pool = aio_task_pool_new(QCOW2_MAX_WORKERS);
+        int l2_ret[CHECK_L2_READAHEAD];
 
-        l2_offset = l1_table[i] & L1E_OFFSET_MASK;
+        /* Read the next L2 tables from disk */
+        for (batch_end = i, n = 0; batch_end < l1_size && n < readahead;
+             batch_end++)
+        {
+            CheckL2ReadTask *task;
 
-        /* Mark L2 table as used */
-        ret = qcow2_inc_refcounts_imrt(bs, res,
-                                       refcount_table, refcount_table_size,
-                                       l2_offset, s->cluster_size);
-        if (ret < 0) {
-            return ret;
-        }
+            if (!l1_table[batch_end]) {
+                continue;
+            }
 
-        /* L2 tables are cluster aligned */
-        if (offset_into_cluster(s, l2_offset)) {
-            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                "cluster aligned; L1 entry corrupted\n", l2_offset);
-            res->corruptions++;
+            task = g_new(CheckL2ReadTask, 1);
+            *task = (CheckL2ReadTask) {
+                .task.func  = check_l2_read_task_entry,
+                .bs         = bs,
+                .offset     = l1_table[batch_end] & L1E_OFFSET_MASK,
+                .bytes      = l2_size_bytes,
+                .buf        = l2_tables + n * l2_size_bytes,
+                .ret        = &l2_ret[n],
+            };
+            aio_task_pool_wait_slot(pool);
+            aio_task_pool_start_task(pool, &task->task);
+            n++;
         }
+        aio_task_pool_wait_all(pool);
+        aio_task_pool_free(pool);
 
-        /* Process and check L2 entries */
-        ret = check_refcounts_l2(bs, res, refcount_table,
-                                 refcount_table_size, l2_offset, flags,
-                                 fix, active);
-        if (ret < 0) {
-            return ret;
+        /* Do the actual checks */
+        for (j = i, n = 0; j < batch_end; j++) {
+            if (!l1_table[j]) {
+                continue;
+            }
+
+            if (l1_table[j] & L1E_RESERVED_MASK) {
+                fprintf(stderr, "ERROR found L1 entry with reserved bits set: "
+                        "%" PRIx64 "\n", l1_table[j]);
+                res->corruptions++;
+            }
+
+            l2_offset = l1_table[j] & L1E_OFFSET_MASK;
+
+            /* Mark L2 table as used */
+            ret = qcow2_inc_refcounts_imrt(bs, res,
+                                           refcount_table, refcount_table_size,
+                                           l2_offset, s->cluster_size);
+            if (ret < 0) {
+                return ret;
+            }
+
+            /* L2 tables are cluster aligned */
+            if (offset_into_cluster(s, l2_offset)) {
+                fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                    "cluster aligned; L1 entry corrupted\n", l2_offset);
+                res->corruptions++;
+            }
+
+            if (l2_ret[n] < 0) {
+                fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+                res->check_errors++;
+                return l2_ret[n];
+            }
+
+            /* Process and check L2 entries */
+            ret = check_refcounts_l2(bs, res, refcount_table,
+                                     refcount_table_size, l2_offset,
+                                     (uint64_t *)(l2_tables +
+                                                  n * l2_size_bytes),
+                                     flags, fix, active);
+            if (ret < 0) {
+                return ret;
+            }
+            n++;
+
+            check_checkpoint_save(bs, res, cp, table, j + 1,
+                                  *refcount_table, *refcount_table_size);
         }
     }
 
@@ -2200,9 +2521,11 @@ resize_fail:
 static int coroutine_fn GRAPH_RDLOCK
 calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                     BdrvCheckMode fix, bool *rebuild,
-                    void **refcount_table, int64_t *nb_clusters)
+                    void **refcount_table, int64_t *nb_clusters,
+                    Qcow2CheckCheckpoint *cp)
 {
     BDRVQcow2State *s = bs->opaque;
+    bool resuming = cp && cp->resume;
     int64_t i;
     QCowSnapshot *sn;
     int ret;
@@ -2218,28 +2541,35 @@ calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     /* header */
-    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
-                                   0, s->cluster_size);
-    if (ret < 0) {
-        return ret;
+    if (!resuming) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       0, s->cluster_size);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     /* current L1 table */
-    ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                             s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO,
-                             fix, true);
-    if (ret < 0) {
-        return ret;
+    if (!check_checkpoint_skip_table(cp, 0)) {
+        ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
+                                 s->l1_table_offset, s->l1_size,
+                                 CHECK_FRAG_INFO, fix, true, cp, 0);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     /* snapshots */
-    if (has_data_file(bs) && s->nb_snapshots) {
+    if (has_data_file(bs) && s->nb_snapshots && !resuming) {
         fprintf(stderr, "ERROR %d snapshots in image with data file\n",
                 s->nb_snapshots);
         res->corruptions++;
     }
 
     for (i = 0; i < s->nb_snapshots; i++) {
+        if (check_checkpoint_skip_table(cp, i + 1)) {
+            continue;
+        }
         sn = s->snapshots + i;
         if (offset_into_cluster(s, sn->l1_table_offset)) {
             fprintf(stderr, "ERROR snapshot %s (%s) l1_offset=%#" PRIx64 ": "
@@ -2257,11 +2587,16 @@ calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
         ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
                                  sn->l1_table_offset, sn->l1_size, 0, fix,
-                                 false);
+                                 false, cp, i + 1);
         if (ret < 0) {
             return ret;
         }
     }
+    if (cp) {
+        cp->resume = false;
+        check_checkpoint_save(bs, res, cp, s->nb_snapshots + 1, 0,
+                              *refcount_table, *nb_clusters);
+    }
     ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
                                    s->snapshots_offset, s->snapshots_size);
     if (ret < 0) {
@@ -2776,14 +3111,19 @@ fail:
 /*
  * Checks an image for refcount consistency.
  *
+ * If @checkpoint is not NULL, the progress of the check is saved to that file
+ * from time to time, and a check interrupted before is resumed from it.
+ *
  * Returns 0 if no errors are found, the number of errors in case the image is
  * detected as corrupted, and -errno when an internal error occurred.
  */
 int coroutine_fn GRAPH_RDLOCK
-qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix)
+qcow2_check_refcounts_checkpoint(BlockDriverState *bs, BdrvCheckResult *res,
+                                 BdrvCheckMode fix, const char *checkpoint)
 {
     BDRVQcow2State *s = bs->opaque;
     BdrvCheckResult pre_compare_res;
+    Qcow2CheckCheckpoint cp_state, *cp = NULL;
     int64_t size, highest_cluster, nb_clusters;
     void *refcount_table = NULL;
     bool rebuild = false;
@@ -2804,8 +3144,18 @@ qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode
     res->bfi.total_clusters =
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
+    if (checkpoint) {
+        cp_state = (Qcow2CheckCheckpoint) {
+            .filename   = checkpoint,
+            .file_size  = size,
+            .last_save  = g_get_monotonic_time(),
+        };
+        cp = &cp_state;
+        check_checkpoint_load(bs, res, cp, &refcount_table, &nb_clusters);
+    }
+
     ret = calculate_refcounts(bs, res, fix, &rebuild, &refcount_table,
-                              &nb_clusters);
+                              &nb_clusters, cp);
     if (ret < 0) {
         goto fail;
     }
@@ -2838,7 +3188,7 @@ qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode
         rebuild = false;
         memset(refcount_table, 0, refcount_array_byte_size(s, nb_clusters));
         ret = calculate_refcounts(bs, res, 0, &rebuild, &refcount_table,
-                                  &nb_clusters);
+                                  &nb_clusters, NULL);
         if (ret < 0) {
             goto fail;
         }
@@ -2901,6 +3251,13 @@ fail:
     return ret;
 }
 
+int coroutine_fn GRAPH_RDLOCK
+qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                      BdrvCheckMode fix)
+{
+    return qcow2_check_refcounts_checkpoint(bs, res, fix, NULL);
+}
+
 #define overlaps_with(ofs, sz) \
     ranges_overlap(offset, size, ofs, sz)
 
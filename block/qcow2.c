@@ -606,8 +606,9 @@ static void qcow2_add_check_result(BdrvCheckResult *out,
 
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
-                      BdrvCheckMode fix)
+                      BdrvCheckMode fix, const char *checkpoint)
 {
+    BDRVQcow2State *s = bs->opaque;
     BdrvCheckResult snapshot_res = {};
     BdrvCheckResult refcount_res = {};
     int ret;
@@ -620,8 +621,12 @@ qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
         return ret;
     }
 
-    ret = qcow2_check_refcounts(bs, &refcount_res, fix);
+    ret = qcow2_check_refcounts_checkpoint(bs, &refcount_res, fix, checkpoint);
     qcow2_add_check_result(result, &refcount_res, true);
+    if (fix) {
+        /* Repairs may have rewritten L2 entries */
+        qcow2_extent_cache_clear(s->extent_cache);
+    }
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
         return ret;
@@ -645,13 +650,13 @@ qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
 
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_check(BlockDriverState *bs, BdrvCheckResult *result,
-               BdrvCheckMode fix)
+               BdrvCheckMode fix, const char *checkpoint)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_co_check_locked(bs, result, fix);
+    ret = qcow2_co_check_locked(bs, result, fix, checkpoint);
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -685,6 +690,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_DISCARD_SNAPSHOT,
     QCOW2_OPT_DISCARD_OTHER,
     QCOW2_OPT_DISCARD_NO_UNREF,
+    QCOW2_OPT_SPARSE_BITMAPS,
     QCOW2_OPT_OVERLAP,
     QCOW2_OPT_OVERLAP_TEMPLATE,
     QCOW2_OPT_OVERLAP_MAIN_HEADER,
@@ -734,6 +740,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Do not unreference discarded clusters",
         },
+        {
+            .name = QCOW2_OPT_SPARSE_BITMAPS,
+            .type = QEMU_OPT_BOOL,
+            .help = "Load mostly clean persistent bitmaps as sparse bitmaps",
+        },
         {
             .name = QCOW2_OPT_OVERLAP,
             .type = QEMU_OPT_STRING,
@@ -978,6 +989,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
+    bool sparse_bitmaps;
     uint64_t cache_clean_interval;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
@@ -1157,6 +1169,9 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    r->sparse_bitmaps = qemu_opt_get_bool(opts, QCOW2_OPT_SPARSE_BITMAPS,
+                                          false);
+
     switch (s->crypt_method_header) {
     case QCOW_CRYPT_NONE:
         if (encryptfmt) {
@@ -1238,6 +1253,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
 
     s->discard_no_unref = r->discard_no_unref;
+    s->sparse_bitmaps = r->sparse_bitmaps;
 
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
@@ -1628,6 +1644,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 
     QLIST_INIT(&s->cluster_allocs);
     QTAILQ_INIT(&s->discards);
+    s->extent_cache = qcow2_extent_cache_create(QCOW2_EXTENT_CACHE_SIZE);
 
     /* read qcow2 extensions */
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL,
@@ -1870,7 +1887,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         BdrvCheckResult result = {0};
 
         ret = qcow2_co_check_locked(bs, &result,
-                                    BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+                                    BDRV_FIX_ERRORS | BDRV_FIX_LEAKS, NULL);
         if (ret < 0 || result.check_errors) {
             if (ret >= 0) {
                 ret = -EIO;
@@ -1913,6 +1930,8 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    qcow2_extent_cache_destroy(s->extent_cache);
+    s->extent_cache = NULL;
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -2403,12 +2422,15 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
-        qemu_co_mutex_unlock(&s->lock);
-        if (ret < 0) {
-            goto out;
+        if (!qcow2_try_get_host_offset(bs, offset, &cur_bytes,
+                                       &host_offset, &type)) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                goto out;
+            }
         }
 
         if (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
@@ -2756,12 +2778,39 @@ fail_nometa:
     return ret;
 }
 
+/*
+ * Restore QCOW_OFLAG_COPIED on L2 entries whose cluster is no longer
+ * shared, like qcow2_snapshot_delete() does after dropping a snapshot.
+ */
+static int GRAPH_RDLOCK qcow2_update_copied_flags(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!s->copied_flags_stale || !s->l1_table) {
+        return 0;
+    }
+
+    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size,
+                                         0);
+    if (ret < 0) {
+        error_report("Failed to update the copied flags: %s",
+                     strerror(-ret));
+    }
+    return ret;
+}
+
 static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret, result = 0;
     Error *local_err = NULL;
 
+    ret = qcow2_update_copied_flags(bs);
+    if (ret < 0) {
+        result = ret;
+    }
+
     qcow2_store_persistent_dirty_bitmaps(bs, true, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -2795,6 +2844,10 @@ static void coroutine_mixed_fn GRAPH_RDLOCK
 qcow2_do_close(BlockDriverState *bs, bool close_data_file)
 {
     BDRVQcow2State *s = bs->opaque;
+
+    if (!(s->flags & BDRV_O_INACTIVE)) {
+        qcow2_update_copied_flags(bs);
+    }
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -2806,6 +2859,8 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_extent_cache_destroy(s->extent_cache);
+    s->extent_cache = NULL;
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -4162,6 +4217,7 @@ qcow2_co_copy_range_from(BlockDriverState *bs,
     while (bytes != 0) {
         uint64_t copy_offset = 0;
         QCow2SubclusterType type;
+        bool share = false;
         /* prepare next request */
         cur_bytes = MIN(bytes, INT_MAX);
         cur_write_flags = write_flags;
@@ -4200,16 +4256,38 @@ qcow2_co_copy_range_from(BlockDriverState *bs,
 
         case QCOW2_SUBCLUSTER_NORMAL:
             child = s->data_file;
+            /*
+             * Full clusters copied inside the same image can just be shared,
+             * see qcow2_co_copy_range_to()
+             */
+            share = dst->bs == bs &&
+                    !offset_into_cluster(s, src_offset) &&
+                    !offset_into_cluster(s, dst_offset) &&
+                    cur_bytes >= s->cluster_size;
+            if (share) {
+                cur_bytes = QEMU_ALIGN_DOWN(cur_bytes, s->cluster_size);
+            }
             break;
 
         default:
             abort();
         }
         qemu_co_mutex_unlock(&s->lock);
-        ret = bdrv_co_copy_range_from(child,
-                                      copy_offset,
-                                      dst, dst_offset,
-                                      cur_bytes, read_flags, cur_write_flags);
+        if (share) {
+            ret = bdrv_co_copy_range_to(src, src_offset, dst, dst_offset,
+                                        cur_bytes, read_flags,
+                                        cur_write_flags);
+        } else if (write_flags & BDRV_REQ_NO_FALLBACK) {
+            ret = -ENOTSUP;
+        }
+        if ((!share || ret == -ENOTSUP) &&
+            !(write_flags & BDRV_REQ_NO_FALLBACK)) {
+            ret = bdrv_co_copy_range_from(child,
+                                          copy_offset,
+                                          dst, dst_offset,
+                                          cur_bytes, read_flags,
+                                          cur_write_flags);
+        }
         qemu_co_mutex_lock(&s->lock);
         if (ret < 0) {
             goto out;
@@ -4243,6 +4321,33 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
 
     qemu_co_mutex_lock(&s->lock);
 
+    if (src->bs == bs) {
+        /*
+         * A copy inside the same image: instead of copying user data, make
+         * the destination clusters refer to the source host clusters.
+         */
+        if (!QEMU_IS_ALIGNED(src_offset | dst_offset | bytes,
+                             s->cluster_size)) {
+            ret = -ENOTSUP;
+            goto fail;
+        }
+        for (; bytes != 0; bytes -= s->cluster_size) {
+            ret = qcow2_co_share_cluster(bs, src_offset, dst_offset);
+            if (ret < 0) {
+                goto fail;
+            }
+            src_offset += s->cluster_size;
+            dst_offset += s->cluster_size;
+        }
+        ret = 0;
+        goto fail;
+    }
+
+    if (write_flags & BDRV_REQ_NO_FALLBACK) {
+        ret = -ENOTSUP;
+        goto fail;
+    }
+
     while (bytes != 0) {
 
         l2meta = NULL;
@@ -4250,9 +4355,7 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
         cur_bytes = MIN(bytes, INT_MAX);
 
         /* TODO:
-         * If src->bs == dst->bs, we could simply copy by incrementing
-         * the refcnt, without copying user data.
-         * Or if src->bs == dst->bs->backing->bs, we could copy by discarding. */
+         * If src->bs == dst->bs->backing->bs, we could copy by discarding. */
         ret = qcow2_alloc_host_offset(bs, dst_offset, &cur_bytes,
                                       &host_offset, &l2meta);
         if (ret < 0) {
@@ -4905,6 +5008,7 @@ static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
         goto fail_broken_refcounts;
     }
     memset(s->l1_table, 0, l1_size2);
+    qcow2_extent_cache_clear(s->extent_cache);
 
     BLKDBG_EVENT(bs->file, BLKDBG_EMPTY_IMAGE_PREPARE);
 
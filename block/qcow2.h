@@ -126,6 +126,9 @@
 #define DEFAULT_CACHE_CLEAN_INTERVAL 0
 #endif
 
+/* Upper limit for the number of cached guest->host extents */
+#define QCOW2_EXTENT_CACHE_SIZE 16384
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
 #define QCOW2_OPT_DATA_FILE "data-file"
@@ -134,6 +137,7 @@
 #define QCOW2_OPT_DISCARD_SNAPSHOT "pass-discard-snapshot"
 #define QCOW2_OPT_DISCARD_OTHER "pass-discard-other"
 #define QCOW2_OPT_DISCARD_NO_UNREF "discard-no-unref"
+#define QCOW2_OPT_SPARSE_BITMAPS "sparse-bitmaps"
 #define QCOW2_OPT_OVERLAP "overlap-check"
 #define QCOW2_OPT_OVERLAP_TEMPLATE "overlap-check.template"
 #define QCOW2_OPT_OVERLAP_MAIN_HEADER "overlap-check.main-header"
@@ -230,6 +234,7 @@ typedef struct QCowSnapshot {
 
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
+typedef struct Qcow2ExtentCache Qcow2ExtentCache;
 
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
@@ -345,6 +350,7 @@ typedef struct BDRVQcow2State {
 
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    Qcow2ExtentCache *extent_cache;
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
@@ -388,6 +394,9 @@ typedef struct BDRVQcow2State {
 
     bool discard_no_unref;
 
+    /* Load mostly clean persistent bitmaps with the sparse representation */
+    bool sparse_bitmaps;
+
     int overlap_check; /* bitmask of Qcow2MetadataOverlap values */
     bool signaled_corruption;
 
@@ -401,6 +410,13 @@ typedef struct BDRVQcow2State {
     QTAILQ_HEAD (, Qcow2DiscardRegion) discards;
     bool cache_discards;
 
+    /*
+     * Set when the refcount of a cluster dropped back to 1, e.g. because
+     * one of the L2 entries sharing it was overwritten.  The remaining
+     * L2 entry lacks QCOW_OFLAG_COPIED until the flags are recomputed.
+     */
+    bool copied_flags_stale;
+
     /* Backing file path and format as stored in the image (this is not the
      * effective path/format, which may be the result of a runtime option
      * override) */
@@ -889,6 +905,9 @@ int GRAPH_RDLOCK qcow2_flush_caches(BlockDriverState *bs);
 int GRAPH_RDLOCK qcow2_write_caches(BlockDriverState *bs);
 int coroutine_fn qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                        BdrvCheckMode fix);
+int coroutine_fn GRAPH_RDLOCK
+qcow2_check_refcounts_checkpoint(BlockDriverState *bs, BdrvCheckResult *res,
+                                 BdrvCheckMode fix, const char *checkpoint);
 
 void GRAPH_RDLOCK qcow2_process_discards(BlockDriverState *bs, int ret);
 
@@ -927,6 +946,9 @@ int GRAPH_RDLOCK qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *buf, int nb_sectors, bool enc, Error **errp);
 
+bool qcow2_try_get_host_offset(BlockDriverState *bs, uint64_t offset,
+                               unsigned int *bytes, uint64_t *host_offset,
+                               QCow2SubclusterType *subcluster_type);
 int GRAPH_RDLOCK
 qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                       unsigned int *bytes, uint64_t *host_offset,
@@ -958,6 +980,10 @@ int coroutine_fn GRAPH_RDLOCK
 qcow2_subcluster_zeroize(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                          int flags);
 
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_share_cluster(BlockDriverState *bs, uint64_t src_offset,
+                       uint64_t dst_offset);
+
 int GRAPH_RDLOCK
 qcow2_expand_zero_clusters(BlockDriverState *bs,
                            BlockDriverAmendStatusCB *status_cb,
@@ -1022,6 +1048,19 @@ void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
+/* qcow2-extents.c functions */
+Qcow2ExtentCache *qcow2_extent_cache_create(int max_extents);
+void qcow2_extent_cache_destroy(Qcow2ExtentCache *c);
+void qcow2_extent_cache_clear(Qcow2ExtentCache *c);
+bool qcow2_extent_cache_lookup(Qcow2ExtentCache *c, uint64_t offset,
+                               uint64_t *bytes, uint64_t *host_offset,
+                               QCow2SubclusterType *type);
+void qcow2_extent_cache_insert(Qcow2ExtentCache *c, uint64_t offset,
+                               uint64_t bytes, uint64_t host_offset,
+                               QCow2SubclusterType type);
+void qcow2_extent_cache_invalidate(Qcow2ExtentCache *c, uint64_t offset,
+                                   uint64_t bytes);
+
 /* qcow2-bitmap.c functions */
 int coroutine_fn GRAPH_RDLOCK
 qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
@@ -1596,7 +1596,7 @@ bdrv_qed_co_invalidate_cache(BlockDriverState *bs, Error **errp)
 
 static int coroutine_fn GRAPH_RDLOCK
 bdrv_qed_co_check(BlockDriverState *bs, BdrvCheckResult *result,
-                  BdrvCheckMode fix)
+                  BdrvCheckMode fix, const char *checkpoint)
 {
     BDRVQEDState *s = bs->opaque;
     int ret;
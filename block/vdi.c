@@ -276,7 +276,7 @@ static void vdi_header_print(VdiHeader *header)
 }
 
 static int coroutine_fn vdi_co_check(BlockDriverState *bs, BdrvCheckResult *res,
-                                     BdrvCheckMode fix)
+                                     BdrvCheckMode fix, const char *checkpoint)
 {
     /* TODO: additional checks possible. */
     BDRVVdiState *s = (BDRVVdiState *)bs->opaque;
@@ -2169,7 +2169,7 @@ fail:
  */
 static int coroutine_fn GRAPH_RDLOCK
 vhdx_co_check(BlockDriverState *bs, BdrvCheckResult *result,
-              BdrvCheckMode fix)
+              BdrvCheckMode fix, const char *checkpoint)
 {
     BDRVVHDXState *s = bs->opaque;
 
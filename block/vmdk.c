@@ -2953,7 +2953,8 @@ static VmdkExtentInfo * GRAPH_RDLOCK vmdk_get_extent_info(VmdkExtent *extent)
 }
 
 static int coroutine_fn GRAPH_RDLOCK
-vmdk_co_check(BlockDriverState *bs, BdrvCheckResult *result, BdrvCheckMode fix)
+vmdk_co_check(BlockDriverState *bs, BdrvCheckResult *result, BdrvCheckMode fix,
+              const char *checkpoint)
 {
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *extent = NULL;
@@ -18,6 +18,7 @@
 #include "qemu/module.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
 #include "block/block_int.h"
 #include "trace.h"
 #include "hw/block/block.h"
@@ -36,9 +37,17 @@
 #include "hw/virtio/virtio-access.h"
 #include "hw/virtio/virtio-blk-common.h"
 #include "qemu/coroutine.h"
+#include "qapi/qapi-visit-virtio.h"
+#include "qapi/visitor.h"
 
 static void virtio_blk_ioeventfd_attach(VirtIOBlock *s);
 
+static VirtIOBlockNotifyState *virtio_blk_notify_state(VirtIOBlock *s,
+                                                       VirtQueue *vq)
+{
+    return &s->vq_notify[virtio_get_queue_index(vq)];
+}
+
 static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
                                     VirtIOBlockReq *req)
 {
@@ -48,6 +57,7 @@ static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
     req->in_len = 0;
     req->next = NULL;
     req->mr_next = NULL;
+    virtio_blk_notify_state(s, vq)->in_flight++;
 }
 
 static void virtio_blk_free_request(VirtIOBlockReq *req)
@@ -55,6 +65,116 @@ static void virtio_blk_free_request(VirtIOBlockReq *req)
     g_free(req);
 }
 
+/* Return a request to the virtqueue without completing it */
+static void virtio_blk_req_detach(VirtIOBlockReq *req)
+{
+    VirtIOBlockNotifyState *ns = virtio_blk_notify_state(req->dev, req->vq);
+
+    assert(ns->in_flight > 0);
+    ns->in_flight--;
+    virtqueue_detach_element(req->vq, &req->elem, 0);
+}
+
+static void virtio_blk_notify_flush(VirtIOBlockNotifyState *ns)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(ns->dev);
+
+    if (!ns->pending) {
+        return;
+    }
+
+    trace_virtio_blk_notify_flush(vdev, virtio_get_queue_index(ns->vq),
+                                  ns->pending, ns->in_flight);
+    ns->pending = 0;
+    stat64_add(&ns->notifications, 1);
+
+    if (qemu_in_iothread()) {
+        virtio_notify_irqfd(vdev, ns->vq);
+    } else {
+        virtio_notify(vdev, ns->vq);
+    }
+}
+
+/* Context: the virtqueue's AioContext */
+static void virtio_blk_notify_timer_cb(void *opaque)
+{
+    VirtIOBlockNotifyState *ns = opaque;
+
+    if (ns->pending) {
+        stat64_add(&ns->timer_notifications, 1);
+        virtio_blk_notify_flush(ns);
+    }
+}
+
+/*
+ * Notify the guest about a completed request, possibly batching the
+ * notification with those of other requests that are still in flight.
+ *
+ * The batch size adapts to the queue depth: the guest is notified once half
+ * of the requests it has submitted have completed, bounded by
+ * notify-coalesce-max-batch. A completion that leaves no request in flight
+ * (e.g. at queue depth 1) is always notified immediately, so coalescing never
+ * adds latency to synchronous I/O. Otherwise the timer bounds the delay of a
+ * partial batch to notify-coalesce-max-delay-us.
+ */
+static void virtio_blk_notify_completion(VirtIOBlockNotifyState *ns)
+{
+    uint32_t max_batch = ns->dev->conf.notify_coalesce_max_batch;
+    unsigned int batch;
+
+    assert(ns->in_flight > 0);
+    ns->in_flight--;
+    ns->pending++;
+    stat64_add(&ns->completions, 1);
+
+    if (!ns->timer || ns->in_flight == 0) {
+        goto flush;
+    }
+
+    batch = MIN(max_batch, (ns->in_flight + ns->pending) / 2);
+    if (ns->pending >= batch) {
+        goto flush;
+    }
+
+    if (!timer_pending(ns->timer)) {
+        timer_mod(ns->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  ns->dev->conf.notify_coalesce_max_delay_us * SCALE_US);
+    }
+    return;
+
+flush:
+    if (ns->timer) {
+        timer_del(ns->timer);
+    }
+    virtio_blk_notify_flush(ns);
+}
+
+/* Context: the virtqueue's AioContext */
+static void virtio_blk_notify_flush_bh(void *opaque)
+{
+    VirtIOBlockNotifyState *ns = opaque;
+
+    timer_del(ns->timer);
+    virtio_blk_notify_flush(ns);
+}
+
+/*
+ * Send all coalesced notifications that are still pending.
+ *
+ * Context: BQL held
+ */
+static void virtio_blk_notify_flush_all(VirtIOBlock *s)
+{
+    if (!s->conf.notify_coalesce_max_batch) {
+        return;
+    }
+
+    for (uint16_t i = 0; i < s->conf.num_queues; i++) {
+        aio_wait_bh_oneshot(s->vq_aio_context[i], virtio_blk_notify_flush_bh,
+                            &s->vq_notify[i]);
+    }
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlock *s = req->dev;
@@ -66,11 +186,7 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
     iov_discard_undo(&req->inhdr_undo);
     iov_discard_undo(&req->outhdr_undo);
     virtqueue_push(req->vq, &req->elem, req->in_len);
-    if (qemu_in_iothread()) {
-        virtio_notify_irqfd(vdev, req->vq);
-    } else {
-        virtio_notify(vdev, req->vq);
-    }
+    virtio_blk_notify_completion(virtio_blk_notify_state(s, req->vq));
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -987,7 +1103,7 @@ void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 
         while ((req = virtio_blk_get_request(s, vq))) {
             if (virtio_blk_handle_request(req, &mrb)) {
-                virtqueue_detach_element(req->vq, &req->elem, 0);
+                virtio_blk_req_detach(req);
                 virtio_blk_free_request(req);
                 break;
             }
@@ -1037,7 +1153,7 @@ static void virtio_blk_dma_restart_bh(void *opaque)
              */
             while (req) {
                 next = req->next;
-                virtqueue_detach_element(req->vq, &req->elem, 0);
+                virtio_blk_req_detach(req);
                 virtio_blk_free_request(req);
                 req = next;
             }
@@ -1063,6 +1179,8 @@ static void virtio_blk_dma_restart_cb(void *opaque, bool running,
     VirtIOBlockReq *rq = NULL;
 
     if (!running) {
+        /* Don't leave the guest waiting for coalesced notifications */
+        virtio_blk_notify_flush_all(s);
         return;
     }
 
@@ -1104,6 +1222,7 @@ static void virtio_blk_reset(VirtIODevice *vdev)
 {
     VirtIOBlock *s = VIRTIO_BLK(vdev);
     VirtIOBlockReq *req;
+    unsigned i;
 
     /* Dataplane has stopped... */
     assert(!s->ioeventfd_started);
@@ -1119,12 +1238,22 @@ static void virtio_blk_reset(VirtIODevice *vdev)
             s->rq = req->next;
 
             /* No other threads can access req->vq here */
-            virtqueue_detach_element(req->vq, &req->elem, 0);
+            virtio_blk_req_detach(req);
 
             virtio_blk_free_request(req);
         }
     }
 
+    /* The guest driver is gone, there is nobody left to notify */
+    for (i = 0; i < s->conf.num_queues; i++) {
+        VirtIOBlockNotifyState *ns = &s->vq_notify[i];
+
+        if (ns->timer) {
+            timer_del(ns->timer);
+        }
+        ns->pending = 0;
+    }
+
     blk_set_enable_write_cache(s->blk, s->original_wce);
 }
 
@@ -1608,6 +1737,36 @@ static bool virtio_blk_vq_aio_context_init(VirtIOBlock *s, Error **errp)
 }
 
 /* Context: BQL held */
+static void virtio_blk_notify_init(VirtIOBlock *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtIOBlkConf *conf = &s->conf;
+
+    s->vq_notify = g_new0(VirtIOBlockNotifyState, conf->num_queues);
+
+    for (uint16_t i = 0; i < conf->num_queues; i++) {
+        VirtIOBlockNotifyState *ns = &s->vq_notify[i];
+
+        ns->dev = s;
+        ns->vq = virtio_get_queue(vdev, i);
+        if (conf->notify_coalesce_max_batch) {
+            ns->timer = aio_timer_new(s->vq_aio_context[i],
+                                      QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                      virtio_blk_notify_timer_cb, ns);
+        }
+    }
+}
+
+static void virtio_blk_notify_cleanup(VirtIOBlock *s)
+{
+    for (uint16_t i = 0; i < s->conf.num_queues; i++) {
+        timer_free(s->vq_notify[i].timer);
+    }
+
+    g_free(s->vq_notify);
+    s->vq_notify = NULL;
+}
+
 static void virtio_blk_vq_aio_context_cleanup(VirtIOBlock *s)
 {
     VirtIOBlkConf *conf = &s->conf;
@@ -1807,6 +1966,9 @@ static void virtio_blk_stop_ioeventfd(VirtIODevice *vdev)
     /* Wait for virtio_blk_dma_restart_bh() and in flight I/O to complete */
     blk_drain(s->conf.conf.blk);
 
+    /* Deliver coalesced notifications while the guest notifiers still exist */
+    virtio_blk_notify_flush_all(s);
+
     /*
      * Try to switch bs back to the QEMU main loop. If other users keep the
      * BlockBackend in the iothread, that's ok
@@ -1855,6 +2017,12 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
                    conf->queue_size, VIRTQUEUE_MAX_SIZE);
         return;
     }
+    if (conf->notify_coalesce_max_batch &&
+        !conf->notify_coalesce_max_delay_us) {
+        error_setg(errp, "notify-coalesce-max-delay-us must be larger than 0 "
+                   "when notify-coalesce-max-batch is set");
+        return;
+    }
 
     if (!blkconf_apply_backend_options(&conf->conf,
                                        !blk_supports_write_perm(conf->conf.blk),
@@ -1927,6 +2095,8 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    virtio_blk_notify_init(s);
+
     /*
      * This must be after virtio_init() so virtio_blk_dma_restart_cb() gets
      * called after ->start_ioeventfd() has already set blk's AioContext.
@@ -1954,6 +2124,7 @@ static void virtio_blk_device_unrealize(DeviceState *dev)
 
     blk_drain(s->blk);
     del_boot_device_lchs(dev, "/disk@0,0");
+    virtio_blk_notify_cleanup(s);
     virtio_blk_vq_aio_context_cleanup(s);
     for (i = 0; i < conf->num_queues; i++) {
         virtio_del_queue(vdev, i);
@@ -1966,6 +2137,30 @@ static void virtio_blk_device_unrealize(DeviceState *dev)
     virtio_cleanup(vdev);
 }
 
+static void virtio_blk_get_notify_stats(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    VirtIOBlock *s = VIRTIO_BLK(obj);
+    VirtioBlkVirtqueueNotifyStatsList *list = NULL;
+    VirtioBlkVirtqueueNotifyStatsList **tail = &list;
+
+    for (uint16_t i = 0; s->vq_notify && i < s->conf.num_queues; i++) {
+        VirtIOBlockNotifyState *ns = &s->vq_notify[i];
+        VirtioBlkVirtqueueNotifyStats *stats;
+
+        stats = g_new0(VirtioBlkVirtqueueNotifyStats, 1);
+        stats->index = i;
+        stats->completions = stat64_get(&ns->completions);
+        stats->notifications = stat64_get(&ns->notifications);
+        stats->timer_notifications = stat64_get(&ns->timer_notifications);
+        QAPI_LIST_APPEND(tail, stats);
+    }
+
+    visit_type_VirtioBlkVirtqueueNotifyStatsList(v, name, &list, errp);
+    qapi_free_VirtioBlkVirtqueueNotifyStatsList(list);
+}
+
 static void virtio_blk_instance_init(Object *obj)
 {
     VirtIOBlock *s = VIRTIO_BLK(obj);
@@ -1973,6 +2168,9 @@ static void virtio_blk_instance_init(Object *obj)
     device_add_bootindex_property(obj, &s->conf.conf.bootindex,
                                   "bootindex", "/disk@0,0",
                                   DEVICE(obj));
+    object_property_add(obj, "x-notify-stats",
+                        "VirtioBlkVirtqueueNotifyStatsList",
+                        virtio_blk_get_notify_stats, NULL, NULL, NULL);
 }
 
 static const VMStateDescription vmstate_virtio_blk = {
@@ -2012,6 +2210,10 @@ static Property virtio_blk_properties[] = {
                        conf.max_discard_sectors, BDRV_REQUEST_MAX_SECTORS),
     DEFINE_PROP_UINT32("max-write-zeroes-sectors", VirtIOBlock,
                        conf.max_write_zeroes_sectors, BDRV_REQUEST_MAX_SECTORS),
+    DEFINE_PROP_UINT32("notify-coalesce-max-batch", VirtIOBlock,
+                       conf.notify_coalesce_max_batch, 0),
+    DEFINE_PROP_UINT32("notify-coalesce-max-delay-us", VirtIOBlock,
+                       conf.notify_coalesce_max_delay_us, 50),
     DEFINE_PROP_BOOL("x-enable-wce-if-config-wce", VirtIOBlock,
                      conf.x_enable_wce_if_config_wce, true),
     DEFINE_PROP_END_OF_LIST(),
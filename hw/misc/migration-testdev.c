@@ -0,0 +1,177 @@
+/*
+ * Device with live migration state, for testing the migration core
+ *
+ * The device sends a START section when migration starts, and @size bytes
+ * of a pattern derived from @seed when precopy completes.  It opts in to
+ * completing precopy in parallel, so that with the x-parallel-device-state
+ * capability its last section goes through MIG_CMD_DEVICE_STATE.  The
+ * destination fails the migration if the pattern does not match its own
+ * @seed, e.g. because the sections of two devices were swapped.
+ *
+ * The read-only "saved-in-thread" and "loaded-in-thread" properties tell
+ * whether the last section was handled by a device thread, i.e. without
+ * the BQL.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "hw/qdev-properties.h"
+#include "migration/qemu-file.h"
+#include "migration/register.h"
+#include "qom/object.h"
+
+#define TYPE_MIGRATION_TESTDEV "migration-testdev"
+OBJECT_DECLARE_SIMPLE_TYPE(MigrationTestdevState, MIGRATION_TESTDEV)
+
+struct MigrationTestdevState {
+    DeviceState parent_obj;
+
+    uint32_t size;
+    uint8_t seed;
+    bool saved_in_thread;
+    bool loaded_in_thread;
+};
+
+static uint8_t migration_testdev_byte(MigrationTestdevState *s, uint32_t i)
+{
+    return (i * 7 + s->seed) & 0xff;
+}
+
+static int migration_testdev_save_setup(QEMUFile *f, void *opaque,
+                                        Error **errp)
+{
+    /* A START section, so that the destination learns the section id */
+    qemu_put_be32(f, 0);
+
+    return 0;
+}
+
+static int migration_testdev_save_complete_precopy(QEMUFile *f, void *opaque)
+{
+    MigrationTestdevState *s = opaque;
+    g_autofree uint8_t *buf = g_malloc(s->size);
+    uint32_t i;
+
+    for (i = 0; i < s->size; i++) {
+        buf[i] = migration_testdev_byte(s, i);
+    }
+    qemu_put_be32(f, s->size);
+    qemu_put_buffer(f, buf, s->size);
+    qatomic_set(&s->saved_in_thread, !bql_locked());
+
+    return 0;
+}
+
+static int migration_testdev_load_state(QEMUFile *f, void *opaque,
+                                        int version_id)
+{
+    MigrationTestdevState *s = opaque;
+    g_autofree uint8_t *buf = NULL;
+    uint32_t size, i;
+
+    size = qemu_get_be32(f);
+    if (!size) {
+        return 0;
+    }
+    if (size != s->size) {
+        error_report("%s: size %u, expected %u", TYPE_MIGRATION_TESTDEV,
+                     size, s->size);
+        return -EINVAL;
+    }
+
+    buf = g_malloc(size);
+    if (qemu_get_buffer(f, buf, size) != size) {
+        return qemu_file_get_error(f) ?: -EIO;
+    }
+    for (i = 0; i < size; i++) {
+        if (buf[i] != migration_testdev_byte(s, i)) {
+            error_report("%s: mismatch at offset %u", TYPE_MIGRATION_TESTDEV,
+                         i);
+            return -EINVAL;
+        }
+    }
+    qatomic_set(&s->loaded_in_thread, !bql_locked());
+
+    return 0;
+}
+
+static const SaveVMHandlers savevm_migration_testdev_handlers = {
+    .save_setup = migration_testdev_save_setup,
+    .save_live_complete_precopy = migration_testdev_save_complete_precopy,
+    .complete_precopy_parallel = true,
+    .load_state = migration_testdev_load_state,
+};
+
+static void migration_testdev_realize(DeviceState *dev, Error **errp)
+{
+    MigrationTestdevState *s = MIGRATION_TESTDEV(dev);
+
+    if (!s->size) {
+        error_setg(errp, "'size' must not be zero");
+        return;
+    }
+
+    register_savevm_live(TYPE_MIGRATION_TESTDEV, VMSTATE_INSTANCE_ID_ANY, 1,
+                         &savevm_migration_testdev_handlers, s);
+}
+
+static void migration_testdev_unrealize(DeviceState *dev)
+{
+    unregister_savevm(NULL, TYPE_MIGRATION_TESTDEV, MIGRATION_TESTDEV(dev));
+}
+
+static bool migration_testdev_get_saved_in_thread(Object *obj, Error **errp)
+{
+    return qatomic_read(&MIGRATION_TESTDEV(obj)->saved_in_thread);
+}
+
+static bool migration_testdev_get_loaded_in_thread(Object *obj, Error **errp)
+{
+    return qatomic_read(&MIGRATION_TESTDEV(obj)->loaded_in_thread);
+}
+
+static Property migration_testdev_properties[] = {
+    DEFINE_PROP_UINT32("size", MigrationTestdevState, size, 1 * MiB),
+    DEFINE_PROP_UINT8("seed", MigrationTestdevState, seed, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void migration_testdev_class_init(ObjectClass *oc, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(oc);
+
+    dc->realize = migration_testdev_realize;
+    dc->unrealize = migration_testdev_unrealize;
+    dc->desc = "Test device for the migration core";
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+    device_class_set_props(dc, migration_testdev_properties);
+
+    object_class_property_add_bool(oc, "saved-in-thread",
+                                   migration_testdev_get_saved_in_thread,
+                                   NULL);
+    object_class_property_add_bool(oc, "loaded-in-thread",
+                                   migration_testdev_get_loaded_in_thread,
+                                   NULL);
+}
+
+static const TypeInfo migration_testdev_info = {
+    .name          = TYPE_MIGRATION_TESTDEV,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(MigrationTestdevState),
+    .class_init    = migration_testdev_class_init,
+};
+
+static void migration_testdev_register_types(void)
+{
+    type_register_static(&migration_testdev_info);
+}
+
+type_init(migration_testdev_register_types)
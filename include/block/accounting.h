@@ -25,6 +25,7 @@
 #ifndef BLOCK_ACCOUNTING_H
 #define BLOCK_ACCOUNTING_H
 
+#include "qemu/stats64.h"
 #include "qemu/timed-average.h"
 #include "qemu/thread.h"
 #include "qapi/qapi-types-common.h"
@@ -94,6 +95,25 @@ struct BlockAcctStats {
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
 };
 
+/*
+ * Per-node latency histogram with fixed, power-of-two bins: bin i counts
+ * latencies in [2^i, 2^(i+1)) ns, bin 0 also counts 0 and the last bin
+ * everything above.  There is no lock; the counters are split into shards
+ * that are selected by the accounting thread, so that iothreads submitting
+ * to the same node do not bounce the same cache lines.
+ */
+#define BLOCK_NODE_LATENCY_BINS     40
+#define BLOCK_NODE_LATENCY_SHARDS   16
+
+typedef struct BlockNodeLatencyShard {
+    /* [0] for reads, [1] for writes */
+    Stat64 bins[2][BLOCK_NODE_LATENCY_BINS];
+} QEMU_ALIGNED(64) BlockNodeLatencyShard;
+
+typedef struct BlockNodeLatencyHistogram {
+    BlockNodeLatencyShard shards[BLOCK_NODE_LATENCY_SHARDS];
+} BlockNodeLatencyHistogram;
+
 typedef struct BlockAcctCookie {
     int64_t bytes;
     int64_t start_time_ns;
@@ -121,4 +141,13 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
 
+BlockNodeLatencyHistogram *block_node_latency_histogram_new(void);
+void block_node_latency_histogram_free(BlockNodeLatencyHistogram *hist);
+int64_t block_node_latency_start(void);
+void block_node_latency_done(BlockNodeLatencyHistogram *hist,
+                             enum BlockAcctType type, int64_t start_ns);
+void block_node_latency_histogram_get(BlockNodeLatencyHistogram *hist,
+                                      enum BlockAcctType type,
+                                      uint64_t bins[BLOCK_NODE_LATENCY_BINS]);
+
 #endif
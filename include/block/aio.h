@@ -21,6 +21,7 @@
 #include "qemu/queue.h"
 #include "qemu/event_notifier.h"
 #include "qemu/lockcnt.h"
+#include "qemu/stats64.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
 #include "block/graph-lock.h"
@@ -123,6 +124,9 @@ struct BHListSlice {
 
 typedef QSLIST_HEAD(, AioHandler) AioHandlerSList;
 
+/* Number of log2 buckets of the poll wait time histogram (up to ~1 second) */
+#define AIO_POLL_HIST_BUCKETS 30
+
 struct AioContext {
     GSource source;
 
@@ -229,11 +233,26 @@ struct AioContext {
     int poll_disable_cnt;
 
     /* Polling mode parameters */
-    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_ns;        /* current polling time in nanoseconds, atomic */
     int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
     int64_t poll_grow;      /* polling time growth factor */
     int64_t poll_shrink;    /* polling time shrink factor */
 
+    /*
+     * Latency target mode, see aio_context_set_poll_target().  The
+     * histogram buckets are powers of two of the time aio_poll() waited
+     * for an event during the current adaptation window.
+     */
+    int64_t poll_target_ns;     /* 0 selects the grow/shrink heuristic */
+    int64_t poll_cpu_budget;    /* percent, 0 means unlimited */
+    int64_t poll_window_start;
+    int64_t poll_window_wasted_ns;
+    unsigned poll_window_samples;
+    unsigned poll_hist[AIO_POLL_HIST_BUCKETS];
+
+    /* Total time spent polling without making progress */
+    Stat64 poll_wasted_ns;
+
     /* AIO engine parameters */
     int64_t aio_max_batch;  /* maximum number of requests in a batch */
 
@@ -705,6 +724,33 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_poll_target:
+ * @ctx: the aio context
+ * @latency_ns: longest wait for an event that polling should try to cover,
+ *              0 goes back to the poll_grow/poll_shrink heuristic
+ * @cpu_budget: maximum percentage of time to spend polling without finding
+ *              events, 0 means no limit
+ *
+ * In latency target mode, the polling time follows the 99th percentile of
+ * recently measured event wait times, limited by @latency_ns, the poll_max_ns
+ * value set with aio_context_set_poll_params() and @cpu_budget.  Like the
+ * heuristic, it has no effect while poll_max_ns is 0.
+ */
+void aio_context_set_poll_target(AioContext *ctx, int64_t latency_ns,
+                                 int64_t cpu_budget, Error **errp);
+
+/**
+ * aio_context_get_poll_stats:
+ * @ctx: the aio context
+ * @poll_ns: current polling time in nanoseconds
+ * @wasted_ns: total time spent polling without making progress
+ *
+ * May be called from any thread; the values are snapshots.
+ */
+void aio_context_get_poll_stats(AioContext *ctx, int64_t *poll_ns,
+                                uint64_t *wasted_ns);
+
 /**
  * aio_context_set_aio_params:
  * @ctx: the aio context
@@ -319,6 +319,10 @@ bdrv_can_store_new_dirty_bitmap(BlockDriverState *bs, const char *name,
  *                               recursion.
  *         BDRV_REQ_NO_SERIALISING - do not serialize with other overlapping
  *                                   requests currently in flight.
+ *         BDRV_REQ_NO_FALLBACK - (write flag) fail with -ENOTSUP instead of
+ *                                copying the data if the driver cannot
+ *                                make @dst refer to the @src data, e.g.
+ *                                by sharing qcow2 clusters.
  *
  * Returns: 0 if succeeded; negative error code if failed.
  **/
@@ -361,7 +365,8 @@ bdrv_truncate(BdrvChild *child, int64_t offset, bool exact,
               PreallocMode prealloc, BdrvRequestFlags flags, Error **errp);
 
 int co_wrapper_mixed_bdrv_rdlock
-bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix);
+bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix,
+           const char *checkpoint);
 
 /* Invalidate any cached metadata used by image formats */
 int co_wrapper_mixed_bdrv_rdlock
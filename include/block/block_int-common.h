@@ -24,6 +24,7 @@
 #ifndef BLOCK_INT_COMMON_H
 #define BLOCK_INT_COMMON_H
 
+#include "block/accounting.h"
 #include "block/aio.h"
 #include "block/block-common.h"
 #include "block/block-global-state.h"
@@ -766,9 +767,12 @@ struct BlockDriver {
     /*
      * Returns 0 for completed check, -errno for internal errors.
      * The check results are stored in result.
+     * If @checkpoint is not NULL, drivers that can resume a check record its
+     * progress in that file; others ignore it.
      */
     int coroutine_fn GRAPH_RDLOCK_PTR (*bdrv_co_check)(
-        BlockDriverState *bs, BdrvCheckResult *result, BdrvCheckMode fix);
+        BlockDriverState *bs, BdrvCheckResult *result, BdrvCheckMode fix,
+        const char *checkpoint);
 
     void coroutine_fn GRAPH_RDLOCK_PTR (*bdrv_co_debug_event)(
         BlockDriverState *bs, BlkdebugEvent event);
@@ -1213,6 +1217,12 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /*
+     * Read/write latency histogram of requests entering this node, NULL if
+     * disabled.  Only changed in a drained section.
+     */
+    BlockNodeLatencyHistogram *latency_histogram;
+
     /*
      * If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
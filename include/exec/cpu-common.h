@@ -68,6 +68,8 @@ typedef uintptr_t ram_addr_t;
 /* memory API */
 
 void qemu_ram_remap(ram_addr_t addr, ram_addr_t length);
+bool qemu_ram_replace_fd(RAMBlock *block, int fd, off_t fd_offset,
+                         Error **errp);
 /* This should not be used by devices.  */
 ram_addr_t qemu_ram_addr_from_host(void *ptr);
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr);
@@ -58,7 +58,9 @@ static inline void clear_bmap_set(RAMBlock *rb, uint64_t start,
 {
     uint8_t shift = rb->clear_bmap_shift;
 
-    bitmap_set(rb->clear_bmap, start >> shift, clear_bmap_size(npages, shift));
+    /* Atomic: ranges of one block may be synced from several threads */
+    bitmap_set_atomic(rb->clear_bmap, start >> shift,
+                      clear_bmap_size(npages, shift));
 }
 
 /**
@@ -483,6 +485,7 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
     unsigned long word = BIT_WORD((start + rb->offset) >> TARGET_PAGE_BITS);
     uint64_t num_dirty = 0;
     unsigned long *dest = rb->bmap;
+    uint8_t *heat = rb->bmap_heat;
 
     /* start address and length is aligned at the start of a word? */
     if (((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
@@ -500,6 +503,8 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
 
         for (k = page; k < page + nr; k++) {
+            bool written = false;
+
             if (src[idx][offset]) {
                 unsigned long bits = qatomic_xchg(&src[idx][offset], 0);
                 unsigned long new_dirty;
@@ -507,6 +512,10 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 dest[k] |= bits;
                 new_dirty &= bits;
                 num_dirty += ctpopl(new_dirty);
+                written = bits;
+            }
+            if (heat) {
+                heat[k] = (heat[k] >> 1) | (written ? 0x80 : 0);
             }
 
             if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
@@ -533,6 +542,16 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
     } else {
         ram_addr_t offset = rb->offset;
 
+        if (heat) {
+            unsigned long first = BIT_WORD(start >> TARGET_PAGE_BITS);
+            unsigned long last = BIT_WORD((start + length - 1) >>
+                                          TARGET_PAGE_BITS);
+
+            for (unsigned long w = first; w <= last; w++) {
+                heat[w] >>= 1;
+            }
+        }
+
         for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
             if (cpu_physical_memory_test_and_clear_dirty(
                         start + addr + offset,
@@ -542,6 +561,9 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 if (!test_and_set_bit(k, dest)) {
                     num_dirty++;
                 }
+                if (heat) {
+                    heat[BIT_WORD(k)] |= 0x80;
+                }
             }
         }
     }
@@ -46,6 +46,18 @@ struct RAMBlock {
     /* dirty bitmap used during migration */
     unsigned long *bmap;
 
+    /*
+     * Below fields are only used by the x-defer-hot-pages capability
+     */
+    /*
+     * Write history of each word of bmap: the most significant bit is set
+     * if the guest wrote to a page of the word during the last dirty sync
+     * period, the next bit for the period before, and so on.
+     */
+    uint8_t *bmap_heat;
+    /* bitmap of bmap words whose dirty pages were skipped as hot */
+    unsigned long *bmap_deferred;
+
     /*
      * Below fields are only used by mapped-ram migration
      */
@@ -21,6 +21,7 @@
 #include "sysemu/block-backend.h"
 #include "sysemu/block-ram-registrar.h"
 #include "qom/object.h"
+#include "qemu/stats64.h"
 #include "qapi/qapi-types-virtio.h"
 
 #define TYPE_VIRTIO_BLK "virtio-blk-device"
@@ -48,8 +49,25 @@ struct VirtIOBlkConf
     uint32_t max_discard_sectors;
     uint32_t max_write_zeroes_sectors;
     bool x_enable_wce_if_config_wce;
+    uint32_t notify_coalesce_max_batch;
+    uint32_t notify_coalesce_max_delay_us;
 };
 
+/*
+ * Completion notification state of a virtqueue. Only accessed from the
+ * virtqueue's AioContext, except for the statistics.
+ */
+typedef struct VirtIOBlockNotifyState {
+    VirtIOBlock *dev;
+    VirtQueue *vq;
+    QEMUTimer *timer;           /* NULL if coalescing is disabled */
+    unsigned int in_flight;     /* requests popped but not yet completed */
+    unsigned int pending;       /* completions not yet notified */
+    Stat64 completions;
+    Stat64 notifications;
+    Stat64 timer_notifications;
+} VirtIOBlockNotifyState;
+
 struct VirtIOBlockReq;
 struct VirtIOBlock {
     VirtIODevice parent_obj;
@@ -71,6 +89,9 @@ struct VirtIOBlock {
      */
     AioContext **vq_aio_context;
 
+    /* Per-virtqueue completion notification state */
+    VirtIOBlockNotifyState *vq_notify;
+
     uint64_t host_features;
     size_t config_size;
     BlockRAMRegistrar blk_ram_registrar;
@@ -261,5 +261,41 @@ QIOChannelSocket *
 qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
+/**
+ * qio_channel_socket_enable_zero_copy:
+ * @ioc: the socket channel object
+ *
+ * Enable SO_ZEROCOPY on the connected socket @ioc, so that it
+ * supports QIO_CHANNEL_WRITE_FLAG_ZERO_COPY.  Sockets connected
+ * with qio_channel_socket_connect_sync() have it enabled already;
+ * those returned by qio_channel_socket_accept() do not, since the
+ * completion notifications cost something on every send.
+ *
+ * Returns: true if zero copy writes are supported, false otherwise
+ */
+bool qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc);
+
+/**
+ * qio_channel_socket_zero_copy_reap:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Process the completion notifications for writes done with
+ * QIO_CHANNEL_WRITE_FLAG_ZERO_COPY that the kernel has already
+ * queued, without waiting for any further ones. Unlike
+ * qio_channel_flush(), this never blocks, so it can be called
+ * from a coroutine or an event loop callback.
+ *
+ * Afterwards, @ioc->zero_copy_sent counts every zero copy
+ * write whose buffers are no longer used by the kernel; a
+ * buffer may be reused once @ioc->zero_copy_sent has caught
+ * up with the value @ioc->zero_copy_queued had right after
+ * the buffer was written.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qio_channel_socket_zero_copy_reap(QIOChannelSocket *ioc,
+                                      Error **errp);
+
 
 #endif /* QIO_CHANNEL_SOCKET_H */
@@ -33,6 +33,11 @@ OBJECT_DECLARE_TYPE(QIOChannel, QIOChannelClass,
 #define QIO_CHANNEL_ERR_BLOCK -2
 
 #define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY 0x1
+/*
+ * With QIO_CHANNEL_WRITE_FLAG_ZERO_COPY, copy the data instead of failing
+ * when the kernel cannot lock the pages for zero copy (ENOBUFS)
+ */
+#define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK 0x2
 
 #define QIO_CHANNEL_READ_FLAG_MSG_PEEK 0x1
 
@@ -103,6 +103,22 @@ typedef struct SaveVMHandlers {
      */
     int (*save_live_complete_precopy)(QEMUFile *f, void *opaque);
 
+    /**
+     * @complete_precopy_parallel
+     *
+     * Declares that @save_live_complete_precopy, and @load_state for
+     * the section that it produces, only access state that is private
+     * to the device, and need not be ordered with other state
+     * sections.  With the x-parallel-device-state capability, such
+     * devices complete precopy in a thread of their own, concurrently
+     * with each other and with the other devices.  Their last section
+     * is sent once the thread is done, and loaded the same way on the
+     * destination, concurrently with the rest of the stream.  These
+     * threads do not take the BQL, which the migration thread keeps
+     * holding.
+     */
+    bool complete_precopy_parallel;
+
     /* This runs both outside and inside the BQL.  */
 
     /**
@@ -42,6 +42,12 @@ struct HBitmapIter {
     /* Entry offset into the last-level array of longs.  */
     size_t pos;
 
+    /* Whether hb was sparse when the iterator was initialized.  */
+    bool sparse;
+
+    /* Next bit to examine, for sparse bitmaps.  */
+    uint64_t next;
+
     /* The currently-active path in the tree.  Each item of cur[i] stores
      * the bits (i.e. the subtrees) yet to be processed under that node.
      */
@@ -61,6 +67,29 @@ struct HBitmapIter {
  */
 HBitmap *hbitmap_alloc(uint64_t size, int granularity);
 
+/**
+ * hbitmap_alloc_sparse:
+ * @size: Number of bits in the bitmap.
+ * @granularity: Granularity of the bitmap, as for hbitmap_alloc.
+ *
+ * Allocate a new HBitmap that stores runs of set bits instead of one bit
+ * per group.  It supports the same operations as a bitmap allocated with
+ * hbitmap_alloc, but its memory usage depends on the number of runs rather
+ * than on @size, so it is much smaller if few bits are set or if the set
+ * bits are mostly contiguous.  Once the runs would take more memory than
+ * a regular bitmap, the bitmap is converted to a regular one.
+ */
+HBitmap *hbitmap_alloc_sparse(uint64_t size, int granularity);
+
+/**
+ * hbitmap_is_sparse:
+ * @hb: HBitmap to operate on.
+ *
+ * Return whether @hb uses the sparse representation, i.e. it was allocated
+ * with hbitmap_alloc_sparse and has not been converted since.
+ */
+bool hbitmap_is_sparse(const HBitmap *hb);
+
 /**
  * hbitmap_truncate:
  * @hb: The bitmap to change the size of.
@@ -350,4 +379,13 @@ bool hbitmap_status(const HBitmap *hb, int64_t start, int64_t count,
  */
 int64_t hbitmap_iter_next(HBitmapIter *hbi);
 
+/**
+ * test_hbitmap_next_accel:
+ *
+ * Switch to the next slower implementation of the word scanning helpers
+ * used by HBitmap.  If the plain C version was already in use, go back to
+ * the fastest one and return false.  Only meant for tests and benchmarks.
+ */
+bool test_hbitmap_next_accel(void);
+
 #endif
@@ -24,6 +24,7 @@ typedef struct VuFdWatch {
     int fd; /*kick fd*/
     void *pvt;
     vu_watch_cb cb;
+    AioContext *vq_ctx; /* fixed AioContext of the virtqueue, or NULL */
     QTAILQ_ENTRY(VuFdWatch) next;
 } VuFdWatch;
 
@@ -31,7 +32,8 @@ typedef struct VuFdWatch {
  * VuServer:
  * A vhost-user server instance with user-defined VuDevIface callbacks.
  * Vhost-user device backends can be implemented using VuServer. VuDevIface
- * callbacks and virtqueue kicks run in the given AioContext.
+ * callbacks and virtqueue kicks run in the given AioContext, except for kicks
+ * of virtqueues that have been assigned their own AioContext in @vq_ctx.
  */
 typedef struct {
     QIONetListener *listener;
@@ -40,12 +42,21 @@ typedef struct {
     int max_queues;
     const VuDevIface *vu_iface;
 
+    /*
+     * Optional array of max_queues AioContexts in which the kicks of each
+     * virtqueue are processed.  NULL entries follow @ctx.  Owned by the
+     * caller of vhost_user_server_start().
+     */
+    AioContext **vq_ctx;
+
     unsigned int in_flight; /* atomic */
+    unsigned int quiesce_pending; /* atomic */
+    bool wait_idle; /* atomic */
 
     /* Protected by ctx lock */
     bool in_qio_channel_yield;
-    bool wait_idle;
     bool quiescing;
+    bool queues_quiesced;
     VuDev vu_dev;
     QIOChannel *ioc; /* The I/O channel with the client */
     QIOChannelSocket *sioc; /* The underlying data channel with the client */
@@ -57,6 +68,7 @@ typedef struct {
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *unix_socket,
                              AioContext *ctx,
+                             AioContext **vq_ctx,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp);
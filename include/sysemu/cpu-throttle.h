@@ -45,10 +45,24 @@ void cpu_throttle_set(int new_throttle_pct);
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set, and the dirty
+ * page rate sampling started by cpu_throttle_per_vcpu_start.
+ * Must be called with BQL held.
  */
 void cpu_throttle_stop(void);
 
+/**
+ * cpu_throttle_per_vcpu_start:
+ *
+ * Samples the dirty page rate of each vcpu in the background, so that
+ * cpu_throttle_set only throttles the vcpus dirtying memory.  vcpus whose
+ * dirty page rate is well below the average one keep running at full
+ * speed.  Requires the KVM dirty ring.
+ *
+ * Remains in effect until cpu_throttle_stop is called.
+ */
+void cpu_throttle_per_vcpu_start(void);
+
 /**
  * cpu_throttle_active:
  *
@@ -65,6 +79,15 @@ bool cpu_throttle_active(void);
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_throttle_get_vcpus:
+ *
+ * Returns: The number of vcpus that were throttled in the last throttling
+ * period.  Lower than the number of vcpus if only some of them are
+ * throttled, see cpu_throttle_per_vcpu_start.
+ */
+int cpu_throttle_get_vcpus(void);
+
 /**
  * cpu_throttle_dirty_sync_timer_tick:
  *
@@ -19,6 +19,8 @@ void vcpu_dirty_rate_stat_start(void);
 void vcpu_dirty_rate_stat_stop(void);
 void vcpu_dirty_rate_stat_initialize(void);
 void vcpu_dirty_rate_stat_finalize(void);
+void vcpu_dirty_rate_track_start(void);
+void vcpu_dirty_rate_track_stop(void);
 
 void dirtylimit_state_lock(void);
 void dirtylimit_state_unlock(void);
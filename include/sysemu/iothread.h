@@ -38,6 +38,8 @@ struct IOThread {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+    int64_t poll_latency_target_ns;
+    int64_t poll_cpu_budget;
 };
 typedef struct IOThread IOThread;
 
@@ -563,6 +563,16 @@ bool kvm_dirty_ring_enabled(void);
 
 uint32_t kvm_dirty_ring_size(void);
 
+/**
+ * kvm_dirty_ring_stats - Statistics of dirty ring harvesting since the
+ * accelerator was initialized
+ * @pages: Set to the number of dirty pages harvested from the rings
+ * @time_ns: Set to the time spent harvesting them, in nanoseconds
+ * @full_exits: Set to the number of vCPU exits due to a full dirty ring
+ */
+void kvm_dirty_ring_stats(uint64_t *pages, uint64_t *time_ns,
+                          uint64_t *full_exits);
+
 void kvm_mark_guest_state_protected(void);
 
 /**
@@ -13,6 +13,8 @@
 #include "qapi/qapi-types-common.h"
 #include "qemu/accel.h"
 #include "qemu/queue.h"
+#include "qemu/stats64.h"
+#include "qemu/thread.h"
 #include "sysemu/kvm.h"
 #include "hw/boards.h"
 #include "hw/i386/topology.h"
@@ -100,6 +102,22 @@ struct KVMDirtyRingReaper {
     volatile uint64_t reaper_iteration; /* iteration number of reaper thr */
     volatile enum KVMDirtyRingReaperState reaper_state; /* reap thr state */
 };
+
+/*
+ * Helper thread that harvests the dirty rings of a subset of the vCPUs,
+ * namely those whose cpu_index modulo the number of harvesters is its index.
+ * The thread that asks for a full reap harvests shard 0 itself.
+ */
+struct KVMDirtyRingHarvester {
+    QemuThread thread;
+    KVMState *s;
+    unsigned int index;
+    /* Posted to start harvesting */
+    QemuSemaphore sem;
+    /* Dirty pages collected in the current round */
+    uint64_t count;
+};
+
 struct KVMState
 {
     AccelState parent_obj;
@@ -158,6 +176,15 @@ struct KVMState
     bool kvm_dirty_ring_with_bitmap;
     uint64_t kvm_eager_split_size;  /* Eager Page Splitting chunk size */
     struct KVMDirtyRingReaper reaper;
+    /* Number of threads that harvest the dirty rings in parallel */
+    uint32_t kvm_dirty_ring_harvesters;
+    /* kvm_dirty_ring_harvesters - 1 helper threads */
+    struct KVMDirtyRingHarvester *harvesters;
+    /* Posted by each helper when it has harvested its shard */
+    QemuSemaphore harvest_done;
+    Stat64 dirty_ring_harvested;    /* Pages harvested from the rings */
+    Stat64 dirty_ring_harvest_ns;   /* Time spent harvesting them */
+    Stat64 dirty_ring_full_exits;   /* KVM_EXIT_DIRTY_RING_FULL count */
     struct KVMMsrEnergy msr_energy;
     NotifyVmexitOption notify_vmexit;
     uint32_t notify_window;
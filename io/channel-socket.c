@@ -145,6 +145,21 @@ qio_channel_socket_new_fd(int fd,
 }
 
 
+bool qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    int ret, v = 1;
+    ret = setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
+    if (ret == 0) {
+        /* Zero copy available on host */
+        qio_channel_set_feature(QIO_CHANNEL(ioc),
+                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+        return true;
+    }
+#endif
+    return false;
+}
+
 int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
                                     SocketAddress *addr,
                                     Error **errp)
@@ -164,15 +179,7 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
-#ifdef QEMU_MSG_ZEROCOPY
-    int ret, v = 1;
-    ret = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
-    if (ret == 0) {
-        /* Zero copy available on host */
-        qio_channel_set_feature(QIO_CHANNEL(ioc),
-                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
-    }
-#endif
+    qio_channel_socket_enable_zero_copy(ioc);
 
     qio_channel_set_feature(QIO_CHANNEL(ioc),
                             QIO_CHANNEL_FEATURE_READ_MSG_PEEK);
@@ -611,6 +618,12 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
         case EINTR:
             goto retry;
         case ENOBUFS:
+            if ((flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) &&
+                (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK)) {
+                flags &= ~QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+                sflags = 0;
+                goto retry;
+            }
             if (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
                 error_setg_errno(errp, errno,
                                  "Process can't lock enough memory for using MSG_ZEROCOPY");
@@ -725,10 +738,16 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
 
 
 #ifdef QEMU_MSG_ZEROCOPY
-static int qio_channel_socket_flush(QIOChannel *ioc,
-                                    Error **errp)
+/*
+ * Process zero copy completion notifications until every queued write has
+ * completed.  If @block is false, stop instead of waiting when no more
+ * notifications are available.
+ */
+static int qio_channel_socket_flush_internal(QIOChannelSocket *sioc,
+                                             bool block,
+                                             Error **errp)
 {
-    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    QIOChannel *ioc = QIO_CHANNEL(sioc);
     struct msghdr msg = {};
     struct sock_extended_err *serr;
     struct cmsghdr *cm;
@@ -751,6 +770,9 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
         if (received < 0) {
             switch (errno) {
             case EAGAIN:
+                if (!block) {
+                    return ret;
+                }
                 /* Nothing on errqueue, wait until something is available */
                 qio_channel_wait(ioc, G_IO_ERR);
                 continue;
@@ -800,8 +822,25 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
     return ret;
 }
 
+static int qio_channel_socket_flush(QIOChannel *ioc,
+                                    Error **errp)
+{
+    return qio_channel_socket_flush_internal(QIO_CHANNEL_SOCKET(ioc), true,
+                                             errp);
+}
+
 #endif /* QEMU_MSG_ZEROCOPY */
 
+int qio_channel_socket_zero_copy_reap(QIOChannelSocket *ioc,
+                                      Error **errp)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    return qio_channel_socket_flush_internal(ioc, false, errp) < 0 ? -1 : 0;
+#else
+    return 0;
+#endif
+}
+
 static int
 qio_channel_socket_set_blocking(QIOChannel *ioc,
                                 bool enabled,
@@ -169,6 +169,14 @@ static void iothread_set_aio_context_params(EventLoopBase *base, Error **errp)
         return;
     }
 
+    aio_context_set_poll_target(iothread->ctx,
+                                iothread->poll_latency_target_ns,
+                                iothread->poll_cpu_budget,
+                                errp);
+    if (*errp) {
+        return;
+    }
+
     aio_context_set_aio_params(iothread->ctx,
                                iothread->parent_obj.aio_max_batch);
 
@@ -222,6 +230,7 @@ static void iothread_init(EventLoopBase *base, Error **errp)
 typedef struct {
     const char *name;
     ptrdiff_t offset; /* field's byte offset in IOThread struct */
+    int64_t max; /* largest valid value, 0 for INT64_MAX */
 } IOThreadParamInfo;
 
 static IOThreadParamInfo poll_max_ns_info = {
@@ -233,6 +242,12 @@ static IOThreadParamInfo poll_grow_info = {
 static IOThreadParamInfo poll_shrink_info = {
     "poll-shrink", offsetof(IOThread, poll_shrink),
 };
+static IOThreadParamInfo poll_latency_target_ns_info = {
+    "poll-latency-target-ns", offsetof(IOThread, poll_latency_target_ns),
+};
+static IOThreadParamInfo poll_cpu_budget_info = {
+    "poll-cpu-budget", offsetof(IOThread, poll_cpu_budget), 100,
+};
 
 static void iothread_get_param(Object *obj, Visitor *v,
         const char *name, IOThreadParamInfo *info, Error **errp)
@@ -248,15 +263,16 @@ static bool iothread_set_param(Object *obj, Visitor *v,
 {
     IOThread *iothread = IOTHREAD(obj);
     int64_t *field = (void *)iothread + info->offset;
+    int64_t max = info->max ?: INT64_MAX;
     int64_t value;
 
     if (!visit_type_int64(v, name, &value, errp)) {
         return false;
     }
 
-    if (value < 0) {
+    if (value < 0 || value > max) {
         error_setg(errp, "%s value must be in range [0, %" PRId64 "]",
-                   info->name, INT64_MAX);
+                   info->name, max);
         return false;
     }
 
@@ -292,6 +308,24 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
     }
 }
 
+static void iothread_set_poll_target_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+
+    if (!iothread_set_param(obj, v, name, info, errp)) {
+        return;
+    }
+
+    if (iothread->ctx) {
+        aio_context_set_poll_target(iothread->ctx,
+                                    iothread->poll_latency_target_ns,
+                                    iothread->poll_cpu_budget,
+                                    errp);
+    }
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     EventLoopBaseClass *bc = EVENT_LOOP_BASE_CLASS(klass);
@@ -311,6 +345,14 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add(klass, "poll-latency-target-ns", "int",
+                              iothread_get_poll_param,
+                              iothread_set_poll_target_param,
+                              NULL, &poll_latency_target_ns_info);
+    object_class_property_add(klass, "poll-cpu-budget", "int",
+                              iothread_get_poll_param,
+                              iothread_set_poll_target_param,
+                              NULL, &poll_cpu_budget_info);
 }
 
 static const TypeInfo iothread_info = {
@@ -356,6 +398,10 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    info->poll_latency_target_ns = iothread->poll_latency_target_ns;
+    info->poll_cpu_budget = iothread->poll_cpu_budget;
+    aio_context_get_poll_stats(iothread->ctx, &info->poll_ns,
+                               &info->poll_wasted_ns);
     info->aio_max_batch = iothread->parent_obj.aio_max_batch;
 
     QAPI_LIST_APPEND(*tail, info);
@@ -28,6 +28,7 @@
 #include "qemu/main-loop.h"
 #include "sysemu/cpus.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/dirtylimit.h"
 #include "migration.h"
 #include "migration-stats.h"
 #include "trace.h"
@@ -35,8 +36,10 @@
 /* vcpu throttling controls */
 static QEMUTimer *throttle_timer, *throttle_dirty_sync_timer;
 static unsigned int throttle_percentage;
+static unsigned int throttle_vcpus;
 static bool throttle_dirty_sync_timer_active;
 static uint64_t throttle_dirty_sync_count_prev;
+static bool throttle_per_vcpu_active;
 
 #define CPU_THROTTLE_PCT_MIN 1
 #define CPU_THROTTLE_PCT_MAX 99
@@ -45,6 +48,12 @@ static uint64_t throttle_dirty_sync_count_prev;
 /* Making sure RAMBlock dirty bitmap is synchronized every five seconds */
 #define CPU_THROTTLE_DIRTY_SYNC_TIMESLICE_MS 5000
 
+/*
+ * With per-vcpu throttling, vcpus dirtying memory at less than
+ * 1/CPU_THROTTLE_VCPU_DIRTY_RATE_DIV of the average rate are left alone
+ */
+#define CPU_THROTTLE_VCPU_DIRTY_RATE_DIV 8
+
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
     double pct;
@@ -74,21 +83,64 @@ static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
     qatomic_set(&cpu->throttle_thread_scheduled, 0);
 }
 
+/*
+ * Return the dirty page rate (in MB/s) below which a vcpu is not
+ * throttled, or 0 if all vcpus are throttled.
+ */
+static int64_t cpu_throttle_vcpu_dirty_rate_threshold(void)
+{
+    CPUState *cpu;
+    int64_t dirty_rate = 0;
+    int nvcpus = 0;
+
+    if (!qatomic_read(&throttle_per_vcpu_active)) {
+        return 0;
+    }
+
+    CPU_FOREACH(cpu) {
+        dirty_rate += vcpu_dirty_rate_get(cpu->cpu_index);
+        nvcpus++;
+    }
+
+    /* Nothing sampled yet, don't guess which vcpus dirty memory */
+    if (!dirty_rate) {
+        return 0;
+    }
+
+    return DIV_ROUND_UP(dirty_rate,
+                        (int64_t)nvcpus * CPU_THROTTLE_VCPU_DIRTY_RATE_DIV);
+}
+
 static void cpu_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
+    int64_t threshold;
+    unsigned int nvcpus = 0;
     double pct;
 
     /* Stop the timer if needed */
     if (!cpu_throttle_get_percentage()) {
         return;
     }
+
+    threshold = cpu_throttle_vcpu_dirty_rate_threshold();
     CPU_FOREACH(cpu) {
+        if (threshold) {
+            int64_t dirty_rate = vcpu_dirty_rate_get(cpu->cpu_index);
+
+            if (dirty_rate < threshold) {
+                trace_cpu_throttle_vcpu_skip(cpu->cpu_index, dirty_rate,
+                                             threshold);
+                continue;
+            }
+        }
+        nvcpus++;
         if (!qatomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
                              RUN_ON_CPU_NULL);
         }
     }
+    qatomic_set(&throttle_vcpus, nvcpus);
 
     pct = (double)cpu_throttle_get_percentage() / 100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
@@ -120,6 +172,19 @@ void cpu_throttle_stop(void)
 {
     qatomic_set(&throttle_percentage, 0);
     cpu_throttle_dirty_sync_timer(false);
+
+    if (qatomic_read(&throttle_per_vcpu_active)) {
+        qatomic_set(&throttle_per_vcpu_active, 0);
+        vcpu_dirty_rate_track_stop();
+    }
+}
+
+void cpu_throttle_per_vcpu_start(void)
+{
+    if (!qatomic_read(&throttle_per_vcpu_active)) {
+        vcpu_dirty_rate_track_start();
+        qatomic_set(&throttle_per_vcpu_active, 1);
+    }
 }
 
 bool cpu_throttle_active(void)
@@ -132,6 +197,11 @@ int cpu_throttle_get_percentage(void)
     return qatomic_read(&throttle_percentage);
 }
 
+int cpu_throttle_get_vcpus(void)
+{
+    return qatomic_read(&throttle_vcpus);
+}
+
 void cpu_throttle_dirty_sync_timer_tick(void *opaque)
 {
     uint64_t sync_cnt = stat64_get(&mig_stats.dirty_sync_count);
@@ -48,6 +48,8 @@ static void migration_global_dump(Monitor *mon)
                    ms->send_section_footer ? "on" : "off");
     monitor_printf(mon, "clear-bitmap-shift: %u\n",
                    ms->clear_bitmap_shift);
+    monitor_printf(mon, "ram-sync-chunk-shift: %u\n",
+                   ms->ram_sync_chunk_shift);
 }
 
 void hmp_info_migrate(Monitor *mon, const QDict *qdict)
@@ -141,6 +143,14 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                            "Zero-copy-send fallbacks happened: %" PRIu64 " times\n",
                            info->ram->dirty_sync_missed_zero_copy);
         }
+        if (info->ram->has_hot_pages_deferred) {
+            monitor_printf(mon, "hot pages deferred: %" PRIu64 " pages\n",
+                           info->ram->hot_pages_deferred);
+        }
+        if (info->ram->has_hot_resends_avoided) {
+            monitor_printf(mon, "hot resends avoided: %" PRIu64 " pages\n",
+                           info->ram->hot_resends_avoided);
+        }
     }
 
     if (info->xbzrle_cache) {
@@ -165,6 +175,11 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->cpu_throttle_percentage);
     }
 
+    if (info->has_cpu_throttle_vcpus) {
+        monitor_printf(mon, "cpu throttle vcpus: %" PRIu64 "\n",
+                       info->cpu_throttle_vcpus);
+    }
+
     if (info->has_dirty_limit_throttle_time_per_round) {
         monitor_printf(mon, "dirty-limit throttle time: %" PRIu64 " us\n",
                        info->dirty_limit_throttle_time_per_round);
@@ -175,6 +190,15 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->dirty_limit_ring_full_time);
     }
 
+    if (info->dirty_ring) {
+        monitor_printf(mon, "dirty ring harvested pages: %" PRIu64 "\n",
+                       info->dirty_ring->harvested_pages);
+        monitor_printf(mon, "dirty ring harvest rate: %" PRIu64 " pages/s\n",
+                       info->dirty_ring->harvest_rate);
+        monitor_printf(mon, "dirty ring full exits: %" PRIu64 "\n",
+                       info->dirty_ring->ring_full_exits);
+    }
+
     if (info->has_postcopy_blocktime) {
         monitor_printf(mon, "postcopy blocktime: %u\n",
                        info->postcopy_blocktime);
@@ -264,6 +288,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %s\n",
             MigrationParameter_str(MIGRATION_PARAMETER_CPU_THROTTLE_TAILSLOW),
             params->cpu_throttle_tailslow ? "on" : "off");
+        assert(params->has_cpu_throttle_per_vcpu);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_CPU_THROTTLE_PER_VCPU),
+            params->cpu_throttle_per_vcpu ? "on" : "off");
         assert(params->has_max_cpu_throttle);
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MAX_CPU_THROTTLE),
@@ -309,6 +337,9 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %" PRIu64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MAX_POSTCOPY_BANDWIDTH),
             params->max_postcopy_bandwidth);
+        monitor_printf(mon, "%s: %" PRIu32 " pages\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES),
+            params->postcopy_prefetch_pages);
         monitor_printf(mon, "%s: '%s'\n",
             MigrationParameter_str(MIGRATION_PARAMETER_TLS_AUTHZ),
             params->tls_authz);
@@ -512,6 +543,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_cpu_throttle_tailslow = true;
         visit_type_bool(v, param, &p->cpu_throttle_tailslow, &err);
         break;
+    case MIGRATION_PARAMETER_CPU_THROTTLE_PER_VCPU:
+        p->has_cpu_throttle_per_vcpu = true;
+        visit_type_bool(v, param, &p->cpu_throttle_per_vcpu, &err);
+        break;
     case MIGRATION_PARAMETER_MAX_CPU_THROTTLE:
         p->has_max_cpu_throttle = true;
         visit_type_uint8(v, param, &p->max_cpu_throttle, &err);
@@ -603,6 +638,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_max_postcopy_bandwidth = true;
         visit_type_size(v, param, &p->max_postcopy_bandwidth, &err);
         break;
+    case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES:
+        p->has_postcopy_prefetch_pages = true;
+        visit_type_uint32(v, param, &p->postcopy_prefetch_pages, &err);
+        break;
     case MIGRATION_PARAMETER_ANNOUNCE_INITIAL:
         p->has_announce_initial = true;
         visit_type_size(v, param, &p->announce_initial, &err);
@@ -60,6 +60,16 @@ typedef struct {
      * guest is stopped.
      */
     Stat64 downtime_bytes;
+    /*
+     * Number of dirty pages skipped because they were hot, counted each
+     * time they are skipped.
+     */
+    Stat64 hot_pages_deferred;
+    /*
+     * Number of deferred hot pages that the guest wrote again before they
+     * were sent.
+     */
+    Stat64 hot_resends_avoided;
     /*
      * Number of bytes sent through multifd channels.
      */
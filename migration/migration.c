@@ -75,6 +75,7 @@
 static NotifierWithReturnList migration_state_notifiers[] = {
     NOTIFIER_ELEM_INIT(migration_state_notifiers, MIG_MODE_NORMAL),
     NOTIFIER_ELEM_INIT(migration_state_notifiers, MIG_MODE_CPR_REBOOT),
+    NOTIFIER_ELEM_INIT(migration_state_notifiers, MIG_MODE_CPR_LOCAL),
 };
 
 /* Messages sent on the return path from destination to source */
@@ -461,16 +462,17 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
  *   Start: Address offset within the RB
  *   Len: Length in bytes required - must be a multiple of pagesize
  */
-int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start)
+static int migrate_send_rp_message_req_range(MigrationIncomingState *mis,
+                                             RAMBlock *rb, ram_addr_t start,
+                                             size_t len)
 {
     uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
     size_t msglen = 12; /* start + len */
-    size_t len = qemu_ram_pagesize(rb);
     enum mig_rp_message_type msg_type;
     const char *rbname;
     int rbname_len;
 
+    assert(len <= UINT32_MAX);
     *(uint64_t *)bufc = cpu_to_be64((uint64_t)start);
     *(uint32_t *)(bufc + 8) = cpu_to_be32((uint32_t)len);
 
@@ -498,6 +500,13 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
     return migrate_send_rp_message(mis, msg_type, msglen, bufc);
 }
 
+int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
+                                      RAMBlock *rb, ram_addr_t start)
+{
+    return migrate_send_rp_message_req_range(mis, rb, start,
+                                             qemu_ram_pagesize(rb));
+}
+
 int migrate_send_rp_req_pages(MigrationIncomingState *mis,
                               RAMBlock *rb, ram_addr_t start, uint64_t haddr)
 {
@@ -529,6 +538,78 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
     return migrate_send_rp_message_req_pages(mis, rb, start);
 }
 
+/*
+ * Request host pages that no vCPU faulted on yet, but that are expected
+ * to be accessed soon.  @offsets are host page aligned offsets in @rb.
+ * Pages that are already received, discarded or requested are skipped;
+ * the others are recorded like faulted pages, and runs of consecutive
+ * pages are requested with a single message, as long as the length fits
+ * in its 32 bits.
+ *
+ * Returns the number of pages requested, or negative on error.
+ */
+int migrate_send_rp_prefetch_pages(MigrationIncomingState *mis, RAMBlock *rb,
+                                   const ram_addr_t *offsets, unsigned int n)
+{
+    size_t page_size = qemu_ram_pagesize(rb);
+    size_t max_run_len = ROUND_DOWN(UINT32_MAX, page_size);
+    ram_addr_t run_start = 0;
+    size_t run_len = 0;
+    unsigned int i;
+    int requested = 0;
+    int ret;
+
+    for (i = 0; i < n; i++) {
+        ram_addr_t start = offsets[i];
+        void *aligned = ramblock_ptr(rb, start);
+        bool queue = false;
+
+        assert(QEMU_IS_ALIGNED(start, page_size));
+        if (ramblock_page_is_discarded(rb, start)) {
+            continue;
+        }
+
+        WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+            if (!ramblock_recv_bitmap_test_byte_offset(rb, start) &&
+                !g_tree_lookup(mis->page_requested, aligned)) {
+                g_tree_insert(mis->page_requested, aligned, (gpointer)1);
+                qatomic_inc(&mis->page_requested_count);
+                trace_postcopy_page_req_add(aligned,
+                                            mis->page_requested_count);
+                queue = true;
+            }
+        }
+        if (!queue) {
+            continue;
+        }
+
+        requested++;
+        if (run_len && start == run_start + run_len &&
+            run_len + page_size <= max_run_len) {
+            run_len += page_size;
+            continue;
+        }
+        if (run_len) {
+            ret = migrate_send_rp_message_req_range(mis, rb, run_start,
+                                                    run_len);
+            if (ret) {
+                return ret;
+            }
+        }
+        run_start = start;
+        run_len = page_size;
+    }
+
+    if (run_len) {
+        ret = migrate_send_rp_message_req_range(mis, rb, run_start, run_len);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return requested;
+}
+
 static bool migration_colo_enabled;
 bool migration_incoming_colo_enabled(void)
 {
@@ -1192,6 +1273,15 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->downtime_bytes = stat64_get(&mig_stats.downtime_bytes);
     info->ram->postcopy_bytes = stat64_get(&mig_stats.postcopy_bytes);
 
+    if (migrate_defer_hot_pages()) {
+        info->ram->has_hot_pages_deferred = true;
+        info->ram->hot_pages_deferred =
+            stat64_get(&mig_stats.hot_pages_deferred);
+        info->ram->has_hot_resends_avoided = true;
+        info->ram->hot_resends_avoided =
+            stat64_get(&mig_stats.hot_resends_avoided);
+    }
+
     if (migrate_xbzrle()) {
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
@@ -1206,6 +1296,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     if (cpu_throttle_active()) {
         info->has_cpu_throttle_percentage = true;
         info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        info->has_cpu_throttle_vcpus = true;
+        info->cpu_throttle_vcpus = cpu_throttle_get_vcpus();
     }
 
     if (s->state != MIGRATION_STATUS_COMPLETED) {
@@ -1222,6 +1314,19 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->has_dirty_limit_ring_full_time = true;
         info->dirty_limit_ring_full_time = dirtylimit_ring_full_time();
     }
+
+    if (kvm_dirty_ring_enabled()) {
+        uint64_t time_ns;
+
+        info->dirty_ring = g_malloc0(sizeof(*info->dirty_ring));
+        kvm_dirty_ring_stats(&info->dirty_ring->harvested_pages, &time_ns,
+                             &info->dirty_ring->ring_full_exits);
+        if (time_ns) {
+            info->dirty_ring->harvest_rate =
+                (double)info->dirty_ring->harvested_pages *
+                NANOSECONDS_PER_SECOND / time_ns;
+        }
+    }
 }
 
 static void fill_source_migration_info(MigrationInfo *info)
@@ -1579,6 +1684,14 @@ int migration_call_notifiers(MigrationState *s, MigrationEventType type,
     MigrationEvent e;
     int ret;
 
+    /*
+     * cpr-local is a normal live migration as far as devices are
+     * concerned; only the memory is not copied.
+     */
+    if (mode == MIG_MODE_CPR_LOCAL) {
+        mode = MIG_MODE_NORMAL;
+    }
+
     e.type = type;
     ret = notifier_with_return_list_notify(&migration_state_notifiers[mode],
                                            &e, errp);
@@ -1772,7 +1885,8 @@ int migrate_add_blocker(Error **reasonp, Error **errp)
 
 int migrate_add_blocker_normal(Error **reasonp, Error **errp)
 {
-    return migrate_add_blocker_modes(reasonp, errp, MIG_MODE_NORMAL, -1);
+    return migrate_add_blocker_modes(reasonp, errp, MIG_MODE_NORMAL,
+                                     MIG_MODE_CPR_LOCAL, -1);
 }
 
 int migrate_add_blocker_modes(Error **reasonp, Error **errp, MigMode mode, ...)
@@ -2029,6 +2143,25 @@ static bool migrate_prepare(MigrationState *s, bool resume, Error **errp)
         }
     }
 
+    if (migrate_mode() == MIG_MODE_CPR_LOCAL) {
+        const char *conflict = NULL;
+
+        if (migrate_postcopy()) {
+            conflict = "postcopy";
+        } else if (migrate_background_snapshot()) {
+            conflict = "background snapshot";
+        } else if (migrate_colo()) {
+            conflict = "COLO";
+        } else if (migrate_mapped_ram()) {
+            conflict = "mapped-ram";
+        }
+
+        if (conflict) {
+            error_setg(errp, "Cannot use %s with cpr-local mode", conflict);
+            return false;
+        }
+    }
+
     if (migrate_init(s, errp)) {
         return false;
     }
@@ -3483,6 +3616,9 @@ static void *migration_thread(void *opaque)
     if (migrate_auto_converge()) {
         /* Start RAMBlock dirty bitmap sync timer */
         cpu_throttle_dirty_sync_timer(true);
+        if (migrate_cpu_throttle_per_vcpu()) {
+            cpu_throttle_per_vcpu_start();
+        }
     }
 
     bql_lock();
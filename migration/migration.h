@@ -35,12 +35,15 @@
 #define  MIGRATION_THREAD_SRC_MULTIFD       "mig/src/send_%d"
 #define  MIGRATION_THREAD_SRC_RETURN        "mig/src/return"
 #define  MIGRATION_THREAD_SRC_TLS           "mig/src/tls"
+#define  MIGRATION_THREAD_SRC_DEVICE        "mig/src/dev_%d"
 
 #define  MIGRATION_THREAD_DST_COLO          "mig/dst/colo"
 #define  MIGRATION_THREAD_DST_MULTIFD       "mig/dst/recv_%d"
 #define  MIGRATION_THREAD_DST_FAULT         "mig/dst/fault"
 #define  MIGRATION_THREAD_DST_LISTEN        "mig/dst/listen"
 #define  MIGRATION_THREAD_DST_PREEMPT       "mig/dst/preempt"
+#define  MIGRATION_THREAD_DST_DEVICE        "mig/dst/dev_%d"
+#define  MIGRATION_THREAD_DST_ON_DEMAND     "mig/dst/ondemand"
 
 struct PostcopyBlocktimeContext;
 
@@ -63,6 +66,15 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * Dirty bitmap sync chunks are GUEST_PAGE_SIZE << N big. Like for the clear
+ * bitmap, 1<<6=64 pages keeps the chunks LONG aligned in the bitmaps, and
+ * 1<<18=256K pages -> 1G chunk when page size is 4K is the default.
+ */
+#define RAM_SYNC_CHUNK_SHIFT_MIN           6
+#define RAM_SYNC_CHUNK_SHIFT_DEFAULT      18
+#define RAM_SYNC_CHUNK_SHIFT_MAX          31
+
 /* This is an abstraction of a "temp huge page" for postcopy's purpose */
 typedef struct {
     /*
@@ -455,6 +467,12 @@ struct MigrationState {
      * (which is in 4M chunk).
      */
     uint8_t clear_bitmap_shift;
+    /*
+     * With multifd, migration_bitmap_sync() syncs the dirty bitmaps in
+     * parallel in chunks of GUEST_PAGE_SIZE << N.  Only meant to be
+     * lowered for testing, so that small guests take the parallel path.
+     */
+    uint8_t ram_sync_chunk_shift;
 
     /*
      * This save hostname when out-going migration starts
@@ -510,6 +528,8 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
                               ram_addr_t start, uint64_t haddr);
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
                                       RAMBlock *rb, ram_addr_t start);
+int migrate_send_rp_prefetch_pages(MigrationIncomingState *mis, RAMBlock *rb,
+                                   const ram_addr_t *offsets, unsigned int n);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
@@ -0,0 +1,273 @@
+/*
+ * Multifd LZ4 compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include "qemu/bswap.h"
+#include "qemu/rcu.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "options.h"
+#include "multifd.h"
+
+/*
+ * Each page is compressed on its own and preceded in the payload by a
+ * big-endian 32-bit length.  A length equal to the page size means the
+ * page did not compress and is sent as is.
+ */
+#define MULTIFD_LZ4_HDR_SIZE sizeof(uint32_t)
+
+/* LZ4's default, higher values trade compression ratio for speed */
+#define MULTIFD_LZ4_ACCELERATION 1
+
+struct lz4_data {
+    /* compression state, reset before each page */
+    LZ4_stream_t *stream;
+    /* compressed buffer */
+    uint8_t *buf;
+    /* size of compressed buffer */
+    uint32_t buf_len;
+    /* bytes of buf used by the packet being prepared */
+    uint32_t buf_pos;
+};
+
+static uint32_t multifd_lz4_buf_len(void)
+{
+    uint32_t page_size = multifd_ram_page_size();
+
+    /*
+     * A page takes at most its header and the page itself, but LZ4 needs
+     * room for its worst case when compressing the last page.
+     */
+    return multifd_ram_page_count() * (MULTIFD_LZ4_HDR_SIZE + page_size) +
+           LZ4_COMPRESSBOUND(page_size) - page_size;
+}
+
+/* Multifd LZ4 compression */
+
+static int multifd_lz4_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->stream = LZ4_createStream();
+    if (!z->stream) {
+        g_free(z);
+        error_setg(errp, "multifd %u: LZ4 createStream failed", p->id);
+        return -1;
+    }
+
+    z->buf_len = multifd_lz4_buf_len();
+    z->buf = g_try_malloc(z->buf_len);
+    if (!z->buf) {
+        LZ4_freeStream(z->stream);
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for buf", p->id);
+        return -1;
+    }
+    p->compress_data = z;
+
+    /* Needs 2 IOVs, one for packet header and one for compressed data */
+    p->iov = g_new0(struct iovec, 2);
+    return 0;
+}
+
+static void multifd_lz4_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = p->compress_data;
+
+    LZ4_freeStream(z->stream);
+    z->stream = NULL;
+    g_free(z->buf);
+    z->buf = NULL;
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+/*
+ * Called by the zero page scan on each normal page, right after it was
+ * found not to be zero, so that the page is only read once from memory.
+ */
+static void multifd_lz4_compress_page(MultiFDSendParams *p, int index)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    struct lz4_data *z = p->compress_data;
+    uint32_t page_size = multifd_ram_page_size();
+    const char *page = (const char *)pages->block->host +
+                       pages->offset[index];
+    uint8_t *hdr = z->buf + z->buf_pos;
+    char *dst = (char *)hdr + MULTIFD_LZ4_HDR_SIZE;
+    int len;
+
+    /*
+     * Pages are independent of each other, so that the destination can
+     * decompress any of them on its own.  Resetting the stream is cheap,
+     * unlike initializing a new one for each page.
+     */
+    LZ4_resetStream_fast(z->stream);
+    len = LZ4_compress_fast_continue(z->stream, page, dst, page_size,
+                                     LZ4_COMPRESSBOUND(page_size),
+                                     MULTIFD_LZ4_ACCELERATION);
+    if (len <= 0 || len >= page_size) {
+        memcpy(dst, page, page_size);
+        len = page_size;
+    }
+
+    stl_be_p(hdr, len);
+    z->buf_pos += MULTIFD_LZ4_HDR_SIZE + len;
+}
+
+static int multifd_lz4_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    struct lz4_data *z = p->compress_data;
+
+    /*
+     * Zero page detection and compression are done in a single pass over
+     * the pages, instead of multifd_send_prepare_common() reading them
+     * all before they are compressed.
+     */
+    z->buf_pos = 0;
+    multifd_send_zero_page_scan(p, multifd_lz4_compress_page);
+
+    if (!pages->normal_num) {
+        p->next_packet_size = 0;
+        goto out;
+    }
+
+    multifd_send_prepare_header(p);
+
+    p->iov[p->iovs_num].iov_base = z->buf;
+    p->iov[p->iovs_num].iov_len = z->buf_pos;
+    p->iovs_num++;
+    p->next_packet_size = z->buf_pos;
+
+    trace_multifd_lz4_send(p->id, pages->normal_num, z->buf_pos);
+
+out:
+    p->flags |= MULTIFD_FLAG_LZ4;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+static int multifd_lz4_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->buf_len = multifd_lz4_buf_len();
+    z->buf = g_try_malloc(z->buf_len);
+    if (!z->buf) {
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for buf", p->id);
+        return -1;
+    }
+    p->compress_data = z;
+    return 0;
+}
+
+static void multifd_lz4_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct lz4_data *z = p->compress_data;
+
+    if (z) {
+        g_free(z->buf);
+        g_free(z);
+        p->compress_data = NULL;
+    }
+}
+
+static int multifd_lz4_recv(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = p->compress_data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t pos = 0;
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_LZ4) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZ4);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    if (in_size > z->buf_len) {
+        error_setg(errp, "multifd %u: packet size %u larger than %u",
+                   p->id, in_size, z->buf_len);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)z->buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        char *page = (char *)p->host + p->normal[i];
+        uint32_t len;
+
+        if (in_size - pos < MULTIFD_LZ4_HDR_SIZE) {
+            error_setg(errp, "multifd %u: truncated page header", p->id);
+            return -1;
+        }
+        len = ldl_be_p(z->buf + pos);
+        pos += MULTIFD_LZ4_HDR_SIZE;
+        if (!len || len > page_size || in_size - pos < len) {
+            error_setg(errp, "multifd %u: invalid page length %u",
+                       p->id, len);
+            return -1;
+        }
+
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        if (len == page_size) {
+            memcpy(page, z->buf + pos, page_size);
+        } else if (LZ4_decompress_safe((const char *)z->buf + pos, page,
+                                       len, page_size) != page_size) {
+            error_setg(errp, "multifd %u: failed to decompress page at "
+                       "offset 0x" RAM_ADDR_FMT, p->id, p->normal[i]);
+            return -1;
+        }
+        pos += len;
+    }
+
+    if (pos != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u size used %u",
+                   p->id, in_size, pos);
+        return -1;
+    }
+
+    return 0;
+}
+
+static const MultiFDMethods multifd_lz4_ops = {
+    .send_setup = multifd_lz4_send_setup,
+    .send_cleanup = multifd_lz4_send_cleanup,
+    .send_prepare = multifd_lz4_send_prepare,
+    .recv_setup = multifd_lz4_recv_setup,
+    .recv_cleanup = multifd_lz4_recv_cleanup,
+    .recv = multifd_lz4_recv
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZ4, &multifd_lz4_ops);
+}
+
+migration_init(multifd_lz4_register);
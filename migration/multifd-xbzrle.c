@@ -0,0 +1,405 @@
+/*
+ * Multifd XBZRLE delta encoding implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/rcu.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "trace.h"
+#include "options.h"
+#include "multifd.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+
+/*
+ * Each page in the payload is preceded by a big-endian 32-bit length.  A
+ * length equal to the page size means the page is sent verbatim, anything
+ * smaller is an XBZRLE delta against the previous content of the page.  A
+ * zero length delta means the page did not change.
+ */
+#define MULTIFD_XBZRLE_HDR_SIZE sizeof(uint32_t)
+
+/* Lock stripes of the shared page cache per send channel */
+#define MULTIFD_XBZRLE_SHARDS_PER_CHANNEL 16
+
+typedef struct {
+    QemuMutex lock;
+    PageCache *cache;
+} MultiFDXbzrleShard;
+
+/*
+ * Page cache shared by all send channels.  A page is sent by at most one
+ * channel between two multifd syncs, but pages of different channels can
+ * land in the same cache slot, so the cache is split in shards with one
+ * lock each.  The page number selects the shard, the remaining bits the
+ * slot within the shard.
+ */
+typedef struct {
+    MultiFDXbzrleShard *shards;
+    unsigned int nr_shards;
+    unsigned int shard_bits;
+    /* Number of channels using the cache, only touched by setup/cleanup */
+    unsigned int users;
+} MultiFDXbzrleCache;
+
+static MultiFDXbzrleCache *xbzrle_cache;
+
+struct xbzrle_data {
+    /* copy of the page being encoded, the guest may write to the original */
+    uint8_t *page;
+    /* encoded buffer */
+    uint8_t *buf;
+    /* size of encoded buffer */
+    uint32_t buf_len;
+};
+
+static uint32_t multifd_xbzrle_buf_len(void)
+{
+    return multifd_ram_page_count() *
+           (MULTIFD_XBZRLE_HDR_SIZE + multifd_ram_page_size());
+}
+
+static MultiFDXbzrleCache *multifd_xbzrle_cache_new(Error **errp)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    uint64_t cache_size = migrate_xbzrle_cache_size();
+    uint64_t nr_shards;
+    MultiFDXbzrleCache *c;
+
+    nr_shards = pow2ceil(migrate_multifd_channels() *
+                         MULTIFD_XBZRLE_SHARDS_PER_CHANNEL);
+    nr_shards = MIN(nr_shards, cache_size / page_size);
+    if (!nr_shards) {
+        error_setg(errp, "xbzrle-cache-size is smaller than one page");
+        return NULL;
+    }
+
+    c = g_new0(MultiFDXbzrleCache, 1);
+    c->nr_shards = nr_shards;
+    c->shard_bits = ctz64(nr_shards);
+    c->shards = g_new0(MultiFDXbzrleShard, nr_shards);
+
+    for (unsigned int i = 0; i < c->nr_shards; i++) {
+        MultiFDXbzrleShard *shard = &c->shards[i];
+
+        shard->cache = cache_init(cache_size / nr_shards, page_size, errp);
+        if (!shard->cache) {
+            while (i--) {
+                qemu_mutex_destroy(&c->shards[i].lock);
+                cache_fini(c->shards[i].cache);
+            }
+            g_free(c->shards);
+            g_free(c);
+            return NULL;
+        }
+        qemu_mutex_init(&shard->lock);
+    }
+
+    trace_multifd_xbzrle_cache_new(cache_size, c->nr_shards);
+    return c;
+}
+
+static void multifd_xbzrle_cache_free(MultiFDXbzrleCache *c)
+{
+    for (unsigned int i = 0; i < c->nr_shards; i++) {
+        qemu_mutex_destroy(&c->shards[i].lock);
+        cache_fini(c->shards[i].cache);
+    }
+    g_free(c->shards);
+    g_free(c);
+}
+
+/* Return the shard that caches @addr and its address within the shard */
+static MultiFDXbzrleShard *multifd_xbzrle_shard(ram_addr_t addr,
+                                                uint64_t *shard_addr)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    uint64_t page = addr / page_size;
+
+    *shard_addr = (page >> xbzrle_cache->shard_bits) * page_size;
+    return &xbzrle_cache->shards[page & (xbzrle_cache->nr_shards - 1)];
+}
+
+/* The destination clears zero pages, so must the cache */
+static void multifd_xbzrle_cache_zero_page(ram_addr_t addr, uint64_t age)
+{
+    MultiFDXbzrleShard *shard;
+    uint64_t shard_addr;
+
+    shard = multifd_xbzrle_shard(addr, &shard_addr);
+    WITH_QEMU_LOCK_GUARD(&shard->lock) {
+        if (cache_is_cached(shard->cache, shard_addr, age)) {
+            memset(get_cached_data(shard->cache, shard_addr), 0,
+                   multifd_ram_page_size());
+        }
+    }
+}
+
+/*
+ * Clear the cached copy of a page that the migration thread sent as a zero
+ * page on the main channel, with zero-page-detection=legacy.
+ */
+void multifd_xbzrle_zero_page(ram_addr_t addr)
+{
+    assert(xbzrle_cache);
+    multifd_xbzrle_cache_zero_page(addr,
+                                   stat64_get(&mig_stats.dirty_sync_count));
+}
+
+/*
+ * Encode the page at @host into @out, as a delta against the cached copy if
+ * there is one, and update the cache.  Returns the number of bytes written.
+ */
+static uint32_t multifd_xbzrle_encode_page(struct xbzrle_data *x,
+                                           ram_addr_t addr, uint8_t *host,
+                                           uint8_t *out, uint64_t age)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    uint8_t *data = out + MULTIFD_XBZRLE_HDR_SIZE;
+    MultiFDXbzrleShard *shard;
+    uint64_t shard_addr;
+    int len = -1;
+
+    memcpy(x->page, host, page_size);
+
+    shard = multifd_xbzrle_shard(addr, &shard_addr);
+    WITH_QEMU_LOCK_GUARD(&shard->lock) {
+        if (cache_is_cached(shard->cache, shard_addr, age)) {
+            uint8_t *cached = get_cached_data(shard->cache, shard_addr);
+
+            /* Must be smaller than a page to tell it from a verbatim one */
+            len = xbzrle_encode_buffer(cached, x->page, page_size, data,
+                                       page_size - 1);
+            if (len) {
+                memcpy(cached, x->page, page_size);
+            }
+        } else {
+            /* The slot may be in use by a fresher page, then just send it */
+            cache_insert(shard->cache, shard_addr, x->page, age);
+        }
+    }
+
+    if (len < 0) {
+        len = page_size;
+        memcpy(data, x->page, page_size);
+    }
+    stl_be_p(out, len);
+
+    return MULTIFD_XBZRLE_HDR_SIZE + len;
+}
+
+static int multifd_xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *x;
+
+    if (!xbzrle_cache) {
+        xbzrle_cache = multifd_xbzrle_cache_new(errp);
+        if (!xbzrle_cache) {
+            return -1;
+        }
+    }
+
+    x = g_new0(struct xbzrle_data, 1);
+    x->page = g_malloc(multifd_ram_page_size());
+    x->buf_len = multifd_xbzrle_buf_len();
+    x->buf = g_try_malloc(x->buf_len);
+    if (!x->buf) {
+        g_free(x->page);
+        g_free(x);
+        if (!xbzrle_cache->users) {
+            multifd_xbzrle_cache_free(xbzrle_cache);
+            xbzrle_cache = NULL;
+        }
+        error_setg(errp, "multifd %u: out of memory for buf", p->id);
+        return -1;
+    }
+    p->compress_data = x;
+    xbzrle_cache->users++;
+
+    /* Needs 2 IOVs, one for packet header and one for encoded data */
+    p->iov = g_new0(struct iovec, 2);
+
+    return 0;
+}
+
+static void multifd_xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *x = p->compress_data;
+
+    if (x) {
+        g_free(x->page);
+        g_free(x->buf);
+        g_free(x);
+        p->compress_data = NULL;
+
+        if (!--xbzrle_cache->users) {
+            multifd_xbzrle_cache_free(xbzrle_cache);
+            xbzrle_cache = NULL;
+        }
+    }
+
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+static int multifd_xbzrle_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    struct xbzrle_data *x = p->compress_data;
+    uint64_t age = stat64_get(&mig_stats.dirty_sync_count);
+    uint32_t out_size = 0;
+    uint32_t i;
+    bool has_normal;
+
+    has_normal = multifd_send_prepare_common(p);
+
+    for (i = pages->normal_num; i < pages->num; i++) {
+        multifd_xbzrle_cache_zero_page(pages->block->offset +
+                                       pages->offset[i], age);
+    }
+
+    if (!has_normal) {
+        goto out;
+    }
+
+    for (i = 0; i < pages->normal_num; i++) {
+        out_size += multifd_xbzrle_encode_page(x,
+                        pages->block->offset + pages->offset[i],
+                        pages->block->host + pages->offset[i],
+                        x->buf + out_size, age);
+    }
+    p->iov[p->iovs_num].iov_base = x->buf;
+    p->iov[p->iovs_num].iov_len = out_size;
+    p->iovs_num++;
+    p->next_packet_size = out_size;
+
+    trace_multifd_xbzrle_send(p->id, pages->normal_num, out_size);
+
+out:
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+static int multifd_xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct xbzrle_data *x = g_new0(struct xbzrle_data, 1);
+
+    x->buf_len = multifd_xbzrle_buf_len();
+    x->buf = g_try_malloc(x->buf_len);
+    if (!x->buf) {
+        g_free(x);
+        error_setg(errp, "multifd %u: out of memory for buf", p->id);
+        return -1;
+    }
+    p->compress_data = x;
+    return 0;
+}
+
+static void multifd_xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct xbzrle_data *x = p->compress_data;
+
+    if (x) {
+        g_free(x->buf);
+        g_free(x);
+        p->compress_data = NULL;
+    }
+}
+
+static int multifd_xbzrle_recv(MultiFDRecvParams *p, Error **errp)
+{
+    struct xbzrle_data *x = p->compress_data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t pos = 0;
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    if (in_size > x->buf_len) {
+        error_setg(errp, "multifd %u: packet size %u larger than %u",
+                   p->id, in_size, x->buf_len);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)x->buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint8_t *page = p->host + p->normal[i];
+        uint32_t len;
+
+        if (in_size - pos < MULTIFD_XBZRLE_HDR_SIZE) {
+            error_setg(errp, "multifd %u: truncated page header", p->id);
+            return -1;
+        }
+        len = ldl_be_p(x->buf + pos);
+        pos += MULTIFD_XBZRLE_HDR_SIZE;
+        if (len > page_size || in_size - pos < len) {
+            error_setg(errp, "multifd %u: invalid page length %u",
+                       p->id, len);
+            return -1;
+        }
+
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        if (len == page_size) {
+            memcpy(page, x->buf + pos, page_size);
+        } else if (len &&
+                   xbzrle_decode_buffer(x->buf + pos, len, page,
+                                        page_size) < 0) {
+            error_setg(errp, "multifd %u: failed to decode page at "
+                       "offset 0x" RAM_ADDR_FMT, p->id, p->normal[i]);
+            return -1;
+        }
+        pos += len;
+    }
+
+    if (pos != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u size used %u",
+                   p->id, in_size, pos);
+        return -1;
+    }
+
+    return 0;
+}
+
+static const MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = multifd_xbzrle_send_setup,
+    .send_cleanup = multifd_xbzrle_send_cleanup,
+    .send_prepare = multifd_xbzrle_send_prepare,
+    .recv_setup = multifd_xbzrle_recv_setup,
+    .recv_cleanup = multifd_xbzrle_recv_cleanup,
+    .recv = multifd_xbzrle_recv
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
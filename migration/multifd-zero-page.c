@@ -38,14 +38,20 @@ static void swap_page_offset(ram_addr_t *pages_offset, int a, int b)
 }
 
 /**
- * multifd_send_zero_page_detect: Perform zero page detection on all pages.
+ * multifd_send_zero_page_scan: Perform zero page detection on all pages,
+ * and pass each normal page to a callback as soon as it is found.
  *
  * Sorts normal pages before zero pages in p->pages->offset and updates
- * p->pages->normal_num.
+ * p->pages->normal_num.  @func is called with the index of each normal
+ * page in its final position, in increasing order, while the page is
+ * still hot in the CPU caches.  It is called for every page if zero page
+ * detection is not done by multifd.
  *
  * @param p A pointer to the send params.
+ * @param func Called on each normal page, or NULL.
  */
-void multifd_send_zero_page_detect(MultiFDSendParams *p)
+void multifd_send_zero_page_scan(MultiFDSendParams *p,
+                                 MultiFDNormalPageFunc *func)
 {
     MultiFDPages_t *pages = &p->data->u.ram;
     RAMBlock *rb = pages->block;
@@ -54,6 +60,9 @@ void multifd_send_zero_page_detect(MultiFDSendParams *p)
 
     if (!multifd_zero_page_enabled()) {
         pages->normal_num = pages->num;
+        for (i = 0; func && i < pages->num; i++) {
+            func(p, i);
+        }
         goto out;
     }
 
@@ -65,6 +74,9 @@ void multifd_send_zero_page_detect(MultiFDSendParams *p)
         uint64_t offset = pages->offset[i];
 
         if (!buffer_is_zero(rb->host + offset, multifd_ram_page_size())) {
+            if (func) {
+                func(p, i);
+            }
             i++;
             continue;
         }
@@ -81,6 +93,19 @@ out:
     stat64_add(&mig_stats.zero_pages, pages->num - pages->normal_num);
 }
 
+/**
+ * multifd_send_zero_page_detect: Perform zero page detection on all pages.
+ *
+ * Sorts normal pages before zero pages in p->pages->offset and updates
+ * p->pages->normal_num.
+ *
+ * @param p A pointer to the send params.
+ */
+void multifd_send_zero_page_detect(MultiFDSendParams *p)
+{
+    multifd_send_zero_page_scan(p, NULL);
+}
+
 void multifd_recv_zero_page_process(MultiFDRecvParams *p)
 {
     for (int i = 0; i < p->zero_num; i++) {
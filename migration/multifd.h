@@ -45,6 +45,9 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_QPL (4 << 1)
 #define MULTIFD_FLAG_UADK (8 << 1)
 #define MULTIFD_FLAG_QATZIP (16 << 1)
+/* The single bit values are used up, the field is compared as a whole */
+#define MULTIFD_FLAG_XBZRLE (3 << 1)
+#define MULTIFD_FLAG_LZ4 (5 << 1)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
@@ -311,7 +314,10 @@ typedef struct {
 void multifd_register_ops(int method, const MultiFDMethods *ops);
 void multifd_send_fill_packet(MultiFDSendParams *p);
 bool multifd_send_prepare_common(MultiFDSendParams *p);
+typedef void MultiFDNormalPageFunc(MultiFDSendParams *p, int index);
 void multifd_send_zero_page_detect(MultiFDSendParams *p);
+void multifd_send_zero_page_scan(MultiFDSendParams *p,
+                                 MultiFDNormalPageFunc *func);
 void multifd_recv_zero_page_process(MultiFDRecvParams *p);
 
 static inline void multifd_send_prepare_header(MultiFDSendParams *p)
@@ -341,4 +347,6 @@ int multifd_ram_flush_and_sync(void);
 size_t multifd_ram_payload_size(void);
 void multifd_ram_fill_packet(MultiFDSendParams *p);
 int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp);
+
+void multifd_xbzrle_zero_page(ram_addr_t addr);
 #endif
@@ -950,12 +950,97 @@ static void postcopy_pause_fault_thread(MigrationIncomingState *mis)
     trace_postcopy_pause_fault_thread_continued();
 }
 
+/*
+ * Page fault streams followed by the prefetcher.  Faults are assigned to a
+ * stream by the faulting vCPU, so that the access pattern of each vCPU is
+ * learned even when the faults of several vCPUs interleave.  Faults whose
+ * vCPU is unknown all go to the first stream.
+ */
+#define POSTCOPY_PREFETCH_STREAMS       16
+/* Largest distance between two faults that is taken as a stride */
+#define POSTCOPY_PREFETCH_MAX_STRIDE    64  /* in host pages */
+
+typedef struct PostcopyPrefetchStream {
+    RAMBlock *rb;
+    ram_addr_t last;            /* offset of the last fault */
+    int64_t stride;             /* distance between the last two faults */
+    unsigned int hits;          /* times @stride was seen in a row */
+} PostcopyPrefetchStream;
+
+/*
+ * Request the pages that the vCPU that faulted on @offset in @rb is
+ * expected to access next.  When the last faults of the vCPU were evenly
+ * spaced, follow that stride; otherwise fetch the pages right after
+ * @offset.  Called after the faulting page itself was requested, so that
+ * the source serves that one first.
+ */
+static int postcopy_prefetch(MigrationIncomingState *mis,
+                             PostcopyPrefetchStream *streams,
+                             RAMBlock *rb, ram_addr_t offset, uint32_t ptid)
+{
+    unsigned int npages = MIN(migrate_postcopy_prefetch_pages(),
+                              POSTCOPY_PREFETCH_MAX_PAGES);
+    ram_addr_t pages[POSTCOPY_PREFETCH_MAX_PAGES];
+    int64_t page_size = qemu_ram_pagesize(rb);
+    int64_t stride = page_size;
+    PostcopyPrefetchStream *s;
+    unsigned int i, n = 0;
+    int cpu, ret;
+
+    if (!npages) {
+        return 0;
+    }
+
+    cpu = ptid ? get_mem_fault_cpu_index(ptid) : -1;
+    s = &streams[cpu < 0 ? 0 : cpu % POSTCOPY_PREFETCH_STREAMS];
+
+    if (s->rb != rb) {
+        s->rb = rb;
+        s->stride = 0;
+        s->hits = 0;
+    } else if (offset != s->last) {
+        int64_t delta = (int64_t)offset - (int64_t)s->last;
+
+        if (delta == s->stride) {
+            s->hits++;
+        } else {
+            s->hits = 0;
+            s->stride = delta;
+            if (ABS(delta) > POSTCOPY_PREFETCH_MAX_STRIDE * page_size) {
+                s->stride = 0;
+            }
+        }
+    }
+    s->last = offset;
+
+    if (s->hits && s->stride) {
+        stride = s->stride;
+    }
+
+    for (i = 1; i <= npages; i++) {
+        int64_t next = (int64_t)offset + stride * i;
+
+        if (next < 0 || next >= rb->used_length) {
+            break;
+        }
+        pages[n++] = next;
+    }
+
+    ret = migrate_send_rp_prefetch_pages(mis, rb, pages, n);
+    if (ret >= 0) {
+        trace_postcopy_prefetch(qemu_ram_get_idstr(rb), offset, cpu, stride,
+                                n, ret);
+    }
+    return ret < 0 ? ret : 0;
+}
+
 /*
  * Handle faults detected by the USERFAULT markings
  */
 static void *postcopy_ram_fault_thread(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
+    PostcopyPrefetchStream streams[POSTCOPY_PREFETCH_STREAMS] = {};
     struct uffd_msg msg;
     int ret;
     size_t index;
@@ -1079,6 +1164,10 @@ retry:
              */
             ret = postcopy_request_page(mis, rb, rb_offset,
                                         msg.arg.pagefault.address);
+            if (!ret) {
+                ret = postcopy_prefetch(mis, streams, rb, rb_offset,
+                                        msg.arg.pagefault.feat.ptid);
+            }
             if (ret) {
                 /* May be network failure, try to wait for recovery */
                 postcopy_pause_fault_thread(mis);
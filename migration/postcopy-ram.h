@@ -15,6 +15,9 @@
 
 #include "qapi/qapi-types-migration.h"
 
+/* Upper bound of the postcopy-prefetch-pages parameter */
+#define POSTCOPY_PREFETCH_MAX_PAGES 256
+
 /* Return true if the host supports everything we need to do postcopy-ram */
 bool postcopy_ram_supported_by_host(MigrationIncomingState *mis,
                                     Error **errp);
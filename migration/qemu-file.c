@@ -37,9 +37,15 @@
 #define IO_BUF_SIZE 32768
 #define MAX_IOV_SIZE MIN_CONST(IOV_MAX, 64)
 
+typedef struct FdEntry {
+    QTAILQ_ENTRY(FdEntry) entry;
+    int fd;
+} FdEntry;
+
 struct QEMUFile {
     QIOChannel *ioc;
     bool is_writable;
+    bool can_pass_fd;
 
     int buf_index;
     int buf_size; /* 0 when writing */
@@ -51,6 +57,9 @@ struct QEMUFile {
 
     int last_error;
     Error *last_error_obj;
+
+    /* File descriptors received with the stream, in order */
+    QTAILQ_HEAD(, FdEntry) fds;
 };
 
 /*
@@ -109,6 +118,8 @@ static QEMUFile *qemu_file_new_impl(QIOChannel *ioc, bool is_writable)
     object_ref(ioc);
     f->ioc = ioc;
     f->is_writable = is_writable;
+    f->can_pass_fd = qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_FD_PASS);
+    QTAILQ_INIT(&f->fds);
 
     return f;
 }
@@ -325,10 +336,25 @@ static ssize_t coroutine_mixed_fn qemu_fill_buffer(QEMUFile *f)
     }
 
     do {
-        len = qio_channel_read(f->ioc,
-                               (char *)f->buf + pending,
-                               IO_BUF_SIZE - pending,
-                               &local_error);
+        struct iovec iov = {
+            .iov_base = f->buf + pending,
+            .iov_len = IO_BUF_SIZE - pending,
+        };
+        int *fds = NULL;
+        size_t nfds = 0;
+
+        len = qio_channel_readv_full(f->ioc, &iov, 1,
+                                     f->can_pass_fd ? &fds : NULL,
+                                     f->can_pass_fd ? &nfds : NULL,
+                                     0, &local_error);
+        for (size_t i = 0; i < nfds; i++) {
+            FdEntry *fde = g_new0(FdEntry, 1);
+
+            fde->fd = fds[i];
+            QTAILQ_INSERT_TAIL(&f->fds, fde, entry);
+        }
+        g_free(fds);
+
         if (len == QIO_CHANNEL_ERR_BLOCK) {
             if (qemu_in_coroutine()) {
                 qio_channel_yield(f->ioc, G_IO_IN);
@@ -361,11 +387,17 @@ static ssize_t coroutine_mixed_fn qemu_fill_buffer(QEMUFile *f)
  */
 int qemu_fclose(QEMUFile *f)
 {
+    FdEntry *fde, *next;
     int ret = qemu_fflush(f);
     int ret2 = qio_channel_close(f->ioc, NULL);
     if (ret >= 0) {
         ret = ret2;
     }
+    QTAILQ_FOREACH_SAFE(fde, &f->fds, entry, next) {
+        warn_report("qemu_fclose: received fd %d was never used", fde->fd);
+        close(fde->fd);
+        g_free(fde);
+    }
     g_clear_pointer(&f->ioc, object_unref);
     error_free(f->last_error_obj);
     g_free(f);
@@ -831,6 +863,83 @@ QIOChannel *qemu_file_get_ioc(QEMUFile *file)
     return file->ioc;
 }
 
+/*
+ * qemu_file_put_fd:
+ *
+ * Send @fd to the other side of the stream, after everything that was
+ * queued so far.  The channel must support fd passing, as UNIX sockets
+ * do.  The descriptor travels with a single dummy byte, because ancillary
+ * data cannot be sent alone on a stream socket.
+ *
+ * Returns 0 on success, negative on error (the error is also set on @f).
+ */
+int qemu_file_put_fd(QEMUFile *f, int fd)
+{
+    struct iovec iov = { .iov_base = (void *)"", .iov_len = 1 };
+    Error *local_error = NULL;
+    int ret;
+
+    if (!f->can_pass_fd) {
+        error_setg(&local_error, "Channel %s cannot pass file descriptors",
+                   f->ioc->name ?: "");
+        qemu_file_set_error_obj(f, -EINVAL, local_error);
+        return -EINVAL;
+    }
+
+    ret = qemu_fflush(f);
+    if (ret) {
+        return ret;
+    }
+
+    if (qio_channel_writev_full_all(f->ioc, &iov, 1, &fd, 1, 0,
+                                    &local_error) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+        return -EIO;
+    }
+    stat64_add(&mig_stats.qemu_file_transferred, iov.iov_len);
+    trace_qemu_file_put_fd(fd);
+
+    return 0;
+}
+
+/*
+ * qemu_file_get_fd:
+ *
+ * Receive a descriptor sent with qemu_file_put_fd().  The caller owns the
+ * returned descriptor.
+ *
+ * Returns the descriptor, or negative on error (the error is also set
+ * on @f).
+ */
+int qemu_file_get_fd(QEMUFile *f)
+{
+    Error *local_error = NULL;
+    FdEntry *fde;
+    int fd;
+
+    /* Make sure that the dummy byte, and the descriptor with it, arrived */
+    qemu_peek_byte(f, 0);
+    if (qemu_file_get_error(f)) {
+        return -EIO;
+    }
+
+    fde = QTAILQ_FIRST(&f->fds);
+    if (!fde) {
+        error_setg(&local_error, "Expected a file descriptor on channel %s",
+                   f->ioc->name ?: "");
+        qemu_file_set_error_obj(f, -EINVAL, local_error);
+        return -EINVAL;
+    }
+    qemu_file_skip(f, 1);
+
+    QTAILQ_REMOVE(&f->fds, fde, entry);
+    fd = fde->fd;
+    g_free(fde);
+    trace_qemu_file_get_fd(fd);
+
+    return fd;
+}
+
 /*
  * Read size bytes from QEMUFile f and write them to fd.
  */
@@ -38,6 +38,7 @@
 #include "migration-stats.h"
 #include "migration/register.h"
 #include "migration/misc.h"
+#include "migration/blocker.h"
 #include "qemu-file.h"
 #include "postcopy-ram.h"
 #include "page_cache.h"
@@ -55,6 +56,7 @@
 #include "sysemu/cpu-throttle.h"
 #include "savevm.h"
 #include "qemu/iov.h"
+#include "io/channel-file.h"
 #include "multifd.h"
 #include "sysemu/runstate.h"
 #include "rdma.h"
@@ -65,6 +67,7 @@
 #include "hw/boards.h" /* for machine_dump_guest_core() */
 
 #if defined(__linux__)
+#include <sys/ioctl.h>
 #include "qemu/userfaultfd.h"
 #endif /* defined(__linux__) */
 
@@ -214,11 +217,26 @@ static bool postcopy_preempt_active(void)
     return migrate_postcopy_preempt() && migration_in_postcopy();
 }
 
+/*
+ * In cpr-local mode, the memory of RAM blocks backed by a shared file, such
+ * as memory-backend-memfd or memory-backend-file with share=on, is not
+ * copied.  The file is passed to the destination, which maps it in place of
+ * its own memory.
+ */
+static bool ram_block_is_handed_off(RAMBlock *block)
+{
+    return migrate_mode() == MIG_MODE_CPR_LOCAL &&
+           qemu_ram_is_migratable(block) && qemu_ram_is_shared(block) &&
+           qemu_ram_get_fd(block) >= 0 &&
+           !memory_region_has_guest_memfd(block->mr);
+}
+
 bool migrate_ram_is_ignored(RAMBlock *block)
 {
     return !qemu_ram_is_migratable(block) ||
            (migrate_ignore_shared() && qemu_ram_is_shared(block)
-                                    && qemu_ram_is_named_file(block));
+                                    && qemu_ram_is_named_file(block)) ||
+           ram_block_is_handed_off(block);
 }
 
 #undef RAMBLOCK_FOREACH
@@ -351,6 +369,22 @@ struct RAMSrcPageRequest {
     QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
 };
 
+/* Range of a RAM block whose dirty bitmap is synced in one go */
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} RAMSyncChunk;
+
+typedef struct {
+    QemuThread thread;
+    struct RAMState *rs;
+    /* Posted to start a sync round, or to quit */
+    QemuSemaphore sem;
+    /* Newly dirtied pages found by this worker in the current round */
+    uint64_t dirty_pages;
+} RAMSyncWorker;
+
 /* State of RAM for migration */
 struct RAMState {
     /*
@@ -388,6 +422,16 @@ struct RAMState {
     /* Are we on the last stage of migration */
     bool last_stage;
 
+    /*
+     * x-defer-hot-pages: skip dirty pages of hot words.  Set by each dirty
+     * sync, cleared when a round over RAM finds nothing but hot pages.
+     */
+    bool defer_hot;
+    /* A round found only hot pages, ask for a new dirty sync */
+    bool defer_hot_resync;
+    /* target_page_count at the last dirty sync */
+    uint64_t defer_hot_sync_pages;
+
     /* total handled target pages at the beginning of period */
     uint64_t target_page_count_prev;
     /* total handled target pages since start */
@@ -414,6 +458,26 @@ struct RAMState {
      * RAM migration.
      */
     unsigned int postcopy_bmap_sync_requested;
+
+    /*
+     * Threads that help migration_bitmap_sync() with huge guests, one less
+     * than there are multifd channels. Created on first use.
+     */
+    RAMSyncWorker *sync_workers;
+    unsigned int sync_nworkers;
+    /* Posted by each worker when it has run out of chunks */
+    QemuSemaphore sync_done;
+    bool sync_quit;
+    /* Chunks of the current sync round, sync_next_chunk is claimed next */
+    RAMSyncChunk *sync_chunks;
+    /*
+     * Size of the chunks, a multiple of BITS_PER_LONG target pages so that
+     * the workers never write the same word of the migration bitmap
+     */
+    ram_addr_t sync_chunk_size;
+    unsigned int sync_nchunks;
+    unsigned int sync_chunks_alloc;
+    unsigned int sync_next_chunk;
 };
 typedef struct RAMState RAMState;
 
@@ -698,6 +762,44 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
     return 1;
 }
 
+/*
+ * A word of the dirty bitmap is hot if the guest wrote to it in each of the
+ * last two dirty sync periods, see RAMBlock.bmap_heat.
+ */
+#define RAM_HEAT_HOT 0xc0
+
+static bool ram_defer_hot_active(RAMState *rs)
+{
+    return rs->defer_hot && !migration_in_postcopy();
+}
+
+/*
+ * Find the next dirty page from @page on that is not in a hot word.  Dirty
+ * pages of hot words are left in the bitmap: the guest is likely to write
+ * them again, so they are sent once they cool down or nothing else is left.
+ */
+static unsigned long ram_find_next_cold_dirty(RAMState *rs, RAMBlock *rb,
+                                              unsigned long size,
+                                              unsigned long page)
+{
+    while ((page = find_next_bit(rb->bmap, size, page)) < size) {
+        unsigned long word = BIT_WORD(page);
+
+        if ((rb->bmap_heat[word] & RAM_HEAT_HOT) != RAM_HEAT_HOT) {
+            break;
+        }
+
+        /* Keep tracking writes to the page while it is deferred */
+        migration_clear_memory_region_dirty_bitmap(rb, page);
+        set_bit(word, rb->bmap_deferred);
+        stat64_add(&mig_stats.hot_pages_deferred,
+                   ctpopl(rb->bmap[word] >> (page % BITS_PER_LONG)));
+        page = (word + 1) * BITS_PER_LONG;
+    }
+
+    return MIN(page, size);
+}
+
 /**
  * pss_find_next_dirty: find the next dirty page of current ramblock
  *
@@ -728,6 +830,9 @@ static void pss_find_next_dirty(PageSearchStatus *pss)
     if (pss->host_page_sending) {
         assert(pss->host_page_end);
         size = MIN(size, pss->host_page_end);
+    } else if (ram_defer_hot_active(ram_state)) {
+        pss->page = ram_find_next_cold_dirty(ram_state, rb, size, pss->page);
+        return;
     }
 
     pss->page = find_next_bit(bitmap, size, pss->page);
@@ -922,6 +1027,154 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/* Sync chunks of the current round until there are none left to claim */
+static uint64_t ram_sync_claim_chunks(RAMState *rs)
+{
+    uint64_t dirty_pages = 0;
+    unsigned int i;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        while ((i = qatomic_fetch_inc(&rs->sync_next_chunk)) <
+               rs->sync_nchunks) {
+            RAMSyncChunk *chunk = &rs->sync_chunks[i];
+
+            dirty_pages += cpu_physical_memory_sync_dirty_bitmap(
+                chunk->block, chunk->start, chunk->length);
+        }
+    }
+    return dirty_pages;
+}
+
+static void *ram_sync_worker_thread(void *opaque)
+{
+    RAMSyncWorker *w = opaque;
+    RAMState *rs = w->rs;
+
+    rcu_register_thread();
+    for (;;) {
+        qemu_sem_wait(&w->sem);
+        if (qatomic_read(&rs->sync_quit)) {
+            break;
+        }
+        w->dirty_pages = ram_sync_claim_chunks(rs);
+        qemu_sem_post(&rs->sync_done);
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void ram_sync_workers_start(RAMState *rs, unsigned int n)
+{
+    rs->sync_workers = g_new0(RAMSyncWorker, n);
+    rs->sync_nworkers = n;
+    qemu_sem_init(&rs->sync_done, 0);
+
+    for (unsigned int i = 0; i < n; i++) {
+        RAMSyncWorker *w = &rs->sync_workers[i];
+        g_autofree char *name = g_strdup_printf("mig/src/sync_%u", i);
+
+        w->rs = rs;
+        qemu_sem_init(&w->sem, 0);
+        qemu_thread_create(&w->thread, name, ram_sync_worker_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void ram_sync_workers_stop(RAMState *rs)
+{
+    if (!rs->sync_workers) {
+        return;
+    }
+
+    qatomic_set(&rs->sync_quit, true);
+    for (unsigned int i = 0; i < rs->sync_nworkers; i++) {
+        qemu_sem_post(&rs->sync_workers[i].sem);
+    }
+    for (unsigned int i = 0; i < rs->sync_nworkers; i++) {
+        RAMSyncWorker *w = &rs->sync_workers[i];
+
+        qemu_thread_join(&w->thread);
+        qemu_sem_destroy(&w->sem);
+    }
+    qemu_sem_destroy(&rs->sync_done);
+    g_free(rs->sync_workers);
+    rs->sync_workers = NULL;
+    rs->sync_nworkers = 0;
+    g_free(rs->sync_chunks);
+    rs->sync_chunks = NULL;
+    rs->sync_chunks_alloc = 0;
+}
+
+static void ram_sync_add_chunk(RAMState *rs, RAMBlock *rb, ram_addr_t start,
+                               ram_addr_t length)
+{
+    if (rs->sync_nchunks == rs->sync_chunks_alloc) {
+        rs->sync_chunks_alloc = MAX(16, rs->sync_chunks_alloc * 2);
+        rs->sync_chunks = g_renew(RAMSyncChunk, rs->sync_chunks,
+                                  rs->sync_chunks_alloc);
+    }
+    rs->sync_chunks[rs->sync_nchunks++] = (RAMSyncChunk) {
+        .block = rb,
+        .start = start,
+        .length = length,
+    };
+}
+
+/*
+ * Sync the dirty bitmaps of all RAMBlocks. With multifd, large guests are
+ * split into chunks that are synced in parallel by as many threads as there
+ * are multifd channels, so the sync keeps up with the channels' throughput.
+ *
+ * Called with RCU critical section and bitmap_mutex held
+ */
+static void ram_sync_dirty_bitmaps(RAMState *rs)
+{
+    unsigned int nthreads = migrate_multifd() ? migrate_multifd_channels() : 1;
+    uint64_t new_dirty_pages;
+    RAMBlock *block;
+
+    rs->sync_nchunks = 0;
+    if (nthreads > 1) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            for (ram_addr_t start = 0; start < block->used_length;
+                 start += rs->sync_chunk_size) {
+                ram_sync_add_chunk(rs, block, start,
+                                   MIN(rs->sync_chunk_size,
+                                       block->used_length - start));
+            }
+        }
+    }
+
+    if (rs->sync_nchunks <= 1) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ramblock_sync_dirty_bitmap(rs, block);
+        }
+        return;
+    }
+
+    if (!rs->sync_workers) {
+        ram_sync_workers_start(rs, nthreads - 1);
+    }
+
+    trace_ram_sync_dirty_bitmaps(rs->sync_nchunks, rs->sync_nworkers);
+    qatomic_set(&rs->sync_next_chunk, 0);
+    for (unsigned int i = 0; i < rs->sync_nworkers; i++) {
+        qemu_sem_post(&rs->sync_workers[i].sem);
+    }
+
+    new_dirty_pages = ram_sync_claim_chunks(rs);
+
+    for (unsigned int i = 0; i < rs->sync_nworkers; i++) {
+        qemu_sem_wait(&rs->sync_done);
+    }
+    for (unsigned int i = 0; i < rs->sync_nworkers; i++) {
+        new_dirty_pages += rs->sync_workers[i].dirty_pages;
+    }
+
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1041,9 +1294,41 @@ static void migration_trigger_throttle(RAMState *rs)
     }
 }
 
-static void migration_bitmap_sync(RAMState *rs, bool last_stage)
+/*
+ * Count the deferred pages whose word was written again in the period that
+ * just ended.  Had they been sent, they would have to be sent again.
+ *
+ * Called with RCU critical section and bitmap_mutex held
+ */
+static void ram_defer_hot_sync(RAMState *rs, bool last_stage)
 {
+    uint64_t avoided = 0;
     RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long words = BITS_TO_LONGS(block->used_length >>
+                                            TARGET_PAGE_BITS);
+        unsigned long word;
+
+        for (word = find_first_bit(block->bmap_deferred, words);
+             word < words;
+             word = find_next_bit(block->bmap_deferred, words, word + 1)) {
+            if (block->bmap_heat[word] & 0x80) {
+                avoided += ctpopl(block->bmap[word]);
+            }
+        }
+        bitmap_zero(block->bmap_deferred, words);
+    }
+    stat64_add(&mig_stats.hot_resends_avoided, avoided);
+
+    /* Everything must go once the guest is stopped */
+    rs->defer_hot = !last_stage;
+    rs->defer_hot_resync = false;
+    rs->defer_hot_sync_pages = rs->target_page_count;
+}
+
+static void migration_bitmap_sync(RAMState *rs, bool last_stage)
+{
     int64_t end_time;
 
     stat64_add(&mig_stats.dirty_sync_count, 1);
@@ -1057,8 +1342,9 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
     WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
         WITH_RCU_READ_LOCK_GUARD() {
-            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-                ramblock_sync_dirty_bitmap(rs, block);
+            ram_sync_dirty_bitmaps(rs);
+            if (migrate_defer_hot_pages()) {
+                ram_defer_hot_sync(rs, last_stage);
             }
             stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
         }
@@ -1164,6 +1450,9 @@ static int save_zero_page(RAMState *rs, PageSearchStatus *pss,
         XBZRLE_cache_lock();
         xbzrle_cache_zero_page(pss->block->offset + offset);
         XBZRLE_cache_unlock();
+    } else if (migrate_multifd() &&
+               migrate_multifd_compression() == MULTIFD_COMPRESSION_XBZRLE) {
+        multifd_xbzrle_zero_page(pss->block->offset + offset);
     }
 
     return len;
@@ -1290,6 +1579,25 @@ static int ram_save_multifd_page(RAMBlock *block, ram_addr_t offset)
 #define PAGE_ALL_CLEAN 0
 #define PAGE_TRY_AGAIN 1
 #define PAGE_DIRTY_FOUND 2
+/*
+ * A whole round over RAM found nothing but hot pages.  If something was
+ * sent since the last dirty sync, report RAM as clean so that the next
+ * pending query syncs again, which may find more cold pages and lets hot
+ * pages cool down.  Otherwise only hot pages are left, so send them.
+ */
+static int ram_defer_hot_round_done(RAMState *rs, PageSearchStatus *pss)
+{
+    if (rs->target_page_count != rs->defer_hot_sync_pages) {
+        rs->defer_hot_resync = true;
+        return PAGE_ALL_CLEAN;
+    }
+
+    trace_ram_defer_hot_round_done(rs->migration_dirty_pages);
+    rs->defer_hot = false;
+    pss->complete_round = false;
+    return PAGE_TRY_AGAIN;
+}
+
 /**
  * find_dirty_block: find the next dirty page and update any state
  * associated with the search process.
@@ -1311,6 +1619,9 @@ static int find_dirty_block(RAMState *rs, PageSearchStatus *pss)
 
     if (pss->complete_round && pss->block == rs->last_seen_block &&
         pss->page >= rs->last_page) {
+        if (ram_defer_hot_active(rs) && rs->migration_dirty_pages) {
+            return ram_defer_hot_round_done(rs, pss);
+        }
         /*
          * We've been once around the RAM and haven't found anything.
          * Give up.
@@ -1925,14 +2236,13 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
      * rp-return thread.
      */
     if (postcopy_preempt_active()) {
-        ram_addr_t page_start = start >> TARGET_PAGE_BITS;
+        ram_addr_t offset = start;
         size_t page_size = qemu_ram_pagesize(ramblock);
         PageSearchStatus *pss = &ram_state->pss[RAM_CHANNEL_POSTCOPY];
         int ret = 0;
 
         qemu_mutex_lock(&rs->bitmap_mutex);
 
-        pss_init(pss, ramblock, page_start);
         /*
          * Always use the preempt channel, and make sure it's there.  It's
          * safe to access without lock, because when rp-thread is running
@@ -1947,22 +2257,22 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
          */
         assert(len % page_size == 0);
         while (len) {
+            /*
+             * ram_save_host_page_urgent() leaves pss->page on the next
+             * dirty page, which can be far beyond the request, or does not
+             * move it at all if precopy is sending the page.  Requests for
+             * more than one host page come from a destination that
+             * prefetches pages, so walk the range explicitly.
+             */
+            pss_init(pss, ramblock, offset >> TARGET_PAGE_BITS);
             if (ram_save_host_page_urgent(pss)) {
                 error_setg(errp, "ram_save_host_page_urgent() failed: "
                            "ramblock=%s, start_addr=0x"RAM_ADDR_FMT,
-                           ramblock->idstr, start);
+                           ramblock->idstr, offset);
                 ret = -1;
                 break;
             }
-            /*
-             * NOTE: after ram_save_host_page_urgent() succeeded, pss->page
-             * will automatically be moved and point to the next host page
-             * we're going to send, so no need to update here.
-             *
-             * Normally QEMU never sends >1 host page in requests, so
-             * logically we don't even need that as the loop should only
-             * run once, but just to be consistent.
-             */
+            offset += page_size;
             len -= page_size;
         };
         qemu_mutex_unlock(&rs->bitmap_mutex);
@@ -2326,6 +2636,7 @@ static void xbzrle_load_cleanup(void)
 static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
+        ram_sync_workers_stop(*rsp);
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
@@ -2361,6 +2672,10 @@ static void ram_bitmaps_destroy(void)
         block->bmap = NULL;
         g_free(block->file_bmap);
         block->file_bmap = NULL;
+        g_free(block->bmap_heat);
+        block->bmap_heat = NULL;
+        g_free(block->bmap_deferred);
+        block->bmap_deferred = NULL;
     }
 }
 
@@ -2689,6 +3004,23 @@ err_out:
     return false;
 }
 
+static ram_addr_t ram_sync_chunk_size(void)
+{
+    uint8_t shift = migrate_get_current()->ram_sync_chunk_shift;
+
+    if (shift > RAM_SYNC_CHUNK_SHIFT_MAX) {
+        error_report("ram_sync_chunk_shift (%u) too big, using "
+                     "max value (%u)", shift, RAM_SYNC_CHUNK_SHIFT_MAX);
+        shift = RAM_SYNC_CHUNK_SHIFT_MAX;
+    } else if (shift < RAM_SYNC_CHUNK_SHIFT_MIN) {
+        error_report("ram_sync_chunk_shift (%u) too small, using "
+                     "min value (%u)", shift, RAM_SYNC_CHUNK_SHIFT_MIN);
+        shift = RAM_SYNC_CHUNK_SHIFT_MIN;
+    }
+
+    return (ram_addr_t)TARGET_PAGE_SIZE << shift;
+}
+
 static bool ram_state_init(RAMState **rsp, Error **errp)
 {
     *rsp = g_try_new0(RAMState, 1);
@@ -2702,6 +3034,7 @@ static bool ram_state_init(RAMState **rsp, Error **errp)
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
     (*rsp)->ram_bytes_total = ram_bytes_total();
+    (*rsp)->sync_chunk_size = ram_sync_chunk_size();
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -2750,6 +3083,10 @@ static void ram_list_init_bitmaps(void)
             if (migrate_mapped_ram()) {
                 block->file_bmap = bitmap_new(pages);
             }
+            if (migrate_defer_hot_pages()) {
+                block->bmap_heat = g_new0(uint8_t, BITS_TO_LONGS(pages));
+                block->bmap_deferred = bitmap_new(BITS_TO_LONGS(pages));
+            }
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
         }
@@ -3034,6 +3371,22 @@ static int ram_save_setup(QEMUFile *f, void *opaque, Error **errp)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mode() == MIG_MODE_CPR_LOCAL) {
+                bool handoff = ram_block_is_handed_off(block);
+
+                qemu_put_byte(f, handoff);
+                if (handoff) {
+                    qemu_put_be64(f, block->fd_offset);
+                    trace_ram_save_handoff(block->idstr, block->fd);
+                    ret = qemu_file_put_fd(f, block->fd);
+                    if (ret < 0) {
+                        error_setg(errp, "%s: failed to pass the file of "
+                                   "RAM block %s: %s", __func__, block->idstr,
+                                   strerror(-ret));
+                        return ret;
+                    }
+                }
+            }
 
             if (migrate_mapped_ram()) {
                 mapped_ram_setup_ramblock(f, block);
@@ -3312,6 +3665,14 @@ static void ram_state_pending_estimate(void *opaque, uint64_t *must_precopy,
 
     uint64_t remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
 
+    /*
+     * Only deferred hot pages are left until the next dirty sync, make the
+     * caller ask for the exact value.
+     */
+    if (rs->defer_hot_resync && ram_defer_hot_active(rs)) {
+        remaining_size = 0;
+    }
+
     if (migrate_postcopy_ram()) {
         /* We can do postcopy, and all the data is postcopiable */
         *can_postcopy += remaining_size;
@@ -3906,6 +4267,460 @@ static size_t ram_load_multifd_pages(void *host_addr, size_t size,
     return size;
 }
 
+#ifdef CONFIG_LINUX
+/*
+ * On-demand restore from a mapped-ram file
+ *
+ * Instead of reading all of RAM before the guest can start, RAM blocks
+ * are registered with userfaultfd and filled by a thread: pages that are
+ * touched are read from the file when they fault, the others are read in
+ * file order in the background.  The migration file is kept open until
+ * then, and migration is blocked so that it cannot be overwritten.
+ *
+ * Only private anonymous blocks are restored this way, the others are
+ * read before the guest starts as usual.
+ */
+typedef struct RAMOnDemandBlock {
+    RAMBlock *block;
+    uint64_t pages_offset;
+    ram_addr_t length;
+    /* Target pages that have data in the file */
+    unsigned long *file_bmap;
+    /* Host pages that were already placed */
+    unsigned long *done_bmap;
+    unsigned long nr_host_pages;
+} RAMOnDemandBlock;
+
+typedef struct RAMOnDemand {
+    int uffd;
+    /* Duplicate of the migration file descriptor */
+    int fd;
+    GArray *blocks;
+    /* Position of the background fill */
+    guint cursor_block;
+    unsigned long cursor;
+    uint8_t *buf;
+    QemuThread thread;
+    Error *blocker;
+    uint64_t faults;
+    int64_t start_time;
+} RAMOnDemand;
+
+static RAMOnDemand *ram_on_demand;
+
+static void ram_on_demand_unregister(RAMOnDemand *od)
+{
+    guint i;
+
+    for (i = 0; i < od->blocks->len; i++) {
+        RAMOnDemandBlock *odb = &g_array_index(od->blocks, RAMOnDemandBlock, i);
+
+        uffd_unregister_memory(od->uffd, odb->block->host, odb->length);
+    }
+}
+
+static void ram_on_demand_free(RAMOnDemand *od)
+{
+    guint i;
+
+    for (i = 0; i < od->blocks->len; i++) {
+        RAMOnDemandBlock *odb = &g_array_index(od->blocks, RAMOnDemandBlock, i);
+
+        memory_region_unref(odb->block->mr);
+        g_free(odb->file_bmap);
+        g_free(odb->done_bmap);
+    }
+    g_array_free(od->blocks, true);
+    qemu_vfree(od->buf);
+    close(od->fd);
+    uffd_close_fd(od->uffd);
+    g_free(od);
+}
+
+/**
+ * ram_on_demand_add: register a RAM block to be restored on demand
+ *
+ * Returns true if the block was registered, false if it must be read
+ * right away.
+ *
+ * @f: QEMUFile of the migration file
+ * @block: RAM block to restore
+ * @length: length of the block in the file
+ * @pages_offset: file offset of the pages of the block
+ * @bitmap: pages present in the file, taken over on success
+ */
+static bool ram_on_demand_add(QEMUFile *f, RAMBlock *block, ram_addr_t length,
+                              uint64_t pages_offset, unsigned long **bitmap)
+{
+    const uint64_t ioctls_mask = BIT(_UFFDIO_COPY) | BIT(_UFFDIO_ZEROPAGE);
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    RAMOnDemand *od = ram_on_demand;
+    RAMOnDemandBlock odb = {};
+    uint64_t ioctls;
+
+    /*
+     * The pages are discarded below, which devices that pin RAM, such as
+     * VFIO, do not allow: read them right away instead.
+     */
+    if (ram_block_discard_is_disabled()) {
+        trace_ram_on_demand_skip(block->idstr);
+        return false;
+    }
+
+    if (block->fd >= 0 || qemu_ram_is_shared(block) ||
+        block->page_size != qemu_real_host_page_size() ||
+        length > block->used_length ||
+        !QEMU_IS_ALIGNED(length, block->page_size) ||
+        !QEMU_IS_ALIGNED(pages_offset, block->page_size) ||
+        !object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        trace_ram_on_demand_skip(block->idstr);
+        return false;
+    }
+
+    if (!od) {
+        od = g_new0(RAMOnDemand, 1);
+        od->uffd = uffd_create_fd(0, true);
+        if (od->uffd < 0) {
+            g_free(od);
+            trace_ram_on_demand_skip(block->idstr);
+            return false;
+        }
+        od->fd = dup(QIO_CHANNEL_FILE(ioc)->fd);
+        if (od->fd < 0) {
+            uffd_close_fd(od->uffd);
+            g_free(od);
+            trace_ram_on_demand_skip(block->idstr);
+            return false;
+        }
+        od->blocks = g_array_new(false, true, sizeof(RAMOnDemandBlock));
+        /* Aligned for O_DIRECT, like the buffers of the multifd channels */
+        od->buf = qemu_memalign(qemu_real_host_page_size(),
+                                MAPPED_RAM_LOAD_BUF_SIZE);
+        ram_on_demand = od;
+    }
+
+    /* Pages populated since the block was allocated would not fault */
+    if (ram_block_discard_range(block, 0, length) ||
+        uffd_register_memory(od->uffd, block->host, length,
+                             UFFDIO_REGISTER_MODE_MISSING, &ioctls)) {
+        trace_ram_on_demand_skip(block->idstr);
+        return false;
+    }
+    if ((ioctls & ioctls_mask) != ioctls_mask) {
+        uffd_unregister_memory(od->uffd, block->host, length);
+        trace_ram_on_demand_skip(block->idstr);
+        return false;
+    }
+
+    memory_region_ref(block->mr);
+    odb.block = block;
+    odb.pages_offset = pages_offset;
+    odb.length = length;
+    odb.file_bmap = g_steal_pointer(bitmap);
+    odb.nr_host_pages = length / block->page_size;
+    odb.done_bmap = bitmap_new(odb.nr_host_pages);
+    g_array_append_val(od->blocks, odb);
+
+    trace_ram_on_demand_add(block->idstr, length);
+    return true;
+}
+
+static int ram_on_demand_pread(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+    while (len) {
+        ssize_t ret = pread(fd, buf, len, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (!ret) {
+            /* The file was truncated */
+            return -EIO;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+/*
+ * Read @len bytes of the block at @offset into od->buf, with zeroes for
+ * the pages that are not in the file.
+ *
+ * Returns 1 if data was read, 0 if the range is all zeroes (od->buf is
+ * then left untouched), or negative errno.
+ */
+static int ram_on_demand_read(RAMOnDemand *od, RAMOnDemandBlock *odb,
+                              ram_addr_t offset, size_t len)
+{
+    unsigned long first = offset >> TARGET_PAGE_BITS;
+    unsigned long last = (offset + len) >> TARGET_PAGE_BITS;
+    unsigned long set_bit_idx, clear_bit_idx;
+    size_t pos = 0;
+    int ret;
+
+    for (set_bit_idx = find_next_bit(odb->file_bmap, last, first);
+         set_bit_idx < last;
+         set_bit_idx = find_next_bit(odb->file_bmap, last, clear_bit_idx + 1)) {
+        size_t start, end;
+
+        clear_bit_idx = find_next_zero_bit(odb->file_bmap, last,
+                                           set_bit_idx + 1);
+        start = (set_bit_idx - first) << TARGET_PAGE_BITS;
+        end = (clear_bit_idx - first) << TARGET_PAGE_BITS;
+
+        memset(od->buf + pos, 0, start - pos);
+        ret = ram_on_demand_pread(od->fd, od->buf + start, end - start,
+                                  odb->pages_offset + offset + start);
+        if (ret) {
+            return ret;
+        }
+        pos = end;
+    }
+
+    if (!pos) {
+        return 0;
+    }
+    memset(od->buf + pos, 0, len - pos);
+    return 1;
+}
+
+/*
+ * Resolve missing pages at @host with @from, or with zeroes if @from is
+ * NULL.  Pages that are already present are left alone.
+ */
+static int ram_on_demand_place(RAMOnDemand *od, uint8_t *host,
+                               uint8_t *from, size_t len)
+{
+    size_t page_size = qemu_real_host_page_size();
+
+    while (len) {
+        int64_t done;
+        int ret;
+
+        if (from) {
+            struct uffdio_copy copy = {
+                .dst = (uintptr_t)host,
+                .src = (uintptr_t)from,
+                .len = len,
+            };
+
+            ret = ioctl(od->uffd, UFFDIO_COPY, &copy);
+            done = copy.copy;
+        } else {
+            struct uffdio_zeropage zero = {
+                .range.start = (uintptr_t)host,
+                .range.len = len,
+            };
+
+            ret = ioctl(od->uffd, UFFDIO_ZEROPAGE, &zero);
+            done = zero.zeropage;
+        }
+        if (!ret) {
+            return 0;
+        }
+
+        if (done <= 0) {
+            if (errno == EAGAIN) {
+                continue;
+            }
+            if (errno != EEXIST) {
+                return -errno;
+            }
+            done = page_size;
+        }
+        host += done;
+        from = from ? from + done : NULL;
+        len -= done;
+    }
+    return 0;
+}
+
+/* Place @nr host pages of the block from @page, none of them placed yet */
+static int ram_on_demand_fill(RAMOnDemand *od, RAMOnDemandBlock *odb,
+                              unsigned long page, unsigned long nr)
+{
+    ram_addr_t offset = (ram_addr_t)page * odb->block->page_size;
+    size_t len = nr * odb->block->page_size;
+    int ret;
+
+    ret = ram_on_demand_read(od, odb, offset, len);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = ram_on_demand_place(od, odb->block->host + offset,
+                              ret ? od->buf : NULL, len);
+    if (ret) {
+        return ret;
+    }
+    bitmap_set(odb->done_bmap, page, nr);
+    return 0;
+}
+
+static int ram_on_demand_fault(RAMOnDemand *od, uint8_t *addr)
+{
+    RAMOnDemandBlock *odb = NULL;
+    unsigned long page;
+    guint i;
+
+    for (i = 0; i < od->blocks->len; i++) {
+        odb = &g_array_index(od->blocks, RAMOnDemandBlock, i);
+        if (addr >= odb->block->host &&
+            addr < odb->block->host + odb->length) {
+            break;
+        }
+    }
+    if (i == od->blocks->len) {
+        return -EFAULT;
+    }
+
+    page = (addr - odb->block->host) / odb->block->page_size;
+    if (test_bit(page, odb->done_bmap)) {
+        /* Placed earlier, then discarded: it reads as zeroes now */
+        return ram_on_demand_place(od, odb->block->host +
+                                   page * odb->block->page_size,
+                                   NULL, odb->block->page_size);
+    }
+
+    od->faults++;
+    trace_ram_on_demand_fault(odb->block->idstr,
+                              (uint64_t)page * odb->block->page_size);
+    return ram_on_demand_fill(od, odb, page, 1);
+}
+
+/*
+ * Place the next chunk of pages that did not fault.
+ *
+ * Returns 1 once all pages are placed, 0 if there are more, or negative
+ * errno.
+ */
+static int ram_on_demand_fill_next(RAMOnDemand *od)
+{
+    while (od->cursor_block < od->blocks->len) {
+        RAMOnDemandBlock *odb = &g_array_index(od->blocks, RAMOnDemandBlock,
+                                               od->cursor_block);
+        unsigned long max = MAPPED_RAM_LOAD_BUF_SIZE / odb->block->page_size;
+        unsigned long start, end;
+
+        start = find_next_zero_bit(odb->done_bmap, odb->nr_host_pages,
+                                   od->cursor);
+        if (start >= odb->nr_host_pages) {
+            od->cursor_block++;
+            od->cursor = 0;
+            continue;
+        }
+        end = find_next_bit(odb->done_bmap,
+                            MIN(odb->nr_host_pages, start + max), start);
+        od->cursor = end;
+        return ram_on_demand_fill(od, odb, start, end - start);
+    }
+    return 1;
+}
+
+static void ram_on_demand_finish_bh(void *opaque)
+{
+    RAMOnDemand *od = opaque;
+
+    qemu_thread_join(&od->thread);
+    migrate_del_blocker(&od->blocker);
+    ram_on_demand_free(od);
+}
+
+static void *ram_on_demand_thread(void *opaque)
+{
+    RAMOnDemand *od = opaque;
+    struct uffd_msg msgs[16];
+    int ret;
+
+    /*
+     * Faults are served between chunks of the background fill, which
+     * bounds how long a vCPU waits for a page to about one chunk read.
+     */
+    do {
+        int n = uffd_read_events(od->uffd, msgs, ARRAY_SIZE(msgs));
+
+        ret = n < 0 ? -EIO : 0;
+        for (int i = 0; i < n && !ret; i++) {
+            if (msgs[i].event == UFFD_EVENT_PAGEFAULT) {
+                ret = ram_on_demand_fault(od, (uint8_t *)(uintptr_t)
+                                          msgs[i].arg.pagefault.address);
+            }
+        }
+        if (!ret) {
+            ret = ram_on_demand_fill_next(od);
+        }
+    } while (!ret);
+
+    if (ret < 0) {
+        /* The guest cannot go on without its memory */
+        error_report("Restoring RAM from the migration file failed: %s",
+                     strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    trace_ram_on_demand_complete(od->faults,
+                                 qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                                 od->start_time);
+
+    /* Unregistering wakes up any fault that arrived in the meantime */
+    ram_on_demand_unregister(od);
+
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), ram_on_demand_finish_bh,
+                            od);
+    return NULL;
+}
+
+/**
+ * ram_on_demand_start: start filling the blocks registered by
+ *   ram_on_demand_add()
+ *
+ * Returns 0 on success, negative errno on error
+ */
+static int ram_on_demand_start(void)
+{
+    RAMOnDemand *od = g_steal_pointer(&ram_on_demand);
+    Error *local_err = NULL;
+
+    if (!od) {
+        return 0;
+    }
+    if (!od->blocks->len) {
+        ram_on_demand_free(od);
+        return 0;
+    }
+
+    error_setg(&od->blocker, "RAM is still being restored from the "
+               "migration file");
+    if (migrate_add_blocker_internal(&od->blocker, &local_err) < 0) {
+        error_report_err(local_err);
+        ram_on_demand_unregister(od);
+        ram_on_demand_free(od);
+        return -EBUSY;
+    }
+
+    trace_ram_on_demand_start(od->blocks->len);
+    od->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_thread_create(&od->thread, MIGRATION_THREAD_DST_ON_DEMAND,
+                       ram_on_demand_thread, od, QEMU_THREAD_JOINABLE);
+    return 0;
+}
+#else
+static bool ram_on_demand_add(QEMUFile *f, RAMBlock *block, ram_addr_t length,
+                              uint64_t pages_offset, unsigned long **bitmap)
+{
+    return false;
+}
+
+static int ram_on_demand_start(void)
+{
+    return 0;
+}
+#endif /* CONFIG_LINUX */
+
 static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
                                      long num_pages, unsigned long *bitmap,
                                      Error **errp)
@@ -3998,8 +4813,12 @@ static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
         return;
     }
 
-    if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
-        return;
+    /* Blocks restored on demand are read after ram_on_demand_start() */
+    if (!migrate_mapped_ram_on_demand() ||
+        !ram_on_demand_add(f, block, length, block->pages_offset, &bitmap)) {
+        if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
+            return;
+        }
     }
 
     /* Skip pages array */
@@ -4067,6 +4886,33 @@ static int parse_ramblock(QEMUFile *f, RAMBlock *block, ram_addr_t length)
             return -EINVAL;
         }
     }
+    if (migrate_mode() == MIG_MODE_CPR_LOCAL) {
+        bool handoff = qemu_get_byte(f);
+
+        if (handoff != ram_block_is_handed_off(block)) {
+            error_report("Block %s is %s by the source, but %s backed by "
+                         "a shared file here", block->idstr,
+                         handoff ? "handed over" : "copied",
+                         handoff ? "not" : "is");
+            return -EINVAL;
+        }
+        if (handoff) {
+            off_t fd_offset = qemu_get_be64(f);
+            int fd = qemu_file_get_fd(f);
+
+            if (fd < 0) {
+                error_report("Cannot receive the file of block %s",
+                             block->idstr);
+                return -EINVAL;
+            }
+            if (!qemu_ram_replace_fd(block, fd, fd_offset, &local_err)) {
+                close(fd);
+                error_report_err(local_err);
+                return -EINVAL;
+            }
+            trace_ram_load_handoff(block->idstr, fd);
+        }
+    }
     ret = rdma_block_notification_handle(f, block->idstr);
     if (ret < 0) {
         qemu_file_set_error(f, ret);
@@ -4101,6 +4947,10 @@ static int parse_ramblocks(QEMUFile *f, ram_addr_t total_ram_bytes)
         total_ram_bytes -= length;
     }
 
+    if (!ret && migrate_mapped_ram_on_demand()) {
+        ret = ram_on_demand_start();
+    }
+
     return ret;
 }
 
@@ -55,6 +55,7 @@
 #include "qemu/main-loop.h"
 #include "block/snapshot.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "io/channel-buffer.h"
 #include "io/channel-file.h"
 #include "sysemu/replay.h"
@@ -90,6 +91,8 @@ enum qemu_vm_cmd {
     MIG_CMD_ENABLE_COLO,       /* Enable COLO */
     MIG_CMD_POSTCOPY_RESUME,   /* resume postcopy on dest */
     MIG_CMD_RECV_BITMAP,       /* Request for recved bitmap on dst */
+    MIG_CMD_DEVICE_STATE,      /* Chunk of a section to load concurrently */
+    MIG_CMD_DEVICE_STATE_END,  /* Wait for the concurrent sections */
     MIG_CMD_MAX
 };
 
@@ -109,6 +112,8 @@ static struct mig_cmd_args {
     [MIG_CMD_POSTCOPY_RESUME]  = { .len =  0, .name = "POSTCOPY_RESUME" },
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
     [MIG_CMD_RECV_BITMAP]      = { .len = -1, .name = "RECV_BITMAP" },
+    [MIG_CMD_DEVICE_STATE]     = { .len =  8, .name = "DEVICE_STATE" },
+    [MIG_CMD_DEVICE_STATE_END] = { .len =  4, .name = "DEVICE_STATE_END" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -1470,25 +1475,250 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
-static
-int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
+static bool save_live_complete_precopy_needed(SaveStateEntry *se,
+                                              bool in_postcopy)
 {
-    int64_t start_ts_each, end_ts_each;
+    if (!se->ops ||
+        (in_postcopy && se->ops->has_postcopy &&
+         se->ops->has_postcopy(se->opaque)) ||
+        !se->ops->save_live_complete_precopy) {
+        return false;
+    }
+
+    if (se->ops->is_active) {
+        if (!se->ops->is_active(se->opaque)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * MIG_CMD_DEVICE_STATE carries a chunk of at most DEVICE_STATE_CHUNK_SIZE bytes
+ * of a QEMU_VM_SECTION_END section, footer included:
+ *
+ *   be32 flags (DEVICE_STATE_LAST on the last chunk of the section)
+ *   be32 length
+ *   length bytes
+ *
+ * The chunks of a section are not interleaved with other device state.  The
+ * destination loads each section in a thread of its own once it has been
+ * received completely, and waits for all of them at MIG_CMD_DEVICE_STATE_END,
+ * whose argument is the number of sections that were sent.
+ */
+#define DEVICE_STATE_CHUNK_SIZE (1 * MiB)
+#define DEVICE_STATE_LAST       1
+
+/*
+ * State of a device that completes precopy in a thread of its own, see
+ * SaveVMHandlers.complete_precopy_parallel.  The section is written to a
+ * buffer, which the migration thread sends as soon as the thread is done.
+ */
+typedef struct SaveDeviceThread {
     SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    QEMUFile *file;
+    QemuThread thread;
+    QemuSemaphore *done_sem;
+    bool done; /* atomic */
+    bool sent;
     int ret;
+} SaveDeviceThread;
 
-    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
-        if (!se->ops ||
-            (in_postcopy && se->ops->has_postcopy &&
-             se->ops->has_postcopy(se->opaque)) ||
-            !se->ops->save_live_complete_precopy) {
+static void *qemu_savevm_device_thread(void *opaque)
+{
+    SaveDeviceThread *dt = opaque;
+    SaveStateEntry *se = dt->se;
+    int64_t start_ts, end_ts;
+    int ret;
+
+    rcu_register_thread();
+
+    start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    trace_savevm_section_start(se->idstr, se->section_id);
+
+    save_section_header(dt->file, se, QEMU_VM_SECTION_END);
+
+    ret = se->ops->save_live_complete_precopy(dt->file, se->opaque);
+    trace_savevm_section_end(se->idstr, se->section_id, ret);
+    save_section_footer(dt->file, se);
+    if (!ret) {
+        ret = qemu_fflush(dt->file);
+    }
+    dt->ret = ret;
+
+    end_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    trace_vmstate_downtime_save("iterable", se->idstr, se->instance_id,
+                                end_ts - start_ts);
+
+    qatomic_store_release(&dt->done, true);
+    qemu_sem_post(dt->done_sem);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void qemu_savevm_device_thread_start(SaveDeviceThread *dt,
+                                            SaveStateEntry *se, int id,
+                                            QemuSemaphore *done_sem)
+{
+    g_autofree char *name = g_strdup_printf(MIGRATION_THREAD_SRC_DEVICE, id);
+
+    dt->se = se;
+    dt->done_sem = done_sem;
+    dt->bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(dt->bioc), "migration-device-buffer");
+    dt->file = qemu_file_new_output(QIO_CHANNEL(dt->bioc));
+    object_unref(OBJECT(dt->bioc));
+
+    qemu_thread_create(&dt->thread, name, qemu_savevm_device_thread, dt,
+                       QEMU_THREAD_JOINABLE);
+}
+
+static void qemu_savevm_device_thread_free(gpointer opaque)
+{
+    SaveDeviceThread *dt = opaque;
+
+    if (dt->file) {
+        qemu_fclose(dt->file);
+    }
+    g_free(dt);
+}
+
+/* Send the section of a device thread in MIG_CMD_DEVICE_STATE chunks */
+static int qemu_savevm_send_device_state(QEMUFile *f, SaveDeviceThread *dt)
+{
+    QIOChannelBuffer *bioc = dt->bioc;
+    size_t offset = 0;
+
+    trace_savevm_send_device_state(dt->se->idstr, bioc->usage);
+
+    do {
+        size_t len = MIN(bioc->usage - offset, DEVICE_STATE_CHUNK_SIZE);
+        uint32_t buf[2];
+
+        buf[0] = cpu_to_be32(offset + len == bioc->usage ?
+                             DEVICE_STATE_LAST : 0);
+        buf[1] = cpu_to_be32(len);
+        qemu_savevm_command_send(f, MIG_CMD_DEVICE_STATE, sizeof(buf),
+                                 (uint8_t *)buf);
+        qemu_put_buffer(f, bioc->data + offset, len);
+        offset += len;
+    } while (offset < bioc->usage && !qemu_file_get_error(f));
+
+    /* Release the buffer */
+    qemu_fclose(dt->file);
+    dt->file = NULL;
+
+    return qemu_file_get_error(f);
+}
+
+/*
+ * Send the sections of the device threads that are done and have not been
+ * sent yet.  Returns the number of sections that are still to be sent, or
+ * a negative value if a thread or the stream failed.
+ */
+static int qemu_savevm_send_done_device_state(QEMUFile *f, GPtrArray *threads)
+{
+    int pending = 0;
+    guint i;
+    int ret;
+
+    for (i = 0; i < threads->len; i++) {
+        SaveDeviceThread *dt = g_ptr_array_index(threads, i);
+
+        if (dt->sent) {
+            continue;
+        }
+        if (!qatomic_load_acquire(&dt->done)) {
+            pending++;
             continue;
         }
 
-        if (se->ops->is_active) {
-            if (!se->ops->is_active(se->opaque)) {
+        dt->sent = true;
+        if (dt->ret < 0) {
+            qemu_file_set_error(f, dt->ret);
+            return dt->ret;
+        }
+        ret = qemu_savevm_send_device_state(f, dt);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return pending;
+}
+
+/*
+ * Wait for the device threads, sending their sections as they finish, then
+ * send MIG_CMD_DEVICE_STATE_END.  Nothing more is sent if @send is false,
+ * or if a thread or the stream failed.
+ */
+static int qemu_savevm_complete_device_state(QEMUFile *f, GPtrArray *threads,
+                                             QemuSemaphore *done_sem,
+                                             bool send)
+{
+    uint32_t count;
+    int ret = 0;
+    guint i;
+
+    if (send) {
+        while ((ret = qemu_savevm_send_done_device_state(f, threads)) > 0) {
+            /* Every thread posts once after it is done */
+            qemu_sem_wait(done_sem);
+        }
+    }
+
+    for (i = 0; i < threads->len; i++) {
+        SaveDeviceThread *dt = g_ptr_array_index(threads, i);
+
+        qemu_thread_join(&dt->thread);
+    }
+
+    if (ret < 0 || !send) {
+        return ret;
+    }
+
+    trace_savevm_send_device_state_end(threads->len);
+    count = cpu_to_be32(threads->len);
+    qemu_savevm_command_send(f, MIG_CMD_DEVICE_STATE_END, 4,
+                             (uint8_t *)&count);
+
+    return qemu_file_get_error(f);
+}
+
+static
+int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
+{
+    g_autoptr(GPtrArray) threads =
+        g_ptr_array_new_with_free_func(qemu_savevm_device_thread_free);
+    bool parallel = migrate_parallel_device_state() && !in_postcopy;
+    int64_t start_ts_each, end_ts_each;
+    QemuSemaphore done_sem;
+    SaveStateEntry *se;
+    int ret = 0;
+
+    if (parallel) {
+        qemu_sem_init(&done_sem, 0);
+        QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+            SaveDeviceThread *dt;
+
+            if (!se->ops || !se->ops->complete_precopy_parallel ||
+                !save_live_complete_precopy_needed(se, in_postcopy)) {
                 continue;
             }
+
+            dt = g_new0(SaveDeviceThread, 1);
+            qemu_savevm_device_thread_start(dt, se, threads->len, &done_sem);
+            g_ptr_array_add(threads, dt);
+        }
+    }
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (!save_live_complete_precopy_needed(se, in_postcopy) ||
+            (parallel && se->ops->complete_precopy_parallel)) {
+            continue;
         }
 
         start_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
@@ -1501,11 +1731,32 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
         save_section_footer(f, se);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return -1;
+            break;
         }
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         trace_vmstate_downtime_save("iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
+
+        /* Do not keep the state of devices that are done in memory */
+        if (threads->len) {
+            ret = qemu_savevm_send_done_device_state(f, threads);
+            if (ret < 0) {
+                break;
+            }
+            ret = 0;
+        }
+    }
+
+    if (parallel) {
+        /* Always wait for the device threads, even if another device failed */
+        if (qemu_savevm_complete_device_state(f, threads, &done_sem,
+                                              ret == 0) < 0) {
+            ret = -1;
+        }
+        qemu_sem_destroy(&done_sem);
+    }
+    if (ret < 0) {
+        return -1;
     }
 
     trace_vmstate_downtime_checkpoint("src-iterable-saved");
@@ -2412,6 +2663,198 @@ static int loadvm_process_enable_colo(MigrationIncomingState *mis)
     return ret;
 }
 
+static int qemu_loadvm_section_part_end(QEMUFile *f, uint8_t type);
+
+/*
+ * State of a section from MIG_CMD_DEVICE_STATE, loaded in a thread of its
+ * own.
+ */
+typedef struct LoadDeviceThread {
+    QIOChannelBuffer *bioc;
+    QemuThread thread;
+    int ret;
+} LoadDeviceThread;
+
+static void *loadvm_device_thread(void *opaque)
+{
+    LoadDeviceThread *dt = opaque;
+    QEMUFile *f;
+
+    rcu_register_thread();
+
+    f = qemu_file_new_input(QIO_CHANNEL(dt->bioc));
+    dt->ret = qemu_loadvm_section_part_end(f, qemu_get_byte(f));
+    qemu_fclose(f);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Only sections of devices that asked for it may be loaded concurrently;
+ * anything else in MIG_CMD_DEVICE_STATE is a broken stream.
+ */
+static bool loadvm_device_state_check(QIOChannelBuffer *bioc)
+{
+    uint32_t section_id;
+    SaveStateEntry *se;
+
+    if (bioc->usage < 5 || bioc->data[0] != QEMU_VM_SECTION_END) {
+        error_report("CMD_DEVICE_STATE: Invalid section");
+        return false;
+    }
+
+    section_id = ldl_be_p(bioc->data + 1);
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->load_section_id == section_id) {
+            break;
+        }
+    }
+    if (!se || !se->ops || !se->ops->complete_precopy_parallel) {
+        error_report("CMD_DEVICE_STATE: Section %u cannot be loaded in "
+                     "parallel", section_id);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Sections from MIG_CMD_DEVICE_STATE: the one being received, and the threads
+ * loading the ones that were received completely.
+ */
+static struct {
+    QIOChannelBuffer *bioc;
+    GPtrArray *threads;
+} loadvm_device_state;
+
+/* Wait for the device threads, returns the first error */
+static int loadvm_device_state_join(void)
+{
+    GPtrArray *threads = loadvm_device_state.threads;
+    int ret = 0;
+    guint i;
+
+    if (loadvm_device_state.bioc) {
+        object_unref(OBJECT(loadvm_device_state.bioc));
+        loadvm_device_state.bioc = NULL;
+    }
+    if (!threads) {
+        return 0;
+    }
+
+    for (i = 0; i < threads->len; i++) {
+        LoadDeviceThread *dt = g_ptr_array_index(threads, i);
+
+        qemu_thread_join(&dt->thread);
+        object_unref(OBJECT(dt->bioc));
+        if (dt->ret < 0 && !ret) {
+            ret = dt->ret;
+        }
+        g_free(dt);
+    }
+    g_ptr_array_free(threads, true);
+    loadvm_device_state.threads = NULL;
+
+    return ret;
+}
+
+/*
+ * Receive a chunk of a section to be loaded concurrently, see
+ * DEVICE_STATE_CHUNK_SIZE for the format.  Once the last chunk is in, the
+ * section is loaded by a thread while the stream goes on.
+ *
+ * Returns: Negative values on error
+ */
+static int loadvm_handle_device_state(MigrationIncomingState *mis)
+{
+    QEMUFile *f = mis->from_src_file;
+    QIOChannelBuffer *bioc;
+    LoadDeviceThread *dt;
+    g_autofree char *name = NULL;
+    uint32_t flags, length;
+    size_t ret;
+
+    flags = qemu_get_be32(f);
+    length = qemu_get_be32(f);
+    trace_loadvm_handle_device_state(flags, length);
+
+    if (flags & ~DEVICE_STATE_LAST || length > DEVICE_STATE_CHUNK_SIZE) {
+        error_report("CMD_DEVICE_STATE: Invalid flags 0x%x or length %u",
+                     flags, length);
+        return -EINVAL;
+    }
+
+    if (!loadvm_device_state.bioc) {
+        loadvm_device_state.bioc = qio_channel_buffer_new(length);
+        qio_channel_set_name(QIO_CHANNEL(loadvm_device_state.bioc),
+                             "migration-device-buffer");
+    }
+    bioc = loadvm_device_state.bioc;
+    if (bioc->capacity - bioc->usage < length) {
+        bioc->capacity = bioc->usage + length;
+        bioc->data = g_realloc(bioc->data, bioc->capacity);
+    }
+
+    ret = qemu_get_buffer(f, bioc->data + bioc->usage, length);
+    if (ret != length) {
+        error_report("CMD_DEVICE_STATE: Buffer receive fail ret=%zu "
+                     "length=%u", ret, length);
+        return qemu_file_get_error(f) ?: -EIO;
+    }
+    bioc->usage += length;
+
+    if (!(flags & DEVICE_STATE_LAST)) {
+        return 0;
+    }
+
+    if (!loadvm_device_state_check(bioc)) {
+        return -EINVAL;
+    }
+    loadvm_device_state.bioc = NULL;
+
+    if (!loadvm_device_state.threads) {
+        loadvm_device_state.threads = g_ptr_array_new();
+    }
+    dt = g_new0(LoadDeviceThread, 1);
+    dt->bioc = bioc;
+    name = g_strdup_printf(MIGRATION_THREAD_DST_DEVICE,
+                           loadvm_device_state.threads->len);
+    qemu_thread_create(&dt->thread, name, loadvm_device_thread, dt,
+                       QEMU_THREAD_JOINABLE);
+    g_ptr_array_add(loadvm_device_state.threads, dt);
+
+    return 0;
+}
+
+/*
+ * Wait for the sections from MIG_CMD_DEVICE_STATE to be loaded; @count is
+ * the number of sections the source sent.
+ *
+ * Returns: Negative values on error
+ */
+static int loadvm_handle_device_state_end(MigrationIncomingState *mis)
+{
+    uint32_t count = qemu_get_be32(mis->from_src_file);
+    uint32_t started = loadvm_device_state.threads ?
+                       loadvm_device_state.threads->len : 0;
+    bool partial = loadvm_device_state.bioc;
+    int ret;
+
+    trace_loadvm_handle_device_state_end(count);
+
+    ret = loadvm_device_state_join();
+    if (ret < 0) {
+        return ret;
+    }
+    if (partial || count != started) {
+        error_report("CMD_DEVICE_STATE_END: %u sections sent, %u received%s",
+                     count, started, partial ? " and a partial one" : "");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
 /*
  * Process an incoming 'QEMU_VM_COMMAND'
  * 0           just a normal return
@@ -2508,6 +2951,12 @@ static int loadvm_process_command(QEMUFile *f)
     case MIG_CMD_RECV_BITMAP:
         return loadvm_handle_recv_bitmap(mis, len);
 
+    case MIG_CMD_DEVICE_STATE:
+        return loadvm_handle_device_state(mis);
+
+    case MIG_CMD_DEVICE_STATE_END:
+        return loadvm_handle_device_state_end(mis);
+
     case MIG_CMD_ENABLE_COLO:
         return loadvm_process_enable_colo(mis);
     }
@@ -2955,6 +3404,10 @@ int qemu_loadvm_state(QEMUFile *f)
     cpu_synchronize_all_pre_loadvm();
 
     ret = qemu_loadvm_state_main(f, mis);
+    /* Device threads are left running if the stream ended early */
+    if (loadvm_device_state_join() < 0 && ret == 0) {
+        ret = -EINVAL;
+    }
     qemu_event_set(&mis->main_thread_load_event);
 
     trace_qemu_loadvm_state_post_main(ret);
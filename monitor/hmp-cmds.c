@@ -200,6 +200,13 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
         monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
+        monitor_printf(mon, "  poll-latency-target-ns=%" PRId64 "\n",
+                       value->poll_latency_target_ns);
+        monitor_printf(mon, "  poll-cpu-budget=%" PRId64 "\n",
+                       value->poll_cpu_budget);
+        monitor_printf(mon, "  poll-ns=%" PRId64 "\n", value->poll_ns);
+        monitor_printf(mon, "  poll-wasted-ns=%" PRIu64 "\n",
+                       value->poll_wasted_ns);
         monitor_printf(mon, "  aio-max-batch=%" PRId64 "\n",
                        value->aio_max_batch);
     }
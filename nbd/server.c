@@ -83,8 +83,41 @@ struct NBDRequestData {
     NBDClient *client;
     uint8_t *data;
     bool complete;
+    bool zero_copy; /* data may have been sent with MSG_ZEROCOPY */
 };
 
+/*
+ * Payload sent with MSG_ZEROCOPY that the kernel may still be reading from.
+ * It is freed once sioc->zero_copy_sent reaches @seq.
+ */
+typedef struct NBDZeroCopyBuf {
+    void *data;
+    ssize_t seq;
+    QSIMPLEQ_ENTRY(NBDZeroCopyBuf) next;
+} NBDZeroCopyBuf;
+
+typedef QSIMPLEQ_HEAD(, NBDZeroCopyBuf) NBDZeroCopyBufList;
+
+/*
+ * Zero copy buffers of a client that went away.  They are kept, together
+ * with the socket so that completion notifications can still be received,
+ * until the kernel has sent them: queued data is still transmitted after
+ * the socket is shut down.
+ */
+typedef struct NBDZeroCopyDrain {
+    QIOChannelSocket *sioc;
+    NBDZeroCopyBufList bufs;
+    QEMUTimer *timer;
+} NBDZeroCopyDrain;
+
+#define NBD_ZERO_COPY_DRAIN_INTERVAL_MS 10
+
+/*
+ * Smaller payloads are copied: the page pinning and completion notification
+ * that come with MSG_ZEROCOPY cost more than copying a few pages.
+ */
+#define NBD_ZERO_COPY_MIN (16 * 1024)
+
 struct NBDExport {
     BlockExport common;
 
@@ -101,6 +134,8 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    bool zero_copy;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -152,6 +187,13 @@ struct NBDClient {
     NBDMode mode;
     NBDMetaContexts contexts; /* Negotiated meta contexts */
 
+    /*
+     * Send read payloads with MSG_ZEROCOPY.  Only set if the export asks for
+     * it, the socket supports it and no TLS is used.
+     */
+    bool zero_copy;
+    NBDZeroCopyBufList zero_copy_bufs; /* protected by lock */
+
     uint32_t opt; /* Current option being negotiated */
     uint32_t optlen; /* remaining length of data in ioc for the option being
                         negotiated now */
@@ -1554,6 +1596,114 @@ static int coroutine_fn nbd_receive_request(NBDClient *client, NBDRequest *reque
 
 #define MAX_NBD_REQUESTS 16
 
+/*
+ * Free the buffers in @bufs whose transmission the kernel has reported as
+ * complete on @sioc.  Returns false if the completions could not be
+ * received; the buffers are kept then.
+ */
+static bool nbd_zero_copy_free_sent(QIOChannelSocket *sioc,
+                                    NBDZeroCopyBufList *bufs)
+{
+    NBDZeroCopyBuf *buf;
+    Error *local_err = NULL;
+
+    if (qio_channel_socket_zero_copy_reap(sioc, &local_err) < 0) {
+        trace_nbd_zero_copy_reap_fail(error_get_pretty(local_err));
+        error_free(local_err);
+        return false;
+    }
+
+    while ((buf = QSIMPLEQ_FIRST(bufs)) && buf->seq <= sioc->zero_copy_sent) {
+        QSIMPLEQ_REMOVE_HEAD(bufs, next);
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+    return true;
+}
+
+/*
+ * Free the zero copy buffers whose transmission the kernel has reported as
+ * complete.  Runs in export AioContext with client->lock held.
+ */
+static void nbd_zero_copy_reap(NBDClient *client)
+{
+    nbd_zero_copy_free_sent(client->sioc, &client->zero_copy_bufs);
+}
+
+/*
+ * Release a request buffer that may have been sent with MSG_ZEROCOPY.
+ * Runs in export AioContext with client->lock held.
+ */
+static void nbd_zero_copy_release(NBDClient *client, void *data)
+{
+    NBDZeroCopyBuf *buf;
+
+    nbd_zero_copy_reap(client);
+
+    if (client->sioc->zero_copy_sent == client->sioc->zero_copy_queued) {
+        qemu_vfree(data);
+        return;
+    }
+
+    buf = g_new(NBDZeroCopyBuf, 1);
+    buf->data = data;
+    buf->seq = client->sioc->zero_copy_queued;
+    QSIMPLEQ_INSERT_TAIL(&client->zero_copy_bufs, buf, next);
+}
+
+/* Runs in the main loop thread */
+static void nbd_zero_copy_drain_timer(void *opaque)
+{
+    NBDZeroCopyDrain *drain = opaque;
+
+    if (!nbd_zero_copy_free_sent(drain->sioc, &drain->bufs)) {
+        /*
+         * Without completions, there is no telling when the kernel is done
+         * with the buffers, so they are leaked rather than reused.
+         */
+        QSIMPLEQ_INIT(&drain->bufs);
+    }
+
+    if (!QSIMPLEQ_EMPTY(&drain->bufs)) {
+        timer_mod(drain->timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                NBD_ZERO_COPY_DRAIN_INTERVAL_MS);
+        return;
+    }
+
+    trace_nbd_zero_copy_drain_done(drain);
+    timer_free(drain->timer);
+    object_unref(OBJECT(drain->sioc));
+    g_free(drain);
+}
+
+/*
+ * Called when the last reference to the client is dropped.  The buffers
+ * that the kernel is still sending from are handed over, with a reference
+ * to the socket, to a timer that frees them as their completions arrive.
+ * This never blocks, even if the peer went away without acknowledging the
+ * data.
+ */
+static void nbd_zero_copy_drain(NBDClient *client)
+{
+    NBDZeroCopyDrain *drain;
+
+    nbd_zero_copy_free_sent(client->sioc, &client->zero_copy_bufs);
+    if (QSIMPLEQ_EMPTY(&client->zero_copy_bufs)) {
+        return;
+    }
+
+    drain = g_new0(NBDZeroCopyDrain, 1);
+    drain->sioc = client->sioc;
+    object_ref(OBJECT(drain->sioc));
+    QSIMPLEQ_INIT(&drain->bufs);
+    QSIMPLEQ_CONCAT(&drain->bufs, &client->zero_copy_bufs);
+    drain->timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                nbd_zero_copy_drain_timer, drain);
+    trace_nbd_zero_copy_drain(drain);
+    timer_mod(drain->timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                            NBD_ZERO_COPY_DRAIN_INTERVAL_MS);
+}
+
 /* Runs in export AioContext and main loop thread */
 void nbd_client_get(NBDClient *client)
 {
@@ -1570,6 +1720,7 @@ void nbd_client_put(NBDClient *client)
          */
         assert(client->closing);
 
+        nbd_zero_copy_drain(client);
         object_unref(OBJECT(client->sioc));
         object_unref(OBJECT(client->ioc));
         if (client->tlscreds) {
@@ -1654,7 +1805,11 @@ static void nbd_request_put(NBDRequestData *req)
     NBDClient *client = req->client;
 
     if (req->data) {
-        qemu_vfree(req->data);
+        if (req->zero_copy) {
+            nbd_zero_copy_release(client, req->data);
+        } else {
+            qemu_vfree(req->data);
+        }
     }
     g_free(req);
 
@@ -1931,6 +2086,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->zero_copy;
 
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
@@ -2048,6 +2204,53 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Like nbd_co_send_iov(), but the last element of @iov is read payload from
+ * a request buffer.  With zero copy enabled, the headers are copied into a
+ * buffer of their own and sent together with the payload in one
+ * MSG_ZEROCOPY sendmsg(), so the payload buffer must not be touched until
+ * the kernel is done with it; see nbd_request_put().  If the kernel cannot
+ * lock the pages, the data is copied instead.
+ */
+static int coroutine_fn nbd_co_send_iov_payload(NBDClient *client,
+                                                struct iovec *iov,
+                                                unsigned niov, Error **errp)
+{
+    struct iovec zc_iov[2];
+    size_t hdr_len;
+    uint8_t *hdr;
+    int ret;
+
+    if (!client->zero_copy || iov[niov - 1].iov_len < NBD_ZERO_COPY_MIN) {
+        return nbd_co_send_iov(client, iov, niov, errp);
+    }
+
+    /* The headers are on the stack, which changes before the kernel sends */
+    hdr_len = iov_size(iov, niov - 1);
+    hdr = qemu_memalign(sizeof(uint64_t), hdr_len);
+    iov_to_buf(iov, niov - 1, 0, hdr, hdr_len);
+    zc_iov[0] = (struct iovec) { .iov_base = hdr, .iov_len = hdr_len };
+    zc_iov[1] = iov[niov - 1];
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    ret = qio_channel_writev_full_all(client->ioc, zc_iov, 2, NULL, 0,
+                                      QIO_CHANNEL_WRITE_FLAG_ZERO_COPY |
+                                      QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK,
+                                      errp);
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    WITH_QEMU_LOCK_GUARD(&client->lock) {
+        nbd_zero_copy_release(client, hdr);
+    }
+
+    return ret < 0 ? -EIO : 0;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t cookie)
 {
@@ -2079,6 +2282,9 @@ static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
                                    nbd_err_lookup(nbd_err), len);
     set_be_simple_reply(&reply, nbd_err, request->cookie);
 
+    if (len) {
+        return nbd_co_send_iov_payload(client, iov, 2, errp);
+    }
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
@@ -2160,7 +2366,7 @@ static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
                  NBD_REPLY_TYPE_OFFSET_DATA, request);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 3, errp);
+    return nbd_co_send_iov_payload(client, iov, 3, errp);
 }
 
 static int coroutine_fn nbd_co_send_chunk_error(NBDClient *client,
@@ -3128,6 +3334,7 @@ static coroutine_fn void nbd_trip(void *opaque)
                                      error_get_pretty(export_err), &local_err);
         error_free(export_err);
     } else {
+        req->zero_copy = client->zero_copy && request.type == NBD_CMD_READ;
         ret = nbd_handle_request(client, &request, req->data, &local_err);
     }
     if (request.contexts && request.contexts != &client->contexts) {
@@ -3236,6 +3443,16 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
     }
 
     timer_free(handshake_timer);
+
+    /*
+     * TLS encrypts into its own buffers, so zero copy would gain nothing.
+     * SO_ZEROCOPY is only enabled here, on the connections that use it.
+     */
+    client->zero_copy = client->exp->zero_copy &&
+        client->ioc == QIO_CHANNEL(client->sioc) &&
+        qio_channel_socket_enable_zero_copy(client->sioc);
+    trace_nbd_co_client_start_zero_copy(client->exp->name, client->zero_copy);
+
     WITH_QEMU_LOCK_GUARD(&client->lock) {
         nbd_client_receive_next_request(client);
     }
@@ -3259,6 +3476,7 @@ void nbd_client_new(QIOChannelSocket *sioc,
 
     client = g_new0(NBDClient, 1);
     qemu_mutex_init(&client->lock);
+    QSIMPLEQ_INIT(&client->zero_copy_bufs);
     client->refcount = 1;
     client->tlscreds = tlscreds;
     if (tlscreds) {
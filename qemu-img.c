@@ -44,8 +44,11 @@
 #include "qemu/sockets.h"
 #include "qemu/units.h"
 #include "qemu/memalign.h"
+#include "qemu/stats64.h"
+#include "qemu/xxhash.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/dirty-bitmap.h"
@@ -86,6 +89,8 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_DEDUP = 278,
+    OPTION_CHECKPOINT = 279,
 };
 
 typedef enum OutputFormat {
@@ -201,12 +206,18 @@ void help(void)
            "       '-r leaks' repairs only cluster leaks, whereas '-r all' fixes all\n"
            "       kinds of errors, with a higher risk of choosing the wrong fix or\n"
            "       hiding corruption that has already occurred.\n"
+           "  '--checkpoint' saves the progress of the check to the given file, and\n"
+           "       resumes from it if it exists (qcow2 only)\n"
            "\n"
            "Parameters to convert subcommand:\n"
            "  '--bitmaps' copies all top-level persistent bitmaps to destination\n"
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '-j' partitions the image into the given number of ranges that are\n"
+           "       converted in parallel by separate threads (defaults to 1)\n"
+           "  '--dedup' writes clusters with identical content only once and lets\n"
+           "       the duplicates share them (qcow2 target only)\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -219,6 +230,12 @@ void help(void)
            "  '-f' first image format\n"
            "  '-F' second image format\n"
            "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "  '--checkpoint' saves the progress of the comparison to the given file, and\n"
+           "       resumes from it if it exists\n"
+           "\n"
+           "Parameters to dedup subcommand:\n"
+           "  'filename' is a qcow2 image whose identical data clusters are made to share\n"
+           "       a single host cluster\n"
            "\n"
            "Parameters to dd subcommand:\n"
            "  'bs=BYTES' read and write up to BYTES bytes at a time "
@@ -672,12 +689,13 @@ static int collect_image_check(BlockDriverState *bs,
                    ImageCheck *check,
                    const char *filename,
                    const char *fmt,
-                   int fix)
+                   int fix,
+                   const char *checkpoint)
 {
     int ret;
     BdrvCheckResult result;
 
-    ret = bdrv_check(bs, &result, fix);
+    ret = bdrv_check(bs, &result, fix, checkpoint);
     if (ret < 0) {
         return ret;
     }
@@ -721,6 +739,7 @@ static int img_check(int argc, char **argv)
     int c, ret;
     OutputFormat output_format = OFORMAT_HUMAN;
     const char *filename, *fmt, *output, *cache;
+    const char *checkpoint = NULL;
     BlockBackend *blk;
     BlockDriverState *bs;
     int fix = 0;
@@ -745,6 +764,7 @@ static int img_check(int argc, char **argv)
             {"object", required_argument, 0, OPTION_OBJECT},
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"force-share", no_argument, 0, 'U'},
+            {"checkpoint", required_argument, 0, OPTION_CHECKPOINT},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:r:T:qU",
@@ -795,6 +815,9 @@ static int img_check(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_CHECKPOINT:
+            checkpoint = optarg;
+            break;
         }
     }
     if (optind != argc - 1) {
@@ -802,6 +825,11 @@ static int img_check(int argc, char **argv)
     }
     filename = argv[optind++];
 
+    if (checkpoint && fix) {
+        error_report("--checkpoint cannot be used with -r");
+        return 1;
+    }
+
     if (output && !strcmp(output, "json")) {
         output_format = OFORMAT_JSON;
     } else if (output && !strcmp(output, "human")) {
@@ -825,7 +853,7 @@ static int img_check(int argc, char **argv)
     bs = blk_bs(blk);
 
     check = g_new0(ImageCheck, 1);
-    ret = collect_image_check(bs, check, filename, fmt, fix);
+    ret = collect_image_check(bs, check, filename, fmt, fix, checkpoint);
 
     if (ret == -ENOTSUP) {
         error_report("This image format does not support checks");
@@ -854,7 +882,7 @@ static int img_check(int argc, char **argv)
 
         qapi_free_ImageCheck(check);
         check = g_new0(ImageCheck, 1);
-        ret = collect_image_check(bs, check, filename, fmt, 0);
+        ret = collect_image_check(bs, check, filename, fmt, 0, NULL);
 
         check->leaks_fixed          = leaks_fixed;
         check->has_leaks_fixed      = has_leaks_fixed;
@@ -883,6 +911,11 @@ static int img_check(int argc, char **argv)
         goto fail;
     }
 
+    /* The check is complete, there is nothing left to resume */
+    if (checkpoint) {
+        unlink(checkpoint);
+    }
+
     if (check->corruptions) {
         ret = 2;
     } else if (check->leaks) {
@@ -1348,6 +1381,85 @@ static int check_empty_sectors(BlockBackend *blk, int64_t offset,
     return 0;
 }
 
+#define COMPARE_CHECKPOINT_GROUP "compare"
+/* Minimum time between two checkpoints of 'compare --checkpoint' */
+#define COMPARE_CHECKPOINT_INTERVAL (10 * G_USEC_PER_SEC)
+
+/*
+ * Load the offset up to which a previous run of 'compare' with the same
+ * arguments found the images identical.  Returns 0 and sets *@offset to 0 if
+ * there is no checkpoint file, -1 if it belongs to a different comparison.
+ */
+static int compare_checkpoint_load(const char *checkpoint,
+                                   const char *filename1, int64_t size1,
+                                   const char *filename2, int64_t size2,
+                                   bool strict, int64_t *offset)
+{
+    g_autoptr(GKeyFile) kf = g_key_file_new();
+    g_autoptr(GError) err = NULL;
+    g_autofree char *cp_filename1 = NULL;
+    g_autofree char *cp_filename2 = NULL;
+
+    *offset = 0;
+    if (!g_key_file_load_from_file(kf, checkpoint, G_KEY_FILE_NONE, &err)) {
+        if (g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            return 0;
+        }
+        error_report("Cannot read checkpoint '%s': %s", checkpoint,
+                     err->message);
+        return -1;
+    }
+
+    cp_filename1 = g_key_file_get_string(kf, COMPARE_CHECKPOINT_GROUP,
+                                         "filename1", NULL);
+    cp_filename2 = g_key_file_get_string(kf, COMPARE_CHECKPOINT_GROUP,
+                                         "filename2", NULL);
+    if (g_strcmp0(cp_filename1, filename1) ||
+        g_strcmp0(cp_filename2, filename2) ||
+        g_key_file_get_int64(kf, COMPARE_CHECKPOINT_GROUP, "size1",
+                             NULL) != size1 ||
+        g_key_file_get_int64(kf, COMPARE_CHECKPOINT_GROUP, "size2",
+                             NULL) != size2 ||
+        g_key_file_get_boolean(kf, COMPARE_CHECKPOINT_GROUP, "strict",
+                               NULL) != strict)
+    {
+        error_report("Checkpoint '%s' belongs to a different comparison",
+                     checkpoint);
+        return -1;
+    }
+
+    *offset = g_key_file_get_int64(kf, COMPARE_CHECKPOINT_GROUP, "offset",
+                                   NULL);
+    if (*offset < 0 || *offset > MAX(size1, size2)) {
+        error_report("Invalid offset in checkpoint '%s'", checkpoint);
+        return -1;
+    }
+    return 0;
+}
+
+static void compare_checkpoint_save(const char *checkpoint,
+                                    const char *filename1, int64_t size1,
+                                    const char *filename2, int64_t size2,
+                                    bool strict, int64_t offset)
+{
+    g_autoptr(GKeyFile) kf = g_key_file_new();
+    g_autoptr(GError) err = NULL;
+
+    g_key_file_set_string(kf, COMPARE_CHECKPOINT_GROUP, "filename1",
+                          filename1);
+    g_key_file_set_int64(kf, COMPARE_CHECKPOINT_GROUP, "size1", size1);
+    g_key_file_set_string(kf, COMPARE_CHECKPOINT_GROUP, "filename2",
+                          filename2);
+    g_key_file_set_int64(kf, COMPARE_CHECKPOINT_GROUP, "size2", size2);
+    g_key_file_set_boolean(kf, COMPARE_CHECKPOINT_GROUP, "strict", strict);
+    g_key_file_set_int64(kf, COMPARE_CHECKPOINT_GROUP, "offset", offset);
+
+    if (!g_key_file_save_to_file(kf, checkpoint, &err)) {
+        warn_report("Failed to write checkpoint '%s': %s", checkpoint,
+                    err->message);
+    }
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -1375,6 +1487,9 @@ static int img_compare(int argc, char **argv)
     uint64_t progress_base;
     bool image_opts = false;
     bool force_share = false;
+    const char *checkpoint = NULL;
+    int64_t last_checkpoint = 0;
+    bool checkpoint_loaded = false;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1383,6 +1498,7 @@ static int img_compare(int argc, char **argv)
             {"object", required_argument, 0, OPTION_OBJECT},
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"force-share", no_argument, 0, 'U'},
+            {"checkpoint", required_argument, 0, OPTION_CHECKPOINT},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:F:T:pqsU",
@@ -1439,6 +1555,9 @@ static int img_compare(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_CHECKPOINT:
+            checkpoint = optarg;
+            break;
         }
     }
 
@@ -1508,9 +1627,33 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
+    if (checkpoint) {
+        if (compare_checkpoint_load(checkpoint, filename1, total_size1,
+                                    filename2, total_size2, strict,
+                                    &offset) < 0) {
+            ret = 2;
+            goto out;
+        }
+        checkpoint_loaded = true;
+        if (offset) {
+            qprintf(quiet, "Resuming comparison at offset %" PRId64 "\n",
+                    offset);
+            qemu_progress_print(((float) offset / progress_base) * 100, 100);
+        }
+        last_checkpoint = g_get_monotonic_time();
+    }
+
     while (offset < total_size) {
         int status1, status2;
 
+        if (checkpoint &&
+            g_get_monotonic_time() - last_checkpoint >=
+            COMPARE_CHECKPOINT_INTERVAL) {
+            compare_checkpoint_save(checkpoint, filename1, total_size1,
+                                    filename2, total_size2, strict, offset);
+            last_checkpoint = g_get_monotonic_time();
+        }
+
         status1 = bdrv_block_status_above(bs1, NULL, offset,
                                           total_size1 - offset, &pnum1, NULL,
                                           NULL);
@@ -1631,6 +1774,17 @@ static int img_compare(int argc, char **argv)
     ret = 0;
 
 out:
+    /* Only touch a checkpoint file known to belong to this comparison */
+    if (checkpoint_loaded) {
+        if (ret <= 1) {
+            /* The result is final */
+            unlink(checkpoint);
+        } else {
+            /* Everything before @offset has been found identical */
+            compare_checkpoint_save(checkpoint, filename1, total_size1,
+                                    filename2, total_size2, strict, offset);
+        }
+    }
     qemu_vfree(buf1);
     qemu_vfree(buf2);
     blk_unref(blk2);
@@ -1658,6 +1812,181 @@ static void do_dirty_bitmap_merge(const char *dst_node, const char *dst_name,
     qapi_free_BlockDirtyBitmapOrStrList(list);
 }
 
+/*
+ * Content-based cluster deduplication, shared by 'convert --dedup' and
+ * 'dedup'. Clusters are looked up by a hash of their content; when a match
+ * is found (and the content really is identical), the duplicate is created
+ * with blk_co_copy_range() inside the image, which qcow2 implements by
+ * sharing the host cluster and raising its refcount.
+ */
+typedef struct ImgDedupEntry {
+    uint64_t hash; /* must come first, see g_int64_hash() */
+    int64_t offset;
+} ImgDedupEntry;
+
+typedef struct ImgDedupState {
+    GHashTable *clusters;
+    int64_t cluster_size;
+    bool unsupported;
+    int64_t nb_hashed;
+    int64_t nb_shared;
+} ImgDedupState;
+
+static void img_dedup_init(ImgDedupState *d, int64_t cluster_size)
+{
+    assert(QEMU_IS_ALIGNED(cluster_size, 4 * sizeof(uint64_t)));
+    d->clusters = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                        g_free, NULL);
+    d->cluster_size = cluster_size;
+}
+
+/*
+ * Sharing a cluster needs one more reference than qcow2 can count with
+ * refcount_bits=1, so it would fail for every single cluster.
+ */
+static bool img_dedup_check_refcounts(BlockDriverState *bs)
+{
+    ImageInfoSpecific *info;
+    bool ok = true;
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    info = bdrv_get_specific_info(bs, NULL);
+    if (info && info->type == IMAGE_INFO_SPECIFIC_KIND_QCOW2 &&
+        info->u.qcow2.data->refcount_bits < 2) {
+        error_report("Deduplication needs refcount_bits of at least 2");
+        ok = false;
+    }
+    qapi_free_ImageInfoSpecific(info);
+    return ok;
+}
+
+static void img_dedup_cleanup(ImgDedupState *d)
+{
+    if (d->clusters) {
+        g_hash_table_destroy(d->clusters);
+        d->clusters = NULL;
+    }
+}
+
+/*
+ * XXH64 with four independent accumulators, which compilers turn into
+ * vector code; collisions are caught by comparing the data.
+ */
+static uint64_t img_dedup_hash(const uint8_t *buf, int64_t len)
+{
+    const uint64_t *p = (const uint64_t *)buf;
+    uint64_t v1 = QEMU_XXHASH_SEED + XXH_PRIME64_1 + XXH_PRIME64_2;
+    uint64_t v2 = QEMU_XXHASH_SEED + XXH_PRIME64_2;
+    uint64_t v3 = QEMU_XXHASH_SEED + 0;
+    uint64_t v4 = QEMU_XXHASH_SEED - XXH_PRIME64_1;
+    int64_t i;
+
+    for (i = 0; i < len / 8; i += 4) {
+        v1 = XXH64_round(v1, p[i + 0]);
+        v2 = XXH64_round(v2, p[i + 1]);
+        v3 = XXH64_round(v3, p[i + 2]);
+        v4 = XXH64_round(v4, p[i + 3]);
+    }
+
+    return XXH64_avalanche(XXH64_mergerounds(v1, v2, v3, v4) + len);
+}
+
+/* Make the cluster at @offset with hash @hash available for sharing */
+static void img_dedup_insert(ImgDedupState *d, uint64_t hash, int64_t offset)
+{
+    ImgDedupEntry *e;
+
+    if (d->unsupported || g_hash_table_contains(d->clusters, &hash)) {
+        return;
+    }
+    e = g_new(ImgDedupEntry, 1);
+    e->hash = hash;
+    e->offset = offset;
+    g_hash_table_add(d->clusters, e);
+}
+
+/*
+ * Try to store the cluster in @buf at @offset in @blk by sharing an
+ * identical cluster that has been written before. *@hash is set to the hash
+ * of @buf, unless the image turned out not to support sharing clusters,
+ * in which case nothing is hashed anymore.
+ *
+ * Returns 1 if the cluster was shared, 0 if the caller has to write it, and
+ * -errno on error.
+ */
+static int coroutine_fn
+img_dedup_co_share(ImgDedupState *d, BlockBackend *blk, int64_t offset,
+                   const uint8_t *buf, uint64_t *hash)
+{
+    ImgDedupEntry *e;
+    uint8_t *verify_buf;
+    int ret;
+
+    if (d->unsupported) {
+        return 0;
+    }
+
+    *hash = img_dedup_hash(buf, d->cluster_size);
+    d->nb_hashed++;
+
+    e = g_hash_table_lookup(d->clusters, hash);
+    if (!e) {
+        return 0;
+    }
+
+    verify_buf = blk_blockalign(blk, d->cluster_size);
+    ret = blk_co_pread(blk, e->offset, d->cluster_size, verify_buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+    if (memcmp(verify_buf, buf, d->cluster_size)) {
+        /* Hash collision */
+        ret = 0;
+        goto out;
+    }
+
+    /* Fail rather than copy the data if the cluster cannot be shared */
+    ret = blk_co_copy_range(blk, e->offset, blk, offset, d->cluster_size,
+                            0, BDRV_REQ_NO_FALLBACK);
+    if (ret == -ENOTSUP || ret == -EINVAL) {
+        /*
+         * If nothing could be shared so far, the image does not support it
+         * at all; otherwise only this cluster cannot be shared (e.g. its
+         * refcount is at the maximum).
+         */
+        if (!d->nb_shared) {
+            warn_report("Cannot share clusters in this image: %s; "
+                        "deduplication disabled", strerror(-ret));
+            d->unsupported = true;
+            g_hash_table_remove_all(d->clusters);
+        }
+        ret = 0;
+        goto out;
+    } else if (ret < 0) {
+        goto out;
+    }
+
+    d->nb_shared++;
+    ret = 1;
+out:
+    qemu_vfree(verify_buf);
+    return ret;
+}
+
+static void img_dedup_report(ImgDedupState *d, int64_t bytes,
+                             int64_t elapsed_us)
+{
+    int64_t unique = d->nb_hashed - d->nb_shared;
+
+    printf("Deduplication: %" PRId64 " of %" PRId64 " clusters shared "
+           "(ratio %.2f:1)\n", d->nb_shared, d->nb_hashed,
+           unique ? (double)d->nb_hashed / unique : 1.0);
+    printf("Processed %" PRId64 " bytes in %3.3f seconds (%.1f MiB/s)\n",
+           bytes, elapsed_us / 1000000.0,
+           elapsed_us ? (double)bytes / MiB * 1000000 / elapsed_us : 0.0);
+}
+
 enum ImgConvertBlockStatus {
     BLK_DATA,
     BLK_ZERO,
@@ -1665,9 +1994,12 @@ enum ImgConvertBlockStatus {
 };
 
 #define MAX_COROUTINES 16
+#define MAX_CONVERT_THREADS 64
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
-typedef struct ImgConvertState {
+typedef struct ImgConvertState ImgConvertState;
+
+struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
     int *src_alignment;
@@ -1689,6 +2021,8 @@ typedef struct ImgConvertState {
     bool copy_range;
     bool salvage;
     bool quiet;
+    bool dedup;
+    ImgDedupState dedup_state;
     int min_sparse;
     int alignment;
     size_t cluster_sectors;
@@ -1699,7 +2033,20 @@ typedef struct ImgConvertState {
     int64_t wait_sector_num[MAX_COROUTINES];
     CoMutex lock;
     int ret;
-} ImgConvertState;
+
+    /* Number of threads that the target range is partitioned across (-j) */
+    long num_threads;
+    /* Threads still copying, only accessed from the main loop */
+    int running_threads;
+    /* Progress of all threads, in sectors */
+    Stat64 threads_done;
+    QEMUTimer *progress_timer;
+    /*
+     * Each thread works on a private copy of the state that only covers its
+     * part of the image.  @parent points back to the original state.
+     */
+    ImgConvertState *parent;
+};
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
                                 int *src_cur, int64_t *src_cur_offset)
@@ -1874,6 +2221,69 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
+/*
+ * Write the data in @buf to the target, sharing full clusters that have
+ * already been written with the same content.
+ */
+static int coroutine_fn convert_co_dedup_write(ImgConvertState *s,
+                                               int64_t sector_num,
+                                               int nb_sectors, uint8_t *buf,
+                                               BdrvRequestFlags flags)
+{
+    ImgDedupState *d = &s->dedup_state;
+    int64_t start = sector_num << BDRV_SECTOR_BITS;
+    int64_t end = start + ((int64_t)nb_sectors << BDRV_SECTOR_BITS);
+    int64_t first = ROUND_UP(start, d->cluster_size);
+    int64_t pending = start; /* start of data that still needs writing */
+    int64_t offset, o;
+    g_autofree uint64_t *hashes = NULL;
+    int ret;
+
+    if (d->unsupported || first + d->cluster_size > end) {
+        return blk_co_pwrite(s->target, start, end - start, buf, flags);
+    }
+    hashes = g_new0(uint64_t, (end - first) / d->cluster_size);
+
+    for (offset = first; ; offset += d->cluster_size) {
+        bool full = offset + d->cluster_size <= end;
+        int64_t write_end = full ? offset : end;
+
+        if (full) {
+            ret = img_dedup_co_share(d, s->target, offset,
+                                     buf + (offset - start),
+                                     &hashes[(offset - first) /
+                                             d->cluster_size]);
+            if (ret < 0) {
+                return ret;
+            } else if (ret == 0) {
+                continue;
+            }
+        }
+
+        /* Write everything before the shared cluster, or up to the end */
+        if (pending < write_end) {
+            ret = blk_co_pwrite(s->target, pending, write_end - pending,
+                                buf + (pending - start), flags);
+            if (ret < 0) {
+                return ret;
+            }
+            for (o = ROUND_UP(pending, d->cluster_size);
+                 o + d->cluster_size <= write_end;
+                 o += d->cluster_size)
+            {
+                img_dedup_insert(d, hashes[(o - first) / d->cluster_size], o);
+            }
+        }
+
+        if (!full) {
+            break;
+        }
+        pending = offset + d->cluster_size;
+    }
+
+    return 0;
+}
+
 static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
                                          enum ImgConvertBlockStatus status)
@@ -1906,8 +2316,13 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                 (s->compressed &&
                  !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
             {
-                ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
-                                    n << BDRV_SECTOR_BITS, buf, flags);
+                if (s->dedup) {
+                    ret = convert_co_dedup_write(s, sector_num, n, buf, flags);
+                } else {
+                    ret = blk_co_pwrite(s->target,
+                                        sector_num << BDRV_SECTOR_BITS,
+                                        n << BDRV_SECTOR_BITS, buf, flags);
+                }
                 if (ret < 0) {
                     return ret;
                 }
@@ -1969,6 +2384,25 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+static void convert_thread_done_bh(void *opaque);
+
+/* Drop a reference to s->running_coroutines */
+static void convert_put_running(ImgConvertState *s)
+{
+    s->running_coroutines--;
+    if (s->running_coroutines) {
+        return;
+    }
+    if (s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+    if (s->parent) {
+        aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                convert_thread_done_bh, s);
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -2019,8 +2453,13 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 
         if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
             s->allocated_done += n;
-            qemu_progress_print(100.0 * s->allocated_done /
-                                        s->allocated_sectors, 0);
+            if (s->parent) {
+                /* Progress is printed by the main loop */
+                stat64_add(&s->parent->threads_done, n);
+            } else {
+                qemu_progress_print(100.0 * s->allocated_done /
+                                            s->allocated_sectors, 0);
+            }
         }
 
 retry:
@@ -2085,16 +2524,158 @@ retry:
 
     qemu_vfree(buf);
     s->co[index] = NULL;
-    s->running_coroutines--;
-    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
-        /* the convert job finished successfully */
+    convert_put_running(s);
+}
+
+static void convert_start_coroutines(ImgConvertState *s)
+{
+    int i;
+
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i]);
+    }
+}
+
+typedef struct ImgConvertThread {
+    ImgConvertState s;
+    IOThread *iothread;
+    int index;
+    int64_t start_sector;
+    int64_t start_time;
+    int64_t end_time;
+} ImgConvertThread;
+
+static void convert_thread_done_bh(void *opaque)
+{
+    ImgConvertThread *t = container_of(opaque, ImgConvertThread, s);
+
+    t->end_time = g_get_monotonic_time();
+    t->s.parent->running_threads--;
+}
+
+/* Runs in the thread's AioContext */
+static void convert_thread_start_bh(void *opaque)
+{
+    ImgConvertThread *t = opaque;
+
+    /*
+     * Hold a reference while starting the coroutines so that the thread is
+     * not reported as done if the first ones complete without yielding.
+     */
+    t->s.running_coroutines++;
+    convert_start_coroutines(&t->s);
+    convert_put_running(&t->s);
+}
+
+static void convert_progress_cb(void *opaque)
+{
+    ImgConvertState *s = opaque;
+
+    qemu_progress_print(100.0 * stat64_get(&s->threads_done) /
+                                s->allocated_sectors, 0);
+    timer_mod(s->progress_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 100);
+}
+
+static void convert_thread_report(ImgConvertThread *t)
+{
+    int64_t bytes = t->s.allocated_done * BDRV_SECTOR_SIZE;
+    int64_t elapsed_us = t->end_time - t->start_time;
+
+    printf("Thread %d: offset %" PRId64 " to %" PRId64 ", copied %" PRId64
+           " bytes in %3.3f seconds (%.1f MiB/s)\n",
+           t->index, t->start_sector * BDRV_SECTOR_SIZE,
+           t->s.total_sectors * BDRV_SECTOR_SIZE, bytes,
+           elapsed_us / 1000000.0,
+           elapsed_us ? (double)bytes / MiB * 1000000 / elapsed_us : 0.0);
+}
+
+/*
+ * Partition the image into s->num_threads ranges and copy each of them in a
+ * separate iothread, with its own set of coroutines.  Block status queries,
+ * zero detection, compression and encryption of the ranges can then run on
+ * different CPUs.
+ */
+static void convert_run_threads(ImgConvertState *s)
+{
+    g_autofree ImgConvertThread *threads = NULL;
+    int64_t align = MAX(MAX(s->cluster_sectors, s->alignment), 1);
+    int64_t range = QEMU_ALIGN_UP(DIV_ROUND_UP(s->total_sectors,
+                                               s->num_threads), align);
+    Error *local_err = NULL;
+    int nb_threads = 0;
+    int i;
+
+    threads = g_new0(ImgConvertThread, s->num_threads);
+    s->progress_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                     convert_progress_cb, s);
+    timer_mod(s->progress_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 100);
+
+    for (i = 0; i < s->num_threads; i++) {
+        ImgConvertThread *t = &threads[i];
+        int64_t start = i * range;
+        g_autofree char *name = NULL;
+
+        if (start >= s->total_sectors) {
+            break;
+        }
+
+        name = g_strdup_printf("img-convert-%d", i);
+        t->iothread = iothread_create(name, &local_err);
+        if (!t->iothread) {
+            error_report_err(local_err);
+            s->ret = -EIO;
+            break;
+        }
+
+        t->s = *s;
+        t->s.parent = s;
+        t->s.sector_num = start;
+        t->s.wr_offs = start;
+        t->s.total_sectors = MIN(start + range, s->total_sectors);
+        t->s.allocated_done = 0;
+        t->s.running_coroutines = 0;
+        t->index = i;
+        t->start_sector = start;
+        t->start_time = g_get_monotonic_time();
+        nb_threads++;
+
+        s->running_threads++;
+        aio_bh_schedule_oneshot(iothread_get_aio_context(t->iothread),
+                                convert_thread_start_bh, t);
+    }
+
+    while (s->running_threads) {
+        main_loop_wait(false);
+    }
+    timer_free(s->progress_timer);
+    s->progress_timer = NULL;
+
+    for (i = 0; i < nb_threads; i++) {
+        ImgConvertThread *t = &threads[i];
+
+        iothread_destroy(t->iothread);
+        s->allocated_done += t->s.allocated_done;
+        if (t->s.ret < 0 && s->ret == -EINPROGRESS) {
+            s->ret = t->s.ret;
+        }
+        if (!s->quiet) {
+            convert_thread_report(t);
+        }
+    }
+
+    if (s->ret == -EINPROGRESS) {
         s->ret = 0;
     }
 }
 
 static int convert_do_copy(ImgConvertState *s)
 {
-    int ret, i, n;
+    int ret, n;
     int64_t sector_num = 0;
 
     /* Check whether we have zero initialisation or can get it efficiently */
@@ -2133,15 +2714,13 @@ static int convert_do_copy(ImgConvertState *s)
     s->sector_next_status = 0;
     s->ret = -EINPROGRESS;
 
-    qemu_co_mutex_init(&s->lock);
-    for (i = 0; i < s->num_coroutines; i++) {
-        s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
-        s->wait_sector_num[i] = -1;
-        qemu_coroutine_enter(s->co[i]);
-    }
-
-    while (s->running_coroutines) {
-        main_loop_wait(false);
+    if (s->num_threads > 1) {
+        convert_run_threads(s);
+    } else {
+        convert_start_coroutines(s);
+        while (s->running_coroutines) {
+            main_loop_wait(false);
+        }
     }
 
     if (s->compressed && !s->ret) {
@@ -2200,7 +2779,7 @@ static int convert_copy_bitmaps(BlockDriverState *src, BlockDriverState *dst,
                                    true, bdrv_dirty_bitmap_granularity(bm),
                                    true, true,
                                    true, !bdrv_dirty_bitmap_enabled(bm),
-                                   &err);
+                                   false, false, &err);
         if (err) {
             error_reportf_err(err, "Failed to create bitmap %s: ", name);
             return -1;
@@ -2254,6 +2833,7 @@ static int img_convert(int argc, char **argv)
     bool bitmaps = false;
     bool skip_broken = false;
     int64_t rate_limit = 0;
+    int64_t start_time;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -2262,6 +2842,7 @@ static int img_convert(int argc, char **argv)
         .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
         .wr_in_order        = true,
         .num_coroutines     = 8,
+        .num_threads        = 1,
     };
 
     for(;;) {
@@ -2275,9 +2856,10 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"dedup", no_argument, 0, OPTION_DEDUP},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:WUr:",
+        c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:j:WUr:",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -2371,6 +2953,15 @@ static int img_convert(int argc, char **argv)
                 goto fail_getopt;
             }
             break;
+        case 'j':
+            if (qemu_strtol(optarg, NULL, 0, &s.num_threads) ||
+                s.num_threads < 1 || s.num_threads > MAX_CONVERT_THREADS) {
+                error_report("Invalid number of threads. Allowed number of"
+                             " threads is between 1 and %d",
+                             MAX_CONVERT_THREADS);
+                goto fail_getopt;
+            }
+            break;
         case 'W':
             s.wr_in_order = false;
             break;
@@ -2409,6 +3000,9 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_DEDUP:
+            s.dedup = true;
+            break;
         }
     }
 
@@ -2436,6 +3030,16 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (s.dedup && (s.compressed || s.copy_range)) {
+        error_report("Cannot deduplicate when -c or -C is used");
+        goto fail_getopt;
+    }
+
+    if (s.num_threads > 1 && (s.dedup || rate_limit)) {
+        error_report("Cannot use multiple threads with --dedup or -r");
+        goto fail_getopt;
+    }
+
     if (tgt_image_opts && !skip_create) {
         error_report("--target-image-opts requires use of -n flag");
         goto fail_getopt;
@@ -2779,12 +3383,32 @@ static int img_convert(int argc, char **argv)
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    if (s.dedup) {
+        if (!s.cluster_sectors || s.compressed) {
+            error_report("Deduplication not supported for this file format");
+            ret = -1;
+            goto out;
+        }
+        if (!img_dedup_check_refcounts(out_bs)) {
+            ret = -1;
+            goto out;
+        }
+        img_dedup_init(&s.dedup_state, s.cluster_sectors * BDRV_SECTOR_SIZE);
+    }
+
     if (rate_limit) {
         set_rate_limit(s.target, rate_limit);
     }
 
+    start_time = g_get_monotonic_time();
     ret = convert_do_copy(&s);
 
+    if (s.dedup && ret == 0 && !s.quiet) {
+        img_dedup_report(&s.dedup_state,
+                         s.allocated_sectors * BDRV_SECTOR_SIZE,
+                         g_get_monotonic_time() - start_time);
+    }
+
     /* Now copy the bitmaps */
     if (bitmaps && ret == 0) {
         ret = convert_copy_bitmaps(blk_bs(s.src[0]), out_bs, skip_broken);
@@ -2807,6 +3431,7 @@ out:
     }
     g_free(s.src_sectors);
     g_free(s.src_alignment);
+    img_dedup_cleanup(&s.dedup_state);
 fail_getopt:
     qemu_opts_del(sn_opts);
     g_free(options);
@@ -2814,6 +3439,228 @@ fail_getopt:
     return !!ret;
 }
 
+typedef struct ImgDedupCoState {
+    BlockBackend *blk;
+    ImgDedupState *dedup;
+    int64_t size;
+    int64_t bytes_done;
+    int ret;
+} ImgDedupCoState;
+
+static void coroutine_fn img_dedup_co_entry(void *opaque)
+{
+    ImgDedupCoState *dc = opaque;
+    ImgDedupState *d = dc->dedup;
+    BlockDriverState *bs = blk_bs(dc->blk);
+    BlockDriverState *base;
+    int64_t buf_size = QEMU_ALIGN_UP(IO_BUF_SIZE, d->cluster_size);
+    uint8_t *buf = blk_blockalign(dc->blk, buf_size);
+    int64_t offset = 0;
+    int ret = 0;
+
+    bdrv_graph_co_rdlock();
+    base = bdrv_cow_bs(bdrv_skip_filters(bs));
+    bdrv_graph_co_rdunlock();
+
+    while (offset < dc->size) {
+        int64_t bytes, o;
+        uint64_t hash;
+
+        /* Only data allocated in this image (and not the backing chain) */
+        ret = blk_co_block_status_above(dc->blk, base, offset,
+                                        MIN(dc->size - offset, buf_size),
+                                        &bytes, NULL, NULL);
+        if (ret < 0) {
+            error_report("error while reading block status at offset %"
+                         PRId64 ": %s", offset, strerror(-ret));
+            break;
+        }
+        assert(bytes > 0);
+
+        if (!(ret & BDRV_BLOCK_DATA) || (ret & BDRV_BLOCK_ZERO) ||
+            !(ret & BDRV_BLOCK_ALLOCATED))
+        {
+            offset += bytes;
+            ret = 0;
+            continue;
+        }
+
+        /* Work on whole clusters only */
+        bytes = QEMU_ALIGN_UP(offset + bytes, d->cluster_size) - offset;
+        bytes = MIN(bytes, MIN(dc->size - offset, buf_size));
+        ret = blk_co_pread(dc->blk, offset, bytes, buf, 0);
+        if (ret < 0) {
+            error_report("error while reading at byte %" PRId64 ": %s",
+                         offset, strerror(-ret));
+            break;
+        }
+
+        for (o = ROUND_UP(offset, d->cluster_size);
+             o + d->cluster_size <= offset + bytes;
+             o += d->cluster_size)
+        {
+            ret = img_dedup_co_share(d, dc->blk, o, buf + (o - offset), &hash);
+            if (ret < 0) {
+                error_report("error while sharing cluster at byte %" PRId64
+                             ": %s", o, strerror(-ret));
+                goto out;
+            } else if (ret == 0) {
+                img_dedup_insert(d, hash, o);
+            }
+        }
+
+        /* Nothing left to do, the image cannot share clusters */
+        if (d->unsupported) {
+            ret = 0;
+            break;
+        }
+
+        offset += bytes;
+        dc->bytes_done += bytes;
+        qemu_progress_print(100.0 * offset / dc->size, 0);
+    }
+
+out:
+    qemu_vfree(buf);
+    dc->ret = ret < 0 ? ret : 0;
+}
+
+static int img_dedup(int argc, char **argv)
+{
+    const char *fmt = NULL, *filename, *cache = BDRV_DEFAULT_CACHE;
+    BlockBackend *blk = NULL;
+    BlockDriverInfo bdi;
+    ImgDedupState dedup = {};
+    ImgDedupCoState dc;
+    Coroutine *co;
+    bool image_opts = false, quiet = false, progress = false;
+    bool writethrough;
+    int64_t start_time;
+    int c, flags, ret;
+
+    for (;;) {
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"object", required_argument, 0, OPTION_OBJECT},
+            {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, ":hf:t:pq", long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case ':':
+            missing_argument(argv[optind - 1]);
+            break;
+        case '?':
+            unrecognized_option(argv[optind - 1]);
+            break;
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 't':
+            cache = optarg;
+            break;
+        case 'p':
+            progress = true;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case OPTION_OBJECT:
+            user_creatable_process_cmdline(optarg);
+            break;
+        case OPTION_IMAGE_OPTS:
+            image_opts = true;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[optind];
+
+    if (quiet) {
+        progress = false;
+    }
+    qemu_progress_init(progress, 1.0);
+
+    flags = BDRV_O_RDWR | BDRV_O_UNMAP;
+    ret = bdrv_parse_cache_mode(cache, &flags, &writethrough);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        goto out;
+    }
+
+    blk = img_open(image_opts, filename, fmt, flags, writethrough, quiet,
+                   false);
+    if (!blk) {
+        ret = -1;
+        goto out;
+    }
+
+    ret = bdrv_get_info(blk_bs(blk), &bdi);
+    if (ret < 0 || !bdi.cluster_size || bdi.needs_compressed_writes) {
+        error_report("Deduplication not supported for this file format");
+        ret = -1;
+        goto out;
+    }
+    if (!img_dedup_check_refcounts(blk_bs(blk))) {
+        ret = -1;
+        goto out;
+    }
+    img_dedup_init(&dedup, bdi.cluster_size);
+
+    dc = (ImgDedupCoState) {
+        .blk    = blk,
+        .dedup  = &dedup,
+        .size   = blk_getlength(blk),
+        .ret    = -EINPROGRESS,
+    };
+    if (dc.size < 0) {
+        error_report("Could not get size of %s: %s", filename,
+                     strerror(-dc.size));
+        ret = -1;
+        goto out;
+    }
+
+    qemu_progress_print(0, 100);
+    start_time = g_get_monotonic_time();
+
+    co = qemu_coroutine_create(img_dedup_co_entry, &dc);
+    qemu_coroutine_enter(co);
+    while (dc.ret == -EINPROGRESS) {
+        main_loop_wait(false);
+    }
+    ret = dc.ret;
+
+    if (ret == 0) {
+        ret = blk_flush(blk);
+        if (ret < 0) {
+            error_report("Could not flush %s: %s", filename, strerror(-ret));
+        }
+    }
+
+    if (ret == 0) {
+        qemu_progress_print(100, 0);
+        if (!quiet) {
+            img_dedup_report(&dedup, dc.bytes_done,
+                             g_get_monotonic_time() - start_time);
+        }
+    }
+
+out:
+    qemu_progress_end();
+    img_dedup_cleanup(&dedup);
+    blk_unref(blk);
+    return ret < 0;
+}
+
 
 static void dump_snapshots(BlockDriverState *bs)
 {
@@ -4932,7 +5779,7 @@ static int img_bitmap(int argc, char **argv)
         case BITMAP_ADD:
             qmp_block_dirty_bitmap_add(bs->node_name, bitmap,
                                        !!granularity, granularity, true, true,
-                                       false, false, &err);
+                                       false, false, false, false, &err);
             op = "add";
             break;
         case BITMAP_REMOVE:
@@ -188,6 +188,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
+    "                dirty-ring-harvesters=n (threads harvesting the KVM dirty rings, default 1)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n"
@@ -248,6 +249,13 @@ SRST
         is disabled (dirty-ring-size=0).  When enabled, KVM will instead
         record dirty pages in a bitmap.
 
+    ``dirty-ring-harvesters=n``
+        When the KVM dirty ring is enabled, it controls how many threads
+        collect the dirty rings in parallel, for example when migration
+        synchronizes the dirty bitmap.  The vCPUs are split among the
+        threads by their index.  Guests with many vCPUs and a high dirty
+        rate may want one thread per migration channel.  The default is 1.
+
     ``eager-split-size=n``
         KVM implements dirty page logging at the PAGE_SIZE granularity and
         enabling dirty-logging on a huge-page requires breaking it into
@@ -5991,7 +5999,7 @@ SRST
 
             CN=laptop.example.com,O=Example Home,L=London,ST=London,C=GB
 
-    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,aio-max-batch=aio-max-batch``
+    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,poll-latency-target-ns=poll-latency-target-ns,poll-cpu-budget=poll-cpu-budget,aio-max-batch=aio-max-batch``
         Creates a dedicated event loop thread that devices can be
         assigned to. This is known as an IOThread. By default device
         emulation happens in vCPU threads or the main event loop thread.
@@ -6027,6 +6035,20 @@ SRST
         the polling time when the algorithm detects it is spending too
         long polling without encountering events.
 
+        The ``poll-latency-target-ns`` parameter replaces the
+        ``poll-grow``/``poll-shrink`` heuristic with one that measures
+        how long the event loop waits for events and polls for the 99th
+        percentile of those wait times, but never longer than this value
+        or ``poll-max-ns``. Set it to the longest wait that should still
+        be covered by polling rather than by a wakeup. It has no effect
+        when ``poll-max-ns`` is 0, which disables polling.
+
+        The ``poll-cpu-budget`` parameter limits the percentage of time
+        that polling without finding events may take in that mode, from
+        0 to 100. 0 means no limit. ``query-iothreads`` reports the
+        current polling time and the total time spent on unsuccessful
+        polling, which helps to trade CPU time for latency per IOThread.
+
         The ``aio-max-batch`` parameter is the maximum number of requests
         in a batch for the AIO engine, 0 means that the engine will use
         its default.
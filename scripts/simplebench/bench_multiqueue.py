@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+#
+# Benchmark random I/O scaling over the number of virtio-blk queues
+#
+# Each case starts a guest with N iothreads and a virtio-blk device whose N
+# virtqueues are spread over them with iothread-vq-mapping, then runs fio with
+# one job per queue inside the guest. Sweeping N shows how well the block
+# layer below the device (format driver, throttling, BlockBackend) scales with
+# the number of iothreads submitting requests to the same node.
+#
+# For qcow2, only reads of already mapped clusters are answered without
+# taking s->lock; writes and cluster allocation still serialize on it. The
+# randwrite cases are therefore a reference, not a measure of lock-free
+# scaling.
+#
+# The guest image must have fio installed, accept root logins over ssh with
+# the invoking user's key and must not need the test disk to boot. The test
+# disk shows up as the second virtio-blk device (/dev/vdb).
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+import sys
+import os
+import subprocess
+import socket
+import json
+import time
+
+import simplebench
+from results_to_text import results_to_text
+
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..', 'python'))
+from qemu.machine import QEMUMachine
+from qemu.qmp import ConnectError
+
+
+SSH_PORT = 10022
+SSH_ARGS = ['ssh', '-p', str(SSH_PORT), '-o', 'StrictHostKeyChecking=no',
+            '-o', 'UserKnownHostsFile=/dev/null', '-o', 'BatchMode=yes',
+            '-o', 'ConnectTimeout=5', 'root@127.0.0.1']
+
+
+def guest_run(cmd, timeout=None):
+    return subprocess.run(SSH_ARGS + [cmd], stdout=subprocess.PIPE,
+                          stderr=subprocess.DEVNULL, universal_newlines=True,
+                          timeout=timeout)
+
+
+def wait_for_guest(timeout=300):
+    end = time.monotonic() + timeout
+    while time.monotonic() < end:
+        if guest_run('true', timeout=30).returncode == 0:
+            return True
+        time.sleep(1)
+    return False
+
+
+def qemu_args(env, case, test_img):
+    queues = case['queues']
+    mapping = [{'iothread': f'iothread{i}'} for i in range(queues)]
+    device = {
+        'driver': 'virtio-blk-pci',
+        'drive': 'test',
+        'num-queues': queues,
+        'iothread-vq-mapping': mapping,
+    }
+    blockdev = {
+        'driver': env['format'],
+        'node-name': 'test',
+        'cache': {'direct': True, 'no-flush': False},
+        'file': {
+            'driver': 'file',
+            'filename': test_img,
+            'aio': 'native',
+            'cache': {'direct': True, 'no-flush': False},
+        },
+    }
+
+    args = [env['qemu-binary'],
+            '-machine', 'q35,accel=kvm', '-cpu', 'host',
+            '-smp', str(max(queues, 2)), '-m', '2G', '-nographic',
+            '-drive', f"file={env['guest-image']},if=virtio,snapshot=on",
+            '-netdev', f'user,id=net0,hostfwd=tcp:127.0.0.1:{SSH_PORT}-:22',
+            '-device', 'virtio-net-pci,netdev=net0']
+    for i in range(queues):
+        args += ['-object', f'iothread,id=iothread{i}']
+    args += ['-blockdev', json.dumps(blockdev),
+             '-device', json.dumps(device)]
+    return args
+
+
+def bench_func(env, case):
+    test_img = os.path.join(case['dir'], 'multiqueue-test.img')
+    try:
+        os.remove(test_img)
+    except OSError:
+        pass
+
+    create_args = [env['qemu-img-binary'], 'create', '-f', env['format']]
+    if env['format'] == 'qcow2':
+        # Benchmark the steady state rather than cluster allocation
+        create_args += ['-o', 'preallocation=metadata']
+    subprocess.run(create_args + [test_img, case['size']],
+                   stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL,
+                   check=True)
+
+    args = qemu_args(env, case, test_img)
+    vm = QEMUMachine(args[0], args=args[1:])
+    try:
+        vm.launch()
+    except OSError as e:
+        return {'error': 'popen failed: ' + str(e)}
+    except (ConnectError, socket.timeout):
+        return {'error': 'qemu failed: ' + str(vm.get_log())}
+
+    try:
+        if not wait_for_guest():
+            return {'error': 'guest did not come up', 'vm-log': vm.get_log()}
+
+        fio = ('fio --name=bench --filename=/dev/vdb --direct=1 '
+               '--ioengine=libaio --group_reporting --time_based '
+               f"--rw={case['rw']} --bs={case['block-size']} "
+               f"--iodepth={case['iodepth']} --numjobs={case['queues']} "
+               f"--runtime={case['runtime']} --output-format=json")
+        p = guest_run(fio, timeout=case['runtime'] + 120)
+        if p.returncode != 0:
+            return {'error': f'fio failed: {p.returncode}: {p.stdout}'}
+
+        try:
+            job = json.loads(p.stdout)['jobs'][0]
+        except (ValueError, KeyError, IndexError):
+            return {'error': f'failed to parse fio output: {p.stdout}'}
+
+        return {'iops': job['read']['iops'] + job['write']['iops']}
+    finally:
+        vm.shutdown()
+        os.remove(test_img)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 5:
+        print(f'USAGE: {sys.argv[0]} <qemu binary> <qemu-img binary> '
+              '<guest image> <test dir> [QUEUES ...]')
+        print('Runs random read and write benchmarks against a raw and a '
+              'qcow2 test image\nin <test dir>, once for every number of '
+              'queues (default: 1 2 4 8).')
+        exit(1)
+
+    queue_counts = [int(q) for q in sys.argv[5:]] or [1, 2, 4, 8]
+
+    envs = [
+        {
+            'id': fmt,
+            'format': fmt,
+            'qemu-binary': sys.argv[1],
+            'qemu-img-binary': sys.argv[2],
+            'guest-image': sys.argv[3],
+        } for fmt in ('raw', 'qcow2')
+    ]
+
+    cases = []
+    for rw in ('randread', 'randwrite'):
+        for queues in queue_counts:
+            cases.append({
+                'id': f'{rw} 4k, {queues} queue(s)',
+                'rw': rw,
+                'block-size': '4k',
+                'iodepth': 32,
+                'queues': queues,
+                'runtime': 30,
+                'size': '8G',
+                'dir': sys.argv[4],
+            })
+
+    result = simplebench.bench(bench_func, envs, cases, count=3)
+    print(results_to_text(result))
+    with open('results.json', 'w') as f:
+        json.dump(result, f, indent=4)
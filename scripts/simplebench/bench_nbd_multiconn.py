@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+#
+# Benchmark the NBD client's multi-conn option
+#
+# For each number of connections N, a raw image is exported with qemu-nbd over
+# TCP loopback allowing N shared connections (which makes qemu-nbd advertise
+# NBD_FLAG_CAN_MULTI_CONN for N > 1), and qemu-img bench is run against it
+# with the NBD block driver opening multi-conn=N connections.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+import sys
+import os
+import signal
+import socket
+import subprocess
+import re
+import json
+
+import simplebench
+from results_to_text import results_to_text
+
+
+def free_port():
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+
+def qemu_img_bench(args):
+    p = subprocess.run(args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                       universal_newlines=True)
+
+    if p.returncode == 0:
+        try:
+            m = re.search(r'Run completed in (\d+.\d+) seconds.', p.stdout)
+            return {'seconds': float(m.group(1))}
+        except Exception:
+            return {'error': f'failed to parse qemu-img output: {p.stdout}'}
+    else:
+        return {'error': f'qemu-img failed: {p.returncode}: {p.stdout}'}
+
+
+def bench_func(env, case):
+    img = os.path.join(case['dir'], 'nbd-multiconn-test.raw')
+    pidfile = os.path.join(case['dir'], 'nbd-multiconn-test.pid')
+    port = free_port()
+
+    subprocess.run([env['qemu-img-binary'], 'create', '-f', 'raw', img,
+                    case['size']], stdout=subprocess.DEVNULL,
+                   stderr=subprocess.DEVNULL, check=True)
+
+    # --fork only returns once the server is listening
+    p = subprocess.run([env['qemu-nbd-binary'], '--fork', '--persistent',
+                        '--pid-file', pidfile, '--bind', '127.0.0.1',
+                        '--port', str(port), '--shared', str(env['conns']),
+                        '--format', 'raw', '--cache', 'none',
+                        '--aio', 'native', img],
+                       stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                       universal_newlines=True)
+    if p.returncode != 0:
+        os.remove(img)
+        return {'error': f'qemu-nbd failed: {p.returncode}: {p.stdout}'}
+
+    try:
+        opts = ('driver=nbd,server.type=inet,server.host=127.0.0.1,'
+                f"server.port={port},multi-conn={env['conns']}")
+        args = [env['qemu-img-binary'], 'bench', '-c', str(case['count']),
+                '-d', str(case['depth']), '-s', case['block-size'],
+                '-S', case['block-size'], '--image-opts', opts]
+        if case['write']:
+            args.append('-w')
+        res = qemu_img_bench(args)
+        if 'seconds' in res:
+            res['iops'] = case['count'] / res['seconds']
+        return res
+    finally:
+        with open(pidfile) as f:
+            os.kill(int(f.read()), signal.SIGTERM)
+        os.remove(pidfile)
+        os.remove(img)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 4:
+        print(f'USAGE: {sys.argv[0]} <qemu-img binary> <qemu-nbd binary> '
+              '<test dir> [CONNECTIONS ...]')
+        print('Runs read and write benchmarks against a qemu-nbd export of a '
+              'raw image in\n<test dir> over TCP loopback, once for every '
+              'number of client connections\n(default: 1 2 4 8).')
+        exit(1)
+
+    conn_counts = [int(c) for c in sys.argv[4:]] or [1, 2, 4, 8]
+
+    envs = [
+        {
+            'id': f'multi-conn={conns}',
+            'qemu-img-binary': sys.argv[1],
+            'qemu-nbd-binary': sys.argv[2],
+            'conns': conns,
+        } for conns in conn_counts
+    ]
+
+    cases = []
+    for write in (False, True):
+        for bs, count in (('4k', 400000), ('64k', 100000)):
+            cases.append({
+                'id': f"{'write' if write else 'read'} {bs}",
+                'write': write,
+                'block-size': bs,
+                'count': count,
+                'depth': 64,
+                'size': '4G',
+                'dir': sys.argv[3],
+            })
+
+    result = simplebench.bench(bench_func, envs, cases, count=3)
+    print(results_to_text(result))
+    with open('results.json', 'w') as f:
+        json.dump(result, f, indent=4)
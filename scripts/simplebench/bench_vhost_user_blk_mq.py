@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+#
+# Benchmark vhost-user-blk exports with virtqueues spread across IOThreads
+#
+# For each number of IOThreads N, qemu-storage-daemon exports a raw image or
+# block device over vhost-user-blk with a fixed number of virtqueues that are
+# assigned round-robin to N IOThreads with iothread-vq-mapping (N = 0 means
+# the default of processing all virtqueues in the main loop). fio's libblkio
+# engine acts as the vhost-user client, with one job per virtqueue. fio must
+# be built with libblkio support.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+import sys
+import os
+import subprocess
+import time
+import json
+
+import simplebench
+from results_to_text import results_to_text
+
+
+NUM_QUEUES = 8
+
+
+def start_daemon(env, case, sock):
+    args = [env['qsd-binary']]
+    mapping = []
+    for i in range(env['iothreads']):
+        args += ['--object', f'iothread,id=iothread{i}']
+        mapping.append(f'iothread-vq-mapping.{i}.iothread=iothread{i}')
+
+    driver = 'host_device' if case['device'].startswith('/dev/') else 'file'
+    args += ['--blockdev', f"driver={driver},node-name=disk,"
+             f"filename={case['device']},cache.direct=on,aio=native",
+             '--export', ','.join([
+                 'type=vhost-user-blk', 'id=export', 'node-name=disk',
+                 'writable=on', 'addr.type=unix', f'addr.path={sock}',
+                 f'num-queues={NUM_QUEUES}'] + mapping)]
+
+    p = subprocess.Popen(args, stdout=subprocess.DEVNULL,
+                         stderr=subprocess.DEVNULL)
+    for _ in range(100):
+        if os.path.exists(sock) or p.poll() is not None:
+            break
+        time.sleep(0.1)
+    return p
+
+
+def bench_func(env, case):
+    sock = os.path.join(case['dir'], 'vhost-user-blk-bench.sock')
+    daemon = start_daemon(env, case, sock)
+
+    try:
+        if daemon.poll() is not None:
+            return {'error': f'qemu-storage-daemon failed: {daemon.returncode}'}
+
+        # With thread=1, all jobs share one libblkio instance, one queue each
+        args = [env['fio-binary'], '--name=bench', '--output-format=json',
+                '--ioengine=libblkio',
+                '--libblkio_driver=virtio-blk-vhost-user',
+                f'--libblkio_path={sock}',
+                f'--libblkio_pre_start_props=num-queues={NUM_QUEUES}',
+                '--thread=1', f'--numjobs={NUM_QUEUES}', '--group_reporting',
+                '--direct=1', f"--rw={case['rw']}", f"--bs={case['bs']}",
+                f"--iodepth={case['iodepth']}", '--time_based',
+                f"--runtime={case['runtime']}", f"--size={case['size']}"]
+        p = subprocess.run(args, stdout=subprocess.PIPE,
+                           stderr=subprocess.STDOUT, universal_newlines=True)
+        if p.returncode != 0:
+            return {'error': f'fio failed: {p.returncode}: {p.stdout}'}
+
+        try:
+            job = json.loads(p.stdout)['jobs'][0]
+        except (ValueError, KeyError, IndexError):
+            return {'error': f'failed to parse fio output: {p.stdout}'}
+
+        op = 'read' if 'read' in case['rw'] else 'write'
+        return {'iops': job[op]['iops']}
+    finally:
+        daemon.terminate()
+        daemon.wait()
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 5:
+        print(f'USAGE: {sys.argv[0]} <qemu-storage-daemon binary> '
+              '<fio binary> <image or device> <test dir> [IOTHREADS ...]')
+        print(f'Runs 4k random read and write benchmarks against a '
+              f'vhost-user-blk export\nwith {NUM_QUEUES} virtqueues, once for '
+              'every number of IOThreads (default:\n0 1 2 4 8). The export '
+              'socket is created in <test dir>.\n'
+              'WARNING: the write benchmark overwrites <image or device>.')
+        exit(1)
+
+    iothread_counts = [int(n) for n in sys.argv[5:]] or [0, 1, 2, 4, 8]
+
+    envs = [
+        {
+            'id': f'iothreads={n}',
+            'qsd-binary': sys.argv[1],
+            'fio-binary': sys.argv[2],
+            'iothreads': n,
+        } for n in iothread_counts
+    ]
+
+    cases = [
+        {
+            'id': f'{rw} 4k',
+            'rw': rw,
+            'bs': '4k',
+            'iodepth': 32,
+            'runtime': 20,
+            'size': '1G',
+            'device': sys.argv[3],
+            'dir': sys.argv[4],
+        } for rw in ('randread', 'randwrite')
+    ]
+
+    result = simplebench.bench(bench_func, envs, cases, count=3)
+    print(results_to_text(result))
+    with open('results.json', 'w') as f:
+        json.dump(result, f, indent=4)
@@ -74,6 +74,12 @@ static QemuMutex dirtylimit_mutex;
 /* dirtylimit thread quit if dirtylimit_quit is true */
 static bool dirtylimit_quit;
 
+/*
+ * Number of users of vcpu_dirty_rate_stat: dirtylimit itself and
+ * migration auto-converge, protected by dirtylimit_mutex.
+ */
+static unsigned int vcpu_dirty_rate_stat_users;
+
 static void vcpu_dirty_rate_stat_collect(void)
 {
     VcpuStat stat;
@@ -191,6 +197,45 @@ __attribute__((__constructor__)) dirtylimit_mutex_init(void)
     qemu_mutex_init(&dirtylimit_mutex);
 }
 
+/* Must be called with dirtylimit_mutex held */
+static void vcpu_dirty_rate_stat_get(void)
+{
+    if (!vcpu_dirty_rate_stat_users++) {
+        vcpu_dirty_rate_stat_initialize();
+        vcpu_dirty_rate_stat_start();
+    }
+}
+
+/* Must be called with both BQL and dirtylimit_mutex held */
+static void vcpu_dirty_rate_stat_put(void)
+{
+    assert(vcpu_dirty_rate_stat_users);
+    if (!--vcpu_dirty_rate_stat_users) {
+        vcpu_dirty_rate_stat_stop();
+        vcpu_dirty_rate_stat_finalize();
+    }
+}
+
+/*
+ * Start sampling the dirty page rate of each vcpu in the background,
+ * without limiting it.  The rates are available with vcpu_dirty_rate_get()
+ * until vcpu_dirty_rate_track_stop() is called.
+ */
+void vcpu_dirty_rate_track_start(void)
+{
+    dirtylimit_state_lock();
+    vcpu_dirty_rate_stat_get();
+    dirtylimit_state_unlock();
+}
+
+/* Must be called with BQL held */
+void vcpu_dirty_rate_track_stop(void)
+{
+    dirtylimit_state_lock();
+    vcpu_dirty_rate_stat_put();
+    dirtylimit_state_unlock();
+}
+
 static inline VcpuDirtyLimitState *dirtylimit_vcpu_get_state(int cpu_index)
 {
     return &dirtylimit_state->states[cpu_index];
@@ -429,14 +474,12 @@ static void dirtylimit_init(void)
 {
     dirtylimit_state_initialize();
     dirtylimit_change(true);
-    vcpu_dirty_rate_stat_initialize();
-    vcpu_dirty_rate_stat_start();
+    vcpu_dirty_rate_stat_get();
 }
 
 static void dirtylimit_cleanup(void)
 {
-    vcpu_dirty_rate_stat_stop();
-    vcpu_dirty_rate_stat_finalize();
+    vcpu_dirty_rate_stat_put();
     dirtylimit_change(false);
     dirtylimit_state_finalize();
 }
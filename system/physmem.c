@@ -2209,6 +2209,80 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+/*
+ * Make @block use the memory of the file @fd, starting at @fd_offset,
+ * instead of its own.  The file is mapped over the current memory of the
+ * block, so the host address of the block does not change.  The block
+ * must already be backed by a shared file, and @fd must have the same
+ * page size.  Huge pages would be reserved for the memory of the block
+ * in addition to those of @fd, so hugetlb blocks must be RAM_NORESERVE.
+ * On success the block owns @fd.
+ */
+bool qemu_ram_replace_fd(RAMBlock *block, int fd, off_t fd_offset,
+                         Error **errp)
+{
+    int flags = MAP_SHARED | MAP_FIXED;
+    int prot = PROT_READ;
+    struct stat st;
+    void *area;
+
+    if (!(block->flags & RAM_SHARED) || (block->flags & RAM_PREALLOC) ||
+        block->fd < 0) {
+        error_setg(errp, "RAM block '%s' is not backed by a shared file",
+                   block->idstr);
+        return false;
+    }
+    if (block->page_size != qemu_real_host_page_size() &&
+        !(block->flags & RAM_NORESERVE)) {
+        error_setg(errp, "RAM block '%s' reserved huge pages of its own, "
+                   "its memory backend must have reserve=off", block->idstr);
+        return false;
+    }
+    if (qemu_fd_getpagesize(fd) != block->page_size) {
+        error_setg(errp, "RAM block '%s' has page size %zu, but the file "
+                   "has page size %zu", block->idstr, block->page_size,
+                   qemu_fd_getpagesize(fd));
+        return false;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Cannot stat file of RAM block '%s'",
+                         block->idstr);
+        return false;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size < fd_offset + block->max_length) {
+        error_setg(errp, "RAM block '%s' needs %" PRIu64 " bytes at offset "
+                   "%" PRIu64 ", but the file only has %" PRIu64 " bytes",
+                   block->idstr, (uint64_t)block->max_length,
+                   (uint64_t)fd_offset, (uint64_t)st.st_size);
+        return false;
+    }
+
+    flags |= block->flags & RAM_NORESERVE ? MAP_NORESERVE : 0;
+    prot |= block->flags & RAM_READONLY ? 0 : PROT_WRITE;
+    area = mmap(block->host, block->max_length, prot, flags, fd, fd_offset);
+    if (area == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Cannot map file of RAM block '%s'",
+                         block->idstr);
+        return false;
+    }
+    assert(area == block->host);
+    memory_try_enable_merging(block->host, block->max_length);
+    qemu_ram_setup_dump(block->host, block->max_length);
+
+    close(block->fd);
+    block->fd = fd;
+    block->fd_offset = fd_offset;
+    return true;
+}
+#else
+bool qemu_ram_replace_fd(RAMBlock *block, int fd, off_t fd_offset,
+                         Error **errp)
+{
+    error_setg(errp, "Replacing the memory of RAM blocks is not supported "
+               "on this host");
+    return false;
+}
 #endif /* !_WIN32 */
 
 /*
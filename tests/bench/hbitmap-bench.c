@@ -0,0 +1,91 @@
+/*
+ * QEMU HBitmap scanning speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/hbitmap.h"
+#include "qemu/units.h"
+
+/* 1 TiB worth of 64 KiB clusters at granularity 0: a 2 MiB bitmap */
+#define BENCH_BITS  (16 * MiB)
+
+typedef void (*BenchFn)(HBitmap *hb);
+
+static void bench_count(HBitmap *hb)
+{
+    /* Recomputes the number of set bits over the whole bitmap */
+    hbitmap_deserialize_finish(hb);
+}
+
+static void bench_next_zero(HBitmap *hb)
+{
+    hbitmap_next_zero(hb, 0, INT64_MAX);
+}
+
+static void bench_dirty_areas(HBitmap *hb)
+{
+    int64_t offset, count;
+
+    for (offset = 0;
+         hbitmap_next_dirty_area(hb, offset, BENCH_BITS, INT64_MAX,
+                                 &offset, &count);
+         offset += count) {
+        ;
+    }
+}
+
+static void run(const char *name, HBitmap *hb, BenchFn fn)
+{
+    int accel_index = 0;
+
+    do {
+        double total = 0.0;
+
+        g_test_timer_start();
+        do {
+            fn(hb);
+            total += BENCH_BITS / BITS_PER_BYTE;
+        } while (g_test_timer_elapsed() < 0.5);
+
+        total /= MiB;
+        g_test_message("%s #%d: %8.0f MB/sec", name, accel_index,
+                       total / g_test_timer_last());
+        accel_index++;
+    } while (test_hbitmap_next_accel());
+}
+
+static void test_full(const void *opaque)
+{
+    HBitmap *hb = hbitmap_alloc(BENCH_BITS, 0);
+
+    hbitmap_set(hb, 0, BENCH_BITS);
+    run("count, full", hb, bench_count);
+    run("next_zero, full", hb, bench_next_zero);
+    hbitmap_free(hb);
+}
+
+static void test_dense(const void *opaque)
+{
+    HBitmap *hb = hbitmap_alloc(BENCH_BITS, 0);
+    uint64_t i;
+
+    /* One clean cluster every 4 MiB of guest data */
+    hbitmap_set(hb, 0, BENCH_BITS);
+    for (i = 0; i < BENCH_BITS; i += 64) {
+        hbitmap_reset(hb, i + 17, 1);
+    }
+    run("count, dense", hb, bench_count);
+    run("dirty areas, dense", hb, bench_dirty_areas);
+    hbitmap_free(hb);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/hbitmap/speed/full", NULL, test_full);
+    g_test_add_data_func("/hbitmap/speed/dense", NULL, test_dense);
+    return g_test_run();
+}
@@ -1358,6 +1358,33 @@ static void test_postcopy_preempt(void)
     test_postcopy_common(&args);
 }
 
+static void *test_migrate_postcopy_prefetch_start(QTestState *from,
+                                                  QTestState *to)
+{
+    migrate_set_parameter_int(to, "postcopy-prefetch-pages", 16);
+
+    return NULL;
+}
+
+static void test_postcopy_prefetch(void)
+{
+    MigrateCommon args = {
+        .start_hook = test_migrate_postcopy_prefetch_start,
+    };
+
+    test_postcopy_common(&args);
+}
+
+static void test_postcopy_preempt_prefetch(void)
+{
+    MigrateCommon args = {
+        .postcopy_preempt = true,
+        .start_hook = test_migrate_postcopy_prefetch_start,
+    };
+
+    test_postcopy_common(&args);
+}
+
 #ifdef CONFIG_GNUTLS
 static void test_postcopy_tls_psk(void)
 {
@@ -2067,6 +2094,93 @@ test_migrate_xbzrle_start(QTestState *from,
     return NULL;
 }
 
+static void *
+test_migrate_defer_hot_pages_start(QTestState *from,
+                                   QTestState *to)
+{
+    migrate_set_capability(from, "x-defer-hot-pages", true);
+
+    return NULL;
+}
+
+static void test_migrate_defer_hot_pages_finish(QTestState *from,
+                                                QTestState *to,
+                                                void *opaque)
+{
+    g_assert_cmpint(read_ram_property_int(from, "hot-pages-deferred"), >, 0);
+    g_assert_cmpint(read_ram_property_int(from, "hot-resends-avoided"), >, 0);
+}
+
+static void test_precopy_unix_defer_hot_pages(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = uri,
+        .start_hook = test_migrate_defer_hot_pages_start,
+        .finish_hook = test_migrate_defer_hot_pages_finish,
+        .iterations = 2,
+        /*
+         * The guest keeps dirtying its pages, so that they become hot and
+         * get deferred from the second iteration on.
+         */
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
+static void *
+test_migrate_parallel_device_state_start(QTestState *from,
+                                         QTestState *to)
+{
+    migrate_set_capability(from, "x-parallel-device-state", true);
+
+    return NULL;
+}
+
+#define PARALLEL_DEVICE_STATE_OPTS                                      \
+    "-device migration-testdev,id=mt0,seed=1 "                          \
+    "-device migration-testdev,id=mt1,seed=2,size=3145728"
+
+static void test_migrate_parallel_device_state_finish(QTestState *from,
+                                                      QTestState *to,
+                                                      void *opaque)
+{
+    const char *ids[] = { "mt0", "mt1" };
+
+    for (int i = 0; i < ARRAY_SIZE(ids); i++) {
+        g_autofree char *path = g_strdup_printf("/machine/peripheral/%s",
+                                                ids[i]);
+
+        g_assert(qtest_qom_get_bool(from, path, "saved-in-thread"));
+        g_assert(qtest_qom_get_bool(to, path, "loaded-in-thread"));
+    }
+}
+
+/*
+ * Two migration-testdev devices complete precopy in device threads and
+ * send their state in MIG_CMD_DEVICE_STATE chunks; mt1 is larger than a
+ * chunk.  The destination loads each section in a thread and checks its
+ * content against the device's seed.
+ */
+static void test_precopy_unix_parallel_device_state(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .start = {
+            .opts_source = PARALLEL_DEVICE_STATE_OPTS,
+            .opts_target = PARALLEL_DEVICE_STATE_OPTS,
+        },
+        .connect_uri = uri,
+        .listen_uri = uri,
+        .start_hook = test_migrate_parallel_device_state_start,
+        .finish_hook = test_migrate_parallel_device_state_finish,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void test_precopy_unix_xbzrle(void)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -2204,6 +2318,36 @@ static void test_mode_reboot(void)
     test_file_common(&args, true);
 }
 
+static void *test_mode_local_start(QTestState *from, QTestState *to)
+{
+    migrate_set_parameter_str(from, "mode", "cpr-local");
+    migrate_set_parameter_str(to, "mode", "cpr-local");
+
+    return NULL;
+}
+
+static void test_mode_local_finish(QTestState *from, QTestState *to,
+                                   void *opaque)
+{
+    /* The shared guest RAM must have been handed over, not copied */
+    g_assert_cmpint(read_ram_property_int(from, "transferred"), <,
+                    1024 * 1024);
+}
+
+static void test_mode_local(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .start.use_shmem = true,
+        .connect_uri = uri,
+        .listen_uri = uri,
+        .start_hook = test_mode_local_start,
+        .finish_hook = test_mode_local_finish,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void test_precopy_file_mapped_ram_live(void)
 {
     g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
@@ -2230,6 +2374,35 @@ static void test_precopy_file_mapped_ram(void)
     test_file_common(&args, true);
 }
 
+#ifdef CONFIG_LINUX
+static void *migrate_mapped_ram_on_demand_start(QTestState *from,
+                                                QTestState *to)
+{
+    migrate_mapped_ram_start(from, to);
+    migrate_set_capability(to, "mapped-ram-on-demand", true);
+
+    return NULL;
+}
+
+static void test_precopy_file_mapped_ram_on_demand(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        /*
+         * Without userfaultfd, RAM is read before the guest starts, so
+         * this passes either way; with it, the guest's RAM is checked
+         * while it is being restored.
+         */
+        .start_hook = migrate_mapped_ram_on_demand_start,
+    };
+
+    test_file_common(&args, true);
+}
+#endif
+
 static void *migrate_multifd_mapped_ram_start(QTestState *from, QTestState *to)
 {
     migrate_mapped_ram_start(from, to);
@@ -2782,10 +2955,15 @@ static void test_validate_uri_channels_none_set(void)
  * To make things even worse, we need to run the initial stage at
  * 3MB/s so we enter autoconverge even when host is (over)loaded.
  */
-static void test_migrate_auto_converge(void)
+static void do_test_migrate_auto_converge(bool per_vcpu)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
-    MigrateStart args = {};
+    MigrateStart args = {
+        .use_dirty_ring = per_vcpu,
+        /* Only the boot CPU runs the guest code, the other one is idle */
+        .opts_source = per_vcpu ? "-smp 2" : NULL,
+        .opts_target = per_vcpu ? "-smp 2" : NULL,
+    };
     QTestState *from, *to;
     int64_t percentage;
 
@@ -2806,6 +2984,9 @@ static void test_migrate_auto_converge(void)
     migrate_set_parameter_int(from, "cpu-throttle-initial", init_pct);
     migrate_set_parameter_int(from, "cpu-throttle-increment", inc_pct);
     migrate_set_parameter_int(from, "max-cpu-throttle", max_pct);
+    if (per_vcpu) {
+        migrate_set_parameter_bool(from, "cpu-throttle-per-vcpu", true);
+    }
 
     /*
      * Set the initial parameters so that the migration could not converge
@@ -2834,6 +3015,18 @@ static void test_migrate_auto_converge(void)
     /* The first percentage of throttling should be at least init_pct */
     g_assert_cmpint(percentage, >=, init_pct);
 
+    /*
+     * Until the first dirty rate sample, all vcpus are throttled.  Once the
+     * idle one is known to dirty no memory, only the busy one must be.
+     */
+    if (per_vcpu) {
+        max_try_count = 10;
+        while (read_migrate_property_int(from, "cpu-throttle-vcpus") != 1) {
+            g_assert_cmpint(--max_try_count, >, 0);
+            sleep(1);
+        }
+    }
+
     /*
      * End the loop when the dirty sync count greater than 1.
      */
@@ -2885,6 +3078,20 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
+static void test_migrate_auto_converge(void)
+{
+    do_test_migrate_auto_converge(false);
+}
+
+/*
+ * Of the two guest vcpus, only the one that keeps dirtying memory must be
+ * throttled when only the vcpus dirtying memory are.
+ */
+static void test_migrate_auto_converge_per_vcpu(void)
+{
+    do_test_migrate_auto_converge(true);
+}
+
 static void *
 test_migrate_precopy_tcp_multifd_start_common(QTestState *from,
                                               QTestState *to,
@@ -2944,6 +3151,24 @@ test_migrate_precopy_tcp_multifd_zlib_start(QTestState *from,
     return test_migrate_precopy_tcp_multifd_start_common(from, to, "zlib");
 }
 
+static void *
+test_migrate_precopy_tcp_multifd_xbzrle_start(QTestState *from,
+                                              QTestState *to)
+{
+    migrate_set_parameter_int(from, "xbzrle-cache-size", 33554432);
+
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "xbzrle");
+}
+
+static void *
+test_migrate_precopy_tcp_multifd_xbzrle_legacy_start(QTestState *from,
+                                                     QTestState *to)
+{
+    test_migrate_precopy_tcp_multifd_xbzrle_start(from, to);
+    migrate_set_parameter_str(from, "zero-page-detection", "legacy");
+    return NULL;
+}
+
 #ifdef CONFIG_ZSTD
 static void *
 test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
@@ -2985,6 +3210,15 @@ test_migrate_precopy_tcp_multifd_uadk_start(QTestState *from,
 }
 #endif /* CONFIG_UADK */
 
+#ifdef CONFIG_LZ4
+static void *
+test_migrate_precopy_tcp_multifd_lz4_start(QTestState *from,
+                                           QTestState *to)
+{
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "lz4");
+}
+#endif /* CONFIG_LZ4 */
+
 static void test_multifd_tcp_uri_none(void)
 {
     MigrateCommon args = {
@@ -3000,6 +3234,23 @@ static void test_multifd_tcp_uri_none(void)
     test_precopy_common(&args);
 }
 
+/*
+ * Shrink the dirty bitmap sync chunks to 256K so that the guest spans many
+ * chunks and migration_bitmap_sync() takes the parallel path
+ */
+static void test_multifd_tcp_sync_chunks(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_start,
+        .start = {
+            .opts_source = "-global migration.x-ram-sync-chunk-shift=6",
+        },
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_zero_page_legacy(void)
 {
     MigrateCommon args = {
@@ -3054,6 +3305,36 @@ static void test_multifd_tcp_zlib(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_xbzrle(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_xbzrle_start,
+        .iterations = 2,
+        /*
+         * XBZRLE needs pages to be modified when doing the 2nd+ round
+         * iteration to have real data pushed to the stream.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
+/*
+ * Zero pages are sent by the migration thread, which must clear them in the
+ * cache of the multifd channels
+ */
+static void test_multifd_tcp_xbzrle_zero_page_legacy(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_xbzrle_legacy_start,
+        .iterations = 2,
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 #ifdef CONFIG_ZSTD
 static void test_multifd_tcp_zstd(void)
 {
@@ -3098,6 +3379,22 @@ static void test_multifd_tcp_uadk(void)
 }
 #endif
 
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_lz4_start,
+        /*
+         * Pages are compressed while the guest writes to them, make sure
+         * that each of them still decompresses to exactly one page.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+#endif
+
 #ifdef CONFIG_GNUTLS
 static void *
 test_migrate_multifd_tcp_tls_psk_start_match(QTestState *from,
@@ -3836,6 +4133,10 @@ int main(int argc, char **argv)
                            test_postcopy_recovery);
         migration_test_add("/migration/postcopy/preempt/plain",
                            test_postcopy_preempt);
+        migration_test_add("/migration/postcopy/prefetch",
+                           test_postcopy_prefetch);
+        migration_test_add("/migration/postcopy/preempt/prefetch",
+                           test_postcopy_preempt_prefetch);
         migration_test_add("/migration/postcopy/preempt/recovery/plain",
                            test_postcopy_preempt_recovery);
         migration_test_add("/migration/postcopy/recovery/double-failures/handshake",
@@ -3854,6 +4155,12 @@ int main(int argc, char **argv)
         migration_test_add("/migration/precopy/unix/xbzrle",
                            test_precopy_unix_xbzrle);
     }
+    migration_test_add("/migration/precopy/unix/x-defer-hot-pages",
+                       test_precopy_unix_defer_hot_pages);
+    if (qtest_has_device("migration-testdev")) {
+        migration_test_add("/migration/precopy/unix/x-parallel-device-state",
+                           test_precopy_unix_parallel_device_state);
+    }
     migration_test_add("/migration/precopy/file",
                        test_precopy_file);
     migration_test_add("/migration/precopy/file/offset",
@@ -3871,12 +4178,17 @@ int main(int argc, char **argv)
      */
     if (getenv("QEMU_TEST_FLAKY_TESTS")) {
         migration_test_add("/migration/mode/reboot", test_mode_reboot);
+        migration_test_add("/migration/mode/local", test_mode_local);
     }
 
     migration_test_add("/migration/precopy/file/mapped-ram",
                        test_precopy_file_mapped_ram);
     migration_test_add("/migration/precopy/file/mapped-ram/live",
                        test_precopy_file_mapped_ram_live);
+#ifdef CONFIG_LINUX
+    migration_test_add("/migration/precopy/file/mapped-ram/on-demand",
+                       test_precopy_file_mapped_ram_on_demand);
+#endif
 
     migration_test_add("/migration/multifd/file/mapped-ram",
                        test_multifd_file_mapped_ram);
@@ -3976,12 +4288,16 @@ int main(int argc, char **argv)
             has_kvm && kvm_dirty_ring_supported()) {
             migration_test_add("/migration/dirty_limit",
                                test_migrate_dirty_limit);
+            migration_test_add("/migration/auto_converge/per-vcpu",
+                               test_migrate_auto_converge_per_vcpu);
         }
     }
     migration_test_add("/migration/multifd/tcp/uri/plain/none",
                        test_multifd_tcp_uri_none);
     migration_test_add("/migration/multifd/tcp/channels/plain/none",
                        test_multifd_tcp_channels_none);
+    migration_test_add("/migration/multifd/tcp/plain/sync-chunks",
+                       test_multifd_tcp_sync_chunks);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/legacy",
                        test_multifd_tcp_zero_page_legacy);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/none",
@@ -3990,6 +4306,10 @@ int main(int argc, char **argv)
                        test_multifd_tcp_cancel);
     migration_test_add("/migration/multifd/tcp/plain/zlib",
                        test_multifd_tcp_zlib);
+    migration_test_add("/migration/multifd/tcp/plain/xbzrle",
+                       test_multifd_tcp_xbzrle);
+    migration_test_add("/migration/multifd/tcp/plain/xbzrle/zero-page/legacy",
+                       test_multifd_tcp_xbzrle_zero_page_legacy);
 #ifdef CONFIG_ZSTD
     migration_test_add("/migration/multifd/tcp/plain/zstd",
                        test_multifd_tcp_zstd);
@@ -4006,6 +4326,10 @@ int main(int argc, char **argv)
     migration_test_add("/migration/multifd/tcp/plain/uadk",
                        test_multifd_tcp_uadk);
 #endif
+#ifdef CONFIG_LZ4
+    migration_test_add("/migration/multifd/tcp/plain/lz4",
+                       test_multifd_tcp_lz4);
+#endif
 #ifdef CONFIG_GNUTLS
     migration_test_add("/migration/multifd/tcp/tls/psk/match",
                        test_multifd_tcp_tls_psk_match);
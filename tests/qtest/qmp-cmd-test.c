@@ -341,6 +341,63 @@ static void test_object_add_failure_modes(void)
     qtest_quit(qts);
 }
 
+#ifndef _WIN32
+static void test_iothread_poll_target(void)
+{
+    QTestState *qts;
+    QDict *resp;
+
+    qts = qtest_init(common_args);
+
+    /* poll-cpu-budget is a percentage */
+    resp = qtest_qmp(qts, "{'execute': 'object-add', 'arguments':"
+                     " {'qom-type': 'iothread', 'id': 'iothread0',"
+                     " 'poll-latency-target-ns': 100000,"
+                     " 'poll-cpu-budget': 101 } }");
+    qmp_expect_error_and_unref(resp, "GenericError");
+
+    resp = qtest_qmp(qts, "{'execute': 'object-add', 'arguments':"
+                     " {'qom-type': 'iothread', 'id': 'iothread0',"
+                     " 'poll-latency-target-ns': 100000,"
+                     " 'poll-cpu-budget': 20 } }");
+    g_assert(qdict_haskey(resp, "return"));
+    qobject_unref(resp);
+
+    resp = qtest_qmp(qts, "{'execute': 'qom-set', 'arguments':"
+                     " {'path': '/objects/iothread0',"
+                     " 'property': 'poll-latency-target-ns',"
+                     " 'value': 50000 } }");
+    g_assert(qdict_haskey(resp, "return"));
+    qobject_unref(resp);
+
+    /* Rejected values leave the property unchanged */
+    resp = qtest_qmp(qts, "{'execute': 'qom-set', 'arguments':"
+                     " {'path': '/objects/iothread0',"
+                     " 'property': 'poll-cpu-budget', 'value': 101 } }");
+    qmp_expect_error_and_unref(resp, "GenericError");
+
+    resp = qtest_qmp(qts, "{'execute': 'qom-set', 'arguments':"
+                     " {'path': '/objects/iothread0',"
+                     " 'property': 'poll-latency-target-ns',"
+                     " 'value': -1 } }");
+    qmp_expect_error_and_unref(resp, "GenericError");
+
+    resp = qtest_qmp(qts, "{'execute': 'qom-get', 'arguments':"
+                     " {'path': '/objects/iothread0',"
+                     " 'property': 'poll-cpu-budget' } }");
+    g_assert_cmpint(qdict_get_int(resp, "return"), ==, 20);
+    qobject_unref(resp);
+
+    resp = qtest_qmp(qts, "{'execute': 'qom-get', 'arguments':"
+                     " {'path': '/objects/iothread0',"
+                     " 'property': 'poll-latency-target-ns' } }");
+    g_assert_cmpint(qdict_get_int(resp, "return"), ==, 50000);
+    qobject_unref(resp);
+
+    qtest_quit(qts);
+}
+#endif
+
 int main(int argc, char *argv[])
 {
     QmpSchema schema;
@@ -353,6 +410,9 @@ int main(int argc, char *argv[])
 
     qtest_add_func("qmp/object-add-failure-modes",
                    test_object_add_failure_modes);
+#ifndef _WIN32
+    qtest_add_func("qmp/iothread-poll-target", test_iothread_poll_target);
+#endif
 
     ret = g_test_run();
 
@@ -12,6 +12,8 @@
 #include "libqtest-single.h"
 #include "qemu/bswap.h"
 #include "qemu/module.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "standard-headers/linux/virtio_blk.h"
 #include "standard-headers/linux/virtio_pci.h"
 #include "libqos/qgraph.h"
@@ -771,6 +773,124 @@ static void resize(void *obj, void *data, QGuestAllocator *t_alloc)
 
 }
 
+#define NOTIFY_COALESCE_REQS    8
+
+/* Returns the x-notify-stats entry of virtqueue @index */
+static QDict *get_notify_stats(QTestState *qts, uint16_t index)
+{
+    QDict *resp;
+    QList *devices;
+    QListEntry *e;
+    g_autofree char *path = NULL;
+    QDict *stats = NULL;
+
+    resp = qtest_qmp(qts, "{ 'execute': 'x-query-virtio' }");
+    devices = qdict_get_qlist(resp, "return");
+    QLIST_FOREACH_ENTRY(devices, e) {
+        QDict *d = qobject_to(QDict, qlist_entry_obj(e));
+
+        if (!strcmp(qdict_get_str(d, "name"), "virtio-blk")) {
+            path = g_strdup(qdict_get_str(d, "path"));
+            break;
+        }
+    }
+    qobject_unref(resp);
+    g_assert(path);
+
+    resp = qtest_qmp(qts, "{ 'execute': 'qom-get', 'arguments': "
+                     "{ 'path': %s, 'property': 'x-notify-stats' } }", path);
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(resp, "return"), e) {
+        QDict *d = qobject_to(QDict, qlist_entry_obj(e));
+
+        if (qdict_get_int(d, "index") == index) {
+            stats = qobject_ref(d);
+            break;
+        }
+    }
+    qobject_unref(resp);
+    g_assert(stats);
+
+    return stats;
+}
+
+static void notify_coalesce(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QTestState *qts = global_qtest;
+    QVirtioBlkReq req;
+    uint64_t req_addr[NOTIFY_COALESCE_REQS];
+    uint32_t free_head[NOTIFY_COALESCE_REQS];
+    uint64_t completions, notifications;
+    QVirtQueue *vq;
+    QDict *stats;
+    gint64 start_time;
+    int i, done;
+
+    /* Queue depth 1: every completion must be notified immediately */
+    vq = test_basic(dev, t_alloc);
+
+    stats = get_notify_stats(qts, 0);
+    completions = qdict_get_int(stats, "completions");
+    g_assert_cmpint(completions, >, 0);
+    g_assert_cmpint(qdict_get_int(stats, "notifications"), ==, completions);
+    g_assert_cmpint(qdict_get_int(stats, "timer-notifications"), ==, 0);
+    qobject_unref(stats);
+
+    /*
+     * Submit a burst of requests. The device may complete some of them
+     * before it sees the later kicks, so the number of notifications is not
+     * deterministic. Stepping the virtual clock lets the timer notify any
+     * partial batch.
+     */
+    for (i = 0; i < NOTIFY_COALESCE_REQS; i++) {
+        req.type = VIRTIO_BLK_T_OUT;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+        strcpy(req.data, "TEST");
+
+        req_addr[i] = virtio_blk_request(t_alloc, dev, &req, 512);
+
+        g_free(req.data);
+
+        free_head[i] = qvirtqueue_add(qts, vq, req_addr[i], 16, false, true);
+        qvirtqueue_add(qts, vq, req_addr[i] + 16, 512, false, true);
+        qvirtqueue_add(qts, vq, req_addr[i] + 528, 1, true, false);
+    }
+    for (i = 0; i < NOTIFY_COALESCE_REQS; i++) {
+        qvirtqueue_kick(qts, dev, vq, free_head[i]);
+    }
+
+    start_time = g_get_monotonic_time();
+    for (done = 0; done < NOTIFY_COALESCE_REQS;) {
+        /* 100 us of virtual time, a tenth of notify-coalesce-max-delay-us */
+        qtest_clock_step(qts, 100 * 1000);
+        while (qvirtqueue_get_buf(qts, vq, NULL, NULL)) {
+            done++;
+        }
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_BLK_TIMEOUT_US);
+    }
+
+    for (i = 0; i < NOTIFY_COALESCE_REQS; i++) {
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+        guest_free(t_alloc, req_addr[i]);
+    }
+
+    stats = get_notify_stats(qts, 0);
+    g_assert_cmpint(qdict_get_int(stats, "completions"), ==,
+                    completions + NOTIFY_COALESCE_REQS);
+    notifications = qdict_get_int(stats, "notifications") - completions;
+    g_assert_cmpint(notifications, >, 0);
+    g_assert_cmpint(notifications, <=, NOTIFY_COALESCE_REQS);
+    g_assert_cmpint(qdict_get_int(stats, "timer-notifications"), <=,
+                    notifications);
+    qobject_unref(stats);
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
 static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
 {
     char *tmp_path = drive_create();
@@ -785,16 +905,30 @@ static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
     return arg;
 }
 
+static void *virtio_blk_notify_coalesce_setup(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line,
+                    " -global virtio-blk-device.notify-coalesce-max-batch=4"
+                    " -global virtio-blk-device.notify-coalesce-max-delay-us=1000 ");
+
+    return virtio_blk_test_setup(cmd_line, arg);
+}
+
 static void register_virtio_blk_test(void)
 {
     QOSGraphTestOptions opts = {
         .before = virtio_blk_test_setup,
     };
+    QOSGraphTestOptions notify_coalesce_opts = {
+        .before = virtio_blk_notify_coalesce_setup,
+    };
 
     qos_add_test("indirect", "virtio-blk", indirect, &opts);
     qos_add_test("config", "virtio-blk", config, &opts);
     qos_add_test("basic", "virtio-blk", basic, &opts);
     qos_add_test("resize", "virtio-blk", resize, &opts);
+    qos_add_test("notify-coalesce", "virtio-blk", notify_coalesce,
+                 &notify_coalesce_opts);
 
     /* tests just for virtio-blk-pci */
     qos_add_test("msix", "virtio-blk-pci", msix, &opts);
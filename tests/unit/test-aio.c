@@ -424,6 +424,60 @@ static void test_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+#ifndef _WIN32
+/*
+ * Wait for a timer that fires every 200 microseconds for @duration_ms, and
+ * return the polling time that the AioContext arrived at.
+ */
+static int64_t poll_target_run(int64_t duration_ms)
+{
+    TimerTestData data = { .n = 0, .ctx = ctx, .ns = 200 * SCALE_US,
+                           .max = INT_MAX,
+                           .clock_type = QEMU_CLOCK_REALTIME };
+    int64_t end = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + duration_ms;
+    int64_t poll_ns;
+    uint64_t wasted_ns;
+    EventNotifier e;
+
+    /* aio_poll() only blocks for timers if it has an fd to wait on */
+    event_notifier_init(&e, false);
+    set_event_notifier(ctx, &e, dummy_io_handler_read);
+
+    aio_timer_init(ctx, &data.timer, data.clock_type,
+                   SCALE_NS, timer_test_cb, &data);
+    timer_mod(&data.timer, qemu_clock_get_ns(data.clock_type) + data.ns);
+    while (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) < end) {
+        aio_poll(ctx, true);
+    }
+    timer_del(&data.timer);
+
+    set_event_notifier(ctx, &e, NULL);
+    event_notifier_cleanup(&e);
+
+    aio_context_get_poll_stats(ctx, &poll_ns, &wasted_ns);
+    return poll_ns;
+}
+
+static void test_poll_target(void)
+{
+    Error *local_err = NULL;
+
+    /* Events take about 200us, so the 99th percentile is above the target */
+    aio_context_set_poll_params(ctx, 1000 * SCALE_US, 0, 0, &error_abort);
+    aio_context_set_poll_target(ctx, 50 * SCALE_US, 0, &error_abort);
+    g_assert_cmpint(poll_target_run(200), ==, 50 * SCALE_US);
+
+    /* Only poll-max-ns enables polling */
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    g_assert_cmpint(poll_target_run(200), ==, 0);
+
+    aio_context_set_poll_target(ctx, 50 * SCALE_US, 101, &local_err);
+    error_free_or_abort(&local_err);
+
+    aio_context_set_poll_target(ctx, 0, 0, &error_abort);
+}
+#endif
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -847,6 +901,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+#ifndef _WIN32
+    g_test_add_func("/aio/poll/target",             test_poll_target);
+#endif
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
     g_test_add_func("/aio/coroutine/worker-thread-co-enter", test_worker_thread_co_enter);
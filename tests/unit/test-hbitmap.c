@@ -12,6 +12,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/bitmap.h"
+#include "qapi/error.h"
 #include "block/block.h"
 
 #define LOG_BITS_PER_LONG          (BITS_PER_LONG == 32 ? 5 : 6)
@@ -26,6 +27,7 @@ typedef struct TestHBitmapData {
     size_t         size;
     size_t         old_size;
     int            granularity;
+    bool           sparse;
 } TestHBitmapData;
 
 
@@ -79,7 +81,8 @@ static void hbitmap_test_init(TestHBitmapData *data,
                               uint64_t size, int granularity)
 {
     size_t n;
-    data->hb = hbitmap_alloc(size, granularity);
+    data->hb = data->sparse ? hbitmap_alloc_sparse(size, granularity) :
+                              hbitmap_alloc(size, granularity);
 
     n = DIV_ROUND_UP(size, BITS_PER_LONG);
     if (n == 0) {
@@ -800,6 +803,21 @@ static void hbitmap_test_add(const char *testpath,
                hbitmap_test_teardown);
 }
 
+static void hbitmap_test_setup_sparse(TestHBitmapData *data,
+                                      const void *unused)
+{
+    data->sparse = true;
+}
+
+/* Run the same test against a sparse bitmap */
+static void hbitmap_test_add_sparse(const char *testpath,
+                                    void (*test_func)(TestHBitmapData *data,
+                                                      const void *user_data))
+{
+    g_test_add(testpath, TestHBitmapData, NULL, hbitmap_test_setup_sparse,
+               test_func, hbitmap_test_teardown);
+}
+
 static void test_hbitmap_iter_and_reset(TestHBitmapData *data,
                                         const void *unused)
 {
@@ -1042,6 +1060,80 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+static void test_hbitmap_sparse_to_dense(TestHBitmapData *data,
+                                         const void *unused)
+{
+    HBitmapIter hbi;
+    uint64_t i;
+
+    hbitmap_test_init(data, L2, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_iter_init(&hbi, data->hb, 0);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, 0);
+
+    /* One run per bit, until the runs outgrow a regular bitmap */
+    for (i = 2; hbitmap_is_sparse(data->hb); i += 2) {
+        g_assert_cmpint(i, <, L2);
+        hbitmap_test_set(data, i, 1);
+    }
+    hbitmap_test_reset(data, 4, 2);
+    hbitmap_test_set(data, L2 - 1, 1);
+
+    /* The iterator carries on with the regular bitmap */
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, 2);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, 6);
+}
+
+static void test_hbitmap_sparse_sha256(TestHBitmapData *data,
+                                       const void *unused)
+{
+    g_autofree char *sparse_hash = NULL;
+    g_autofree char *dense_hash = NULL;
+    HBitmap *dense;
+
+    hbitmap_test_init(data, L3, 0);
+    dense = hbitmap_alloc(L3, 0);
+
+    hbitmap_set(data->hb, 5, 100);
+    hbitmap_set(dense, 5, 100);
+    hbitmap_set(data->hb, L3 - 1, 1);
+    hbitmap_set(dense, L3 - 1, 1);
+
+    sparse_hash = hbitmap_sha256(data->hb, &error_abort);
+    dense_hash = hbitmap_sha256(dense, &error_abort);
+    g_assert_cmpstr(sparse_hash, ==, dense_hash);
+
+    hbitmap_free(dense);
+}
+
+static void test_hbitmap_accel(TestHBitmapData *data, const void *unused)
+{
+    do {
+        hbitmap_test_init(data, L3 * 2, 0);
+
+        /* A dense run over several whole groups of words, with holes */
+        hbitmap_test_set(data, L2 - 3, L2 * 3 + 7);
+        hbitmap_test_reset(data, L2 * 2 + 5, 1);
+        hbitmap_test_set(data, L3 + 1, L2 * 5);
+        hbitmap_test_reset(data, L3 + L2 * 2, L1);
+        hbitmap_test_set(data, L3 * 2 - L1 - 1, L1 + 1);
+
+        test_hbitmap_next_x_check(data, 0);
+        test_hbitmap_next_x_check(data, L2);
+        test_hbitmap_next_x_check(data, L2 * 2 + 4);
+        test_hbitmap_next_x_check(data, L3 + 2);
+        test_hbitmap_next_x_check_range(data, L3 + 2, L2);
+        test_hbitmap_next_dirty_area_check(data, L2, INT64_MAX);
+        test_hbitmap_next_dirty_area_check(data, L3, INT64_MAX);
+
+        /* Recompute the count from scratch */
+        hbitmap_deserialize_finish(data->hb);
+        hbitmap_test_check(data, 0);
+
+        hbitmap_test_teardown(data, NULL);
+    } while (test_hbitmap_next_accel());
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1113,6 +1205,40 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    hbitmap_test_add_sparse("/hbitmap/sparse/iter/partial",
+                            test_hbitmap_iter_partial);
+    hbitmap_test_add_sparse("/hbitmap/sparse/iter/granularity",
+                            test_hbitmap_iter_granularity);
+    hbitmap_test_add_sparse("/hbitmap/sparse/get/some",
+                            test_hbitmap_get_some);
+    hbitmap_test_add_sparse("/hbitmap/sparse/set/general", test_hbitmap_set);
+    hbitmap_test_add_sparse("/hbitmap/sparse/set/overlap",
+                            test_hbitmap_set_overlap);
+    hbitmap_test_add_sparse("/hbitmap/sparse/reset/general",
+                            test_hbitmap_reset);
+    hbitmap_test_add_sparse("/hbitmap/sparse/reset/all",
+                            test_hbitmap_reset_all);
+    hbitmap_test_add_sparse("/hbitmap/sparse/truncate/grow/medium",
+                            test_hbitmap_truncate_grow_medium);
+    hbitmap_test_add_sparse("/hbitmap/sparse/truncate/shrink/medium",
+                            test_hbitmap_truncate_shrink_medium);
+    hbitmap_test_add_sparse("/hbitmap/sparse/serialize/basic",
+                            test_hbitmap_serialize_basic);
+    hbitmap_test_add_sparse("/hbitmap/sparse/serialize/part",
+                            test_hbitmap_serialize_part);
+    hbitmap_test_add_sparse("/hbitmap/sparse/serialize/zeroes",
+                            test_hbitmap_serialize_zeroes);
+    hbitmap_test_add_sparse("/hbitmap/sparse/next_zero/next_x_4",
+                            test_hbitmap_next_x_4);
+    hbitmap_test_add_sparse("/hbitmap/sparse/next_dirty_area/next_dirty_area_1",
+                            test_hbitmap_next_dirty_area_1);
+    hbitmap_test_add_sparse("/hbitmap/sparse/to_dense",
+                            test_hbitmap_sparse_to_dense);
+    hbitmap_test_add_sparse("/hbitmap/sparse/sha256",
+                            test_hbitmap_sparse_sha256);
+
+    hbitmap_test_add("/hbitmap/accel", test_hbitmap_accel);
+
     g_test_run();
 
     return 0;
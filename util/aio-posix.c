@@ -22,6 +22,7 @@
 #include "qemu/rcu_queue.h"
 #include "qemu/sockets.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "trace.h"
 #include "aio-posix.h"
 
@@ -549,6 +550,11 @@ static bool run_poll_handlers(AioContext *ctx, AioHandlerList *ready_list,
         assert(!(max_ns && progress));
     } while (elapsed_time < max_ns && !ctx->fdmon_ops->need_wait(ctx));
 
+    if (!progress) {
+        ctx->poll_window_wasted_ns += elapsed_time;
+        stat64_add(&ctx->poll_wasted_ns, elapsed_time);
+    }
+
     if (remove_idle_poll_handlers(ctx, ready_list,
                                   start_time + elapsed_time)) {
         *timeout = 0;
@@ -585,7 +591,7 @@ static bool try_poll_mode(AioContext *ctx, AioHandlerList *ready_list,
         return false;
     }
 
-    max_ns = qemu_soonest_timeout(*timeout, ctx->poll_ns);
+    max_ns = qemu_soonest_timeout(*timeout, qatomic_read(&ctx->poll_ns));
     if (max_ns && !ctx->fdmon_ops->need_wait(ctx)) {
         /*
          * Enable poll mode. It pairs with the poll_set_started() in
@@ -600,6 +606,72 @@ static bool try_poll_mode(AioContext *ctx, AioHandlerList *ready_list,
     return false;
 }
 
+/* Minimum length and number of samples of a latency target mode window */
+#define POLL_WINDOW_NS          (50 * SCALE_MS)
+#define POLL_WINDOW_MIN_SAMPLES 64
+
+/*
+ * adjust_poll_time_to_target:
+ * @ctx: the AioContext
+ * @now: current time
+ * @block_ns: how long the last aio_poll() took to find an event
+ *
+ * Collect the wait times of one window and then set the polling time to
+ * their 99th percentile, so that most events are found by polling without
+ * polling for the outliers.  The result is limited by the latency target
+ * and poll_max_ns.  If there is a CPU budget, assume that the unsuccessful
+ * polling time scales with the polling time and keep it within the budget.
+ */
+static void adjust_poll_time_to_target(AioContext *ctx, int64_t now,
+                                       int64_t block_ns)
+{
+    int64_t old_ns = qatomic_read(&ctx->poll_ns);
+    int64_t window_ns, new_ns, p99_ns;
+    unsigned threshold, seen;
+    int i;
+
+    if (!ctx->poll_window_start) {
+        memset(ctx->poll_hist, 0, sizeof(ctx->poll_hist));
+        ctx->poll_window_samples = 0;
+        ctx->poll_window_wasted_ns = 0;
+        ctx->poll_window_start = now;
+    }
+
+    i = MIN(63 - clz64(block_ns | 1), AIO_POLL_HIST_BUCKETS - 1);
+    ctx->poll_hist[i]++;
+    ctx->poll_window_samples++;
+
+    window_ns = now - ctx->poll_window_start;
+    if (window_ns < POLL_WINDOW_NS ||
+        ctx->poll_window_samples < POLL_WINDOW_MIN_SAMPLES) {
+        return;
+    }
+
+    /* Bucket i counts wait times in [2^i, 2^(i+1)) */
+    threshold = ctx->poll_window_samples - ctx->poll_window_samples / 100;
+    seen = 0;
+    for (i = 0; i < AIO_POLL_HIST_BUCKETS - 1; i++) {
+        seen += ctx->poll_hist[i];
+        if (seen >= threshold) {
+            break;
+        }
+    }
+    p99_ns = 1LL << (i + 1);
+
+    new_ns = MIN(p99_ns, MIN(ctx->poll_target_ns, ctx->poll_max_ns));
+    if (ctx->poll_cpu_budget && ctx->poll_window_wasted_ns) {
+        int64_t budget_ns = window_ns * ctx->poll_cpu_budget / 100;
+
+        new_ns = MIN(new_ns, old_ns * budget_ns /
+                             ctx->poll_window_wasted_ns);
+    }
+
+    trace_poll_adjust(ctx, old_ns, new_ns, p99_ns,
+                      ctx->poll_window_wasted_ns, window_ns);
+    qatomic_set(&ctx->poll_ns, new_ns);
+    ctx->poll_window_start = 0;
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandlerList ready_list = QLIST_HEAD_INITIALIZER(ready_list);
@@ -683,40 +755,44 @@ bool aio_poll(AioContext *ctx, bool blocking)
     if (ctx->poll_max_ns) {
         int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
 
-        if (block_ns <= ctx->poll_ns) {
+        if (ctx->poll_target_ns) {
+            adjust_poll_time_to_target(ctx, start + block_ns, block_ns);
+        } else if (block_ns <= qatomic_read(&ctx->poll_ns)) {
             /* This is the sweet spot, no adjustment needed */
         } else if (block_ns > ctx->poll_max_ns) {
             /* We'd have to poll for too long, poll less */
-            int64_t old = ctx->poll_ns;
+            int64_t old = qatomic_read(&ctx->poll_ns);
 
             if (ctx->poll_shrink) {
-                ctx->poll_ns /= ctx->poll_shrink;
+                qatomic_set(&ctx->poll_ns, old / ctx->poll_shrink);
             } else {
-                ctx->poll_ns = 0;
+                qatomic_set(&ctx->poll_ns, 0);
             }
 
-            trace_poll_shrink(ctx, old, ctx->poll_ns);
-        } else if (ctx->poll_ns < ctx->poll_max_ns &&
+            trace_poll_shrink(ctx, old, qatomic_read(&ctx->poll_ns));
+        } else if (qatomic_read(&ctx->poll_ns) < ctx->poll_max_ns &&
                    block_ns < ctx->poll_max_ns) {
             /* There is room to grow, poll longer */
-            int64_t old = ctx->poll_ns;
+            int64_t old = qatomic_read(&ctx->poll_ns);
             int64_t grow = ctx->poll_grow;
+            int64_t new_ns;
 
             if (grow == 0) {
                 grow = 2;
             }
 
-            if (ctx->poll_ns) {
-                ctx->poll_ns *= grow;
+            if (old) {
+                new_ns = old * grow;
             } else {
-                ctx->poll_ns = 4000; /* start polling at 4 microseconds */
+                new_ns = 4000; /* start polling at 4 microseconds */
             }
 
-            if (ctx->poll_ns > ctx->poll_max_ns) {
-                ctx->poll_ns = ctx->poll_max_ns;
+            if (new_ns > ctx->poll_max_ns) {
+                new_ns = ctx->poll_max_ns;
             }
+            qatomic_set(&ctx->poll_ns, new_ns);
 
-            trace_poll_grow(ctx, old, ctx->poll_ns);
+            trace_poll_grow(ctx, old, new_ns);
         }
     }
 
@@ -771,13 +847,37 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
      * is used once.
      */
     ctx->poll_max_ns = max_ns;
-    ctx->poll_ns = 0;
+    qatomic_set(&ctx->poll_ns, 0);
     ctx->poll_grow = grow;
     ctx->poll_shrink = shrink;
 
     aio_notify(ctx);
 }
 
+void aio_context_set_poll_target(AioContext *ctx, int64_t latency_ns,
+                                 int64_t cpu_budget, Error **errp)
+{
+    if (cpu_budget > 100) {
+        error_setg(errp, "poll-cpu-budget must be a percentage");
+        return;
+    }
+
+    /* Same as aio_context_set_poll_params(), no thread synchronization */
+    ctx->poll_target_ns = latency_ns;
+    ctx->poll_cpu_budget = cpu_budget;
+    ctx->poll_window_start = 0;
+    qatomic_set(&ctx->poll_ns, 0);
+
+    aio_notify(ctx);
+}
+
+void aio_context_get_poll_stats(AioContext *ctx, int64_t *poll_ns,
+                                uint64_t *wasted_ns)
+{
+    *poll_ns = qatomic_read(&ctx->poll_ns);
+    *wasted_ns = stat64_get(&ctx->poll_wasted_ns);
+}
+
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch)
 {
     /*
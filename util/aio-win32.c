@@ -439,6 +439,21 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
     }
 }
 
+void aio_context_set_poll_target(AioContext *ctx, int64_t latency_ns,
+                                 int64_t cpu_budget, Error **errp)
+{
+    if (latency_ns) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
+
+void aio_context_get_poll_stats(AioContext *ctx, int64_t *poll_ns,
+                                uint64_t *wasted_ns)
+{
+    *poll_ns = 0;
+    *wasted_ns = 0;
+}
+
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch)
 {
 }
@@ -613,6 +613,10 @@ AioContext *aio_context_new(Error **errp)
     ctx->poll_max_ns = 0;
     ctx->poll_grow = 0;
     ctx->poll_shrink = 0;
+    ctx->poll_target_ns = 0;
+    ctx->poll_cpu_budget = 0;
+    ctx->poll_window_start = 0;
+    stat64_init(&ctx->poll_wasted_ns, 0);
 
     ctx->aio_max_batch = 0;
 
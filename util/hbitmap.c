@@ -11,9 +11,12 @@
 
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
+#include "qemu/bitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/interval-tree.h"
 #include "trace.h"
 #include "crypto/hash.h"
+#include "host/cpuinfo.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
  * array of unsigned longs, but HBitmap is also optimized to provide fast
@@ -50,6 +53,15 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * All of this costs one bit of memory per group of 2^G elements, whether
+ * set or not.  For bitmaps that are expected to be mostly clean, there is
+ * also a sparse representation (see hbitmap_alloc_sparse): the set bits of
+ * the bottom level are kept as a tree of maximal runs, [start, last], and
+ * levels[] are not allocated at all.  Runs are merged whenever they touch,
+ * so the bit after a run is always clear.  Memory then grows with the
+ * number of runs rather than with the size of the bitmap, and finding the
+ * next set or clear bit is O(log r) for r runs.
  */
 
 struct HBitmap {
@@ -99,8 +111,240 @@ struct HBitmap {
 
     /* The length of each levels[] array. */
     uint64_t sizes[HBITMAP_LEVELS];
+
+    /* For sparse bitmaps, the runs of set bits in the bottom level (in
+     * units of the granularity); NULL for regular bitmaps.
+     */
+    IntervalTreeRoot *runs;
+
+    /* The number of nodes in runs.  */
+    uint64_t nb_runs;
 };
 
+/* Linear scans over arrays of words, accelerated where the host allows.  */
+typedef struct HBitmapAccel {
+    /* Return the index of the first word in [start, end) that is not ~0UL,
+     * or end if there is none.
+     */
+    size_t (*find_not_ones)(const unsigned long *p, size_t start, size_t end);
+
+    /* Return the number of bits set in the n words at p.  */
+    uint64_t (*popcount)(const unsigned long *p, size_t n);
+} HBitmapAccel;
+
+static size_t hb_find_not_ones_int(const unsigned long *p, size_t start,
+                                   size_t end)
+{
+    while (start < end && p[start] == ~0UL) {
+        start++;
+    }
+    return start;
+}
+
+static uint64_t hb_popcount_int(const unsigned long *p, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        count += ctpopl(p[i]);
+    }
+    return count;
+}
+
+#include "host/hbitmap.c.inc"
+
+static const HBitmapAccel *hb_accel;
+static unsigned accel_index;
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    accel_index = best_accel();
+    hb_accel = &accel_table[accel_index];
+}
+
+bool test_hbitmap_next_accel(void)
+{
+    if (accel_index != 0) {
+        hb_accel = &accel_table[--accel_index];
+        return true;
+    }
+    init_accel();
+    return false;
+}
+
+/* Return the run containing bit @pos of a sparse bitmap, if any.  */
+static IntervalTreeNode *hb_sparse_run_at(const HBitmap *hb, uint64_t pos)
+{
+    return interval_tree_iter_first(hb->runs, pos, pos);
+}
+
+/* Set bits [first, last] of a sparse bitmap, and update hb->count.
+ * Returns true if at least one bit is changed.
+ */
+static bool hb_sparse_set(HBitmap *hb, uint64_t first, uint64_t last)
+{
+    uint64_t start = first, end = last, covered = 0;
+    IntervalTreeNode *node;
+
+    /* Absorb every run that overlaps the range or touches it.  */
+    while ((node = interval_tree_iter_first(hb->runs,
+                                            first ? first - 1 : 0,
+                                            last + 1))) {
+        if (node->start <= last && node->last >= first) {
+            covered += MIN(node->last, last) - MAX(node->start, first) + 1;
+        }
+        start = MIN(start, node->start);
+        end = MAX(end, node->last);
+        interval_tree_remove(node, hb->runs);
+        g_free(node);
+        hb->nb_runs--;
+    }
+
+    node = g_new0(IntervalTreeNode, 1);
+    node->start = start;
+    node->last = end;
+    interval_tree_insert(node, hb->runs);
+    hb->nb_runs++;
+
+    hb->count += last - first + 1 - covered;
+    return covered != last - first + 1;
+}
+
+/* Clear bits [first, last] of a sparse bitmap, and update hb->count.
+ * Returns true if at least one bit is changed.
+ */
+static bool hb_sparse_reset(HBitmap *hb, uint64_t first, uint64_t last)
+{
+    uint64_t cleared = 0;
+    IntervalTreeNode *node;
+
+    while ((node = interval_tree_iter_first(hb->runs, first, last))) {
+        uint64_t start = node->start, end = node->last;
+
+        cleared += MIN(end, last) - MAX(start, first) + 1;
+        interval_tree_remove(node, hb->runs);
+
+        /* The remaining head and tail are outside the range, so the loop
+         * does not see them again.
+         */
+        if (end > last) {
+            IntervalTreeNode *tail = g_new0(IntervalTreeNode, 1);
+
+            tail->start = last + 1;
+            tail->last = end;
+            interval_tree_insert(tail, hb->runs);
+            hb->nb_runs++;
+        }
+        if (start < first) {
+            node->start = start;
+            node->last = first - 1;
+            interval_tree_insert(node, hb->runs);
+        } else {
+            g_free(node);
+            hb->nb_runs--;
+        }
+    }
+
+    hb->count -= cleared;
+    return cleared != 0;
+}
+
+static void hb_sparse_reset_all(HBitmap *hb)
+{
+    IntervalTreeNode *node;
+
+    while ((node = interval_tree_iter_first(hb->runs, 0, UINT64_MAX))) {
+        interval_tree_remove(node, hb->runs);
+        g_free(node);
+    }
+    hb->nb_runs = 0;
+    hb->count = 0;
+}
+
+/* Expand the runs of a sparse bitmap into @nb_words bottom-level words,
+ * starting at word @first_word.
+ */
+static void hb_sparse_to_words(const HBitmap *hb, unsigned long *words,
+                               uint64_t first_word, uint64_t nb_words)
+{
+    uint64_t lo = first_word << BITS_PER_LEVEL;
+    uint64_t hi = ((first_word + nb_words) << BITS_PER_LEVEL) - 1;
+    IntervalTreeNode *node;
+
+    memset(words, 0, nb_words * sizeof(unsigned long));
+    for (node = interval_tree_iter_first(hb->runs, lo, hi); node;
+         node = interval_tree_iter_next(node, lo, hi)) {
+        uint64_t start = MAX(node->start, lo);
+        uint64_t end = MIN(node->last, hi);
+
+        bitmap_set(words, start - lo, end - start + 1);
+    }
+}
+
+/* Replace bottom-level words [first_word, first_word + nb_words) of a
+ * sparse bitmap with the contents of @words.
+ */
+static void hb_sparse_from_words(HBitmap *hb, const unsigned long *words,
+                                 uint64_t first_word, uint64_t nb_words)
+{
+    uint64_t lo = first_word << BITS_PER_LEVEL;
+    uint64_t nbits = MIN(nb_words << BITS_PER_LEVEL, hb->size - lo);
+    uint64_t start, end;
+
+    hb_sparse_reset(hb, lo, lo + nbits - 1);
+    for (start = find_first_bit(words, nbits); start < nbits;
+         start = find_next_bit(words, nbits, end)) {
+        end = find_next_zero_bit(words, nbits, start);
+        hb_sparse_set(hb, lo + start, lo + end - 1);
+    }
+}
+
+/* Allocate the levels of a regular bitmap of hb->size bits, all clear.  */
+static void hb_alloc_levels(HBitmap *hb)
+{
+    uint64_t size = hb->size;
+    unsigned i;
+
+    for (i = HBITMAP_LEVELS; i-- > 0; ) {
+        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        hb->sizes[i] = size;
+        hb->levels[i] = g_new0(unsigned long, size);
+    }
+
+    /* We necessarily have free bits in level 0 due to the definition
+     * of HBITMAP_LEVELS, so use one for a sentinel.  This speeds up
+     * hbitmap_iter_skip_words.
+     */
+    assert(size == 1);
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+}
+
+/* Fragmented writes can leave a sparse bitmap with so many runs that it
+ * takes more memory than a regular one.  Convert it then; it is never
+ * converted back.
+ */
+static void hb_sparse_check_size(HBitmap *hb)
+{
+    uint64_t dense_bytes = MAX(BITS_TO_LONGS(hb->size), 1) *
+                           sizeof(unsigned long);
+
+    if (!hb->runs || hb->nb_runs * sizeof(IntervalTreeNode) <= dense_bytes) {
+        return;
+    }
+
+    trace_hbitmap_sparse_to_dense(hb, hb->nb_runs);
+    hb_alloc_levels(hb);
+    hb_sparse_to_words(hb, hb->levels[HBITMAP_LEVELS - 1], 0,
+                       hb->sizes[HBITMAP_LEVELS - 1]);
+    hb_sparse_reset_all(hb);
+    g_free(hb->runs);
+    hb->runs = NULL;
+
+    /* Rebuild the upper levels and the count from the bottom level */
+    hbitmap_deserialize_finish(hb);
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -146,12 +390,45 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
     return cur;
 }
 
+static int64_t hbitmap_sparse_iter_next(HBitmapIter *hbi)
+{
+    const HBitmap *hb = hbi->hb;
+    IntervalTreeNode *node;
+    uint64_t item;
+
+    if (hbi->next >= hb->size) {
+        return -1;
+    }
+
+    node = interval_tree_iter_first(hb->runs, hbi->next, hb->size - 1);
+    if (!node) {
+        hbi->next = hb->size;
+        return -1;
+    }
+
+    item = MAX(node->start, hbi->next);
+    hbi->next = item + 1;
+    return item << hbi->granularity;
+}
+
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
-    unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+    unsigned long cur;
     int64_t item;
 
+    if (hbi->sparse) {
+        if (hbi->hb->runs) {
+            return hbitmap_sparse_iter_next(hbi);
+        }
+        /* The bitmap has been converted to a regular one meanwhile */
+        if (hbi->next >= hbi->hb->size) {
+            return -1;
+        }
+        hbitmap_iter_init(hbi, hbi->hb, hbi->next << hbi->granularity);
+    }
+
+    cur = hbi->cur[HBITMAP_LEVELS - 1] &
+          hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
     if (cur == 0) {
         cur = hbitmap_iter_skip_words(hbi);
         if (cur == 0) {
@@ -176,6 +453,12 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
     assert(pos < hb->size);
     hbi->pos = pos >> BITS_PER_LEVEL;
     hbi->granularity = hb->granularity;
+    hbi->sparse = hb->runs != NULL;
+
+    if (hb->runs) {
+        hbi->next = pos;
+        return;
+    }
 
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         bit = pos & (BITS_PER_LONG - 1);
@@ -221,7 +504,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
     unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -235,7 +518,20 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     end_bit = count > hb->orig_size - start ?
                 hb->size :
                 ((start + count - 1) >> hb->granularity) + 1;
+
+    if (hb->runs) {
+        /* The bit after a run is always clear */
+        IntervalTreeNode *node = hb_sparse_run_at(hb, start >> hb->granularity);
+
+        res = node ? node->last + 1 : start >> hb->granularity;
+        if (res >= end_bit) {
+            return -1;
+        }
+        return MAX(res << hb->granularity, start);
+    }
+
     sz = (end_bit + BITS_PER_LONG - 1) >> BITS_PER_LEVEL;
+    cur = last_lev[pos];
 
     /* There may be some zero bits in @cur before @start. We are not interested
      * in them, let's set them.
@@ -245,10 +541,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
-
+        pos = hb_accel->find_not_ones(last_lev, pos + 1, sz);
         if (pos >= sz) {
             return -1;
         }
@@ -383,22 +676,47 @@ static size_t hbitmap_iter_next_word(HBitmapIter *hbi, unsigned long *p_cur)
  */
 static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
 {
+    const unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
+    const unsigned long *groups = hb->levels[HBITMAP_LEVELS - 2];
     HBitmapIter hbi;
     uint64_t count = 0;
     uint64_t end = last + 1;
+    size_t end_pos = end >> BITS_PER_LEVEL;
     unsigned long cur;
-    size_t pos;
+    size_t pos, next;
 
     hbitmap_iter_init(&hbi, hb, start << hb->granularity);
     for (;;) {
         pos = hbitmap_iter_next_word(&hbi, &cur);
-        if (pos >= (end >> BITS_PER_LEVEL)) {
+        if (pos >= end_pos) {
             break;
         }
         count += ctpopl(cur);
+
+        if (groups[pos >> BITS_PER_LEVEL] != ~0UL) {
+            continue;
+        }
+
+        /* Every word in this group is nonzero, so the bitmap is dense here.
+         * Count the run of such groups with a linear scan rather than one
+         * iterator step per word, then resume iterating after it.
+         */
+        next = hb_accel->find_not_ones(groups, (pos >> BITS_PER_LEVEL) + 1,
+                                       hb->sizes[HBITMAP_LEVELS - 2]);
+        next = MIN(next << BITS_PER_LEVEL, end_pos);
+        count += hb_accel->popcount(&last_lev[pos + 1], next - pos - 1);
+
+        if (next == end_pos) {
+            pos = end_pos;
+            cur = end_pos < hb->sizes[HBITMAP_LEVELS - 1] ?
+                  last_lev[end_pos] : 0;
+            break;
+        }
+        hbitmap_iter_init(&hbi, hb,
+                          (uint64_t)next << (BITS_PER_LEVEL + hb->granularity));
     }
 
-    if (pos == (end >> BITS_PER_LEVEL)) {
+    if (pos == end_pos) {
         /* Drop bits representing the END-th and subsequent items.  */
         int bit = end & (BITS_PER_LONG - 1);
         cur &= (1UL << bit) - 1;
@@ -466,6 +784,7 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
     /* Compute range in the last layer.  */
     uint64_t first, n;
     uint64_t last = start + count - 1;
+    bool changed;
 
     if (count == 0) {
         return;
@@ -479,9 +798,14 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count)
     assert(last < hb->size);
     n = last - first + 1;
 
-    hb->count += n - hb_count_between(hb, first, last);
-    if (hb_set_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
+    if (hb->runs) {
+        changed = hb_sparse_set(hb, first, last);
+        hb_sparse_check_size(hb);
+    } else {
+        hb->count += n - hb_count_between(hb, first, last);
+        changed = hb_set_between(hb, HBITMAP_LEVELS - 1, first, last);
+    }
+    if (changed && hb->meta) {
         hbitmap_set(hb->meta, start, count);
     }
 }
@@ -561,6 +885,7 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     uint64_t first;
     uint64_t last = start + count - 1;
     uint64_t gran = 1ULL << hb->granularity;
+    bool changed;
 
     if (count == 0) {
         return;
@@ -576,9 +901,14 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     last >>= hb->granularity;
     assert(last < hb->size);
 
-    hb->count -= hb_count_between(hb, first, last);
-    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
+    if (hb->runs) {
+        changed = hb_sparse_reset(hb, first, last);
+        hb_sparse_check_size(hb);
+    } else {
+        hb->count -= hb_count_between(hb, first, last);
+        changed = hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last);
+    }
+    if (changed && hb->meta) {
         hbitmap_set(hb->meta, start, count);
     }
 }
@@ -587,6 +917,11 @@ void hbitmap_reset_all(HBitmap *hb)
 {
     unsigned int i;
 
+    if (hb->runs) {
+        hb_sparse_reset_all(hb);
+        return;
+    }
+
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
     for (i = HBITMAP_LEVELS; --i >= 1; ) {
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
@@ -621,6 +956,10 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
+    if (hb->runs) {
+        return hb_sparse_run_at(hb, pos) != NULL;
+    }
+
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
@@ -638,7 +977,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -652,20 +991,19 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
 uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
-    uint64_t el_count;
-    unsigned long *cur;
+    uint64_t first, el_count;
 
     if (!count) {
         return 0;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
+    serialization_chunk(hb, start, count, &first, &el_count);
 
     return el_count * sizeof(unsigned long);
 }
@@ -673,13 +1011,21 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
 void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
-    uint64_t el_count;
+    uint64_t first, el_count;
     unsigned long *cur, *end;
+    g_autofree unsigned long *words = NULL;
 
     if (!count) {
         return;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
+    serialization_chunk(hb, start, count, &first, &el_count);
+    if (hb->runs) {
+        words = g_new(unsigned long, el_count);
+        hb_sparse_to_words(hb, words, first, el_count);
+        cur = words;
+    } else {
+        cur = &hb->levels[HBITMAP_LEVELS - 1][first];
+    }
     end = cur + el_count;
 
     while (cur != end) {
@@ -696,13 +1042,20 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               uint64_t start, uint64_t count,
                               bool finish)
 {
-    uint64_t el_count;
+    uint64_t first, el_count;
     unsigned long *cur, *end;
+    g_autofree unsigned long *words = NULL;
 
     if (!count) {
         return;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
+    serialization_chunk(hb, start, count, &first, &el_count);
+    if (hb->runs) {
+        words = g_new(unsigned long, el_count);
+        cur = words;
+    } else {
+        cur = &hb->levels[HBITMAP_LEVELS - 1][first];
+    }
     end = cur + el_count;
 
     while (cur != end) {
@@ -717,23 +1070,40 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
         buf += sizeof(unsigned long);
         cur++;
     }
+    if (hb->runs) {
+        hb_sparse_from_words(hb, words, first, el_count);
+        hb_sparse_check_size(hb);
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
 }
 
+/* Bottom-level bits covered by a serialization chunk of a sparse bitmap.  */
+static void hb_sparse_chunk_bits(const HBitmap *hb, uint64_t first,
+                                 uint64_t el_count, uint64_t *lo, uint64_t *hi)
+{
+    *lo = first << BITS_PER_LEVEL;
+    *hi = MIN((first + el_count) << BITS_PER_LEVEL, hb->size) - 1;
+}
+
 void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
-    uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, el_count, lo, hi;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    if (hb->runs) {
+        hb_sparse_chunk_bits(hb, first, el_count, &lo, &hi);
+        hb_sparse_reset(hb, lo, hi);
+    } else {
+        memset(&hb->levels[HBITMAP_LEVELS - 1][first], 0,
+               el_count * sizeof(unsigned long));
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -742,15 +1112,21 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
 void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
-    uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, el_count, lo, hi;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    if (hb->runs) {
+        hb_sparse_chunk_bits(hb, first, el_count, &lo, &hi);
+        hb_sparse_set(hb, lo, hi);
+        hb_sparse_check_size(hb);
+    } else {
+        memset(&hb->levels[HBITMAP_LEVELS - 1][first], 0xff,
+               el_count * sizeof(unsigned long));
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -761,6 +1137,11 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     int64_t i, size, prev_size;
     int lev;
 
+    if (bitmap->runs) {
+        /* The runs and the count are always up to date */
+        return;
+    }
+
     /* restore levels starting from penultimate to zero level, assuming
      * that the last level is ok */
     size = MAX((bitmap->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
@@ -785,16 +1166,19 @@ void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
     assert(!hb->meta);
+    if (hb->runs) {
+        hb_sparse_reset_all(hb);
+        g_free(hb->runs);
+    }
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
     g_free(hb);
 }
 
-HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+static HBitmap *hbitmap_alloc_common(uint64_t size, int granularity)
 {
     HBitmap *hb = g_new0(struct HBitmap, 1);
-    unsigned i;
 
     assert(size <= INT64_MAX);
     hb->orig_size = size;
@@ -805,18 +1189,27 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
 
     hb->size = size;
     hb->granularity = granularity;
-    for (i = HBITMAP_LEVELS; i-- > 0; ) {
-        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
-        hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
-    }
+    return hb;
+}
 
-    /* We necessarily have free bits in level 0 due to the definition
-     * of HBITMAP_LEVELS, so use one for a sentinel.  This speeds up
-     * hbitmap_iter_skip_words.
-     */
-    assert(size == 1);
-    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+HBitmap *hbitmap_alloc_sparse(uint64_t size, int granularity)
+{
+    HBitmap *hb = hbitmap_alloc_common(size, granularity);
+
+    hb->runs = g_new0(IntervalTreeRoot, 1);
+    return hb;
+}
+
+bool hbitmap_is_sparse(const HBitmap *hb)
+{
+    return hb->runs != NULL;
+}
+
+HBitmap *hbitmap_alloc(uint64_t size, int granularity)
+{
+    HBitmap *hb = hbitmap_alloc_common(size, granularity);
+
+    hb_alloc_levels(hb);
     return hb;
 }
 
@@ -857,7 +1250,8 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
     hb->size = size;
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX(BITS_TO_LONGS(size), 1);
-        if (hb->sizes[i] == size) {
+        /* Sparse bitmaps have no levels to resize */
+        if (hb->runs || hb->sizes[i] == size) {
             break;
         }
         old = hb->sizes[i];
@@ -916,7 +1310,8 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return;
     }
 
-    if (a->granularity != b->granularity) {
+    if (a->granularity != b->granularity ||
+        a->runs || b->runs || result->runs) {
         if ((a != result) && (b != result)) {
             hbitmap_reset_all(result);
         }
@@ -944,11 +1339,57 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
     result->count = hb_count_between(result, 0, result->size - 1);
 }
 
+/* Words of a sparse bitmap that hbitmap_sha256 expands at a time.  */
+#define HB_SHA256_CHUNK_WORDS 512
+
+/* Hash the same data as for a regular bitmap, but expand the runs one
+ * chunk at a time; chunks without runs are hashed from a zeroed buffer.
+ */
+static char *hb_sparse_sha256(const HBitmap *hb, Error **errp)
+{
+    static const unsigned long zeroes[HB_SHA256_CHUNK_WORDS];
+    unsigned long words[HB_SHA256_CHUNK_WORDS];
+    uint64_t nb_words = MAX(BITS_TO_LONGS(hb->size), 1);
+    g_autoptr(QCryptoHash) ctx = NULL;
+    uint64_t word, n;
+    char *hash = NULL;
+
+    ctx = qcrypto_hash_new(QCRYPTO_HASH_ALGO_SHA256, errp);
+    if (!ctx) {
+        return NULL;
+    }
+
+    for (word = 0; word < nb_words; word += n) {
+        uint64_t lo = word << BITS_PER_LEVEL;
+        const unsigned long *data = zeroes;
+
+        n = MIN(nb_words - word, HB_SHA256_CHUNK_WORDS);
+        if (interval_tree_iter_first(hb->runs, lo,
+                                     lo + (n << BITS_PER_LEVEL) - 1)) {
+            hb_sparse_to_words(hb, words, word, n);
+            data = words;
+        }
+        if (qcrypto_hash_update(ctx, (const char *)data,
+                                n * sizeof(unsigned long), errp) < 0) {
+            return NULL;
+        }
+    }
+
+    if (qcrypto_hash_finalize_digest(ctx, &hash, errp) < 0) {
+        return NULL;
+    }
+    return hash;
+}
+
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
     size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
     char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
     char *hash = NULL;
+
+    if (bitmap->runs) {
+        return hb_sparse_sha256(bitmap, errp);
+    }
     qcrypto_hash_digest(QCRYPTO_HASH_ALGO_SHA256, data, size, &hash, errp);
 
     return hash;
@@ -52,6 +52,23 @@
  * possible by QIOChannel's support for spurious coroutine re-entry in
  * qio_channel_yield(). The coroutine will restart I/O when re-entered from the
  * new AioContext.
+ *
+ * Virtqueues can be assigned their own AioContext in VuServer->vq_ctx, e.g. to
+ * spread the virtqueues of a device across several IOThreads. Their kick fds
+ * are handled in that AioContext instead of VuServer->ctx. Since libvhost-user
+ * is not thread-safe, such virtqueues are quiesced while a vhost-user message
+ * is processed: vu_quiesce_queues() stops monitoring all kick fds, waits until
+ * kick handlers running in other threads have returned and until all in-flight
+ * requests have completed. vu_resume_queues() restarts monitoring once the
+ * message has been handled. Watches of virtqueues with their own AioContext
+ * are only freed while the virtqueues are quiesced.
+ *
+ * vhost_user_server_detach_aio_context() does the same BH round-trip, but
+ * cannot wait for it. Until the BHs have run, they count as in-flight
+ * requests, so that a drain also waits for kick handlers that might still
+ * submit a request. Virtqueues that were quiesced when the AioContext was
+ * detached stay quiesced until vu_client_trip() has re-entered in the new
+ * AioContext.
  */
 
 static void vmsg_close_fds(VhostUserMsg *vmsg)
@@ -89,14 +106,14 @@ static void panic_cb(VuDev *vu_dev, const char *buf)
 
 void vhost_user_server_inc_in_flight(VuServer *server)
 {
-    assert(!server->wait_idle);
+    assert(!qatomic_read(&server->wait_idle));
     qatomic_inc(&server->in_flight);
 }
 
 void vhost_user_server_dec_in_flight(VuServer *server)
 {
     if (qatomic_fetch_dec(&server->in_flight) == 1) {
-        if (server->wait_idle) {
+        if (qatomic_xchg(&server->wait_idle, false)) {
             aio_co_wake(server->co_trip);
         }
     }
@@ -107,6 +124,96 @@ bool vhost_user_server_has_in_flight(VuServer *server)
     return qatomic_load_acquire(&server->in_flight) > 0;
 }
 
+/* Wait for in-flight requests to complete, called from server->co_trip */
+static void coroutine_fn vu_wait_idle(VuServer *server)
+{
+    qatomic_set(&server->wait_idle, true);
+    /* Pairs with qatomic_fetch_dec() in vhost_user_server_dec_in_flight() */
+    smp_mb();
+
+    /*
+     * If wait_idle has already been cleared, the last request is about to wake
+     * us up and we must consume that wakeup.
+     */
+    if (vhost_user_server_has_in_flight(server) ||
+        !qatomic_xchg(&server->wait_idle, false)) {
+        qemu_coroutine_yield();
+    }
+    assert(!vhost_user_server_has_in_flight(server));
+}
+
+static AioContext *vu_fd_watch_ctx(VuServer *server, VuFdWatch *vu_fd_watch)
+{
+    return vu_fd_watch->vq_ctx ?: server->ctx;
+}
+
+static void kick_handler(void *opaque);
+
+static void vu_quiesce_bh(void *opaque)
+{
+    VuServer *server = opaque;
+
+    if (qatomic_fetch_dec(&server->quiesce_pending) == 1) {
+        aio_co_wake(server->co_trip);
+    }
+}
+
+/*
+ * Stop processing virtqueues until vu_resume_queues() so that libvhost-user
+ * state can be modified without racing with virtqueues in other threads.
+ */
+static void coroutine_fn vu_quiesce_queues(VuServer *server)
+{
+    AioContext *cur_ctx = qemu_get_current_aio_context();
+    VuFdWatch *vu_fd_watch;
+
+    if (!server->vq_ctx || server->queues_quiesced) {
+        return;
+    }
+    server->queues_quiesced = true;
+
+    qatomic_set(&server->quiesce_pending, 1);
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        AioContext *ctx = vu_fd_watch_ctx(server, vu_fd_watch);
+
+        if (!ctx) {
+            continue;
+        }
+        aio_set_fd_handler(ctx, vu_fd_watch->fd, NULL, NULL, NULL, NULL,
+                           vu_fd_watch);
+        if (ctx != cur_ctx) {
+            /* Wait for a kick_handler() that may be running in ctx */
+            qatomic_inc(&server->quiesce_pending);
+            aio_bh_schedule_oneshot(ctx, vu_quiesce_bh, server);
+        }
+    }
+    if (qatomic_fetch_dec(&server->quiesce_pending) != 1) {
+        qemu_coroutine_yield();
+    }
+
+    vu_wait_idle(server);
+}
+
+static void vu_resume_queues(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+
+    /* Without server->ctx, the next vu_client_trip() resumes them */
+    if (!server->queues_quiesced || !server->ctx) {
+        return;
+    }
+    server->queues_quiesced = false;
+
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        AioContext *ctx = vu_fd_watch_ctx(server, vu_fd_watch);
+
+        if (ctx) {
+            aio_set_fd_handler(ctx, vu_fd_watch->fd, kick_handler, NULL,
+                               NULL, NULL, vu_fd_watch);
+        }
+    }
+}
+
 static bool coroutine_fn
 vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
 {
@@ -175,6 +282,9 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
         read_bytes += rc;
     } while (read_bytes != VHOST_USER_HDR_SIZE);
 
+    /* The message is handled after this function returns */
+    vu_quiesce_queues(server);
+
     /* qio_channel_readv_full will make socket fds blocking, unblock them */
     vmsg_unblock_fds(vmsg);
     if (vmsg->size > sizeof(vmsg->payload)) {
@@ -212,6 +322,9 @@ static coroutine_fn void vu_client_trip(void *opaque)
     VuServer *server = opaque;
     VuDev *vu_dev = &server->vu_dev;
 
+    /* The previous coroutine may have stopped in the middle of a message */
+    vu_resume_queues(server);
+
     while (!vu_dev->broken) {
         if (server->quiescing) {
             server->co_trip = NULL;
@@ -222,20 +335,21 @@ static coroutine_fn void vu_client_trip(void *opaque)
         if (!vu_dispatch(vu_dev) && server->ctx) {
             break;
         }
+        vu_resume_queues(server);
     }
 
-    if (vhost_user_server_has_in_flight(server)) {
-        /* Wait for requests to complete before we can unmap the memory */
-        server->wait_idle = true;
-        qemu_coroutine_yield();
-        server->wait_idle = false;
+    /* Wait for requests to complete before we can unmap the memory */
+    if (server->vq_ctx) {
+        vu_quiesce_queues(server);
+    } else if (vhost_user_server_has_in_flight(server)) {
+        vu_wait_idle(server);
     }
-    assert(!vhost_user_server_has_in_flight(server));
 
     vu_deinit(vu_dev);
 
     /* vu_deinit() should have called remove_watch() */
     assert(QTAILQ_EMPTY(&server->vu_fd_watches));
+    server->queues_quiesced = false;
 
     object_unref(OBJECT(server->sioc));
     server->sioc = NULL;
@@ -297,17 +411,27 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
     VuFdWatch *vu_fd_watch = find_vu_fd_watch(server, fd);
 
     if (!vu_fd_watch) {
+        intptr_t vq_index = (intptr_t)pvt;
+
         vu_fd_watch = g_new0(VuFdWatch, 1);
 
         QTAILQ_INSERT_TAIL(&server->vu_fd_watches, vu_fd_watch, next);
 
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
-        qemu_socket_set_nonblock(fd);
-        aio_set_fd_handler(server->ctx, fd, kick_handler,
-                           NULL, NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+
+        /* libvhost-user only watches kick fds, pvt is the virtqueue index */
+        if (server->vq_ctx && vq_index >= 0 && vq_index < server->max_queues) {
+            vu_fd_watch->vq_ctx = server->vq_ctx[vq_index];
+        }
+
+        qemu_socket_set_nonblock(fd);
+        if (!server->queues_quiesced) {
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), fd,
+                               kick_handler, NULL, NULL, NULL, vu_fd_watch);
+        }
     }
 }
 
@@ -325,7 +449,18 @@ static void remove_watch(VuDev *vu_dev, int fd)
     if (!vu_fd_watch) {
         return;
     }
-    aio_set_fd_handler(server->ctx, fd, NULL, NULL, NULL, NULL, NULL);
+    if (!server->queues_quiesced) {
+        aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), fd,
+                           NULL, NULL, NULL, NULL, NULL);
+
+        /*
+         * This is vu_kick_cb() failing in the virtqueue's AioContext, freeing
+         * the watch is left to vu_deinit() in vu_client_trip().
+         */
+        if (vu_fd_watch->vq_ctx) {
+            return;
+        }
+    }
 
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
     g_free(vu_fd_watch);
@@ -385,8 +520,9 @@ void vhost_user_server_stop(VuServer *server)
         VuFdWatch *vu_fd_watch;
 
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                               vu_fd_watch->fd, NULL, NULL, NULL, NULL,
+                               vu_fd_watch);
         }
 
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
@@ -423,9 +559,16 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
         return;
     }
 
-    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-        aio_set_fd_handler(ctx, vu_fd_watch->fd, kick_handler, NULL,
-                           NULL, NULL, vu_fd_watch);
+    /*
+     * Quiesced virtqueues are resumed by vu_client_trip() once it runs in the
+     * new AioContext, as it may still be in the middle of a message.
+     */
+    if (!server->queues_quiesced) {
+        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                               vu_fd_watch->fd, kick_handler, NULL, NULL,
+                               NULL, vu_fd_watch);
+        }
     }
 
     if (server->co_trip) {
@@ -449,15 +592,33 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
     }
 }
 
+/* Runs in a virtqueue's AioContext after its kick_handler() has returned */
+static void vu_detach_bh(void *opaque)
+{
+    VuServer *server = opaque;
+
+    vhost_user_server_dec_in_flight(server);
+    aio_wait_kick();
+}
+
 /* Called with server->ctx acquired */
 void vhost_user_server_detach_aio_context(VuServer *server)
 {
-    if (server->sioc) {
+    /* Quiesced virtqueues have already done the round-trip */
+    if (server->sioc && !server->queues_quiesced) {
+        AioContext *cur_ctx = qemu_get_current_aio_context();
         VuFdWatch *vu_fd_watch;
 
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+            AioContext *ctx = vu_fd_watch_ctx(server, vu_fd_watch);
+
+            aio_set_fd_handler(ctx, vu_fd_watch->fd, NULL, NULL, NULL, NULL,
+                               vu_fd_watch);
+            if (vu_fd_watch->vq_ctx && ctx != cur_ctx) {
+                /* Like vu_quiesce_queues(), without the wait */
+                qatomic_inc(&server->in_flight);
+                aio_bh_schedule_oneshot(ctx, vu_detach_bh, server);
+            }
         }
     }
 
@@ -474,6 +635,7 @@ void vhost_user_server_detach_aio_context(VuServer *server)
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *socket_addr,
                              AioContext *ctx,
+                             AioContext **vq_ctx,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp)
@@ -503,6 +665,7 @@ bool vhost_user_server_start(VuServer *server,
         .vu_iface              = vu_iface,
         .max_queues            = max_queues,
         .ctx                   = ctx,
+        .vq_ctx                = vq_ctx,
     };
 
     qio_net_listener_set_name(server->listener, "vhost-user-backend-listener");